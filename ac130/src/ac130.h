@@ -49,17 +49,35 @@ typedef struct {
 								///  flatone
 } ac_bldg_t;
 
-/// Prop tree node structure.
-typedef struct ac_prop_s {
-	ac_vec4_t			bounds[2];	///< 2 points describing the AABB (axis-
-									///  aligned bounding box) of the node
-	struct ac_prop_s	*child[4];	///< pointers to children nodes
-	ac_tree_t			*trees;		///< tree array (NULL if node is a
-									///  branch or a building prop leaf)
-	ac_bldg_t			*bldgs;		///< building array (NULL if node is a
-									///  branch or a tree prop leaf)
+/// Prop tree node structure. The nodes live in a single array (see
+/// \ref ac_proptree_t), so they refer to each other and to the props by
+/// indices.
+typedef struct {
+	int			child;			///< index of the first child node; the
+								///  children are adjacent (0 if the node is a
+								///  leaf)
+	int			numChildren;	///< number of children nodes
+	int			trees;			///< index of the first tree in the tree list
+								///  (-1 if node is a branch or a building
+								///  prop leaf)
+	int			bldgs;			///< index of the first building in the
+								///  building list (-1 if node is a branch or
+								///  a tree prop leaf)
 } ac_prop_t;
 
+/// Prop tree structure. The nodes are stored breadth-first, in Morton order
+/// within each level, and their bounds are kept in a separate array, so that
+/// the traversals stream through memory. The whole tree is a single block.
+typedef struct {
+	int			numNodes;	///< number of nodes; the root is node 0
+	ac_prop_t	*nodes;		///< node array
+	ac_vec4_t	*bounds;	///< 2 points describing the AABB (axis-aligned
+							///  bounding box) of each node, i.e. node i spans
+							///  from bounds[i * 2] to bounds[i * 2 + 1]
+	ac_tree_t	*trees;		///< tree list the nodes index into
+	ac_bldg_t	*bldgs;		///< building list the nodes index into
+} ac_proptree_t;
+
 /// Viewpoint definition structure.
 typedef struct {
 	ac_vec4_t	origin;		///< camera position
@@ -102,6 +120,13 @@ extern int m_screen_width;
 extern int m_screen_height;
 /// whether the game is running in full screen mode or not
 extern bool m_full_screen;
+/// whether all the work is forced onto the main thread (no worker threads)
+extern bool m_serial;
+/// whether the troops are drawn with a single instanced draw call where the
+/// hardware supports it, rather than one by one
+extern bool m_instanced_troops;
+/// heightmap size of the game world
+extern int m_world_size;
 
 /// @}
 
@@ -111,9 +136,16 @@ extern bool m_full_screen;
 
 /// @{
 
-/// \brief size of terrain height map
+/// \brief default size of terrain height map
 /// (in pixels; 1 pixel translates to 1 square metre in game world)
-#define HEIGHTMAP_SIZE		1024
+#define HEIGHTMAP_SIZE_DEFAULT	1024
+/// \brief smallest supported height map size
+#define HEIGHTMAP_SIZE_MIN	256
+/// \brief largest supported height map size
+#define HEIGHTMAP_SIZE_MAX	8192
+/// \brief dimension of a streamed terrain tile in height map pixels; each tile
+/// stores 1 extra row and column, shared with its neighbours
+#define GEN_TILE_SIZE		128
 /// \brief height amplitude in metres
 #define HEIGHT				50.f
 /// \brief height scaling factor
@@ -131,6 +163,12 @@ extern bool m_full_screen;
 #define BLDG_SLNT_VERTS		10
 /// \brief number of indices in a slanted-roofed building prop's triangle strip
 #define BLDG_SLNT_INDICES	28
+/// \brief total number of prop vertices (3 tree LODs plus both buildings)
+#define PROP_NUM_VERTS		(TREE_BASE + 1 + TREE_BASE - 2 + TREE_BASE - 4	\
+								+ BLDG_FLAT_VERTS + BLDG_SLNT_VERTS)
+/// \brief total number of prop indices (3 tree LODs plus both buildings)
+#define PROP_NUM_INDICES	(TREE_BASE + 2 + TREE_BASE + TREE_BASE - 2		\
+								+ BLDG_FLAT_INDICES + BLDG_SLNT_INDICES)
 /// \brief dimension of the prop texture (both width and height)
 #define PROP_TEXTURE_SIZE	64
 
@@ -139,7 +177,7 @@ extern bool m_full_screen;
 /// the height map
 #define PROPMAP_SHIFT		4
 /// \brief dimension of the prop map (both width and height)
-#define PROPMAP_SIZE		(HEIGHTMAP_SIZE >> PROPMAP_SHIFT)
+#define PROPMAP_SIZE		(gen_heightmap_size >> PROPMAP_SHIFT)
 /// \brief fraction of the entire terrain's surface area to be covered by trees
 #define TREE_COVERAGE		0.6
 /// \brief fraction of the entire terrain's surf. area to be used by buildings
@@ -159,15 +197,43 @@ extern bool m_full_screen;
 /// \brief dimension of the special effects texture (both width and height)
 #define FX_TEXTURE_SIZE		256
 
+/// \brief default number of octaves of the terrain cloud noise
+#define GEN_CLOUD_OCTAVES	4
+/// \brief maximum number of octaves of the terrain cloud noise
+#define GEN_MAX_CLOUD_OCTAVES	8
+
+/// \brief random number seed of the game world
+#define GEN_WORLD_SEED		0xDEADBEEF
+/// \brief version of the generator algorithms
+/// Must be bumped whenever the generated content changes for the same seed, so
+/// that stale world caches get discarded.
+#define GEN_VERSION			6
+
 /// \brief heightmap byte array
-extern uchar				gen_heightmap[];
-/// \brief root of the prop tree
-extern ac_prop_t			*gen_proptree;
-
-/// \brief Generates the terrain heightmap.
-/// \note				The heightmap is stored in stack memory, therefore it
-///						should not be freed.
-/// \return				constant pointer to the heightmap
+extern uchar				*gen_heightmap;
+/// \brief size of terrain height map (both width and height), set by
+/// \ref gen_init
+extern int					gen_heightmap_size;
+/// \brief number of octaves of the terrain cloud noise; picked up by the next
+/// \ref gen_terrain call and clamped to [1, \ref GEN_MAX_CLOUD_OCTAVES]
+extern int					gen_cloud_octaves;
+/// \brief prop tree, NULL if there is none
+extern ac_proptree_t		*gen_proptree;
+
+/// \brief Allocates the storage for a world of the given size.
+/// Must be called before any other generator function.
+/// \param size			heightmap size; must be a power of 2 between
+///						\ref HEIGHTMAP_SIZE_MIN and \ref HEIGHTMAP_SIZE_MAX
+/// \param tileBudget	0 to keep the entire heightmap in memory, otherwise the
+///						memory budget in megabytes for streamed terrain tiles;
+///						\ref gen_heightmap stays NULL for streamed worlds
+/// \return				true on success
+bool gen_init(int size, int tileBudget);
+
+/// \brief Frees the world storage allocated by \ref gen_init.
+void gen_shutdown(void);
+
+/// \brief Generates the terrain heightmap into \ref gen_heightmap.
 /// \param seed			random number seed; ensures identical random number
 ///						sequence each run
 void gen_terrain(int seed);
@@ -196,10 +262,72 @@ void gen_fx(uchar *texture, ac_vertex_t *verts, uchar *indices);
 void gen_proplists(int *numTrees, ac_tree_t *trees,
 					int *numBldgs, ac_bldg_t *bldgs);
 
-/// \brief Frees the given prop tree node and all of its children.
-/// \param n			pointer to the node of the tree to free (pass NULL to
-///						free the entire tree)
-void gen_free_proptree(ac_prop_t *n);
+/// \brief Maps the world cache file for the given seed and the current world
+/// size, if there is one.
+/// If a valid cache is found, \ref gen_terrain, \ref gen_proplists,
+/// \ref gen_props and \ref gen_fx will load their results from it instead of
+/// generating them. Otherwise they will generate the content as usual and
+/// \ref gen_cache_flush will write a new cache file.
+/// \param seed			random number seed of the world
+/// \return				true if a valid cache was found
+bool gen_cache_open(int seed);
+
+/// \brief Writes the world cache if the content has been generated in this run,
+/// then unmaps the cache file.
+/// \note				Must be called after all of \ref gen_terrain,
+///						\ref gen_proplists, \ref gen_props and \ref gen_fx
+void gen_cache_flush(void);
+
+/// \brief Schedules generation of the terrain tiles around the viewpoint.
+/// Must be called once per frame for streamed worlds; never waits for the
+/// tiles to be generated. Does nothing if the world is not streamed.
+/// \param viewpoint	viewpoint position in world space
+void gen_tiles_update(ac_vec4_t viewpoint);
+
+/// \brief Samples the height of a streamed world.
+/// Uses the full-resolution tile if it is resident, and falls back to the
+/// coarse overview map otherwise.
+/// \param x			X coordinate in heightmap texels
+/// \param y			Y coordinate in heightmap texels
+/// \return				height in heightmap units (0..255)
+float gen_tiles_sample(float x, float y);
+
+/// \brief Tells whether the full-resolution terrain tile at the given point is
+/// resident. Always true if the world is not streamed.
+/// \param x			X coordinate in heightmap texels
+/// \param y			Y coordinate in heightmap texels
+bool gen_tiles_resident(float x, float y);
+
+/// \brief Returns the heights of a resident terrain tile of a streamed world.
+/// The data stays valid until the next \ref gen_tiles_update call.
+/// \param x			X coordinate of the tile, in tiles
+/// \param y			Y coordinate of the tile, in tiles
+/// \return				\ref GEN_TILE_SIZE + 1 rows of as many heights, or NULL
+///						if the tile is not resident
+const uchar *gen_tiles_data(int x, int y);
+
+/// \brief Evaluates the terrain height of a row of texels, without reading the
+/// heightmap; for streamed worlds, which have none. Safe to call from any
+/// thread.
+/// \param out			array of \e n bytes to write the heights to
+/// \param x			X coordinate of the first texel
+/// \param y			Y coordinate of the texels
+/// \param n			number of texels to evaluate
+void gen_terrain_texels(uchar *out, int x, int y, int n);
+
+/// \brief Returns the coarse overview map of a streamed world.
+/// \param size			pointer to where to store the map dimension
+/// \return				the overview map, or NULL if the world is not streamed
+const uchar *gen_tiles_overview(int *size);
+
+/// \brief Frees the prop tree.
+void gen_free_proptree(void);
+
+/// \brief Compares the vectorized Perlin noise against the scalar one over a
+/// sweep of the noise domain.
+/// \param maxError		pointer to where to store the largest absolute difference
+/// \return				true if the difference is within the documented tolerance
+bool gen_perlin_check(float *maxError);
 
 /// @}
 
@@ -210,6 +338,9 @@ void gen_free_proptree(ac_prop_t *n);
 /// @{
 
 /// \brief Initializes the renderer.
+/// Brings up the SDL video subsystem and opens the game window. The null
+/// renderer of the headless build does neither, so the game runs without a
+/// display.
 /// \param vcounter		vertex counter address (for performance measurement)
 /// \param tcounter		triangle counter address (for performance measurement)
 /// \param dpcounter	displayed terrain patch counter address
@@ -222,7 +353,22 @@ bool r_init(uint *vcounter, uint *tcounter,
 void r_shutdown(void);
 
 /// \brief Sets new terrain heightmap.
-void r_set_heightmap();
+/// Only allocates the heightmap texture; the contents are uploaded by
+/// \ref r_upload_heightmap.
+void r_set_heightmap(void);
+
+/// \brief Uploads the next band of heightmap rows to the texture.
+/// Spreads the upload of large heightmaps over several frames.
+/// \return				true if the entire heightmap has been uploaded
+bool r_upload_heightmap(void);
+
+/// \brief Uploads the prop resources generated by \ref gen_props.
+void r_set_props(const uchar *texture, const ac_vertex_t *verts,
+					const uchar *indices);
+
+/// \brief Uploads the special effects resources generated by \ref gen_fx.
+void r_set_fx(const uchar *texture, const ac_vertex_t *verts,
+					const uchar *indices);
 
 /// \brief Starts the rendering of a new frame. Also sets the point of view.
 /// \note				Must be called *before* \ref r_finish_3D
@@ -264,9 +410,11 @@ void r_start_footmobiles(void);
 /// \sa r_start_footmobiles
 void r_finish_footmobiles(void);
 
-/// \brief Draws a footmobile squad of the given size.
+/// \brief Draws a batch of footmobiles.
+/// The whole batch is drawn with a single instanced draw call where the
+/// hardware supports it.
 /// \param squad		pointer to a footmobile array
-/// \param troops		number of soldiers in the squad
+/// \param troops		number of soldiers in the batch
 void r_draw_squad(ac_footmobile_t *squad, size_t troops);
 
 /// \brief Draws a string at given normalized coordinates in given scale.
@@ -344,21 +492,61 @@ typedef struct {
 	short				deltaX, deltaY;	///< mouse motion deltas
 } ac_input_t;
 
+/// Simulation rate in ticks per second. The simulation runs in fixed ticks
+/// regardless of the frame rate, and the frames are interpolated in between.
+extern int g_tick_rate;
+
+/// Number of ground troops spawned by \ref g_init.
+extern int g_troop_count;
+
+/// Seed of the game's random number streams (bullet spread, explosion
+/// particles, gun shake), picked up by \ref g_init. Given the same seed, frame
+/// times and input, the game plays out exactly the same way.
+extern uint g_seed;
+
 /// \brief Initializes the game logic.
+/// Starts generating the world on a background thread; \ref g_frame shows the
+/// loading screen until it is done.
 /// \return true on success
 bool g_init(void);
 
 /// \brief Shuts the game logic down.
 void g_shutdown(void);
 
+/// \brief Checks whether the world is still being loaded.
+/// \return true while \ref g_frame shows the loading screen
+bool g_loading(void);
+
 /// \brief Advances the game world by one frame.
 /// \param ticks		number of ticks (milliseconds) since the start of game
 /// \param frameTime	time elapsed since last frame in seconds
 /// \param input		current state of player input
 void g_frame(int ticks, float frameTime, ac_input_t *input);
 
-/// \brief Updates the game loading screen.
-/// \note				Only to be called before \ref g_init
+/// Object pool statistics.
+typedef struct {
+	int		live;		///< objects currently in use
+	int		capacity;	///< current capacity of the pool
+	int		peak;		///< highest number of objects in use so far
+	int		drops;		///< objects that could not be allocated so far
+} ac_pool_stats_t;
+
+/// \brief Retrieves the projectile pool statistics.
+/// \param stats		pointer to where to store the statistics
+void g_projectile_stats(ac_pool_stats_t *stats);
+
+/// \brief Hashes the state of the simulation.
+/// Used to tell whether a replay has played out the same way as the recording.
+/// \return				hash of the viewpoint, the projectiles and the troops
+uint g_state_hash(void);
+
+/// \brief Returns the number of simulation ticks run so far.
+/// Stays at 0 as long as the game waits on the pause screen for the player to
+/// start it.
+uint g_sim_ticks(void);
+
+/// \brief Reports a unit of world generation progress.
+/// Called by the generator; safe to call from any thread.
 void g_loading_tick(void);
 
 /// @}
@@ -0,0 +1,276 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Input recording module; records the player input and the frame times, and
+// plays them back as a repeatable benchmark
+
+#include <stdio.h>
+#include "ac_replay.h"
+#include "ac_time.h"
+
+/// Log file magic number ("ACRL").
+#define REPLAY_MAGIC		0x4C524341
+/// Version of the log format.
+#define REPLAY_VERSION		1
+/// Number of 32-bit header fields, the magic number and version included.
+#define REPLAY_HEADER_SIZE	11
+/// Frame flag marking a frame with mouse motion; the input flags take the low
+/// bits of the same byte.
+#define REPLAY_MOTION		0x80
+/// Frame time escape; longer frames store the full 32-bit time after it.
+#define REPLAY_LONG_FRAME	0xFF
+
+static FILE				*ac_replay_file = NULL;
+static bool				ac_replay_recording;
+static ac_replay_info_t	ac_replay_info;
+static uint				ac_replay_ticks;	///< time of the last frame
+static uint				ac_replay_frames;	///< frames written or read so far
+static bool				ac_replay_ended;	///< all frames have been read
+
+/// Wall clock times of the replayed frames, in milliseconds.
+static double			*ac_replay_times = NULL;
+static uint				ac_replay_max_times = 0;
+static double			ac_replay_start;	///< wall clock time of the first read
+static double			ac_replay_last;		///< wall clock time of the last read
+
+// the log is little-endian regardless of the platform
+static void ac_replay_put(uint v, int bytes) {
+	while (bytes--) {
+		fputc(v & 0xFF, ac_replay_file);
+		v >>= 8;
+	}
+}
+
+static bool ac_replay_get(uint *v, int bytes) {
+	int i, c;
+
+	for (i = 0, *v = 0; i < bytes; i++) {
+		if ((c = fgetc(ac_replay_file)) == EOF)
+			return false;
+		*v |= (uint)c << (i * 8);
+	}
+	return true;
+}
+
+static void ac_replay_put_header(void) {
+	const ac_replay_info_t *i = &ac_replay_info;
+
+	ac_replay_put(REPLAY_MAGIC, 4);
+	ac_replay_put(REPLAY_VERSION, 4);
+	ac_replay_put(i->seed, 4);
+	ac_replay_put(i->worldSize, 4);
+	ac_replay_put(i->tileBudget, 4);
+	ac_replay_put(i->tickRate, 4);
+	ac_replay_put(i->troops, 4);
+	ac_replay_put(i->octaves, 4);
+	ac_replay_put(i->startTicks, 4);
+	ac_replay_put(i->numFrames, 4);
+	ac_replay_put(i->stateHash, 4);
+}
+
+bool ac_replay_record(const char *path, const ac_replay_info_t *info) {
+	if (!(ac_replay_file = fopen(path, "wb")))
+		return false;
+	ac_replay_recording = true;
+	ac_replay_info = *info;
+	// filled in when the recording is over
+	ac_replay_info.numFrames = 0;
+	ac_replay_info.stateHash = 0;
+	ac_replay_frames = 0;
+	ac_replay_put_header();
+	return true;
+}
+
+void ac_replay_write(const ac_input_t *input, uint ticks, uint frameMs) {
+	const bool motion = input->deltaX || input->deltaY;
+
+	if (!ac_replay_file || !ac_replay_recording)
+		return;
+	if (!ac_replay_frames++)
+		ac_replay_info.startTicks = ticks - frameMs;
+	// most frames take up just 2 bytes: the flags and the frame time
+	ac_replay_put((input->flags & ~REPLAY_MOTION)
+		| (motion ? REPLAY_MOTION : 0), 1);
+	if (frameMs < REPLAY_LONG_FRAME)
+		ac_replay_put(frameMs, 1);
+	else {
+		ac_replay_put(REPLAY_LONG_FRAME, 1);
+		ac_replay_put(frameMs, 4);
+	}
+	if (motion) {
+		ac_replay_put((ushort)input->deltaX, 2);
+		ac_replay_put((ushort)input->deltaY, 2);
+	}
+}
+
+bool ac_replay_play(const char *path, ac_replay_info_t *info) {
+	uint v[REPLAY_HEADER_SIZE];
+	int i;
+
+	if (!(ac_replay_file = fopen(path, "rb")))
+		return false;
+	for (i = 0; i < REPLAY_HEADER_SIZE; i++) {
+		if (!ac_replay_get(&v[i], 4)) {
+			fclose(ac_replay_file);
+			ac_replay_file = NULL;
+			return false;
+		}
+	}
+	if (v[0] != REPLAY_MAGIC || v[1] != REPLAY_VERSION) {
+		fclose(ac_replay_file);
+		ac_replay_file = NULL;
+		return false;
+	}
+	ac_replay_info.seed = v[2];
+	ac_replay_info.worldSize = v[3];
+	ac_replay_info.tileBudget = v[4];
+	ac_replay_info.tickRate = v[5];
+	ac_replay_info.troops = v[6];
+	ac_replay_info.octaves = v[7];
+	ac_replay_info.startTicks = v[8];
+	ac_replay_info.numFrames = v[9];
+	ac_replay_info.stateHash = v[10];
+	*info = ac_replay_info;
+	ac_replay_recording = false;
+	ac_replay_ticks = ac_replay_info.startTicks;
+	ac_replay_frames = 0;
+	ac_replay_ended = false;
+	return true;
+}
+
+/// Takes the wall clock time of the last frame read.
+/// \return false if out of memory
+static bool ac_replay_time_frame(void) {
+	const double now = ac_time_now();
+	double *times;
+
+	if (!ac_replay_frames) {
+		ac_replay_start = ac_replay_last = now;
+		return true;
+	}
+	if (ac_replay_frames > ac_replay_max_times) {
+		ac_replay_max_times = ac_replay_max_times
+			? ac_replay_max_times * 2 : 4096;
+		if (!(times = realloc(ac_replay_times,
+			sizeof(*times) * ac_replay_max_times)))
+			return false;
+		ac_replay_times = times;
+	}
+	ac_replay_times[ac_replay_frames - 1] = now - ac_replay_last;
+	ac_replay_last = now;
+	return true;
+}
+
+bool ac_replay_read(ac_input_t *input, uint *ticks, uint *frameMs) {
+	uint flags, ms, dx = 0, dy = 0;
+
+	if (!ac_replay_file || ac_replay_recording || ac_replay_ended)
+		return false;
+	if (!ac_replay_time_frame()) {
+		ac_replay_ended = true;
+		return false;
+	}
+
+	// an unfinished recording simply ends where the file does
+	if ((ac_replay_info.numFrames
+			&& ac_replay_frames == ac_replay_info.numFrames)
+		|| !ac_replay_get(&flags, 1) || !ac_replay_get(&ms, 1)
+		|| (ms == REPLAY_LONG_FRAME && !ac_replay_get(&ms, 4))
+		|| (flags & REPLAY_MOTION
+			&& (!ac_replay_get(&dx, 2) || !ac_replay_get(&dy, 2)))) {
+		ac_replay_ended = true;
+		return false;
+	}
+	ac_replay_frames++;
+	ac_replay_ticks += ms;
+
+	input->flags = flags & ~REPLAY_MOTION;
+	input->deltaX = (short)dx;
+	input->deltaY = (short)dy;
+	*ticks = ac_replay_ticks;
+	*frameMs = ms;
+	return true;
+}
+
+/// Prints the frame time statistics of the replay.
+static void ac_replay_print_times(void) {
+	const uint n = ac_replay_frames;
+	double total = 0.0;
+	uint i;
+
+	if (!n) {
+		printf("Replay: no frames played\n");
+		return;
+	}
+	// the last frame hasn't been timed if the replay has been interrupted
+	if ((!ac_replay_ended && !ac_replay_time_frame())
+		|| ac_replay_max_times < n) {
+		printf("Replay: out of memory for the frame times\n");
+		return;
+	}
+	for (i = 0; i < n; i++)
+		total += ac_replay_times[i];
+	qsort(ac_replay_times, n, sizeof(*ac_replay_times), ac_time_cmp);
+
+	printf("Replay: %u frames, %.2f s of game time in %.2f s\n", n,
+		(ac_replay_ticks - ac_replay_info.startTicks) * 0.001,
+		(ac_replay_last - ac_replay_start) * 0.001);
+	// nearest rank percentiles
+	printf("Frame time: min %.3f, mean %.3f, median %.3f, p95 %.3f, "
+		"p99 %.3f, max %.3f ms\n", ac_replay_times[0], total / n,
+		ac_replay_times[(50 * n + 99) / 100 - 1],
+		ac_replay_times[(95 * n + 99) / 100 - 1],
+		ac_replay_times[(99 * n + 99) / 100 - 1], ac_replay_times[n - 1]);
+}
+
+/// Tells whether the replay has played out the same way as the recording.
+/// \return false if it has diverged, or if there was nothing to compare
+static bool ac_replay_verify(uint stateHash, uint simTicks) {
+	const uint n = ac_replay_frames;
+
+	// the state hardly changes on the pause screen, so a log that never
+	// leaves it would match whatever the simulation does
+	if (!simTicks) {
+		printf("Replay FAILED: the game never left the pause screen, nothing "
+			"has been simulated\n");
+		return false;
+	}
+	if (!ac_replay_info.numFrames)
+		printf("The recording was not finished, can't verify the replay\n");
+	else if (n < ac_replay_info.numFrames)
+		printf("Replay interrupted after %u of %u frames\n", n,
+			ac_replay_info.numFrames);
+	else if (stateHash != ac_replay_info.stateHash) {
+		printf("Replay DIVERGED from the recording (state %08X, expected "
+			"%08X)\n", stateHash, ac_replay_info.stateHash);
+		return false;
+	} else
+		printf("Replay matches the recording (state %08X)\n", stateHash);
+	return true;
+}
+
+bool ac_replay_stop(uint stateHash, uint simTicks) {
+	bool ok = true;
+
+	if (!ac_replay_file)
+		return true;
+	if (ac_replay_recording) {
+		// now that it's known, fill in the rest of the header
+		ac_replay_info.numFrames = ac_replay_frames;
+		ac_replay_info.stateHash = stateHash;
+		fseek(ac_replay_file, 0, SEEK_SET);
+		ac_replay_put_header();
+		if (!simTicks)
+			printf("Warning: the recording never left the pause screen, so "
+				"its replays will fail\n");
+	} else {
+		ac_replay_print_times();
+		ok = ac_replay_verify(stateHash, simTicks);
+	}
+	fclose(ac_replay_file);
+	ac_replay_file = NULL;
+	free(ac_replay_times);
+	ac_replay_times = NULL;
+	ac_replay_max_times = 0;
+	return ok;
+}
@@ -0,0 +1,73 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+#ifndef AC_REPLAY_H
+#define AC_REPLAY_H
+
+#include "ac130.h"
+
+/// \file ac_replay.h
+/// \brief Public interface to the input recorder.
+/// \addtogroup replay Input recording and replay
+/// @{
+
+/// Everything that a replay must reproduce to play out the same way as the
+/// recording, plus a few things learned when the recording is over.
+typedef struct {
+	uint	seed;			///< \ref g_seed
+	int		worldSize;		///< heightmap size of the world
+	int		tileBudget;		///< terrain tile memory budget; the world is not
+							///  streamed if 0
+	int		tickRate;		///< \ref g_tick_rate
+	int		troops;			///< \ref g_troop_count
+	int		octaves;		///< \ref gen_cloud_octaves
+	uint	startTicks;		///< time of the frame before the first recorded
+							///  one, in milliseconds
+	uint	numFrames;		///< number of recorded frames; 0 if the recording
+							///  has not been finished properly
+	uint	stateHash;		///< \ref g_state_hash after the last frame
+} ac_replay_info_t;
+
+/// \brief Starts recording the input to a log file.
+/// \param path			path of the log file; overwritten if it exists
+/// \param info			settings of the game to record
+/// \return				true on success
+bool ac_replay_record(const char *path, const ac_replay_info_t *info);
+
+/// \brief Records a frame.
+/// \param input		player input of the frame
+/// \param ticks		time of the frame in milliseconds
+/// \param frameMs		time elapsed since the previous frame in milliseconds
+void ac_replay_write(const ac_input_t *input, uint ticks, uint frameMs);
+
+/// \brief Opens a log file for replay.
+/// \param path			path of the log file
+/// \param info			pointer to where to store the settings of the recorded
+///						game
+/// \return				true on success
+bool ac_replay_play(const char *path, ac_replay_info_t *info);
+
+/// \brief Reads the next recorded frame.
+/// Also takes the time of the frame before it, for the statistics printed by
+/// \ref ac_replay_stop.
+/// \param input		pointer to where to store the player input of the frame
+/// \param ticks		pointer to where to store the time of the frame in
+///						milliseconds
+/// \param frameMs		pointer to where to store the time elapsed since the
+///						previous frame in milliseconds
+/// \return				false if there are no more frames
+bool ac_replay_read(ac_input_t *input, uint *ticks, uint *frameMs);
+
+/// \brief Finishes the recording or the replay and closes the log.
+/// A replay prints the frame time statistics and tells whether the game has
+/// played out the same way as the recording.
+/// \param stateHash	\ref g_state_hash after the last frame
+/// \param simTicks		\ref g_sim_ticks after the last frame; a replay that
+///						hasn't simulated anything has nothing to verify
+/// \return				false if the replay has diverged from the recording or
+///						never left the pause screen, true otherwise
+bool ac_replay_stop(uint stateHash, uint simTicks);
+
+/// @}
+
+#endif // AC_REPLAY_H
@@ -0,0 +1,318 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Worker thread pool; SDL provides the threads and synchronization primitives,
+// so this stays platform-agnostic apart from the CPU count query
+
+#include <stdlib.h>
+#include <SDL/SDL.h>
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <unistd.h>
+#endif
+#include "ac_thread.h"
+
+/// Hard limit on the number of worker threads.
+#define MAX_THREADS		32
+
+/// A job split into batches, waiting in the queue.
+struct ac_batch_s {
+	ac_job_t			job;	///< job function
+	void				*arg;	///< user data pointer
+	int					count;	///< total number of items
+	int					grain;	///< number of items per batch
+	int					next;	///< first item not yet handed out
+	int					done;	///< number of completed items
+	struct ac_batch_s	*link;	///< next job in the queue
+};
+typedef struct ac_batch_s ac_batch_t;
+
+static SDL_Thread	*ac_threads[MAX_THREADS];
+static int			ac_num_threads = 0;
+static SDL_mutex	*ac_lock = NULL;
+static SDL_cond		*ac_work_cond = NULL;	///< signalled when work is queued
+static SDL_cond		*ac_done_cond = NULL;	///< signalled when work is done
+static ac_batch_t	*ac_queue = NULL;
+static bool			ac_quit = false;
+
+static int ac_cpu_count(void) {
+#ifdef WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+/// Hands out the next range of the given job. Must be called with the lock
+/// held. \return false if there is nothing left to hand out
+static bool ac_thread_take(ac_batch_t *b, int *first, int *last) {
+	ac_batch_t **p;
+
+	if (b->next >= b->count)
+		return false;
+	*first = b->next;
+	*last = b->next + b->grain;
+	if (*last > b->count)
+		*last = b->count;
+	b->next = *last;
+	// all items handed out, no need to keep it in the queue any longer
+	if (b->next >= b->count) {
+		for (p = &ac_queue; *p; p = &(*p)->link) {
+			if (*p == b) {
+				*p = b->link;
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+/// Marks a range as completed. Must be called with the lock held.
+static void ac_thread_finish(ac_batch_t *b, int first, int last) {
+	b->done += last - first;
+	SDL_CondBroadcast(ac_done_cond);
+}
+
+static int ac_thread_worker(void *unused) {
+	ac_batch_t *b;
+	int first, last;
+
+	SDL_mutexP(ac_lock);
+	while (!ac_quit) {
+		if (!(b = ac_queue)) {
+			SDL_CondWait(ac_work_cond, ac_lock);
+			continue;
+		}
+		// only jobs with items left to hand out are kept in the queue
+		if (!ac_thread_take(b, &first, &last))
+			continue;
+		SDL_mutexV(ac_lock);
+		b->job(b->arg, first, last);
+		SDL_mutexP(ac_lock);
+		ac_thread_finish(b, first, last);
+	}
+	SDL_mutexV(ac_lock);
+	return 0;
+}
+
+bool ac_thread_init(int threads) {
+	int i;
+
+	if (threads < 0)
+		threads = ac_cpu_count() - 1;
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	ac_num_threads = 0;
+	if (threads == 0)
+		return true;
+
+	if (!(ac_lock = SDL_CreateMutex())
+		|| !(ac_work_cond = SDL_CreateCond())
+		|| !(ac_done_cond = SDL_CreateCond()))
+		return false;
+	ac_quit = false;
+	for (i = 0; i < threads; i++) {
+		if (!(ac_threads[i] = SDL_CreateThread(ac_thread_worker, NULL)))
+			break;
+		ac_num_threads++;
+	}
+	return ac_num_threads == threads;
+}
+
+void ac_thread_shutdown(void) {
+	int i;
+
+	if (ac_lock) {
+		SDL_mutexP(ac_lock);
+		ac_quit = true;
+		SDL_CondBroadcast(ac_work_cond);
+		SDL_mutexV(ac_lock);
+	}
+	for (i = 0; i < ac_num_threads; i++)
+		SDL_WaitThread(ac_threads[i], NULL);
+	ac_num_threads = 0;
+	if (ac_lock) {
+		SDL_DestroyCond(ac_done_cond);
+		SDL_DestroyCond(ac_work_cond);
+		SDL_DestroyMutex(ac_lock);
+		ac_lock = NULL;
+	}
+}
+
+int ac_thread_count(void) {
+	return ac_num_threads;
+}
+
+/// Appends a job to the end of the queue so that older jobs are finished
+/// first, or puts it at the head if somebody is waiting for it. Must be called
+/// with the lock held.
+static void ac_thread_enqueue(ac_batch_t *b, bool urgent) {
+	ac_batch_t **p;
+
+	if (urgent)
+		p = &ac_queue;
+	else
+		for (p = &ac_queue; *p; p = &(*p)->link);
+	b->link = *p;
+	*p = b;
+	SDL_CondBroadcast(ac_work_cond);
+}
+
+/// Runs the items of a job that haven't been handed out yet on the calling
+/// thread. Must be called with the lock held.
+static void ac_thread_help(ac_batch_t *b) {
+	int first, last;
+
+	while (ac_thread_take(b, &first, &last)) {
+		SDL_mutexV(ac_lock);
+		b->job(b->arg, first, last);
+		SDL_mutexP(ac_lock);
+		ac_thread_finish(b, first, last);
+	}
+}
+
+void ac_thread_parallel_for(ac_job_t job, void *arg, int count, int grain,
+							void (*progress)(void)) {
+	ac_batch_t b;
+	int first, last, i, reported = 0, n;
+
+	if (count <= 0)
+		return;
+	if (grain < 1)
+		grain = 1;
+
+	// serial path - just run the whole range in order on this thread
+	if (ac_num_threads < 1) {
+		for (first = 0; first < count; first = last) {
+			last = first + grain < count ? first + grain : count;
+			job(arg, first, last);
+			if (progress) {
+				for (i = first; i < last; i++)
+					progress();
+			}
+		}
+		return;
+	}
+
+	b.job = job;
+	b.arg = arg;
+	b.count = count;
+	b.grain = grain;
+	b.next = 0;
+	b.done = 0;
+	b.link = NULL;
+
+	SDL_mutexP(ac_lock);
+	// we're blocked on it, so it goes ahead of the background jobs
+	ac_thread_enqueue(&b, true);
+	// help out with our own job, then wait for the stragglers
+	while (b.done < count) {
+		if (ac_thread_take(&b, &first, &last)) {
+			SDL_mutexV(ac_lock);
+			job(arg, first, last);
+			SDL_mutexP(ac_lock);
+			ac_thread_finish(&b, first, last);
+		} else
+			SDL_CondWait(ac_done_cond, ac_lock);
+		if (progress && b.done > reported) {
+			n = b.done - reported;
+			reported = b.done;
+			SDL_mutexV(ac_lock);
+			while (n-- > 0)
+				progress();
+			SDL_mutexP(ac_lock);
+		}
+	}
+	SDL_mutexV(ac_lock);
+	// items may have completed while we were busy reporting progress
+	if (progress) {
+		for (n = count - reported; n > 0; n--)
+			progress();
+	}
+}
+
+/// Common part of \ref ac_thread_async and \ref ac_thread_async_urgent.
+static ac_task_t *ac_thread_submit(ac_job_t job, void *arg, int count,
+									int grain, bool urgent) {
+	ac_batch_t *b = malloc(sizeof(*b));
+
+	if (grain < 1)
+		grain = 1;
+	b->job = job;
+	b->arg = arg;
+	b->count = count > 0 ? count : 0;
+	b->grain = grain;
+	b->next = 0;
+	b->done = 0;
+	b->link = NULL;
+
+	if (ac_num_threads < 1) {
+		// nobody to hand it over to
+		if (b->count > 0)
+			job(arg, 0, b->count);
+		b->next = b->done = b->count;
+	} else if (b->count > 0) {
+		SDL_mutexP(ac_lock);
+		ac_thread_enqueue(b, urgent);
+		SDL_mutexV(ac_lock);
+	}
+	return b;
+}
+
+ac_task_t *ac_thread_async(ac_job_t job, void *arg, int count, int grain) {
+	return ac_thread_submit(job, arg, count, grain, false);
+}
+
+ac_task_t *ac_thread_async_urgent(ac_job_t job, void *arg, int count,
+									int grain) {
+	return ac_thread_submit(job, arg, count, grain, true);
+}
+
+bool ac_thread_poll(ac_task_t *task) {
+	bool done;
+
+	if (ac_num_threads < 1)
+		done = true;
+	else {
+		SDL_mutexP(ac_lock);
+		done = task->done >= task->count;
+		SDL_mutexV(ac_lock);
+	}
+	if (done)
+		free(task);
+	return done;
+}
+
+void ac_thread_wait(ac_task_t *task) {
+	if (ac_num_threads > 0) {
+		SDL_mutexP(ac_lock);
+		// rather than sit idle, take over whatever the workers haven't got
+		// round to yet
+		ac_thread_help(task);
+		while (task->done < task->count)
+			SDL_CondWait(ac_done_cond, ac_lock);
+		SDL_mutexV(ac_lock);
+	}
+	free(task);
+}
+
+ac_thread_t *ac_thread_spawn(int (*func)(void *), void *arg) {
+	return SDL_CreateThread(func, arg);
+}
+
+void ac_thread_join(ac_thread_t *thread) {
+	SDL_WaitThread(thread, NULL);
+}
+
+// SDL 1.2 has no atomics, but all the supported compilers are GCC-compatible
+int ac_atomic_add(volatile int *value, int delta) {
+	return __sync_add_and_fetch(value, delta);
+}
+
+int ac_atomic_get(volatile int *value) {
+	return __sync_add_and_fetch(value, 0);
+}
@@ -0,0 +1,113 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+#ifndef AC_THREAD_H
+#define AC_THREAD_H
+
+#include <stdbool.h>
+
+/// \file ac_thread.h
+/// \brief Public interface to the worker thread pool.
+/// \addtogroup threads Worker thread pool
+/// @{
+
+/// \brief Job function type.
+/// Processes the items in the [\e first, \e last) range. Must not touch any
+/// state that other ranges of the same job write to.
+/// \param arg			user data pointer passed along with the job
+/// \param first		index of the first item to process
+/// \param last			index one past the last item to process
+typedef void (*ac_job_t)(void *arg, int first, int last);
+
+/// Handle of an asynchronous job, see \ref ac_thread_async.
+typedef struct ac_batch_s ac_task_t;
+
+/// \brief Spawns the worker threads.
+/// \param threads		number of worker threads to spawn; pass a negative
+///						value to spawn one per logical CPU (minus the calling
+///						thread), or 0 to force all jobs to run serially on the
+///						calling thread
+/// \return				true on success
+bool ac_thread_init(int threads);
+
+/// \brief Stops and joins all worker threads.
+void ac_thread_shutdown(void);
+
+/// \brief Returns the number of running worker threads.
+/// 0 means that all jobs are run serially by the calling thread.
+int ac_thread_count(void);
+
+/// \brief Runs a job over the [0, \e count) range and waits for it to finish.
+/// The range is split into batches of \e grain items which are handed out to
+/// the worker threads; the calling thread takes part in the work as well. The
+/// result is therefore identical to calling <tt>job(arg, 0, count)</tt>, as
+/// long as the job only writes to per-item state.
+/// \param job			job function
+/// \param arg			user data pointer passed to the job function
+/// \param count		number of items to process
+/// \param grain		number of items in a batch
+/// \param progress		if not NULL, called once per every completed item;
+///						always called from the calling thread
+void ac_thread_parallel_for(ac_job_t job, void *arg, int count, int grain,
+							void (*progress)(void));
+
+/// \brief Queues a job over the [0, \e count) range and returns immediately.
+/// The job is processed by the worker threads, so the caller is never held up
+/// by it, up until \ref ac_thread_wait, which runs whatever the workers haven't
+/// started yet on the calling thread. The job goes to the end of the queue,
+/// behind the ones queued earlier. If there are no worker threads, the job is
+/// run to completion before the function returns.
+/// \param job			job function
+/// \param arg			user data pointer passed to the job function; must stay
+///						valid until the job is finished
+/// \param count		number of items to process
+/// \param grain		number of items in a batch
+/// \return				job handle; must be passed to \ref ac_thread_poll or
+///						\ref ac_thread_wait to release it
+ac_task_t *ac_thread_async(ac_job_t job, void *arg, int count, int grain);
+
+/// \brief Queues a job like \ref ac_thread_async, but at the head of the
+/// queue, ahead of the jobs queued earlier.
+/// Meant for the jobs that the caller is going to wait for shortly, which
+/// mustn't be held up by background work. The jobs of
+/// \ref ac_thread_parallel_for are queued this way too.
+ac_task_t *ac_thread_async_urgent(ac_job_t job, void *arg, int count,
+									int grain);
+
+/// \brief Checks whether an asynchronous job has finished, without blocking.
+/// \note				The handle is released if the job has finished and must
+///						not be used afterwards.
+/// \return				true if the job has finished
+bool ac_thread_poll(ac_task_t *task);
+
+/// \brief Waits for an asynchronous job to finish and releases its handle.
+/// The calling thread runs the items of the job that haven't been handed out
+/// to the worker threads yet itself.
+void ac_thread_wait(ac_task_t *task);
+
+/// Handle of a dedicated thread, see \ref ac_thread_spawn.
+typedef struct SDL_Thread ac_thread_t;
+
+/// \brief Starts a dedicated thread, outside of the worker pool.
+/// Meant for long-running background tasks that would otherwise hog a worker.
+/// \param func			thread function
+/// \param arg			user data pointer passed to the thread function
+/// \return				thread handle, or NULL on failure
+ac_thread_t *ac_thread_spawn(int (*func)(void *), void *arg);
+
+/// \brief Waits for a dedicated thread to finish and releases its handle.
+void ac_thread_join(ac_thread_t *thread);
+
+/// \brief Atomically adds a value to an integer shared between threads.
+/// Acts as a full memory barrier, so everything written before the call is
+/// visible to any thread that reads the new value.
+/// \return				the new value
+int ac_atomic_add(volatile int *value, int delta);
+
+/// \brief Atomically reads an integer shared between threads.
+/// Acts as a full memory barrier, see \ref ac_atomic_add.
+int ac_atomic_get(volatile int *value);
+
+/// @}
+
+#endif // AC_THREAD_H
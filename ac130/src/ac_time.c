@@ -0,0 +1,29 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// High resolution timer, shared by the benchmarks and the replay statistics
+
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <time.h>
+#endif
+#include "ac_time.h"
+
+double ac_time_now(void) {
+#ifdef WIN32
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+int ac_time_cmp(const void *a, const void *b) {
+	double d = *(const double *)a - *(const double *)b;
+	return d < 0 ? -1 : d > 0;
+}
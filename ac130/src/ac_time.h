@@ -0,0 +1,27 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+#ifndef AC_TIME_H
+#define AC_TIME_H
+
+/// \file ac_time.h
+/// \brief Public interface to the high resolution timer.
+/// \addtogroup time High resolution timer
+/// @{
+
+/// \brief Reads the monotonic clock.
+/// Unlike SDL_GetTicks, it has sub-millisecond resolution, so it can time
+/// single frames and ticks.
+/// \return				time in milliseconds since an arbitrary point
+double ac_time_now(void);
+
+/// \brief Orders two times for qsort, in ascending order.
+/// \param a			pointer to the first time (a double)
+/// \param b			pointer to the second time (a double)
+/// \return				negative if \e a is the lesser, positive if it is the
+///						greater, 0 if they are equal
+int ac_time_cmp(const void *a, const void *b);
+
+/// @}
+
+#endif // AC_TIME_H
@@ -4,148 +4,1579 @@
 // Collision detection
 
 #include "g_local.h"
+#include "../ac_thread.h"
 
-static inline float g_trace_through_AABB(ac_vec4_t p1, ac_vec4_t p2,
-	ac_vec4_t bounds[2]) {
-	float d1, d2, f;
-	float enterFrac = -1.f, leaveFrac = 1.f;
-	bool startOut = false;
+/// Number of SSE vectors of the trees of a prop map square.
+#define TREE_GROUPS		((TREES_PER_FIELD + 3) / 4)
+
+/// Trees of a prop map square, 4 to an SSE vector, for the ray tests. A tree
+/// is a cone standing on its base, which is how the renderer draws it.
+typedef struct {
+	ALIGNED_16 float	x[4];		///< X coordinate of the axis
+	ALIGNED_16 float	z[4];		///< Z coordinate of the axis
+	ALIGNED_16 float	top[4];		///< height of the apex
+	ALIGNED_16 float	bottom[4];	///< height of the base
+	ALIGNED_16 float	slope[4];	///< squared ratio of the radius of the
+									///  cone to the depth below its apex
+} g_trees4_t;
+
+/// Building in the form that the ray tests take it in; the inverse of the
+/// instance transform of the renderer's prop shader, which takes the building
+/// to the space of its model, i.e. a box spanning from -0.5 to 0.5 along the X
+/// and Z axes and from -1 to 1 along the Y axis, with the ridge of a slanted
+/// roof 1.4 high.
+typedef struct {
+	ac_vec4_t	pos;			///< position of the building's origin
+	float		xx, xz;			///< model X coordinate per world X and Z
+	float		zx, zz;			///< model Z coordinate per world X and Z
+	float		invY;			///< model Y coordinate per world Y
+	float		roof;			///< slope of the roof, 0 if it's flat
+	float		top;			///< height of the roof at the model's Z axis
+} g_bldg_ray_t;
+
+/// Trees of the prop tree, \ref TREE_GROUPS vectors per prop map square, in
+/// the order of the tree list.
+static g_trees4_t	*g_ray_trees = NULL;
+/// Buildings of the prop tree, in the order of the building list.
+static g_bldg_ray_t	*g_ray_bldgs = NULL;
+/// Lengths of the prop lists covered by the prop tree.
+static int			g_ray_num_trees = 0;
+static int			g_ray_num_bldgs = 0;
+
+bool				g_collide_bvh = false;
+
+/// Batch being traced.
+static struct {
+	const g_ray_t	*rays;
+	g_trace_t		*hits;
+	int				num;
+	int				*order;		///< ray indices, sorted along a Morton curve
+	int				*temp;		///< scratch space for the sort
+	uint			*keys;		///< Morton codes of the rays' starts
+	int				max;		///< capacity of the arrays above
+} g_batch;
+
+/// Puts a tree in a lane of an SSE vector of cones.
+/// \param t		the tree, or NULL to fill the lane with an empty cone
+static void g_ray_tree(g_trees4_t *g, int lane, const ac_tree_t *t) {
+	float c;
+
+	if (!t) {
+		// padding; a cone with its apex below its base is empty
+		g->x[lane] = g->z[lane] = 0.f;
+		g->top[lane] = -FLT_MAX;
+		g->bottom[lane] = FLT_MAX;
+		g->slope[lane] = 0.f;
+		return;
+	}
+	// see gen_props() for the model and gen_fill_propleaf() for the scales
+	g->x[lane] = t->pos.f[0];
+	g->z[lane] = t->pos.f[2];
+	g->top[lane] = t->pos.f[1] + t->Yscale;
+	g->bottom[lane] = t->pos.f[1] - 0.1f * t->Yscale;
+	c = t->XZscale / (1.1f * t->Yscale);
+	g->slope[lane] = c * c;
+}
+
+/// Converts the props of a range of prop tree nodes for the ray tests.
+static void g_ray_props_nodes(void *arg, int first, int last) {
+	const ac_prop_t *node;
+	const ac_bldg_t *b;
+	g_trees4_t *g;
+	g_bldg_ray_t *r;
+	float c, s;
+	int n, i;
+
+	for (n = first; n < last; n++) {
+		node = &gen_proptree->nodes[n];
+		if (node->trees >= 0) {
+			// the trees are only needed by the prop tree walk
+			if (!g_ray_trees)
+				continue;
+			g = g_ray_trees + node->trees / TREES_PER_FIELD * TREE_GROUPS;
+			for (i = 0; i < TREE_GROUPS * 4; i++)
+				g_ray_tree(&g[i / 4], i % 4, i < TREES_PER_FIELD
+					? gen_proptree->trees + node->trees + i : NULL);
+		} else if (node->bldgs >= 0) {
+			for (i = 0; i < BLDGS_PER_FIELD; i++) {
+				b = gen_proptree->bldgs + node->bldgs + i;
+				r = g_ray_bldgs + node->bldgs + i;
+				// the shader rotates the model and then scales it along the
+				// world axes, so undo it in the reverse order
+				c = cosf(b->ang);
+				s = sinf(b->ang);
+				r->pos = b->pos;
+				r->xx = c / b->Xscale;
+				r->xz = -s / b->Zscale;
+				r->zx = s / b->Xscale;
+				r->zz = c / b->Zscale;
+				r->invY = 1.f / b->Yscale;
+				r->roof = b->slantedRoof ? 0.8f : 0.f;
+				r->top = b->slantedRoof ? 1.4f : 1.f;
+			}
+		}
+	}
+}
+
+/// Builds the prop lists of the ray tests.
+/// \return		false if out of memory
+static bool g_ray_props_build(void) {
+	const ac_prop_t *node;
+	int n, numTrees = 0, numBldgs = 0;
+
+	g_ray_num_trees = g_ray_num_bldgs = 0;
+	if (!gen_proptree)
+		return true;
+	// the lists aren't stored with the tree, but the leaves cover them
+	for (n = 0; n < gen_proptree->numNodes; n++) {
+		node = &gen_proptree->nodes[n];
+		if (node->trees >= 0 && node->trees + TREES_PER_FIELD > numTrees)
+			numTrees = node->trees + TREES_PER_FIELD;
+		else if (node->bldgs >= 0
+			&& node->bldgs + BLDGS_PER_FIELD > numBldgs)
+			numBldgs = node->bldgs + BLDGS_PER_FIELD;
+	}
+	// the BVH keeps the trees in its leaves
+	if (!g_collide_bvh && !(g_ray_trees = _mm_malloc(sizeof(*g_ray_trees)
+		* (numTrees / TREES_PER_FIELD * TREE_GROUPS + 1), 16)))
+		return false;
+	if (!(g_ray_bldgs = malloc(sizeof(*g_ray_bldgs) * (numBldgs + 1))))
+		return false;
+	ac_thread_parallel_for(g_ray_props_nodes, NULL, gen_proptree->numNodes,
+		256, NULL);
+	g_ray_num_trees = numTrees;
+	g_ray_num_bldgs = numBldgs;
+	return true;
+}
+
+/// Returns \e t where \e mask is set, \e f elsewhere.
+static inline __m128 g_select4(__m128 mask, __m128 t, __m128 f) {
+	return _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, f));
+}
+
+/// Clips 4 ray intervals to half-spaces, given as den * t <= num, where \e t
+/// is the fraction of the way along the ray. An interval that ends up with
+/// \e tout < \e tin is empty.
+static inline void g_clip4(__m128 num, __m128 den, __m128 *tin,
+	__m128 *tout) {
+	const __m128 zero = _mm_setzero_ps();
+	// the lanes parallel to the plane divide by 0, but aren't selected
+	const __m128 t = _mm_div_ps(num, den);
+
+	*tin = g_select4(_mm_cmplt_ps(den, zero), _mm_max_ps(*tin, t), *tin);
+	*tout = g_select4(_mm_cmpgt_ps(den, zero), _mm_min_ps(*tout, t), *tout);
+	// parallel and outside
+	*tout = g_select4(_mm_and_ps(_mm_cmpeq_ps(den, zero),
+		_mm_cmplt_ps(num, zero)), _mm_set1_ps(-1.f), *tout);
+}
+
+/// State of a ray traced through the prop tree, in world space.
+typedef struct {
+	ac_vec4_t		p1;			///< start of the ray
+	ac_vec4_t		v;			///< the ray, from its start to its end
+	ac_vec4_t		invV;		///< reciprocals of the ray's components
+	g_trace_t		hit;		///< closest hit so far
+	int				batch[4];	///< buildings waiting to be tested
+	int				numBatch;	///< number of the waiting buildings
+} g_prop_ray_t;
+
+/// Intersects the ray with a box, all 3 slabs at once.
+/// \param min		lower corner of the box, 16 byte aligned; the 4th float
+///					may be anything, as the ray's 4th component is ignored
+/// \param max		upper corner of the box, likewise
+/// \return			fraction at which the ray enters the box, 0 if it starts
+///					inside and 2 if it misses
+static inline float g_ray_box(const g_prop_ray_t *ray, const float *min,
+	const float *max) {
+	const __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(min), ray->p1.sse),
+		ray->invV.sse);
+	const __m128 b = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(max), ray->p1.sse),
+		ray->invV.sse);
+	ac_vec4_t t0, t1;
+	float enter, leave;
+
+	// near and far planes of every slab
+	t0.sse = _mm_min_ps(a, b);
+	t1.sse = _mm_max_ps(a, b);
+	enter = ac_max(ac_max(t0.f[0], t0.f[1]), ac_max(t0.f[2], 0.f));
+	leave = ac_min(ac_min(t1.f[0], t1.f[1]), ac_min(t1.f[2], 1.f));
+	return enter <= leave ? enter : 2.f;
+}
+
+/// Intersects the ray with 4 cones.
+/// \param base		fraction of the way at which the ray reaches the trees' node;
+///					the cone equations are solved from there, as their terms
+///					lose too much precision far away from the cone
+/// \return			fractions at which the cones are hit, 2 where they aren't
+static inline __m128 g_ray_cones4(const g_prop_ray_t *ray,
+	const g_trees4_t *g, float base) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 vx = _mm_set1_ps(ray->v.f[0]);
+	const __m128 vy = _mm_set1_ps(ray->v.f[1]);
+	const __m128 vz = _mm_set1_ps(ray->v.f[2]);
+	const __m128 py = _mm_set1_ps(ray->p1.f[1] + ray->v.f[1] * base);
+	const __m128 k = _mm_load_ps(g->slope);
+	__m128 ox, oy, oz, a, b, c, disc, q, r1, r2, tin, tout, root, inside,
+		hit;
+
+	// clip the ray to the height range of the cone
+	tin = zero;
+	tout = _mm_set1_ps(ray->hit.frac - base);
+	g_clip4(_mm_sub_ps(_mm_load_ps(g->top), py), vy, &tin, &tout);
+	g_clip4(_mm_sub_ps(py, _mm_load_ps(g->bottom)), _mm_sub_ps(zero, vy),
+		&tin, &tout);
+
+	// the ray is in the cone where a * t^2 + 2 * b * t + c <= 0; above the
+	// apex is the other nappe, which the clip has cut off
+	ox = _mm_sub_ps(_mm_set1_ps(ray->p1.f[0] + ray->v.f[0] * base),
+		_mm_load_ps(g->x));
+	oz = _mm_sub_ps(_mm_set1_ps(ray->p1.f[2] + ray->v.f[2] * base),
+		_mm_load_ps(g->z));
+	oy = _mm_sub_ps(_mm_load_ps(g->top), py);
+	a = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vz, vz)),
+		_mm_mul_ps(k, _mm_mul_ps(vy, vy)));
+	b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, vx), _mm_mul_ps(oz, vz)),
+		_mm_mul_ps(k, _mm_mul_ps(oy, vy)));
+	c = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oz, oz)),
+		_mm_mul_ps(k, _mm_mul_ps(oy, oy)));
+
+	// if the ray enters the height range inside the cone, that's the hit
+	inside = _mm_cmple_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(a, tin),
+		_mm_add_ps(b, b)), tin), c), zero);
+	// otherwise it's the first root past it; the numerically stable roots
+	// are q / a and c / q, the latter still right when the equation is linear
+	disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+	q = _mm_or_ps(_mm_sqrt_ps(_mm_max_ps(disc, zero)),
+		_mm_and_ps(b, _mm_set1_ps(-0.f)));
+	q = _mm_sub_ps(zero, _mm_add_ps(b, q));
+	r1 = _mm_div_ps(q, a);
+	r2 = _mm_div_ps(c, q);
+	root = g_select4(_mm_cmpge_ps(_mm_min_ps(r1, r2), tin),
+		_mm_min_ps(r1, r2), _mm_max_ps(r1, r2));
+	hit = _mm_or_ps(inside, _mm_and_ps(_mm_cmpge_ps(disc, zero),
+		_mm_cmpge_ps(root, tin)));
+	tin = g_select4(inside, tin, root);
+	hit = _mm_and_ps(hit, _mm_cmple_ps(tin, tout));
+	return g_select4(hit, _mm_add_ps(tin, _mm_set1_ps(base)),
+		_mm_set1_ps(2.f));
+}
+
+/// Tests 4 consecutive trees of the tree list against the ray.
+/// \param index	index of the first of the trees
+/// \param base		see \ref g_ray_cones4
+static inline void g_ray_trees4(g_prop_ray_t *ray, const g_trees4_t *g,
+	int index, float base) {
+	ac_vec4_t t;
+	int i;
+
+	t.sse = g_ray_cones4(ray, g, base);
+	for (i = 0; i < 4; i++) {
+		if (t.f[i] < ray->hit.frac) {
+			ray->hit.frac = t.f[i];
+			ray->hit.type = HIT_TREE;
+			ray->hit.prop = index + i;
+		}
+	}
+}
+
+/// Tests the batch of buildings against the ray.
+static void g_ray_bldgs4(g_prop_ray_t *ray) {
+	const __m128 zero = _mm_setzero_ps(), half = _mm_set1_ps(0.5f);
+	const g_bldg_ray_t *b[4];
+	__m128 dx, dy, dz, ox, oy, oz, vx, vy, vz, roof, top, tin, tout;
+	ac_vec4_t t;
+	int i;
+
+	if (!ray->numBatch)
+		return;
+	// fill the empty lanes with copies of the first building
+	for (i = 0; i < 4; i++)
+		b[i] = g_ray_bldgs + ray->batch[i < ray->numBatch ? i : 0];
+#define GATHER(f)	_mm_set_ps(b[3]->f, b[2]->f, b[1]->f, b[0]->f)
+	// transform the ray to the model space of every building
+	dx = _mm_sub_ps(_mm_set1_ps(ray->p1.f[0]), GATHER(pos.f[0]));
+	dy = _mm_sub_ps(_mm_set1_ps(ray->p1.f[1]), GATHER(pos.f[1]));
+	dz = _mm_sub_ps(_mm_set1_ps(ray->p1.f[2]), GATHER(pos.f[2]));
+	ox = _mm_add_ps(_mm_mul_ps(GATHER(xx), dx), _mm_mul_ps(GATHER(xz), dz));
+	oz = _mm_add_ps(_mm_mul_ps(GATHER(zx), dx), _mm_mul_ps(GATHER(zz), dz));
+	oy = _mm_mul_ps(GATHER(invY), dy);
+	dx = _mm_set1_ps(ray->v.f[0]);
+	dz = _mm_set1_ps(ray->v.f[2]);
+	vx = _mm_add_ps(_mm_mul_ps(GATHER(xx), dx), _mm_mul_ps(GATHER(xz), dz));
+	vz = _mm_add_ps(_mm_mul_ps(GATHER(zx), dx), _mm_mul_ps(GATHER(zz), dz));
+	vy = _mm_mul_ps(GATHER(invY), _mm_set1_ps(ray->v.f[1]));
+	roof = GATHER(roof);
+	top = GATHER(top);
+#undef GATHER
+
+	// clip the ray to the walls, the floor and both sides of the roof
+	tin = zero;
+	tout = _mm_set1_ps(ray->hit.frac);
+	g_clip4(_mm_sub_ps(half, ox), vx, &tin, &tout);
+	g_clip4(_mm_add_ps(half, ox), _mm_sub_ps(zero, vx), &tin, &tout);
+	g_clip4(_mm_sub_ps(half, oz), vz, &tin, &tout);
+	g_clip4(_mm_add_ps(half, oz), _mm_sub_ps(zero, vz), &tin, &tout);
+	g_clip4(_mm_add_ps(_mm_set1_ps(1.f), oy), _mm_sub_ps(zero, vy),
+		&tin, &tout);
+	g_clip4(_mm_sub_ps(_mm_sub_ps(top, oy), _mm_mul_ps(roof, ox)),
+		_mm_add_ps(vy, _mm_mul_ps(roof, vx)), &tin, &tout);
+	g_clip4(_mm_add_ps(_mm_sub_ps(top, oy), _mm_mul_ps(roof, ox)),
+		_mm_sub_ps(vy, _mm_mul_ps(roof, vx)), &tin, &tout);
+	t.sse = g_select4(_mm_cmple_ps(tin, tout), tin, _mm_set1_ps(2.f));
+
+	for (i = 0; i < ray->numBatch; i++) {
+		if (t.f[i] < ray->hit.frac) {
+			ray->hit.frac = t.f[i];
+			ray->hit.type = HIT_BLDG;
+			ray->hit.prop = ray->batch[i];
+		}
+	}
+	ray->numBatch = 0;
+}
+
+/// Traces the ray through a prop tree node. The trees are tested as soon as
+/// their node is reached; the buildings, one to a node, are batched 4 at a
+/// time.
+static void g_ray_node(g_prop_ray_t *ray, int n) {
+	const ac_prop_t *node = &gen_proptree->nodes[n];
+	const g_trees4_t *g;
+	float enter;
+	int i;
+
+	// nothing in the box can be closer than the closest hit so far
+	if ((enter = g_ray_box(ray, gen_proptree->bounds[n * 2].f,
+		gen_proptree->bounds[n * 2 + 1].f)) >= ray->hit.frac)
+		return;
+	if (node->trees >= 0) {
+		g = g_ray_trees + node->trees / TREES_PER_FIELD * TREE_GROUPS;
+		for (i = 0; i < TREE_GROUPS; i++)
+			g_ray_trees4(ray, g + i, node->trees + i * 4, enter);
+		return;
+	} else if (node->bldgs >= 0) {
+		for (i = 0; i < BLDGS_PER_FIELD; i++) {
+			ray->batch[ray->numBatch++] = node->bldgs + i;
+			if (ray->numBatch == 4)
+				g_ray_bldgs4(ray);
+		}
+		return;
+	}
+	for (i = 0; i < node->numChildren; i++)
+		g_ray_node(ray, node->child + i);
+}
+
+/// Number of bins the split candidates of a BVH node are picked from, along
+/// the axis its props' centres are spread the most along.
+#define BVH_BINS			16
+/// Maximum number of props in a BVH leaf; the trees of a leaf make up a single
+/// SSE vector of cones.
+#define BVH_LEAF_SIZE		4
+/// Ranges of props up to that size are built into a subtree by a single
+/// worker thread.
+#define BVH_TASK_SIZE		4096
+/// Number of props binned by a worker thread at a time; the larger ranges at
+/// the top of the tree are binned by all of them.
+#define BVH_BIN_GRAIN		16384
+/// Depth past which the nodes are halved instead, so that the tree stays
+/// shallow enough for the traversal stack.
+#define BVH_SAH_DEPTH		48
+/// Size of the traversal stack.
+#define BVH_STACK			80
+
+/// Node of the prop BVH, two to a cache line.
+typedef struct {
+	ALIGNED_16 float	min[3];	///< lower corner of the node's box
+	int		index;		///< inner nodes: index of the second child, the first
+						///  one comes right after the node; leaves: index of
+						///  the leaf's props
+	float	max[3];		///< upper corner of the node's box
+	int		count;		///< number of props of a leaf, 0 for inner nodes
+} g_bvh_node_t;
+
+/// Nodes of the prop BVH, depth first.
+static g_bvh_node_t	*g_bvh_nodes = NULL;
+static int			g_bvh_num_nodes = 0;
+/// Trees of every BVH leaf, as cones in the order of the leaf's props.
+static g_trees4_t	*g_bvh_trees = NULL;
+/// Props of every BVH leaf, \ref BVH_LEAF_SIZE to a leaf; the trees come first,
+/// as their indices in the tree list, and the buildings as -1 minus theirs.
+static int			*g_bvh_props = NULL;
+static int			g_bvh_num_leaves = 0;
+
+/// Prop being built into the BVH.
+typedef struct {
+	ac_vec4_t	min, max;	///< bounding box
+	int			id;			///< index in the tree list, or -1 minus the index
+							///  in the building list
+} g_bvh_prim_t;
+
+/// Bounding boxes of a range of props and of their centres.
+typedef struct {
+	ac_vec4_t	min, max;
+	ac_vec4_t	cmin, cmax;
+	int			count;		///< number of props in the range
+} g_bvh_bin_t;
+
+/// Growable array of BVH nodes.
+typedef struct {
+	g_bvh_node_t	*nodes;
+	int				num, max;
+} g_bvh_vec_t;
+
+/// Subtree built by a single worker thread.
+typedef struct {
+	int				first, count;	///< range of props
+	int				depth;			///< depth of the subtree's root
+	g_bvh_bin_t		bounds;			///< bounds of the props
+	g_bvh_vec_t		out;			///< nodes of the subtree, depth first
+	bool			failed;			///< set if out of memory
+} g_bvh_task_t;
+
+/// State of the BVH build.
+static struct {
+	g_bvh_prim_t	*prims;
+	int				numPrims;
+	g_bvh_vec_t		top;		///< nodes at the top of the tree; those with
+								///  negative counts stand for the subtrees
+	g_bvh_task_t	*tasks;		///< subtrees built in parallel
+	int				numTasks, maxTasks;
+	/// Bins of the chunks of a range binned in parallel.
+	g_bvh_bin_t		(*chunks)[BVH_BINS];
+	int				first, count;	///< range binned in parallel
+	int				axis;			///< its bin mapping
+	float			cmin, scale;
+} g_bvh_work;
+
+/// Computes the bounding boxes of a range of props.
+static void g_bvh_prims(void *arg, int first, int last) {
+	const ac_tree_t *t;
+	const ac_bldg_t *b;
+	g_bvh_prim_t *p;
+	float r, rx, rz, top;
 	int i;
-	for (i = 0; i < 6; i++) {
-		if (i < 3) {
-			d1 = -p1.f[i] + bounds[0].f[i];
-			d2 = -p2.f[i] + bounds[0].f[i];
+
+	for (i = first; i < last; i++) {
+		p = &g_bvh_work.prims[i];
+		if (i < g_ray_num_trees) {
+			// the same boxes as gen_fill_propleaf() grows the leaves by
+			t = gen_proptree->trees + i;
+			r = t->XZscale;
+			p->min = ac_vec_set(t->pos.f[0] - r,
+				t->pos.f[1] - 0.1f * t->Yscale, t->pos.f[2] - r, 0.f);
+			p->max = ac_vec_set(t->pos.f[0] + r, t->pos.f[1] + t->Yscale,
+				t->pos.f[2] + r, 0.f);
+			p->id = i;
 		} else {
-			d1 = p1.f[i - 3] - bounds[1].f[i - 3];
-			d2 = p2.f[i - 3] - bounds[1].f[i - 3];
-		}
-		if (d1 > 0)
-            startOut = true;
-		// if completely in front of face, no intersection with the entire AABB
-		if (d1 > 0 && (d2 >= 0.f || d2 >= d1))
-			return 1.f;
-		// if it doesn't cross the plane, the plane isn't relevent
-		if (d1 <= 0 && d2 <= 0)
+			b = gen_proptree->bldgs + i - g_ray_num_trees;
+			r = fabsf(cosf(b->ang)) + fabsf(sinf(b->ang));
+			rx = 0.5f * b->Xscale * r;
+			rz = 0.5f * b->Zscale * r;
+			top = b->Yscale * (b->slantedRoof ? 1.4f : 1.f);
+			p->min = ac_vec_set(b->pos.f[0] - rx, b->pos.f[1] - b->Yscale,
+				b->pos.f[2] - rz, 0.f);
+			p->max = ac_vec_set(b->pos.f[0] + rx, b->pos.f[1] + top,
+				b->pos.f[2] + rz, 0.f);
+			p->id = -1 - (i - g_ray_num_trees);
+		}
+	}
+}
+
+/// Empties a bin.
+static inline void g_bvh_bin_clear(g_bvh_bin_t *b) {
+	b->min = b->cmin = ac_vec_setall(FLT_MAX);
+	b->max = b->cmax = ac_vec_setall(-FLT_MAX);
+	b->count = 0;
+}
+
+/// Adds a prop with the given centre to a bin.
+static inline void g_bvh_bin_add(g_bvh_bin_t *b, const g_bvh_prim_t *p,
+	__m128 c) {
+	b->min.sse = _mm_min_ps(b->min.sse, p->min.sse);
+	b->max.sse = _mm_max_ps(b->max.sse, p->max.sse);
+	b->cmin.sse = _mm_min_ps(b->cmin.sse, c);
+	b->cmax.sse = _mm_max_ps(b->cmax.sse, c);
+	b->count++;
+}
+
+/// Adds the contents of bin \e s to bin \e d.
+static inline void g_bvh_bin_merge(g_bvh_bin_t *d, const g_bvh_bin_t *s) {
+	d->min.sse = _mm_min_ps(d->min.sse, s->min.sse);
+	d->max.sse = _mm_max_ps(d->max.sse, s->max.sse);
+	d->cmin.sse = _mm_min_ps(d->cmin.sse, s->cmin.sse);
+	d->cmax.sse = _mm_max_ps(d->cmax.sse, s->cmax.sse);
+	d->count += s->count;
+}
+
+/// \return half of the surface area of the bin's box
+static inline float g_bvh_area(const g_bvh_bin_t *b) {
+	ac_vec4_t d;
+
+	d.sse = _mm_max_ps(_mm_sub_ps(b->max.sse, b->min.sse), _mm_setzero_ps());
+	return d.f[0] * d.f[1] + d.f[1] * d.f[2] + d.f[2] * d.f[0];
+}
+
+/// \return the centre of the prop's box
+static inline __m128 g_bvh_centre(const g_bvh_prim_t *p) {
+	return _mm_mul_ps(_mm_add_ps(p->min.sse, p->max.sse), _mm_set1_ps(0.5f));
+}
+
+/// \return the bin of a prop
+static inline int g_bvh_bin_index(const g_bvh_prim_t *p, int axis,
+	float cmin, float scale) {
+	const float f = ((p->min.f[axis] + p->max.f[axis]) * 0.5f - cmin)
+		* scale;
+
+	return f <= 0.f ? 0 : f >= BVH_BINS - 1 ? BVH_BINS - 1 : (int)f;
+}
+
+/// Bins a range of props.
+static void g_bvh_bin_range(int first, int last, int axis, float cmin,
+	float scale, g_bvh_bin_t *bins) {
+	const g_bvh_prim_t *p;
+	int i;
+
+	for (i = 0; i < BVH_BINS; i++)
+		g_bvh_bin_clear(&bins[i]);
+	for (i = first; i < last; i++) {
+		p = &g_bvh_work.prims[i];
+		g_bvh_bin_add(&bins[g_bvh_bin_index(p, axis, cmin, scale)], p,
+			g_bvh_centre(p));
+	}
+}
+
+/// Bins a range of chunks of the range binned in parallel.
+static void g_bvh_bin_chunks(void *arg, int first, int last) {
+	const int end = g_bvh_work.first + g_bvh_work.count;
+	int i, start;
+
+	for (i = first; i < last; i++) {
+		start = g_bvh_work.first + i * BVH_BIN_GRAIN;
+		g_bvh_bin_range(start, ac_min(start + BVH_BIN_GRAIN, end),
+			g_bvh_work.axis, g_bvh_work.cmin, g_bvh_work.scale,
+			g_bvh_work.chunks[i]);
+	}
+}
+
+/// Bins a range of props, on all of the threads if it's large.
+static void g_bvh_bin(int first, int count, int axis, float cmin,
+	float scale, g_bvh_bin_t *bins) {
+	const int chunks = (count + BVH_BIN_GRAIN - 1) / BVH_BIN_GRAIN;
+	int i, k;
+
+	if (chunks < 2) {
+		g_bvh_bin_range(first, first + count, axis, cmin, scale, bins);
+		return;
+	}
+	g_bvh_work.first = first;
+	g_bvh_work.count = count;
+	g_bvh_work.axis = axis;
+	g_bvh_work.cmin = cmin;
+	g_bvh_work.scale = scale;
+	ac_thread_parallel_for(g_bvh_bin_chunks, NULL, chunks, 1, NULL);
+	// merge in a fixed order, so that the tree doesn't depend on the threads
+	memcpy(bins, g_bvh_work.chunks[0], sizeof(g_bvh_work.chunks[0]));
+	for (k = 1; k < chunks; k++) {
+		for (i = 0; i < BVH_BINS; i++)
+			g_bvh_bin_merge(&bins[i], &g_bvh_work.chunks[k][i]);
+	}
+}
+
+/// Computes the bounds of a range of props.
+static void g_bvh_range_bounds(int first, int count, g_bvh_bin_t *b) {
+	const g_bvh_prim_t *p;
+	int i;
+
+	g_bvh_bin_clear(b);
+	for (i = first; i < first + count; i++) {
+		p = &g_bvh_work.prims[i];
+		g_bvh_bin_add(b, p, g_bvh_centre(p));
+	}
+}
+
+/// Splits a range of props in two with the surface area heuristic, evaluated
+/// at the boundaries between the bins along the axis that the props' centres
+/// are spread the most along.
+/// \param b		bounds of the range
+/// \param left		pointer to where to store the bounds of the left half
+/// \param right	pointer to where to store the bounds of the right half
+/// \return			index of the first prop of the right half
+static int g_bvh_split(int first, int count, int depth, const g_bvh_bin_t *b,
+	g_bvh_bin_t *left, g_bvh_bin_t *right) {
+	g_bvh_bin_t bins[BVH_BINS], acc, accL[BVH_BINS];
+	ac_vec4_t extent;
+	float cost, scale, best = FLT_MAX;
+	int axis, i, j, bestBin = -1;
+	g_bvh_prim_t tmp;
+
+	extent.sse = _mm_sub_ps(b->cmax.sse, b->cmin.sse);
+	axis = extent.f[0] > extent.f[1] ? 0 : 1;
+	axis = extent.f[axis] > extent.f[2] ? axis : 2;
+	scale = BVH_BINS / extent.f[axis];
+	if (extent.f[axis] > 0.f && depth < BVH_SAH_DEPTH) {
+		g_bvh_bin(first, count, axis, b->cmin.f[axis], scale, bins);
+		g_bvh_bin_clear(&acc);
+		for (i = 0; i < BVH_BINS - 1; i++) {
+			g_bvh_bin_merge(&acc, &bins[i]);
+			accL[i] = acc;
+		}
+		// sweep from the right, splitting after bin i - 1
+		g_bvh_bin_clear(&acc);
+		for (i = BVH_BINS - 1; i > 0; i--) {
+			g_bvh_bin_merge(&acc, &bins[i]);
+			if (!acc.count || !accL[i - 1].count)
+				continue;
+			cost = g_bvh_area(&accL[i - 1]) * accL[i - 1].count
+				+ g_bvh_area(&acc) * acc.count;
+			if (cost < best) {
+				best = cost;
+				bestBin = i - 1;
+			}
+		}
+	}
+
+	if (bestBin < 0) {
+		// all of the centres coincide, or the tree is getting too deep;
+		// split the range in halves
+		i = first + count / 2;
+		g_bvh_range_bounds(first, i - first, left);
+		g_bvh_range_bounds(i, first + count - i, right);
+		return i;
+	}
+	g_bvh_bin_clear(left);
+	g_bvh_bin_clear(right);
+	for (j = 0; j < BVH_BINS; j++)
+		g_bvh_bin_merge(j <= bestBin ? left : right, &bins[j]);
+	// move the props of the left bins to the front; the bins are found the
+	// very same way as when binning, so the halves match their bounds
+	i = first;
+	j = first + count - 1;
+	while (i <= j) {
+		if (g_bvh_bin_index(&g_bvh_work.prims[i], axis, b->cmin.f[axis],
+			scale) <= bestBin) {
+			i++;
 			continue;
-		// crosses face
-		if (d1 > d2) {	// enter
-			f = d1 / (d1 - d2);
-			if (f < 0)
-				f = 0;
-			if (f > enterFrac)
-				enterFrac = f;
-		} else {	// leave
-			f = d1 / (d1 - d2);
-			if (f > 1)
-				f = 1;
-			if (f < leaveFrac)
-				leaveFrac = f;
-		}
-	}
-	if (!startOut)
-        return 0.f;
-	if (enterFrac < leaveFrac)
-		return (enterFrac > 0 ? enterFrac : 0.f);
-	return 1.f;
+		}
+		tmp = g_bvh_work.prims[i];
+		g_bvh_work.prims[i] = g_bvh_work.prims[j];
+		g_bvh_work.prims[j--] = tmp;
+	}
+	return i;
 }
 
-static inline float g_trace_through_bldg(ac_vec4_t p1, ac_vec4_t p2,
-	ac_bldg_t *b) {
-	// OK, let's do this the easy way - transform the ray into the building's
-	// own object space and just treat it like a bounding box
-	float c, s;
-	ac_vec4_t x, z, l1, l2, bounds[2];
-	c = cosf(b->ang);
-	s = sinf(b->ang);
-	// these vectors make up the first and third rows of the inverse rotation
-	// matrix
-	x = ac_vec_set(c,
-					0.f,
-					-s,
-					0.f);
-	z = ac_vec_set(s,
-					0.f,
-					c,
-					0.f);
-	// now, do the actual transformation; first, make the translation relative
-	p1 = ac_vec_sub(p1, b->pos);
-	p2 = ac_vec_sub(p2, b->pos);
-	// then undo rotation
-	l1 = ac_vec_set(ac_vec_dot(p1, x),
-					p1.f[1],
-					ac_vec_dot(p1, z),
-					0.f);
-	l2 = ac_vec_set(ac_vec_dot(p2, x),
-					p2.f[1],
-					ac_vec_dot(p2, z),
-					0.f);
-	// calculate the bounding box
-	// cheat on the Y axis for slanted roof buildings
-	bounds[0] = ac_vec_set(-0.5 * b->Xscale,
-							b->slantedRoof ? -1.2 : -1.f,
-							-0.5 * b->Zscale,
-							0.f);
-	bounds[1] = ac_vec_mulf(bounds[0], -1.f);
-	// whew, that's about it!
-	return g_trace_through_AABB(l1, l2, bounds);
-}
-
-static float g_collide_bldgs(ac_vec4_t p1, ac_vec4_t p2, ac_prop_t *node,
-	float curFrac) {
+/// Adds a node to an array.
+/// \return index of the node, or -1 if out of memory
+static int g_bvh_push(g_bvh_vec_t *v, const g_bvh_bin_t *b) {
+	g_bvh_node_t *n;
+	int max;
+
+	if (v->num >= v->max) {
+		max = v->max ? v->max * 2 : 256;
+		if (!(n = realloc(v->nodes, sizeof(*n) * max)))
+			return -1;
+		v->nodes = n;
+		v->max = max;
+	}
+	n = &v->nodes[v->num];
+	memcpy(n->min, b->min.f, sizeof(n->min));
+	memcpy(n->max, b->max.f, sizeof(n->max));
+	n->index = n->count = 0;
+	return v->num++;
+}
+
+/// Builds a range of props into a subtree, depth first.
+/// \param top		set to leave the ranges of up to \ref BVH_TASK_SIZE props
+///					for the worker threads
+/// \return			index of the subtree's root, or -1 if out of memory
+static int g_bvh_subtree(g_bvh_vec_t *out, int first, int count, int depth,
+	const g_bvh_bin_t *b, bool top) {
+	g_bvh_bin_t left, right;
+	g_bvh_task_t *task;
+	g_bvh_prim_t tmp;
+	int n, i, j, mid;
+
+	if ((n = g_bvh_push(out, b)) < 0)
+		return -1;
+	if (count <= BVH_LEAF_SIZE) {
+		// put the trees first
+		for (i = first, j = first + count - 1; i <= j;) {
+			if (g_bvh_work.prims[i].id >= 0) {
+				i++;
+				continue;
+			}
+			tmp = g_bvh_work.prims[i];
+			g_bvh_work.prims[i] = g_bvh_work.prims[j];
+			g_bvh_work.prims[j--] = tmp;
+		}
+		out->nodes[n].index = first;
+		out->nodes[n].count = count;
+		return n;
+	}
+	if (top && count <= BVH_TASK_SIZE) {
+		if (g_bvh_work.numTasks >= g_bvh_work.maxTasks) {
+			i = g_bvh_work.maxTasks ? g_bvh_work.maxTasks * 2 : 64;
+			if (!(task = realloc(g_bvh_work.tasks, sizeof(*task) * i)))
+				return -1;
+			g_bvh_work.tasks = task;
+			g_bvh_work.maxTasks = i;
+		}
+		task = &g_bvh_work.tasks[g_bvh_work.numTasks];
+		memset(task, 0, sizeof(*task));
+		task->first = first;
+		task->count = count;
+		task->depth = depth;
+		task->bounds = *b;
+		out->nodes[n].count = -1 - g_bvh_work.numTasks++;
+		return n;
+	}
+	mid = g_bvh_split(first, count, depth, b, &left, &right);
+	// the first child comes right after its parent
+	if (g_bvh_subtree(out, first, mid - first, depth + 1, &left, top) < 0
+		|| (i = g_bvh_subtree(out, mid, first + count - mid, depth + 1,
+		&right, top)) < 0)
+		return -1;
+	out->nodes[n].index = i;
+	return n;
+}
+
+/// Builds a range of the subtrees.
+static void g_bvh_tasks(void *arg, int first, int last) {
+	g_bvh_task_t *t;
 	int i;
-	float frac;
-	frac = g_trace_through_AABB(p1, p2, node->bounds);
-	if (node->bldgs) {
-		for (i = 0; i < BLDGS_PER_FIELD; i++) {
-			if ((frac = g_trace_through_bldg(p1, p2, node->bldgs + i))
-				< curFrac) {
-                printf("LOL %f\n", frac);
-				curFrac = frac;
-            }
-		}
-	} else if (frac >= curFrac)
-		// if we haven't hit our AABB or we hit it further than the closest hit
-		// so far, we can't have anything of interest left
-		return 1.f;
-	for (i = 0; i < 4; i++) {
-		if (!node->child[i])
+
+	for (i = first; i < last; i++) {
+		t = &g_bvh_work.tasks[i];
+		t->failed = g_bvh_subtree(&t->out, t->first, t->count, t->depth,
+			&t->bounds, false) < 0;
+	}
+}
+
+/// Copies a subtree to the final node array, replacing the subtree nodes with
+/// the subtrees themselves, and fills the lists of its leaves.
+/// \return index of the subtree's root in the final array
+static int g_bvh_emit(const g_bvh_vec_t *v, int i) {
+	const g_bvh_node_t *s = &v->nodes[i];
+	const g_bvh_prim_t *p;
+	int n, j, *props;
+
+	if (s->count < 0)
+		return g_bvh_emit(&g_bvh_work.tasks[-1 - s->count].out, 0);
+	n = g_bvh_num_nodes++;
+	g_bvh_nodes[n] = *s;
+	if (s->count > 0) {
+		props = g_bvh_props + g_bvh_num_leaves * BVH_LEAF_SIZE;
+		for (j = 0; j < BVH_LEAF_SIZE; j++) {
+			p = j < s->count ? &g_bvh_work.prims[s->index + j] : NULL;
+			props[j] = p ? p->id : 0;
+			g_ray_tree(&g_bvh_trees[g_bvh_num_leaves], j,
+				p && p->id >= 0 ? gen_proptree->trees + p->id : NULL);
+		}
+		g_bvh_nodes[n].index = g_bvh_num_leaves++;
+		return n;
+	}
+	g_bvh_emit(v, i + 1);
+	j = g_bvh_emit(v, s->index);
+	g_bvh_nodes[n].index = j;
+	return n;
+}
+
+/// Frees the state of the BVH build.
+static void g_bvh_work_free(void) {
+	int i;
+
+	for (i = 0; i < g_bvh_work.numTasks; i++)
+		free(g_bvh_work.tasks[i].out.nodes);
+	free(g_bvh_work.tasks);
+	free(g_bvh_work.top.nodes);
+	free(g_bvh_work.chunks);
+	free(g_bvh_work.prims);
+	memset(&g_bvh_work, 0, sizeof(g_bvh_work));
+}
+
+/// Builds a bounding volume hierarchy over all of the props with the surface
+/// area heuristic. The top of the tree is split on the calling thread, with
+/// the props binned by all of the worker threads, and the subtrees below it
+/// are then built by the worker threads, one to a thread.
+/// \return		false if out of memory
+static bool g_bvh_build(void) {
+	const int n = g_ray_num_trees + g_ray_num_bldgs;
+	g_bvh_bin_t root;
+	int i, j, numNodes, numLeaves;
+	bool ok = false;
+
+	if (!n)
+		return true;
+	g_bvh_work.numPrims = n;
+	if (!(g_bvh_work.prims = malloc(sizeof(*g_bvh_work.prims) * n))
+		|| !(g_bvh_work.chunks = malloc(sizeof(*g_bvh_work.chunks)
+		* ((n + BVH_BIN_GRAIN - 1) / BVH_BIN_GRAIN))))
+		goto done;
+	ac_thread_parallel_for(g_bvh_prims, NULL, n, 4096, NULL);
+	g_bvh_range_bounds(0, n, &root);
+	if (g_bvh_subtree(&g_bvh_work.top, 0, n, 0, &root, true) < 0)
+		goto done;
+	ac_thread_parallel_for(g_bvh_tasks, NULL, g_bvh_work.numTasks, 1, NULL);
+
+	// gather the subtrees into a single array
+	numNodes = numLeaves = 0;
+	for (i = 0; i < g_bvh_work.top.num; i++) {
+		if (g_bvh_work.top.nodes[i].count >= 0)
+			numNodes++;
+		if (g_bvh_work.top.nodes[i].count > 0)
+			numLeaves++;
+	}
+	for (i = 0; i < g_bvh_work.numTasks; i++) {
+		if (g_bvh_work.tasks[i].failed)
+			goto done;
+		numNodes += g_bvh_work.tasks[i].out.num;
+		for (j = 0; j < g_bvh_work.tasks[i].out.num; j++) {
+			if (g_bvh_work.tasks[i].out.nodes[j].count > 0)
+				numLeaves++;
+		}
+	}
+	g_bvh_nodes = _mm_malloc(sizeof(*g_bvh_nodes) * numNodes, 64);
+	g_bvh_trees = _mm_malloc(sizeof(*g_bvh_trees) * numLeaves, 16);
+	g_bvh_props = malloc(sizeof(*g_bvh_props) * numLeaves * BVH_LEAF_SIZE);
+	if (!g_bvh_nodes || !g_bvh_trees || !g_bvh_props)
+		goto done;
+	g_bvh_emit(&g_bvh_work.top, 0);
+	ok = true;
+done:
+	g_bvh_work_free();
+	return ok;
+}
+
+/// Tests the props of a BVH leaf against the ray. The trees are tested right
+/// away; the buildings are batched.
+/// \param base		fraction of the way at which the ray enters the leaf, see
+///					\ref g_ray_cones4
+static void g_ray_bvh_leaf(g_prop_ray_t *ray, const g_bvh_node_t *node,
+	float base) {
+	const int *props = g_bvh_props + node->index * BVH_LEAF_SIZE;
+	ac_vec4_t t;
+	int i;
+
+	if (props[0] >= 0) {
+		t.sse = g_ray_cones4(ray, &g_bvh_trees[node->index], base);
+		for (i = 0; i < 4; i++) {
+			if (t.f[i] < ray->hit.frac) {
+				ray->hit.frac = t.f[i];
+				ray->hit.type = HIT_TREE;
+				ray->hit.prop = props[i];
+			}
+		}
+	}
+	for (i = 0; i < node->count; i++) {
+		if (props[i] >= 0)
 			continue;
-		if ((frac = g_collide_bldgs(p1, p2, node->child[i], curFrac))
-			< curFrac)
-			curFrac = frac;
+		ray->batch[ray->numBatch++] = -1 - props[i];
+		if (ray->numBatch == 4)
+			g_ray_bldgs4(ray);
 	}
-	return curFrac;
 }
 
-static ac_vec4_t g_collide_terrain(ac_vec4_t p1, ac_vec4_t p2) {
-	ac_vec4_t half = ac_vec_setall(0.5);
-	ac_vec4_t v = ac_vec_sub(p2, p1);
-	ac_vec4_t p;
-	float h;
+/// Traces the ray through the BVH, visiting the nearer child of every node
+/// first.
+static void g_ray_bvh(g_prop_ray_t *ray) {
+	const g_bvh_node_t *node;
+	int stack[BVH_STACK], depth = 0, n = 0, a, b;
+	float enters[BVH_STACK], enter, ea, eb;
+
+	if ((enter = g_ray_box(ray, g_bvh_nodes[0].min, g_bvh_nodes[0].max))
+		>= ray->hit.frac)
+		return;
+	for (;;) {
+		node = &g_bvh_nodes[n];
+		if (node->count)
+			g_ray_bvh_leaf(ray, node, enter);
+		else {
+			a = n + 1;
+			b = node->index;
+			ea = g_ray_box(ray, g_bvh_nodes[a].min, g_bvh_nodes[a].max);
+			eb = g_ray_box(ray, g_bvh_nodes[b].min, g_bvh_nodes[b].max);
+			if (eb < ea) {
+				n = a;
+				a = b;
+				b = n;
+				enter = ea;
+				ea = eb;
+				eb = enter;
+			}
+			if (ea < ray->hit.frac) {
+				if (eb < ray->hit.frac) {
+					stack[depth] = b;
+					enters[depth++] = eb;
+				}
+				n = a;
+				enter = ea;
+				continue;
+			}
+		}
+		// go back to the nearest node left that may still hold a closer hit
+		do {
+			if (!depth)
+				return;
+			n = stack[--depth];
+			enter = enters[depth];
+		} while (enter >= ray->hit.frac);
+	}
+}
+
+/// Number of levels of the maximum height pyramid, 0 if there is none.
+static int		g_maxmip_levels = 0;
+/// Maximum height pyramid of the terrain. A cell of level L covers 2^L by 2^L
+/// bilinear cells of the heightmap and holds the highest heightmap texel among
+/// their corners, i.e. the highest point of the surface over it. Level 0 is
+/// the heightmap itself, so only the levels from 1 up are stored; the top one
+/// is a single cell covering the whole world.
+static uchar	*g_maxmip[32];
+
+/// Builds a row of the first level of the pyramid from the heightmap.
+static void g_maxmip_base_rows(void *arg, int first, int last) {
+	const int n = gen_heightmap_size >> 1;
+	uchar *out, m, h;
+	int x, z, i, j;
+
+	for (z = first; z < last; z++) {
+		out = g_maxmip[1] + (size_t)z * n;
+		for (x = 0; x < n; x++) {
+			// 2x2 bilinear cells span 3x3 texels
+			m = 0;
+			for (j = 2 * z; j <= 2 * z + 2 && j < gen_heightmap_size; j++) {
+				for (i = 2 * x; i <= 2 * x + 2 && i < gen_heightmap_size;
+					i++) {
+					h = gen_heightmap[(size_t)j * gen_heightmap_size + i];
+					if (h > m)
+						m = h;
+				}
+			}
+			out[x] = m;
+		}
+	}
+}
+
+/// Builds a row of a level of the pyramid from the level below.
+static void g_maxmip_rows(void *arg, int first, int last) {
+	const int level = *(int *)arg, n = gen_heightmap_size >> level;
+	const uchar *in = g_maxmip[level - 1];
+	const uchar *a, *b;
+	uchar *out, m;
+	int x, z;
+
+	for (z = first; z < last; z++) {
+		out = g_maxmip[level] + (size_t)z * n;
+		// the two rows of the level below
+		a = in + (size_t)z * 4 * n;
+		b = a + 2 * n;
+		for (x = 0; x < n; x++, a += 2, b += 2) {
+			m = a[0] > a[1] ? a[0] : a[1];
+			m = m > b[0] ? m : b[0];
+			out[x] = m > b[1] ? m : b[1];
+		}
+	}
+}
+
+bool g_collide_build(void) {
+	size_t total = 0;
+	int level;
+
+	g_collide_free();
+	if (!g_ray_props_build() || (g_collide_bvh && !g_bvh_build()))
+		return false;
+	// a streamed world has no heightmap to build the pyramid of
+	if (!gen_heightmap)
+		return true;
+	for (level = 1; gen_heightmap_size >> level; level++)
+		total += (size_t)(gen_heightmap_size >> level)
+			* (gen_heightmap_size >> level);
+	if (!(g_maxmip[1] = malloc(total)))
+		return false;
+	g_maxmip_levels = level;
+	for (level = 2; level < g_maxmip_levels; level++)
+		g_maxmip[level] = g_maxmip[level - 1]
+			+ (size_t)(gen_heightmap_size >> (level - 1))
+			* (gen_heightmap_size >> (level - 1));
+
+	ac_thread_parallel_for(g_maxmip_base_rows, NULL, gen_heightmap_size >> 1,
+		16, NULL);
+	for (level = 2; level < g_maxmip_levels; level++)
+		ac_thread_parallel_for(g_maxmip_rows, &level,
+			gen_heightmap_size >> level, 16, NULL);
+	return true;
+}
+
+void g_collide_free(void) {
+	free(g_batch.order);
+	free(g_batch.temp);
+	free(g_batch.keys);
+	memset(&g_batch, 0, sizeof(g_batch));
+	_mm_free(g_ray_trees);
+	g_ray_trees = NULL;
+	free(g_ray_bldgs);
+	g_ray_bldgs = NULL;
+	_mm_free(g_bvh_nodes);
+	g_bvh_nodes = NULL;
+	_mm_free(g_bvh_trees);
+	g_bvh_trees = NULL;
+	free(g_bvh_props);
+	g_bvh_props = NULL;
+	g_bvh_num_nodes = g_bvh_num_leaves = 0;
+	free(g_maxmip[1]);
+	memset(g_maxmip, 0, sizeof(g_maxmip));
+	g_maxmip_levels = 0;
+}
+
+/// \return the cell containing \e x, on the side of the boundary that the ray
+/// is heading to
+static inline int g_cell_floor(float x, float dir) {
+	const int i = (int)floorf(x);
+
+	return dir < 0.f && (float)i == x ? i - 1 : i;
+}
+
+/// \return the highest point of the terrain in the given pyramid cell
+static inline float g_maxmip_height(int level, int x, int z) {
+	const int n = gen_heightmap_size >> level;
+
+	// g_sample_height() is flat 0 outside the heightmap
+	if ((uint)x >= (uint)n || (uint)z >= (uint)n)
+		return 0.f;
+	return g_maxmip[level][(size_t)z * n + x] * HEIGHT_SCALE;
+}
+
+float g_terrain_max(int level, int x, int z) {
+	if (!g_maxmip_levels)
+		return HEIGHT;
+	level = level < 1 ? 1 : ac_min(level, g_maxmip_levels - 1);
+	// the shifts round the negative coordinates down as well
+	return g_maxmip_height(level, x >> level, z >> level);
+}
+
+/// Intersects the ray with a single bilinear cell of the heightmap, exactly
+/// the way \ref g_sample_height interpolates it.
+/// \param x		X coordinate of the cell
+/// \param z		Z coordinate of the cell
+/// \param t0		fraction at which the ray enters the cell
+/// \param t1		fraction at which the ray leaves the cell
+/// \return			fraction of the hit, or a negative value if there is none
+static float g_trace_cell(ac_vec4_t p1, ac_vec4_t v, int x, int z, float t0,
+	float t1) {
+	float h00 = 0.f, h10 = 0.f, h01 = 0.f, h11 = 0.f, B, C, D, fx, fz;
+	float qa, qb, qc, disc, q, r1, r2, ds;
+	size_t i;
+
+	if (x >= 0 && z >= 0 && x + 1 < gen_heightmap_size
+		&& z + 1 < gen_heightmap_size) {
+		i = (size_t)z * gen_heightmap_size + x;
+		h00 = gen_heightmap[i] * HEIGHT_SCALE;
+		h10 = gen_heightmap[i + 1] * HEIGHT_SCALE;
+		h01 = gen_heightmap[i + gen_heightmap_size] * HEIGHT_SCALE;
+		h11 = gen_heightmap[i + gen_heightmap_size + 1] * HEIGHT_SCALE;
+	}
+	// h(fx, fz) = h00 + B * fx + C * fz + D * fx * fz
+	B = h10 - h00;
+	C = h01 - h00;
+	D = h00 - h10 - h01 + h11;
+	// the ray relative to the cell, starting where it enters it
+	fx = p1.f[0] + v.f[0] * t0 - x;
+	fz = p1.f[2] + v.f[2] * t0 - z;
+	// the height of the ray above the surface is then a quadratic of the
+	// fraction s = t - t0
+	qa = -D * v.f[0] * v.f[2];
+	qb = v.f[1] - B * v.f[0] - C * v.f[2] - D * (fx * v.f[2] + fz * v.f[0]);
+	qc = p1.f[1] + v.f[1] * t0 - (h00 + B * fx + C * fz + D * fx * fz);
+	if (qc <= 0.f)
+		return t0;	// already below the surface
+	ds = t1 - t0;
+	if (fabsf(qa) < 1e-12f) {
+		if (qb >= 0.f || (r1 = -qc / qb) > ds)
+			return -1.f;
+		return t0 + r1;
+	}
+	if ((disc = qb * qb - 4.f * qa * qc) < 0.f)
+		return -1.f;
+	// numerically stable roots
+	q = -0.5f * (qb + (qb < 0.f ? -sqrtf(disc) : sqrtf(disc)));
+	if (q == 0.f)
+		return -1.f;
+	r1 = q / qa;
+	r2 = qc / q;
+	if (r1 > r2) {
+		q = r1;
+		r1 = r2;
+		r2 = q;
+	}
+	if (r1 >= 0.f && r1 <= ds)
+		return t0 + r1;
+	if (r2 >= 0.f && r2 <= ds)
+		return t0 + r2;
+	return -1.f;
+}
+
+/// Fallback for streamed worlds, which have no pyramid; marches in steps of
+/// half a metre and bisects the step in which the ray goes below the surface.
+static float g_trace_terrain_steps(ac_vec4_t p1, ac_vec4_t v) {
+	const float len = sqrtf(v.f[0] * v.f[0] + v.f[2] * v.f[2]);
+	const int steps = (int)(len * 2.f) + 1;
+	float t0 = 0.f, t1, t;
 	int i;
-	// bisect for at most 4 steps or until a solution within 10cm is found
-	for (i = 0; i < 4; i++) {
-		v = ac_vec_mul(v, half);
-		p = ac_vec_add(p1, v);
-		h = g_sample_height(p.f[0], p.f[2]);
-		if (fabs(p.f[1] - h) < 0.1)
-			break;
-		if (p.f[1] < h) {
-			p2 = ac_vec_add(p1, v);
 
-		} else
-			p1 = ac_vec_add(p1, v);
+	if (p1.f[1] <= g_sample_height(p1.f[0], p1.f[2]))
+		return 0.f;
+	for (i = 1; i <= steps; i++, t0 = t1) {
+		t1 = (float)i / steps;
+		if (p1.f[1] + v.f[1] * t1
+			> g_sample_height(p1.f[0] + v.f[0] * t1, p1.f[2] + v.f[2] * t1))
+			continue;
+		for (i = 0; i < 16; i++) {
+			t = (t0 + t1) * 0.5f;
+			if (p1.f[1] + v.f[1] * t
+				> g_sample_height(p1.f[0] + v.f[0] * t, p1.f[2] + v.f[2] * t))
+				t0 = t;
+			else
+				t1 = t;
+		}
+		return t1;
 	}
-	p.f[1] = h;
-	return p;
+	return 1.f;
+}
+
+float g_trace_terrain(ac_vec4_t p1, ac_vec4_t p2) {
+	const ac_vec4_t v = ac_vec_sub(p2, p1);
+	const float lenXZ = sqrtf(v.f[0] * v.f[0] + v.f[2] * v.f[2]);
+	const float invX = v.f[0] != 0.f ? 1.f / v.f[0] : 0.f;
+	const float invZ = v.f[2] != 0.f ? 1.f / v.f[2] : 0.f;
+	const int stepX = v.f[0] > 0.f ? 1 : v.f[0] < 0.f ? -1 : 0;
+	const int stepZ = v.f[2] > 0.f ? 1 : v.f[2] < 0.f ? -1 : 0;
+	float t = 0.f, tx, tz, t1, y0, y1, hit;
+	int level, size, x, z, px, pz;
+
+	if (!g_maxmip_levels)
+		return g_trace_terrain_steps(p1, v);
+
+	// start at the level of cells about as large as the ray is long, and go
+	// up and down from there
+	for (level = 0; level + 1 < g_maxmip_levels && (1 << (level + 1)) <= lenXZ;
+		level++);
+	x = g_cell_floor(p1.f[0], v.f[0]) >> level;
+	z = g_cell_floor(p1.f[2], v.f[2]) >> level;
+	for (;;) {
+		// find where the ray leaves the current cell
+		size = 1 << level;
+		tx = stepX ? ((x + (stepX > 0)) * size - p1.f[0]) * invX : 2.f;
+		tz = stepZ ? ((z + (stepZ > 0)) * size - p1.f[2]) * invZ : 2.f;
+		t1 = ac_min(ac_min(tx, tz), 1.f);
+		if (level > 0) {
+			// the ray is straight, so it's lowest at either end of the cell
+			y0 = p1.f[1] + v.f[1] * t;
+			y1 = p1.f[1] + v.f[1] * t1;
+			if (ac_min(y0, y1) <= g_maxmip_height(level, x, z)) {
+				// the ray may hit something here, take a closer look
+				level--;
+				x = ac_max(x * 2, ac_min(x * 2 + 1,
+					g_cell_floor(p1.f[0] + v.f[0] * t, v.f[0]) >> level));
+				z = ac_max(z * 2, ac_min(z * 2 + 1,
+					g_cell_floor(p1.f[2] + v.f[2] * t, v.f[2]) >> level));
+				continue;
+			}
+		} else if ((hit = g_trace_cell(p1, v, x, z, t, t1)) >= 0.f)
+			return hit;
+		// nothing in this cell, move on to the next one
+		if (t1 >= 1.f)
+			return 1.f;
+		t = t1;
+		px = x;
+		pz = z;
+		if (tx <= tz)
+			x += stepX;
+		if (tz <= tx)
+			z += stepZ;
+		// climb back up once out of the parent cell, to skip more at once
+		if (level + 1 < g_maxmip_levels && ((x >> 1) != (px >> 1)
+			|| (z >> 1) != (pz >> 1))) {
+			level++;
+			x >>= 1;
+			z >>= 1;
+		}
+	}
+}
+
+/// Sets a ray up for the prop tree walk and traces it against the terrain,
+/// which is where the walk stops looking.
+/// \param above	set if the ray is already known to pass above the terrain,
+///				which then isn't traced
+static void g_ray_start(g_prop_ray_t *ray, ac_vec4_t p1, ac_vec4_t p2,
+	bool above) {
+	const ac_vec4_t ofs = ac_vec_set(gen_heightmap_size / 2, 0,
+		gen_heightmap_size / 2, 0);
+	int i;
+
+	ray->v = ac_vec_sub(p2, p1);
+	ray->hit.frac = above ? 1.f : g_trace_terrain(p1, p2);
+	ray->hit.type = ray->hit.frac < 1.f ? HIT_TERRAIN : HIT_NOTHING;
+	ray->hit.prop = -1;
+	// the prop tree is in world space
+	ray->p1 = ac_vec_sub(p1, ofs);
+	for (i = 0; i < 3; i++)
+		// keep the products finite for the axes the ray is parallel to
+		ray->invV.f[i] = ray->v.f[i] != 0.f ? 1.f / ray->v.f[i] : 1e30f;
+	ray->invV.f[3] = 0.f;
+	ray->numBatch = 0;
+}
+
+ac_vec4_t g_collide(ac_vec4_t p1, ac_vec4_t p2, g_trace_t *trace) {
+	g_prop_ray_t ray;
+
+	g_ray_start(&ray, p1, p2, false);
+	// the props only count if they are in front of the terrain
+	if (g_bvh_nodes)
+		g_ray_bvh(&ray);
+	else if (g_ray_trees && g_ray_bldgs)
+		g_ray_node(&ray, 0);
+	g_ray_bldgs4(&ray);
+	if (trace)
+		*trace = ray.hit;
+	return ac_vec_ma(ray.v, ac_vec_setall(ray.hit.frac), p1);
+}
+
+/// Number of rays in a packet.
+#define PACKET_SIZE		4
+/// Number of packets handed to a worker thread at a time.
+#define PACKET_GRAIN	8
+
+/// Packet of rays walking the prop tree together. The rays' starts and
+/// reciprocals are also kept 4 to an SSE vector, for the node tests.
+typedef struct {
+	g_prop_ray_t	rays[PACKET_SIZE];
+	__m128			px, py, pz;		///< starts of the rays
+	__m128			ix, iy, iz;		///< reciprocals of the rays' components
+} g_ray_packet_t;
+
+/// Intersects the rays of a packet with a box, the same way \ref g_ray_box
+/// does it for a single ray.
+/// \param enter	the fractions at which the rays enter the box
+/// \return			mask of the rays that enter the box before their closest
+///					hits so far
+static inline int g_packet_box(const g_ray_packet_t *pk, const float *min,
+	const float *max, ac_vec4_t *enter) {
+	const __m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min[0]), pk->px),
+		pk->ix);
+	const __m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max[0]), pk->px),
+		pk->ix);
+	const __m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min[1]), pk->py),
+		pk->iy);
+	const __m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max[1]), pk->py),
+		pk->iy);
+	const __m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min[2]), pk->pz),
+		pk->iz);
+	const __m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max[2]), pk->pz),
+		pk->iz);
+	const __m128 fracs = _mm_set_ps(pk->rays[3].hit.frac,
+		pk->rays[2].hit.frac, pk->rays[1].hit.frac, pk->rays[0].hit.frac);
+	__m128 leave;
+
+	enter->sse = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1),
+		_mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1),
+		_mm_setzero_ps()));
+	leave = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)),
+		_mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(1.f)));
+	return _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(enter->sse, leave),
+		_mm_cmplt_ps(enter->sse, fracs)));
+}
+
+/// \return the smallest of the fractions of the rays in the mask
+static inline float g_packet_nearest(const ac_vec4_t *enter, int mask) {
+	float nearest = FLT_MAX;
+	int j;
+
+	for (j = 0; j < PACKET_SIZE; j++) {
+		if ((mask & (1 << j)) && enter->f[j] < nearest)
+			nearest = enter->f[j];
+	}
+	return nearest;
+}
+
+/// Walks a prop tree node with a packet of rays.
+/// \param mask		mask of the rays that have entered all of the node's
+///					ancestors; a ray visits exactly the nodes that it would on
+///					its own, so it ends up with the very same hit
+static void g_packet_node(g_ray_packet_t *pk, int n, int mask) {
+	const ac_prop_t *node = &gen_proptree->nodes[n];
+	const g_trees4_t *g;
+	g_prop_ray_t *ray;
+	ac_vec4_t enter;
+	int i, j;
+
+	if (!(mask &= g_packet_box(pk, gen_proptree->bounds[n * 2].f,
+		gen_proptree->bounds[n * 2 + 1].f, &enter)))
+		return;
+	if (node->trees >= 0) {
+		g = g_ray_trees + node->trees / TREES_PER_FIELD * TREE_GROUPS;
+		for (j = 0; j < PACKET_SIZE; j++) {
+			if (!(mask & (1 << j)))
+				continue;
+			for (i = 0; i < TREE_GROUPS; i++)
+				g_ray_trees4(&pk->rays[j], g + i, node->trees + i * 4,
+					enter.f[j]);
+		}
+		return;
+	} else if (node->bldgs >= 0) {
+		for (j = 0; j < PACKET_SIZE; j++) {
+			if (!(mask & (1 << j)))
+				continue;
+			ray = &pk->rays[j];
+			for (i = 0; i < BLDGS_PER_FIELD; i++) {
+				ray->batch[ray->numBatch++] = node->bldgs + i;
+				if (ray->numBatch == 4)
+					g_ray_bldgs4(ray);
+			}
+		}
+		return;
+	}
+	for (i = 0; i < node->numChildren; i++)
+		g_packet_node(pk, node->child + i, mask);
+}
+
+/// Traces a packet of rays through the BVH. A ray visits exactly the nodes
+/// that it would on its own, if in another order, so it ends up with the very
+/// same hit.
+static void g_packet_bvh(g_ray_packet_t *pk, int mask) {
+	const g_bvh_node_t *node;
+	ac_vec4_t enters[BVH_STACK], enter, ea, eb, fracs;
+	int stack[BVH_STACK], masks[BVH_STACK], depth = 0, n = 0, a, b, ma, mb;
+	int j;
+
+	if (!(mask &= g_packet_box(pk, g_bvh_nodes[0].min, g_bvh_nodes[0].max,
+		&enter)))
+		return;
+	for (;;) {
+		node = &g_bvh_nodes[n];
+		if (node->count) {
+			for (j = 0; j < PACKET_SIZE; j++) {
+				if (mask & (1 << j))
+					g_ray_bvh_leaf(&pk->rays[j], node, enter.f[j]);
+			}
+		} else {
+			a = n + 1;
+			b = node->index;
+			ma = mask & g_packet_box(pk, g_bvh_nodes[a].min,
+				g_bvh_nodes[a].max, &ea);
+			mb = mask & g_packet_box(pk, g_bvh_nodes[b].min,
+				g_bvh_nodes[b].max, &eb);
+			if (ma && mb) {
+				// go into the child the packet reaches first
+				if (g_packet_nearest(&eb, mb) < g_packet_nearest(&ea, ma)) {
+					stack[depth] = a;
+					masks[depth] = ma;
+					enters[depth++] = ea;
+					n = b;
+					mask = mb;
+					enter = eb;
+				} else {
+					stack[depth] = b;
+					masks[depth] = mb;
+					enters[depth++] = eb;
+					n = a;
+					mask = ma;
+					enter = ea;
+				}
+				continue;
+			} else if (ma || mb) {
+				n = ma ? a : b;
+				mask = ma ? ma : mb;
+				enter = ma ? ea : eb;
+				continue;
+			}
+		}
+		// drop the rays that have found closer hits in the meantime
+		do {
+			if (!depth)
+				return;
+			n = stack[--depth];
+			enter = enters[depth];
+			fracs.sse = _mm_set_ps(pk->rays[3].hit.frac,
+				pk->rays[2].hit.frac, pk->rays[1].hit.frac,
+				pk->rays[0].hit.frac);
+			mask = masks[depth]
+				& _mm_movemask_ps(_mm_cmplt_ps(enter.sse, fracs.sse));
+		} while (!mask);
+	}
+}
+
+/// Tells whether all of the rays of a packet pass above the terrain, from the
+/// blocks of the maximum height pyramid under their bounding box. The rays are
+/// straight, so none of them gets any lower than the lowest of their ends;
+/// if that is above all of the blocks, none of the rays needs a trace of its
+/// own, and the answer is exact. The rays of a packet go together, so this
+/// mostly holds for the rounds high up in the air.
+/// \param first	index of the first ray of the packet in the sorted order
+/// \param count	number of rays in the packet
+static bool g_packet_above(int first, int count) {
+	float x0 = FLT_MAX, x1 = -FLT_MAX, z0 = FLT_MAX, z1 = -FLT_MAX;
+	float y = FLT_MAX, extent;
+	const float n = gen_heightmap_size;
+	const g_ray_t *r;
+	int i, level, x, z, xa, xb, za, zb;
+
+	// streamed worlds have no pyramid
+	if (!g_maxmip_levels)
+		return false;
+	for (i = first; i < first + count; i++) {
+		r = &g_batch.rays[g_batch.order[i]];
+		x0 = ac_min(x0, ac_min(r->p1.f[0], r->p2.f[0]));
+		x1 = ac_max(x1, ac_max(r->p1.f[0], r->p2.f[0]));
+		z0 = ac_min(z0, ac_min(r->p1.f[2], r->p2.f[2]));
+		z1 = ac_max(z1, ac_max(r->p1.f[2], r->p2.f[2]));
+		y = ac_min(y, ac_min(r->p1.f[1], r->p2.f[1]));
+	}
+	// pick the level whose blocks are as large as the box, so that it spans
+	// no more than 2 by 2 of them, and skip the blocks off the heightmap,
+	// which is flat 0 there
+	extent = ac_max(x1 - x0, z1 - z0);
+	for (level = 1; level + 1 < g_maxmip_levels && (1 << level) < extent;
+		level++);
+	xa = (int)floorf(ac_max(x0, -1.f)) >> level;
+	xb = (int)floorf(ac_min(x1, n)) >> level;
+	za = (int)floorf(ac_max(z0, -1.f)) >> level;
+	zb = (int)floorf(ac_min(z1, n)) >> level;
+	for (z = za; z <= zb; z++) {
+		for (x = xa; x <= xb; x++) {
+			if (y <= g_maxmip_height(level, x, z))
+				return false;
+		}
+	}
+	return true;
 }
 
-ac_vec4_t g_collide(ac_vec4_t p1, ac_vec4_t p2) {
-	float frac = g_collide_bldgs(p1, p2, gen_proptree, 1.f);
-	// clip the trace to the terrain first
-	p2 = g_collide_terrain(p1, p2);
-	if (frac < 1.f) {
-		// TODO
+/// Traces a range of packets of the batch.
+static void g_batch_packets(void *arg, int first, int last) {
+	ALIGNED_16 float px[PACKET_SIZE], py[PACKET_SIZE], pz[PACKET_SIZE];
+	ALIGNED_16 float ix[PACKET_SIZE], iy[PACKET_SIZE], iz[PACKET_SIZE];
+	g_ray_packet_t pk;
+	const g_ray_t *r;
+	int i, j, k, mask;
+	bool above;
+
+	for (i = first; i < last; i++) {
+		above = g_packet_above(i * PACKET_SIZE,
+			ac_min(PACKET_SIZE, g_batch.num - i * PACKET_SIZE));
+		for (j = 0, mask = 0; j < PACKET_SIZE; j++) {
+			k = i * PACKET_SIZE + j;
+			if (k < g_batch.num) {
+				r = &g_batch.rays[g_batch.order[k]];
+				g_ray_start(&pk.rays[j], r->p1, r->p2, above);
+				mask |= 1 << j;
+			} else
+				// the spare lanes of the last packet repeat its first ray,
+				// but take no part in the walk
+				pk.rays[j] = pk.rays[0];
+			px[j] = pk.rays[j].p1.f[0];
+			py[j] = pk.rays[j].p1.f[1];
+			pz[j] = pk.rays[j].p1.f[2];
+			ix[j] = pk.rays[j].invV.f[0];
+			iy[j] = pk.rays[j].invV.f[1];
+			iz[j] = pk.rays[j].invV.f[2];
+		}
+		if (g_bvh_nodes || (g_ray_trees && g_ray_bldgs)) {
+			pk.px = _mm_load_ps(px);
+			pk.py = _mm_load_ps(py);
+			pk.pz = _mm_load_ps(pz);
+			pk.ix = _mm_load_ps(ix);
+			pk.iy = _mm_load_ps(iy);
+			pk.iz = _mm_load_ps(iz);
+			if (g_bvh_nodes)
+				g_packet_bvh(&pk, mask);
+			else
+				g_packet_node(&pk, 0, mask);
+		}
+		for (j = 0; j < PACKET_SIZE; j++) {
+			if (!(mask & (1 << j)))
+				continue;
+			g_ray_bldgs4(&pk.rays[j]);
+			g_batch.hits[g_batch.order[i * PACKET_SIZE + j]] = pk.rays[j].hit;
+		}
 	}
-	return p2;
+}
+
+/// Spreads the lower 16 bits of \e x over the even bits.
+static inline uint g_morton_spread(uint x) {
+	x &= 0xFFFF;
+	x = (x | (x << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333;
+	return (x | (x << 1)) & 0x55555555;
+}
+
+/// Sorts the ray indices by their keys with a radix sort, a byte at a time.
+/// The sort is stable, so the rays with equal keys stay in their order and the
+/// result is always the same.
+static void g_batch_sort(void) {
+	int count[4][256], *src = g_batch.order, *dst = g_batch.temp, *swap;
+	int i, pass, sum, c;
+	uint k;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < g_batch.num; i++) {
+		k = g_batch.keys[i];
+		count[0][k & 0xFF]++;
+		count[1][(k >> 8) & 0xFF]++;
+		count[2][(k >> 16) & 0xFF]++;
+		count[3][k >> 24]++;
+	}
+	for (pass = 0; pass < 4; pass++) {
+		// skip the bytes that all of the keys share
+		if (count[pass][(g_batch.keys[0] >> (pass * 8)) & 0xFF]
+			== g_batch.num)
+			continue;
+		for (i = 0, sum = 0; i < 256; i++) {
+			c = count[pass][i];
+			count[pass][i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < g_batch.num; i++)
+			dst[count[pass][(g_batch.keys[src[i]] >> (pass * 8)) & 0xFF]++]
+				= src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != g_batch.order)
+		memcpy(g_batch.order, src, sizeof(*src) * g_batch.num);
+}
+
+bool g_collide_batch(const g_ray_t *rays, int n, g_trace_t *hits) {
+	int *order, *temp, i, x, z;
+	uint *keys;
+
+	if (n <= 0)
+		return true;
+	if (n > g_batch.max) {
+		if (!(order = realloc(g_batch.order, sizeof(*order) * n)))
+			return false;
+		g_batch.order = order;
+		if (!(temp = realloc(g_batch.temp, sizeof(*temp) * n)))
+			return false;
+		g_batch.temp = temp;
+		if (!(keys = realloc(g_batch.keys, sizeof(*keys) * n)))
+			return false;
+		g_batch.keys = keys;
+		g_batch.max = n;
+	}
+	g_batch.rays = rays;
+	g_batch.hits = hits;
+	g_batch.num = n;
+
+	// sort the rays along a Morton curve through the prop map squares of
+	// their starts, so that the rays of a packet walk the same nodes
+	for (i = 0; i < n; i++) {
+		x = (int)rays[i].p1.f[0] >> PROPMAP_SHIFT;
+		z = (int)rays[i].p1.f[2] >> PROPMAP_SHIFT;
+		x = x < 0 ? 0 : x > 0xFFFF ? 0xFFFF : x;
+		z = z < 0 ? 0 : z > 0xFFFF ? 0xFFFF : z;
+		g_batch.keys[i] = g_morton_spread(x) | (g_morton_spread(z) << 1);
+		g_batch.order[i] = i;
+	}
+	g_batch_sort();
+
+	ac_thread_parallel_for(g_batch_packets, NULL,
+		(n + PACKET_SIZE - 1) / PACKET_SIZE, PACKET_GRAIN, NULL);
+	return true;
 }
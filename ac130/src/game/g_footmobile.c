@@ -0,0 +1,356 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Ground troops simulation module
+
+#include "g_local.h"
+#include "../ac_thread.h"
+
+/// Troops per squad.
+#define SQUAD_SIZE			10
+/// Troops per row of the squad formation.
+#define SQUAD_ROW			5
+/// Distance between the troops in the formation, in metres.
+#define SQUAD_SPACING		2.f
+/// Walking speed, in metres per second.
+#define SQUAD_SPEED			1.5f
+/// Maximum distance to the next destination of a squad, in metres.
+#define SQUAD_ROAM			60.f
+/// Distance from the viewpoint up to which the squads are updated every tick;
+/// the update interval doubles with every doubling of the distance past it.
+#define SQUAD_LOD_DIST		300.f
+/// Maximum number of ticks between squad updates.
+#define SQUAD_MAX_INTERVAL	8
+/// Squads per worker thread batch.
+#define SQUAD_GRAIN			64
+/// Attempts at finding a walkable destination.
+#define SQUAD_GOAL_TRIES	4
+/// Height of a soldier's centre above the ground, in metres.
+#define TROOP_CENTRE		0.9f
+/// Radius of a soldier, as far as the projectiles are concerned, in metres.
+#define TROOP_RADIUS		0.5f
+
+g_troops_t		g_troops;
+g_hash_t		g_fmb_hash;
+g_squad_t		*g_squads = NULL;
+int				g_num_squads = 0;
+bool			g_fmb_lod = true;
+
+static uint		g_fmb_ticks = 0;
+/// Scratch space for the spatial hash query results.
+static int		*g_fmb_found = NULL;
+static float	*g_fmb_fracs = NULL;
+
+/// \return next number from the squad's random number generator
+static inline uint g_fmb_rand(g_squad_t *s) {
+	// xorshift; cheap, and the squads don't need to share any state
+	s->seed ^= s->seed << 13;
+	s->seed ^= s->seed >> 17;
+	s->seed ^= s->seed << 5;
+	return s->seed;
+}
+
+/// \return random float in the [-1..1] range
+static inline float g_fmb_randf(g_squad_t *s) {
+	return (float)(g_fmb_rand(s) % 20001) * 0.0001f - 1.f;
+}
+
+/// Batched counterpart of \ref g_sample_height. Samples the terrain height
+/// under a run of troops at once, which keeps the heightmap pointers and the
+/// world offset in registers across the whole run.
+static void g_fmb_sample_heights(float *y, const float *x, const float *z,
+	int n) {
+	const float ofs = gen_heightmap_size / 2;
+	const int size = gen_heightmap_size;
+	const uchar *hm = gen_heightmap;
+	float fx, fz, xfrac, zfrac, r1, r2;
+	int i, xi, zi, k;
+
+	for (i = 0; i < n; i++) {
+		fx = x[i] + ofs;
+		fz = z[i] + ofs;
+		xi = (int)fx;
+		zi = (int)fz;
+		if (fx < 0.f || fz < 0.f || xi + 1 >= size || zi + 1 >= size) {
+			y[i] = 0.f;
+			continue;
+		}
+		// streamed world
+		if (!hm) {
+			y[i] = gen_tiles_sample(fx, fz) * HEIGHT_SCALE;
+			continue;
+		}
+		xfrac = fx - xi;
+		zfrac = fz - zi;
+		k = zi * size + xi;
+		r1 = hm[k] + xfrac * (hm[k + 1] - hm[k]);
+		r2 = hm[k + size] + xfrac * (hm[k + size + 1] - hm[k + size]);
+		y[i] = (r1 + zfrac * (r2 - r1)) * HEIGHT_SCALE;
+	}
+}
+
+/// Picks the next destination of a squad, keeping it inside the map.
+static void g_fmb_pick_goal(g_squad_t *s) {
+	const float lim = gen_heightmap_size / 2 - 2 * SQUAD_SPACING * SQUAD_ROW;
+	int i, dx, dz;
+
+	// with a navigation grid, the squads head for the middle of one of the
+	// nearby clusters, so that the squads going the same way share the flow
+	// field
+	for (i = 0; g_nav_ready() && i < SQUAD_GOAL_TRIES; i++) {
+		dx = (int)(g_fmb_rand(s) % 3) - 1;
+		dz = (int)(g_fmb_rand(s) % 3) - 1;
+		if ((s->goal = g_nav_waypoint_near(s->cx, s->cz, dx, dz,
+			&s->gx, &s->gz)) >= 0)
+			return;
+	}
+	s->goal = -1;
+	s->gx = s->cx + g_fmb_randf(s) * SQUAD_ROAM;
+	s->gz = s->cz + g_fmb_randf(s) * SQUAD_ROAM;
+	s->gx = ac_max(-lim, ac_min(lim, s->gx));
+	s->gz = ac_max(-lim, ac_min(lim, s->gz));
+}
+
+/// Advances a squad by the time it has accumulated and lays its troops out.
+static void g_fmb_update_squad(g_squad_t *s) {
+	const float dt = s->dt;
+	float dx, dz, d, step, c, sn, fx, fz;
+	int i, last = s->first + s->count;
+	g_nav_flow_t flow;
+	ac_stance_t stance;
+
+	s->dt = 0.f;
+	if (s->halt > 0.f) {
+		// hold the position and crouch
+		if ((s->halt -= dt) <= 0.f) {
+			s->halt = 0.f;
+			g_fmb_pick_goal(s);
+		}
+	} else {
+		dx = s->gx - s->cx;
+		dz = s->gz - s->cz;
+		d = sqrtf(dx * dx + dz * dz);
+		step = SQUAD_SPEED * dt;
+		if (d <= step) {
+			// destination reached, take a break of 2 to 8 seconds
+			s->cx = s->gx;
+			s->cz = s->gz;
+			s->halt = 5.f + 3.f * g_fmb_randf(s);
+		} else if ((flow = g_nav_flow(s->goal, s->cx, s->cz, &fx, &fz))
+			== NF_NO_PATH) {
+			// stuck; stop for a second or so and pick another destination
+			s->halt = 1.f + 0.5f * g_fmb_randf(s);
+		} else {
+			if (flow == NF_FLOW) {
+				dx = fx;
+				dz = fz;
+				d = 1.f;
+			}
+			s->cx += dx * step / d;
+			s->cz += dz * step / d;
+			s->heading = atan2f(-dz, dx);
+		}
+	}
+	stance = s->halt > 0.f ? STANCE_CROUCH : STANCE_STAND;
+
+	// rotate the formation to face the heading; the troops are stored in the
+	// order of the squads, so this is a straight run over the arrays
+	c = cosf(s->heading);
+	sn = sinf(s->heading);
+	for (i = s->first; i < last; i++) {
+		// the dead stay where they fell
+		if (g_troops.health[i] <= 0)
+			continue;
+		g_troops.x[i] = s->cx + c * g_troops.ox[i] + sn * g_troops.oz[i];
+		g_troops.z[i] = s->cz - sn * g_troops.ox[i] + c * g_troops.oz[i];
+		g_troops.ang[i] = s->heading;
+		g_troops.stance[i] = stance;
+	}
+	// the dead are sampled along, which keeps it a straight run, but their
+	// heights don't change, as they don't move
+	g_fmb_sample_heights(g_troops.y + s->first, g_troops.x + s->first,
+		g_troops.z + s->first, s->count);
+}
+
+static void g_fmb_squads_job(void *arg, int first, int last) {
+	const bool all = *(bool *)arg;
+	int i;
+	g_squad_t *s;
+
+	for (i = first; i < last; i++) {
+		s = &g_squads[i];
+		if (s->alive && (all || (g_fmb_ticks + i) % s->interval == 0))
+			g_fmb_update_squad(s);
+	}
+}
+
+bool g_fmb_init(int troops, uint seed) {
+	const float area = ac_min(400.f, gen_heightmap_size / 2 - 64.f);
+	g_squad_t *s;
+	int i, j;
+
+	g_fmb_shutdown();
+	if (troops <= 0)
+		return true;
+	g_num_squads = (troops + SQUAD_SIZE - 1) / SQUAD_SIZE;
+	g_troops.num = troops;
+	if (!(g_squads = calloc(g_num_squads, sizeof(*g_squads)))
+		|| !(g_troops.x = malloc(sizeof(float) * 6 * troops))
+		|| !(g_troops.stance = malloc(troops))
+		|| !(g_troops.health = malloc(sizeof(short) * troops))
+		|| !(g_fmb_found = malloc(sizeof(*g_fmb_found) * troops))
+		|| !(g_fmb_fracs = malloc(sizeof(*g_fmb_fracs) * troops))) {
+		g_fmb_shutdown();
+		return false;
+	}
+	// all of the float lanes live in a single block
+	g_troops.y = g_troops.x + troops;
+	g_troops.z = g_troops.y + troops;
+	g_troops.ang = g_troops.z + troops;
+	g_troops.ox = g_troops.ang + troops;
+	g_troops.oz = g_troops.ox + troops;
+
+	for (i = 0; i < g_num_squads; i++) {
+		s = &g_squads[i];
+		s->first = i * SQUAD_SIZE;
+		s->count = ac_min(SQUAD_SIZE, troops - s->first);
+		s->alive = s->count;
+		s->seed = (seed ^ (i * 0x9E3779B9u)) | 1;
+		s->cx = g_fmb_randf(s) * area;
+		s->cz = g_fmb_randf(s) * area;
+		s->heading = g_fmb_randf(s) * M_PI;
+		s->interval = 1;
+		g_fmb_pick_goal(s);
+		for (j = 0; j < s->count; j++) {
+			// rows of troops centred around the middle of the squad
+			g_troops.ox[s->first + j] = SQUAD_SPACING
+				* (j / SQUAD_ROW - 0.5f * ((s->count - 1) / SQUAD_ROW));
+			g_troops.oz[s->first + j] = SQUAD_SPACING
+				* (j % SQUAD_ROW - 0.5f * (SQUAD_ROW - 1));
+			g_troops.health[s->first + j] = 100;
+			// the formation is laid out on the first tick
+			g_troops.x[s->first + j] = s->cx;
+			g_troops.y[s->first + j] = 0.f;
+			g_troops.z[s->first + j] = s->cz;
+		}
+	}
+	g_fmb_ticks = 0;
+	if (!g_hash_init(&g_fmb_hash, troops, g_troops.x, g_troops.y,
+		g_troops.z)) {
+		g_fmb_shutdown();
+		return false;
+	}
+	return true;
+}
+
+void g_fmb_shutdown(void) {
+	free(g_squads);
+	free(g_troops.x);
+	free(g_troops.stance);
+	free(g_troops.health);
+	free(g_fmb_found);
+	free(g_fmb_fracs);
+	g_hash_free(&g_fmb_hash);
+	g_squads = NULL;
+	g_fmb_found = NULL;
+	g_fmb_fracs = NULL;
+	g_num_squads = 0;
+	memset(&g_troops, 0, sizeof(g_troops));
+}
+
+void g_fmb_advance(ac_vec4_t eye, float dt) {
+	bool all = g_fmb_ticks == 0;
+	float dx, dz, d;
+	int i, interval;
+	g_squad_t *s;
+
+	if (!g_num_squads)
+		return;
+	// pick the update rates; the distant squads get updated less often, but
+	// with the time they accumulated in the meantime
+	for (i = 0; i < g_num_squads; i++) {
+		s = &g_squads[i];
+		// the squads that have been wiped out stay put
+		if (!s->alive)
+			continue;
+		s->dt += dt;
+		if (g_fmb_lod) {
+			dx = s->cx - eye.f[0];
+			dz = s->cz - eye.f[2];
+			d = sqrtf(dx * dx + dz * dz + eye.f[1] * eye.f[1]);
+			for (interval = 1; interval < SQUAD_MAX_INTERVAL
+				&& d > SQUAD_LOD_DIST * interval; interval *= 2);
+			s->interval = interval;
+		}
+		// ask for the flow fields of the squads on the move in this tick
+		if (s->halt <= 0.f && s->goal >= 0
+			&& (all || (g_fmb_ticks + i) % s->interval == 0))
+			g_nav_request(s->goal, s->cx, s->cz);
+	}
+	g_nav_update();
+	// the squads don't interact, so they can be updated in any order
+	ac_thread_parallel_for(g_fmb_squads_job, &all, g_num_squads, SQUAD_GRAIN,
+		NULL);
+	// only the squads updated in this tick have moved
+	for (i = 0; i < g_num_squads; i++) {
+		if (g_squads[i].alive && g_squads[i].dt == 0.f)
+			g_hash_update(&g_fmb_hash, g_squads[i].first, g_squads[i].count);
+	}
+	g_fmb_ticks++;
+}
+
+int g_fmb_capture(ac_footmobile_t *out) {
+	int i, n = 0;
+
+	for (i = 0; i < g_troops.num; i++) {
+		// the dead are not drawn
+		if (g_troops.health[i] <= 0)
+			continue;
+		out[n].pos = ac_vec_set(g_troops.x[i], g_troops.y[i], g_troops.z[i],
+			0.f);
+		out[n].ang = g_troops.ang[i];
+		out[n].stance = g_troops.stance[i];
+		out[n++].health = g_troops.health[i];
+	}
+	return n;
+}
+
+int g_fmb_splash(ac_vec4_t pos, float radius, int damage) {
+	int i, j, n, kills = 0;
+	float dx, dy, dz, d;
+
+	// the hash holds the feet, so the query is moved down by the height of
+	// the centre
+	pos.f[1] -= TROOP_CENTRE;
+	n = g_hash_radius(&g_fmb_hash, pos, radius, g_fmb_found, g_troops.num);
+	for (i = 0; i < n; i++) {
+		j = g_fmb_found[i];
+		dx = g_troops.x[j] - pos.f[0];
+		dy = g_troops.y[j] - pos.f[1];
+		dz = g_troops.z[j] - pos.f[2];
+		d = sqrtf(dx * dx + dy * dy + dz * dz);
+		g_troops.health[j] -= (short)(damage * (1.f - d / radius));
+		if (g_troops.health[j] <= 0) {
+			g_hash_remove(&g_fmb_hash, j);
+			g_squads[j / SQUAD_SIZE].alive--;
+			kills++;
+		}
+	}
+	return kills;
+}
+
+int g_fmb_hit(ac_vec4_t p1, ac_vec4_t p2, float *frac) {
+	int i, n, hit = -1;
+
+	p1.f[1] -= TROOP_CENTRE;
+	p2.f[1] -= TROOP_CENTRE;
+	n = g_hash_segment(&g_fmb_hash, p1, p2, TROOP_RADIUS, g_fmb_found,
+		g_fmb_fracs, g_troops.num);
+	for (i = 0; i < n; i++) {
+		if (hit < 0 || g_fmb_fracs[i] < *frac) {
+			hit = g_fmb_found[i];
+			*frac = g_fmb_fracs[i];
+		}
+	}
+	return hit;
+}
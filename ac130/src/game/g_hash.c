@@ -0,0 +1,219 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Spatial hash module; proximity queries against moving entities
+
+#include "g_local.h"
+
+/// Size of a hash cell in metres; the same as a propmap square.
+#define HASH_CELL			(1 << PROPMAP_SHIFT)
+/// Marks the entities that are not in the hash.
+#define HASH_REMOVED		0x7FFFFFFF
+
+/// \return the largest integer not greater than \e f; much cheaper than
+/// floorf() on SSE2
+static inline int g_hash_floor(float f) {
+	const int i = (int)f;
+	return i - (f < i);
+}
+
+/// \return key of the given cell
+static inline int g_hash_cell(int cx, int cz) {
+	return (int)(((uint)cz << 16) | (cx & 0xFFFF));
+}
+
+/// \return key of the cell containing the given point
+static inline int g_hash_key(float x, float z) {
+	return g_hash_cell(g_hash_floor(x * (1.f / HASH_CELL)),
+		g_hash_floor(z * (1.f / HASH_CELL)));
+}
+
+/// \return bucket of the given cell
+static inline int g_hash_bucket(const g_hash_t *h, int key) {
+	return ((uint)key * 2654435761u) >> (32 - h->bits);
+}
+
+static void g_hash_link(g_hash_t *h, int i, int key) {
+	const int b = g_hash_bucket(h, key);
+
+	h->cell[i] = key;
+	h->prev[i] = -1;
+	h->next[i] = h->head[b];
+	if (h->head[b] >= 0)
+		h->prev[h->head[b]] = i;
+	h->head[b] = i;
+}
+
+static void g_hash_unlink(g_hash_t *h, int i) {
+	if (h->prev[i] >= 0)
+		h->next[h->prev[i]] = h->next[i];
+	else
+		h->head[g_hash_bucket(h, h->cell[i])] = h->next[i];
+	if (h->next[i] >= 0)
+		h->prev[h->next[i]] = h->prev[i];
+}
+
+bool g_hash_init(g_hash_t *h, int num, const float *x, const float *y,
+	const float *z) {
+	int i;
+
+	memset(h, 0, sizeof(*h));
+	// about twice as many buckets as entities keeps the chains short
+	for (h->bits = 10; h->bits < 24 && (1 << h->bits) < num * 2; h->bits++);
+	if (!(h->head = malloc(sizeof(*h->head) << h->bits))
+		|| !(h->next = malloc(sizeof(*h->next) * 3 * ac_max(num, 1)))) {
+		g_hash_free(h);
+		return false;
+	}
+	// all of the per-entity lanes live in a single block
+	h->prev = h->next + num;
+	h->cell = h->prev + num;
+	h->num = num;
+	h->x = x;
+	h->y = y;
+	h->z = z;
+	for (i = 0; i < 1 << h->bits; i++)
+		h->head[i] = -1;
+	for (i = 0; i < num; i++)
+		g_hash_link(h, i, g_hash_key(x[i], z[i]));
+	return true;
+}
+
+void g_hash_free(g_hash_t *h) {
+	free(h->head);
+	free(h->next);
+	memset(h, 0, sizeof(*h));
+}
+
+void g_hash_update(g_hash_t *h, int first, int count) {
+	int i, key;
+
+	// only the entities that have crossed into another cell are relinked
+	for (i = first; i < first + count; i++) {
+		if (h->cell[i] == HASH_REMOVED
+			|| (key = g_hash_key(h->x[i], h->z[i])) == h->cell[i])
+			continue;
+		g_hash_unlink(h, i);
+		g_hash_link(h, i, key);
+	}
+}
+
+void g_hash_remove(g_hash_t *h, int i) {
+	if (h->cell[i] == HASH_REMOVED)
+		return;
+	g_hash_unlink(h, i);
+	h->cell[i] = HASH_REMOVED;
+}
+
+int g_hash_radius(const g_hash_t *h, ac_vec4_t pos, float r, int *out,
+	int max) {
+	const int cx0 = g_hash_floor((pos.f[0] - r) * (1.f / HASH_CELL));
+	const int cx1 = g_hash_floor((pos.f[0] + r) * (1.f / HASH_CELL));
+	const int cz0 = g_hash_floor((pos.f[2] - r) * (1.f / HASH_CELL));
+	const int cz1 = g_hash_floor((pos.f[2] + r) * (1.f / HASH_CELL));
+	const float r2 = r * r;
+	float dx, dy, dz;
+	int cx, cz, i, key, n = 0;
+
+	if (!h->num || r < 0.f)
+		return 0;
+	// for huge radii, it's cheaper to go through all of the buckets once
+	if ((float)(cx1 - cx0 + 1) * (cz1 - cz0 + 1) > 1 << h->bits) {
+		for (i = 0; i < h->num && n < max; i++) {
+			if (h->cell[i] == HASH_REMOVED)
+				continue;
+			dx = h->x[i] - pos.f[0];
+			dy = h->y[i] - pos.f[1];
+			dz = h->z[i] - pos.f[2];
+			if (dx * dx + dy * dy + dz * dz <= r2)
+				out[n++] = i;
+		}
+		return n;
+	}
+	for (cz = cz0; cz <= cz1; cz++) {
+		for (cx = cx0; cx <= cx1; cx++) {
+			key = g_hash_cell(cx, cz);
+			for (i = h->head[g_hash_bucket(h, key)]; i >= 0;
+				i = h->next[i]) {
+				// the bucket may be shared with other cells
+				if (h->cell[i] != key)
+					continue;
+				dx = h->x[i] - pos.f[0];
+				dy = h->y[i] - pos.f[1];
+				dz = h->z[i] - pos.f[2];
+				if (dx * dx + dy * dy + dz * dz <= r2) {
+					out[n++] = i;
+					if (n == max)
+						return n;
+				}
+			}
+		}
+	}
+	return n;
+}
+
+int g_hash_segment(const g_hash_t *h, ac_vec4_t p1, ac_vec4_t p2, float r,
+	int *out, float *fracs, int max) {
+	const ac_vec4_t v = ac_vec_sub(p2, p1);
+	const float len2 = v.f[0] * v.f[0] + v.f[1] * v.f[1] + v.f[2] * v.f[2];
+	const float r2 = r * r;
+	float t0, t1, x0, x1, zlo, zhi, t, dx, dy, dz;
+	int cx, cz, cz0, cz1, cx0, cx1, i, key, n = 0;
+
+	if (!h->num || r < 0.f)
+		return 0;
+	cz0 = g_hash_floor((ac_min(p1.f[2], p2.f[2]) - r) * (1.f / HASH_CELL));
+	cz1 = g_hash_floor((ac_max(p1.f[2], p2.f[2]) + r) * (1.f / HASH_CELL));
+	for (cz = cz0; cz <= cz1; cz++) {
+		// clip the segment to the row of cells, grown by the radius...
+		zlo = cz * HASH_CELL - r;
+		zhi = (cz + 1) * HASH_CELL + r;
+		if (fabsf(v.f[2]) > 1e-6f) {
+			t0 = (zlo - p1.f[2]) / v.f[2];
+			t1 = (zhi - p1.f[2]) / v.f[2];
+			if (t0 > t1) {
+				t = t0;
+				t0 = t1;
+				t1 = t;
+			}
+			t0 = ac_max(t0, 0.f);
+			t1 = ac_min(t1, 1.f);
+			if (t0 > t1)
+				continue;
+		} else {
+			t0 = 0.f;
+			t1 = 1.f;
+		}
+		// ...and only visit the cells the clipped piece passes by
+		x0 = p1.f[0] + v.f[0] * t0;
+		x1 = p1.f[0] + v.f[0] * t1;
+		cx0 = g_hash_floor((ac_min(x0, x1) - r) * (1.f / HASH_CELL));
+		cx1 = g_hash_floor((ac_max(x0, x1) + r) * (1.f / HASH_CELL));
+		for (cx = cx0; cx <= cx1; cx++) {
+			key = g_hash_cell(cx, cz);
+			for (i = h->head[g_hash_bucket(h, key)]; i >= 0;
+				i = h->next[i]) {
+				if (h->cell[i] != key)
+					continue;
+				// closest point of the segment
+				dx = h->x[i] - p1.f[0];
+				dy = h->y[i] - p1.f[1];
+				dz = h->z[i] - p1.f[2];
+				t = len2 > 0.f ? (dx * v.f[0] + dy * v.f[1] + dz * v.f[2])
+					/ len2 : 0.f;
+				t = ac_max(0.f, ac_min(1.f, t));
+				dx -= v.f[0] * t;
+				dy -= v.f[1] * t;
+				dz -= v.f[2] * t;
+				if (dx * dx + dy * dy + dz * dz > r2)
+					continue;
+				out[n] = i;
+				if (fracs)
+					fracs[n] = t;
+				if (++n == max)
+					return n;
+			}
+		}
+	}
+	return n;
+}
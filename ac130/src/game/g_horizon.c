@@ -0,0 +1,306 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Horizon maps; terrain line of sight queries without tracing
+
+#include "g_local.h"
+#include "../ac_thread.h"
+
+/// Number of horizon map cells along each side of the heightmap.
+#define HORIZON_CELLS		128
+/// Smallest size of a horizon map cell in metres, as a power of 2.
+#define HORIZON_MIN_SHIFT	1
+/// Number of azimuth sectors of the horizon of a cell.
+#define HORIZON_SECTORS		16
+/// Number of distance bands of the horizon of a cell; band B spans 2^B cell
+/// sizes from the middle of the cell, so 9 of them reach across the heightmap
+/// diagonally from anywhere.
+#define HORIZON_BANDS		9
+/// Height of the viewpoint above the middle of a cell, which the horizon is
+/// measured from, in metres; that of a standing soldier's eyes.
+#define HORIZON_EYE			1.7f
+/// Width of the strip along the middle of a sector whose terrain is sampled,
+/// relative to the width of the sector. The lines of sight of the troops skim
+/// the ground, so the wider the blocks of the pyramid, the more of them are
+/// taken for blocked.
+#define HORIZON_STRIP		0.1f
+/// Margin by which the line of sight must clear the horizon to be taken for
+/// clear, in cell sizes, plus a slope times the distance; the horizons are
+/// those of the cells' middles, so they are the further off, the larger the
+/// cells are. Within the margins, the query is traced instead.
+#define HORIZON_CLEAR_CELLS	0.25f
+#define HORIZON_CLEAR_SLOPE	0.05f
+/// Margin by which the line of sight must go under the horizon to be taken
+/// for blocked, likewise. The horizons take the highest terrain in the
+/// sectors, so they are more often too high than too low.
+#define HORIZON_BLOCK_CELLS	1.f
+#define HORIZON_BLOCK_SLOPE	0.1f
+/// Scale of the fixed point horizon slopes.
+#define HORIZON_SLOPE_SCALE	1024.f
+/// Number of rows of cells handed to a worker thread at a time.
+#define HORIZON_GRAIN		2
+
+/// Horizon of a cell in a sector, up to the end of a distance band.
+typedef struct {
+	short		slope;	///< steepest slope from the viewpoint to the terrain,
+						///  in 1/\ref HORIZON_SLOPE_SCALE, rounded up
+	ushort		top;	///< highest point of the terrain, as a heightmap value
+} g_horizon_t;
+
+/// Answers of the horizon of one end of a line of sight.
+typedef enum {
+	HV_BLOCKED,		///< the terrain is well above the line of sight
+	HV_CLEAR,		///< the line of sight is well above the terrain
+	HV_UNSURE		///< too close to call
+} g_horizon_view_t;
+
+/// Horizons of the cells, \ref HORIZON_SECTORS per band, \ref HORIZON_BANDS
+/// per cell, and rows of cells one after another.
+static g_horizon_t	*g_horizon = NULL;
+/// Viewpoint heights of the cells.
+static float		*g_horizon_eyes = NULL;
+/// Number of cells along each side.
+static int			g_horizon_size = 0;
+/// Size of a cell in metres, as a power of 2.
+static int			g_horizon_shift = 0;
+/// Directions of the middles of the sectors.
+static ALIGNED_16 float	g_horizon_dirx[HORIZON_SECTORS];
+static ALIGNED_16 float	g_horizon_dirz[HORIZON_SECTORS];
+
+/// Rounds 4 floats down to integers.
+static inline __m128i g_horizon_floor4(__m128 f) {
+	const __m128i i = _mm_cvttps_epi32(f);
+
+	// truncation rounds the negative ones up; the comparison mask is -1
+	return _mm_add_epi32(i, _mm_castps_si128(_mm_cmplt_ps(f,
+		_mm_cvtepi32_ps(i))));
+}
+
+/// Rounds 4 floats up to integers.
+static inline __m128i g_horizon_ceil4(__m128 f) {
+	const __m128i i = _mm_cvttps_epi32(f);
+
+	// truncation rounds the positive ones down
+	return _mm_sub_epi32(i, _mm_castps_si128(_mm_cmpgt_ps(f,
+		_mm_cvtepi32_ps(i))));
+}
+
+/// Stores the horizons of 4 sectors up to the end of a band.
+static void g_horizon_store4(g_horizon_t *out, __m128 slopes, __m128 tops) {
+	ALIGNED_16 int s[4], t[4];
+	int i;
+
+	// round the slopes up, and the heights, which are heightmap values, to
+	// the nearest
+	_mm_store_si128((__m128i *)s, g_horizon_ceil4(_mm_min_ps(_mm_max_ps(
+		_mm_mul_ps(slopes, _mm_set1_ps(HORIZON_SLOPE_SCALE)),
+		_mm_set1_ps(-32767.f)), _mm_set1_ps(32767.f))));
+	_mm_store_si128((__m128i *)t, _mm_cvtps_epi32(_mm_mul_ps(tops,
+		_mm_set1_ps(1.f / HEIGHT_SCALE))));
+	for (i = 0; i < 4; i++) {
+		out[i].slope = s[i];
+		out[i].top = t[i];
+	}
+}
+
+/// Computes the horizons of a range of rows of cells. Each sector is marched
+/// along its middle from the viewpoint of the cell, in steps growing with the
+/// distance as the sector widens; each step takes the highest point of a block
+/// of the maximum height pyramid half as wide as the sector is there, 4
+/// sectors at a time.
+static void g_horizon_rows(void *arg, int first, int last) {
+	const int cell = 1 << g_horizon_shift;
+	const float strip = 2.f * tanf(M_PI / HORIZON_SECTORS) * HORIZON_STRIP;
+	const float size = gen_heightmap_size;
+	ALIGNED_16 int xi[4], zi[4];
+	ALIGNED_16 float h[4];
+	__m128 slopes[HORIZON_SECTORS / 4], tops[HORIZON_SECTORS / 4];
+	__m128 cx, cz, dist, inv, eye, height;
+	g_horizon_t *out;
+	float x0, z0, d, far, bandEnd;
+	int x, z, i, v, level, band;
+
+	for (z = first; z < last; z++) {
+		for (x = 0; x < g_horizon_size; x++) {
+			out = g_horizon + ((size_t)z * g_horizon_size + x)
+				* HORIZON_BANDS * HORIZON_SECTORS;
+			x0 = (x + 0.5f) * cell;
+			z0 = (z + 0.5f) * cell;
+			g_horizon_eyes[z * g_horizon_size + x] = g_sample_height(x0, z0)
+				+ HORIZON_EYE;
+			eye = _mm_set1_ps(g_horizon_eyes[z * g_horizon_size + x]);
+			cx = _mm_set1_ps(x0);
+			cz = _mm_set1_ps(z0);
+			// march until out of the heightmap in every direction
+			far = sqrtf(ac_max(x0, size - x0) * ac_max(x0, size - x0)
+				+ ac_max(z0, size - z0) * ac_max(z0, size - z0));
+			for (v = 0; v < HORIZON_SECTORS / 4; v++) {
+				slopes[v] = _mm_set1_ps(-FLT_MAX);
+				tops[v] = _mm_setzero_ps();
+			}
+			band = 0;
+			bandEnd = cell;
+			for (d = 1.f; d < far;) {
+				for (level = 1; (1 << level) < d * strip && level < 30;
+					level++);
+				dist = _mm_set1_ps(d);
+				inv = _mm_set1_ps(1.f / d);
+				for (v = 0; v < HORIZON_SECTORS / 4; v++) {
+					_mm_store_si128((__m128i *)xi, g_horizon_floor4(
+						_mm_add_ps(cx, _mm_mul_ps(dist,
+						_mm_load_ps(g_horizon_dirx + v * 4)))));
+					_mm_store_si128((__m128i *)zi, g_horizon_floor4(
+						_mm_add_ps(cz, _mm_mul_ps(dist,
+						_mm_load_ps(g_horizon_dirz + v * 4)))));
+					for (i = 0; i < 4; i++)
+						h[i] = g_terrain_max(level, xi[i], zi[i]);
+					height = _mm_load_ps(h);
+					slopes[v] = _mm_max_ps(slopes[v],
+						_mm_mul_ps(_mm_sub_ps(height, eye), inv));
+					tops[v] = _mm_max_ps(tops[v], height);
+				}
+				d += (float)(1 << level) * 0.5f;
+				// the bands are cumulative, so a step can end several
+				for (; d > bandEnd && band < HORIZON_BANDS; band++,
+					bandEnd *= 2.f) {
+					for (v = 0; v < HORIZON_SECTORS / 4; v++)
+						g_horizon_store4(out + band * HORIZON_SECTORS + v * 4,
+							slopes[v], tops[v]);
+				}
+			}
+			// there is only flat ground past the edge
+			for (; band < HORIZON_BANDS; band++) {
+				for (v = 0; v < HORIZON_SECTORS / 4; v++)
+					g_horizon_store4(out + band * HORIZON_SECTORS + v * 4,
+						slopes[v], tops[v]);
+			}
+		}
+	}
+}
+
+bool g_horizon_build(void) {
+	int i;
+
+	g_horizon_free();
+	// streamed worlds have neither a heightmap nor the pyramid
+	if (!gen_heightmap)
+		return true;
+	for (g_horizon_shift = HORIZON_MIN_SHIFT;
+		(gen_heightmap_size >> g_horizon_shift) > HORIZON_CELLS;
+		g_horizon_shift++);
+	g_horizon_size = gen_heightmap_size >> g_horizon_shift;
+	g_horizon = malloc(sizeof(*g_horizon) * g_horizon_size * g_horizon_size
+		* HORIZON_BANDS * HORIZON_SECTORS);
+	g_horizon_eyes = malloc(sizeof(*g_horizon_eyes) * g_horizon_size
+		* g_horizon_size);
+	if (!g_horizon || !g_horizon_eyes) {
+		g_horizon_free();
+		return false;
+	}
+	for (i = 0; i < HORIZON_SECTORS; i++) {
+		g_horizon_dirx[i] = cosf(i * 2.f * M_PI / HORIZON_SECTORS);
+		g_horizon_dirz[i] = sinf(i * 2.f * M_PI / HORIZON_SECTORS);
+	}
+	ac_thread_parallel_for(g_horizon_rows, NULL, g_horizon_size,
+		HORIZON_GRAIN, NULL);
+	return true;
+}
+
+void g_horizon_free(void) {
+	free(g_horizon);
+	g_horizon = NULL;
+	free(g_horizon_eyes);
+	g_horizon_eyes = NULL;
+	g_horizon_size = 0;
+}
+
+/// \return the sector that the given direction is in
+static inline int g_horizon_sector(float dx, float dz) {
+	const float ax = fabsf(dx), az = fabsf(dz);
+	int k;
+
+	// compare with the tangents of the sector boundaries in a quadrant, at
+	// 11.25, 33.75, 56.25 and 78.75 degrees, rather than take the arc tangent
+	k = (az > ax * 0.19891237f) + (az > ax * 0.66817864f)
+		+ (az > ax * 1.49660576f) + (az > ax * 5.02733949f);
+	if (dx < 0.f)
+		k = HORIZON_SECTORS / 2 - k;
+	return (dz < 0.f ? HORIZON_SECTORS - k : k) & (HORIZON_SECTORS - 1);
+}
+
+/// Checks the line of sight from \e from to \e to against the horizons of the
+/// cells around \e from, up to the farthest band that doesn't reach past \e to,
+/// so that the terrain behind \e to doesn't hide it; that is over half of the
+/// way at least. In the band, the terrain is below the line rising from the
+/// viewpoint of a cell at the horizon's slope, and below its highest point, so
+/// the line of sight is clear if it's above the former up to where it rises
+/// above the latter. The viewpoints are rarely where \e from is, so the
+/// horizons of the 4 cells whose middles are nearest to it are interpolated
+/// bilinearly, just like the terrain is between the heightmap samples. This
+/// is only an estimate, so the answer is only given if the line of sight is
+/// above or below the horizon by more than the margins.
+static g_horizon_view_t g_horizon_clear(ac_vec4_t from, ac_vec4_t to) {
+	const float dx = to.f[0] - from.f[0], dz = to.f[2] - from.f[2];
+	const float d = sqrtf(dx * dx + dz * dz);
+	const float scale = 1.f / (float)(1 << g_horizon_shift);
+	const g_horizon_t *hor;
+	float fx, fz, w, eye, slope, hslope, top, t, clear, block;
+	int x0, z0, x, z, i, sector, band;
+
+	// nothing but the terrain right below is in the way
+	if (d < 1e-3f)
+		return HV_CLEAR;
+	// cell coordinates relative to the middles of the cells
+	fx = from.f[0] * scale - 0.5f;
+	fz = from.f[2] * scale - 0.5f;
+	x0 = (int)floorf(fx);
+	z0 = (int)floorf(fz);
+	fx -= x0;
+	fz -= z0;
+	sector = g_horizon_sector(dx, dz);
+	for (band = 0; band < HORIZON_BANDS - 1
+		&& d >= (float)(2 << (band + g_horizon_shift)); band++);
+	eye = hslope = top = 0.f;
+	for (i = 0; i < 4; i++) {
+		// the cells past the edges are taken to be like the edge ones
+		x = x0 + (i & 1);
+		z = z0 + (i >> 1);
+		x = x < 0 ? 0 : ac_min(x, g_horizon_size - 1);
+		z = z < 0 ? 0 : ac_min(z, g_horizon_size - 1);
+		w = (i & 1 ? fx : 1.f - fx) * (i & 2 ? fz : 1.f - fz);
+		hor = g_horizon + ((size_t)(z * g_horizon_size + x) * HORIZON_BANDS
+			+ band) * HORIZON_SECTORS + sector;
+		eye += w * g_horizon_eyes[z * g_horizon_size + x];
+		hslope += w * hor->slope;
+		top += w * hor->top;
+	}
+	hslope *= 1.f / HORIZON_SLOPE_SCALE;
+	top *= HEIGHT_SCALE;
+	t = ac_min(d, (float)(1 << (band + g_horizon_shift)));
+	slope = (to.f[1] - from.f[1]) / d;
+	clear = HORIZON_CLEAR_CELLS / scale + HORIZON_CLEAR_SLOPE * t;
+	block = HORIZON_BLOCK_CELLS / scale + HORIZON_BLOCK_SLOPE * t;
+	if (from.f[1] > top + clear)
+		return HV_CLEAR;
+	// where the line of sight rises above the top, if it does in the band
+	if (slope > 0.f)
+		t = ac_min(t, (top + clear - from.f[1]) / slope);
+	w = from.f[1] + slope * t - eye - t * hslope;
+	return w > clear ? HV_CLEAR : w < -block ? HV_BLOCKED : HV_UNSURE;
+}
+
+bool g_horizon_los(ac_vec4_t p1, ac_vec4_t p2) {
+	g_horizon_view_t v1, v2;
+
+	if (!g_horizon)
+		return g_trace_terrain(p1, p2) >= 1.f;
+	// each end covers at least the half of the way nearer to it, so either
+	// one can tell that the line of sight is blocked, but it takes both to
+	// tell that it's clear; when they can't, the line of sight is traced
+	if ((v1 = g_horizon_clear(p1, p2)) == HV_BLOCKED
+		|| (v2 = g_horizon_clear(p2, p1)) == HV_BLOCKED)
+		return false;
+	if (v1 == HV_CLEAR && v2 == HV_CLEAR)
+		return true;
+	return g_trace_terrain(p1, p2) >= 1.f;
+}
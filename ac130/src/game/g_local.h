@@ -31,17 +31,130 @@ typedef struct {
 	weap_t	weap;
 	ac_vec4_t	pos;
 	ac_vec4_t	vel;
+	ac_vec4_t	prev;	///< position at the previous tick, for interpolation
 } projectile_t;
 
+/// Maximum number of particles; a multiple of 8, so that they can be advanced
+/// in whole SIMD vectors.
+#define MAX_PARTICLES		1024
+
+/// Particle storage, as a structure of arrays, so that the particles can be
+/// advanced several at a time. A negative life marks a free slot; the live
+/// particles are also kept on a dense list, in drawing order.
+typedef struct {
+	ALIGNED_16 float	x[MAX_PARTICLES];		///< position
+	ALIGNED_16 float	y[MAX_PARTICLES];
+	ALIGNED_16 float	z[MAX_PARTICLES];
+	ALIGNED_16 float	px[MAX_PARTICLES];		///< position at the previous
+	ALIGNED_16 float	py[MAX_PARTICLES];		///  tick, for interpolation
+	ALIGNED_16 float	pz[MAX_PARTICLES];
+	ALIGNED_16 float	vx[MAX_PARTICLES];		///< velocity
+	ALIGNED_16 float	vy[MAX_PARTICLES];
+	ALIGNED_16 float	vz[MAX_PARTICLES];
+	ALIGNED_16 float	scale[MAX_PARTICLES];
+	ALIGNED_16 float	life[MAX_PARTICLES];	///< seconds left to live
+	ALIGNED_16 float	alpha[MAX_PARTICLES];
+	ALIGNED_16 float	angle[MAX_PARTICLES];
+	ALIGNED_16 float	drag[MAX_PARTICLES];	///< air drag coefficient
+	ALIGNED_16 float	gravity[MAX_PARTICLES];	///< fraction of the gravity
+	ALIGNED_16 float	fade[MAX_PARTICLES];	///< 1 / fade out time
+	ALIGNED_16 float	depth[MAX_PARTICLES];	///< distance along the view
+												///  axis, for sorting
+	int		used;					///< slots below this one may be in use
+	int		numFree;				///< number of free slots
+	int		free[MAX_PARTICLES];	///< free slots, as a stack
+	int		numLive;				///< number of live particles
+	int		live[MAX_PARTICLES];	///< live slots, back-to-front
+	float	keys[MAX_PARTICLES];	///< depths of the live particles, in the
+									///  same order
+} g_particles_t;
+
+/// Ground troop storage, as a structure of arrays. The troops of a squad are
+/// stored next to each other, so a squad is updated in a single run.
+typedef struct {
+	int		num;		///< number of troops
+	float	*x;			///< position
+	float	*y;
+	float	*z;
+	float	*ang;		///< heading
+	float	*ox;		///< position in the squad formation, along the heading
+	float	*oz;		///< position in the squad formation, across the heading
+	uchar	*stance;	///< \ref ac_stance_t values
+	short	*health;
+} g_troops_t;
+
+/// A squad of ground troops, moving in formation.
+typedef struct {
+	int		first;		///< index of the first troop
+	int		count;		///< number of troops
+	int		alive;		///< number of troops still alive; the squad is no
+						///  longer updated once it drops to 0
+	float	cx, cz;		///< centre of the formation
+	float	gx, gz;		///< destination
+	int		goal;		///< navigation cluster of the destination; -1 if the
+						///  squad walks straight there
+	float	heading;
+	float	halt;		///< seconds left before moving on; 0 when on the move
+	float	dt;			///< time elapsed since the last update
+	int		interval;	///< number of ticks between updates
+	uint	seed;		///< random number generator state
+} g_squad_t;
+
+/// Spatial hash over a set of moving points, with cells the size of a propmap
+/// square. The entities of each bucket are kept on a linked list, so that only
+/// the ones which have moved to another cell need to be relinked.
+typedef struct {
+	int			num;		///< number of entities
+	int			bits;		///< log2 of the number of buckets
+	int			*head;		///< first entity of each bucket; -1 if none
+	int			*next;		///< next entity in the bucket; -1 if none
+	int			*prev;		///< previous entity in the bucket; -1 if none
+	int			*cell;		///< key of the cell of each entity
+	const float	*x;			///< entity positions
+	const float	*y;
+	const float	*z;
+} g_hash_t;
+
+/// Bullet tracer, as drawn.
+typedef struct {
+	ac_vec4_t	pos;	///< position of the head of the tracer
+	ac_vec4_t	dir;	///< normalized direction of flight
+	float		scale;	///< length in metres, width in pixels
+} g_tracer_t;
+
+/// Smoke particle, as drawn.
 typedef struct {
 	ac_vec4_t	pos;
-	ac_vec4_t	vel;
 	float		scale;
-	float		life;
 	float		alpha;
 	float		angle;
-	weap_t		weap;
-} particle_t;
+} g_sprite_t;
+
+/// Everything needed to draw a frame. The simulation captures one at the end
+/// of each frame, so that it can go on with the next frame while the snapshot
+/// is being drawn.
+typedef struct {
+	bool			valid;			///< false until captured for the first time
+	int				ticks;			///< game time in milliseconds
+	ac_viewpoint_t	vp;				///< viewpoint, gun shake included
+	float			neg;			///< display negative fraction
+	float			expld;			///< contrast enhancement fraction
+	bool			paused;
+	bool			started;		///< false until the player hits fire
+	weap_t			weapon;			///< current weapon, for the HUD
+	float			targDist;		///< distance to the point looked at
+
+	int				numTroops;
+	int				maxTroops;		///< capacity of the troop array
+	ac_footmobile_t	*troops;
+
+	int				numTracers;
+	int				maxTracers;		///< capacity of the tracer array
+	g_tracer_t		*tracers;
+
+	int				numSprites;
+	g_sprite_t		sprites[MAX_PARTICLES];	///< in back-to-front order
+} g_snapshot_t;
 
 /// Real rate of fire: 6000 rounds per minute
 #define WEAP_FIREDELAY_M61	0.01
@@ -56,6 +169,25 @@ typedef struct {
 /// Real muzzle velocity: 494m/s
 #define WEAP_MUZZVEL_M102	160//494
 
+/// Splash damage radius of the 20mm HEI round, in metres.
+#define WEAP_SPLASH_M61		1.5
+/// Splash damage radius of the 40mm round, in metres.
+#define WEAP_SPLASH_L60		8
+/// Splash damage radius of the 105mm round, in metres.
+#define WEAP_SPLASH_M102	25
+/// Damage at the point of impact of the 20mm HEI round.
+#define WEAP_DAMAGE_M61		120
+/// Damage at the point of impact of the 40mm round.
+#define WEAP_DAMAGE_L60		250
+/// Damage at the point of impact of the 105mm round.
+#define WEAP_DAMAGE_M102	600
+/// Radius of the crater left by the 40mm round, in metres.
+#define WEAP_CRATER_L60		4
+/// Radius of the crater left by the 105mm round, in metres.
+#define WEAP_CRATER_M102	10
+/// Walking cost a crater adds to the navigation cells in it.
+#define WEAP_CRATER_COST	3
+
 /// Amount of time the camera will shake after a M102 shot, in seconds.
 #define SHAKE_TIME			0.45
 /// Amount of time it takes the display to switch to the negative, in seconds.
@@ -67,9 +199,261 @@ typedef struct {
 float g_sample_height(float x, float y);
 
 // collision detection module
-/// \brief Performs a ray trace from \e p1 to \e p2.
-/// \return		the point hit by the trace
-ac_vec4_t g_collide(ac_vec4_t p1, ac_vec4_t p2);
+/// Types of things a trace can hit.
+typedef enum {
+	HIT_NOTHING,
+	HIT_TERRAIN,
+	HIT_BLDG,
+	HIT_TREE
+} g_hit_type_t;
+/// Result of a trace.
+typedef struct {
+	float			frac;	///< fraction of the way at which the first hit is,
+							///  1 if there is none
+	g_hit_type_t	type;	///< type of the thing hit
+	int				prop;	///< index of the building or tree hit in the prop
+							///  tree's lists, -1 if it's not a prop
+} g_trace_t;
+/// Ray of a batch trace.
+typedef struct {
+	ac_vec4_t		p1;		///< start of the ray
+	ac_vec4_t		p2;		///< end of the ray
+} g_ray_t;
+/// Set to trace the props through a bounding volume hierarchy built over them,
+/// rather than through the prop tree; takes effect on the next
+/// \ref g_collide_build. Off by default, as it is barely faster overall and
+/// takes several times longer to build.
+extern bool			g_collide_bvh;
+/// \brief Builds the collision data of the world: the maximum height pyramid
+/// of the terrain for \ref g_trace_terrain and the props in the form that
+/// \ref g_collide tests them in, including their BVH if \ref g_collide_bvh is
+/// set. Must be called whenever the heightmap or the prop tree change; a
+/// streamed world has no heightmap, so its traces go without the pyramid.
+/// \return		true on success
+bool g_collide_build(void);
+/// \brief Frees the collision data.
+void g_collide_free(void);
+/// \brief Traces a ray from \e p1 to \e p2 against the terrain surface, as
+/// interpolated by \ref g_sample_height. The ray marches through the maximum
+/// height pyramid, skipping whole blocks of terrain that it passes over, and
+/// is intersected exactly with the heightmap cells it comes close to, so it
+/// doesn't miss any ridges, however long it is.
+/// \return		fraction of the way from \e p1 to \e p2 at which the terrain
+///				is hit, 1 if it isn't
+float g_trace_terrain(ac_vec4_t p1, ac_vec4_t p2);
+/// \brief Looks the highest point of the terrain over a block of heightmap
+/// cells up in the maximum height pyramid.
+/// \param level	level of the pyramid; a block of level L spans 2^L by 2^L
+///					cells, and is clamped to the levels there are
+/// \param x		X coordinate of any heightmap texel of the block
+/// \param z		Z coordinate of any heightmap texel of the block
+/// \return			the height; 0 outside the heightmap, and \ref HEIGHT if
+///					there is no pyramid
+float g_terrain_max(int level, int x, int z);
+/// \brief Traces a ray from \e p1 to \e p2 against the terrain and the props,
+/// and finds the closest thing it hits. The buildings are tested 4 at a time,
+/// and so are the trees.
+/// \param trace	pointer to where to store the hit (may be NULL)
+/// \return			the point hit by the trace, \e p2 if nothing is hit
+ac_vec4_t g_collide(ac_vec4_t p1, ac_vec4_t p2, g_trace_t *trace);
+/// \brief Traces a batch of rays, with the same results as \ref g_collide would
+/// give for each of them.
+/// The rays are sorted along a Morton curve and walk the props in packets of
+/// 4, which test every node against all 4 at once, so coherent rays (e.g.
+/// a burst of rounds) share most of the work. A packet that stays above the
+/// maximum height pyramid under it skips the terrain traces too; the others
+/// trace the terrain ray by ray. The packets are spread over the worker
+/// threads. Not reentrant.
+/// \param rays		the rays to trace
+/// \param n		number of rays
+/// \param hits		array of \e n traces to store the hits in, in the order of
+///					the rays
+/// \return			false if out of memory
+bool g_collide_batch(const g_ray_t *rays, int n, g_trace_t *hits);
+
+// horizon map module
+/// \brief Builds the horizon maps of the terrain: for each of up to 128 by 128
+/// cells of the heightmap, the steepest slope and the highest point of the
+/// terrain as seen from a soldier's eye height in the middle of the cell, in
+/// 16 azimuth sectors and within 9 distances, doubling from the cell size. The
+/// cells are shared out between the worker threads, and the sectors are
+/// marched 4 at a time with SSE, through the maximum height pyramid of
+/// \ref g_collide_build, so it must be called after it. A streamed world has
+/// no heightmap, so its queries are traced instead.
+/// \return		true on success
+bool g_horizon_build(void);
+/// \brief Frees the horizon maps.
+void g_horizon_free(void);
+/// \brief Checks the line of sight from \e p1 to \e p2 over the terrain: each
+/// end checks the half of the way nearer to it against the horizon of its
+/// cell, and both must be clear. If the line of sight is too close to either
+/// horizon to tell, it's traced. The props are not taken into account. The
+/// answer is best for points at about a soldier's eye height above the
+/// terrain or higher; see \ref game for how often it's wrong.
+/// \param p1		heightmap space position of one end of the line
+/// \param p2		heightmap space position of the other end of the line
+/// \return			true if \e p2 is visible from \e p1
+bool g_horizon_los(ac_vec4_t p1, ac_vec4_t p2);
+
+// footmobile module
+extern g_troops_t	g_troops;
+/// Spatial hash of the live troops.
+extern g_hash_t		g_fmb_hash;
+extern g_squad_t	*g_squads;
+extern int			g_num_squads;
+/// Set to update the distant squads less often.
+extern bool			g_fmb_lod;
+/// \brief Spawns the ground troops.
+/// Any troops spawned before are removed.
+/// \param troops		number of troops to spawn
+/// \param seed			seed of the squad placement and movement
+/// \return				true on success
+bool g_fmb_init(int troops, uint seed);
+/// \brief Removes all ground troops.
+void g_fmb_shutdown(void);
+/// \brief Advances the ground troops by a single tick.
+/// \param eye			viewpoint position, for picking the squad update rates
+/// \param dt			tick length in seconds
+void g_fmb_advance(ac_vec4_t eye, float dt);
+/// \brief Copies the live ground troops out in the form the renderer takes.
+/// \param out			array of \ref g_troops.num footmobiles to fill
+/// \return				number of footmobiles written
+int g_fmb_capture(ac_footmobile_t *out);
+/// \brief Deals splash damage to the ground troops around a point.
+/// The damage falls off linearly with the distance.
+/// \param pos			point of impact
+/// \param radius		radius of the splash
+/// \param damage		damage at the point of impact
+/// \return				number of troops killed
+int g_fmb_splash(ac_vec4_t pos, float radius, int damage);
+/// \brief Finds the first live soldier on a projectile's path.
+/// \param p1			start point of the path
+/// \param p2			end point of the path
+/// \param frac			pointer to where to store the fraction of the path at
+///						which the soldier is hit
+/// \return				index of the soldier hit, or -1 if none is
+int g_fmb_hit(ac_vec4_t p1, ac_vec4_t p2, float *frac);
+
+// spatial hash module
+/// \brief Builds a spatial hash over a set of points.
+/// The positions are not copied; the hash keeps using the arrays it was built
+/// over, so \ref g_hash_update needs to be called whenever they change.
+/// \param h			hash to build
+/// \param num			number of points
+/// \param x			array of X coordinates
+/// \param y			array of Y coordinates
+/// \param z			array of Z coordinates
+/// \return				true on success
+bool g_hash_init(g_hash_t *h, int num, const float *x, const float *y,
+	const float *z);
+/// \brief Frees a spatial hash.
+void g_hash_free(g_hash_t *h);
+/// \brief Moves the points that have changed cells to their new buckets.
+/// \param h			hash to update
+/// \param first		index of the first point that might have moved
+/// \param count		number of points that might have moved
+void g_hash_update(g_hash_t *h, int first, int count);
+/// \brief Takes a point out of the hash for good, e.g. when a soldier dies.
+void g_hash_remove(g_hash_t *h, int i);
+/// \brief Finds the points within a sphere.
+/// \param h			hash to query
+/// \param pos			centre of the sphere
+/// \param r			radius of the sphere
+/// \param out			array to store the indices of the points found in
+/// \param max			size of the \e out array
+/// \return				number of points found, at most \e max
+int g_hash_radius(const g_hash_t *h, ac_vec4_t pos, float r, int *out,
+	int max);
+/// \brief Finds the points within a capsule, i.e. the ones close enough to a
+/// line segment.
+/// \param h			hash to query
+/// \param p1			start point of the segment
+/// \param p2			end point of the segment
+/// \param r			maximum distance from the segment
+/// \param out			array to store the indices of the points found in
+/// \param fracs		if not NULL, array to store the fractions of the segment
+///						closest to the points found in
+/// \param max			size of the \e out and \e fracs arrays
+/// \return				number of points found, at most \e max, in no
+///						particular order
+int g_hash_segment(const g_hash_t *h, ac_vec4_t p1, ac_vec4_t p2, float r,
+	int *out, float *fracs, int max);
+
+// navigation module
+/// Flow field query results.
+typedef enum {
+	NF_STRAIGHT,	///< no flow direction (yet), head straight for the goal
+	NF_FLOW,		///< follow the flow direction
+	NF_NO_PATH		///< the goal can't be reached from here
+} g_nav_flow_t;
+/// \brief Builds the navigation grid of the current world.
+/// The cell costs come from the terrain slope and the trees, and the buildings
+/// block the cells they stand on. A streamed world has no heightmap to read
+/// the slopes from, so its terrain is evaluated right away, as if it was
+/// generated whole. Any previous grid is freed.
+/// \param trees		tree prop list
+/// \param numTrees		number of trees
+/// \param bldgs		building prop list
+/// \param numBldgs		number of buildings
+/// \return				true on success; false if out of memory
+bool g_nav_build(const ac_tree_t *trees, int numTrees,
+	const ac_bldg_t *bldgs, int numBldgs);
+/// \brief Frees the navigation grid and all of the cached flow fields.
+void g_nav_free(void);
+/// \return true if there is a navigation grid to query
+bool g_nav_ready(void);
+/// \brief Picks a destination near a point.
+/// \param x			X coordinate of the point
+/// \param z			Z coordinate of the point
+/// \param dx			offset from the cluster under the point, in clusters
+/// \param dz			offset from the cluster under the point, in clusters
+/// \param wx			pointer to where to store the X coordinate of the
+///						destination
+/// \param wz			pointer to where to store the Z coordinate of the
+///						destination
+/// \return				destination cluster, or -1 if there is no walkable
+///						destination there
+int g_nav_waypoint_near(float x, float z, int dx, int dz,
+	float *wx, float *wz);
+/// \brief Asks for the flow towards a destination to be made available at a
+/// point. Requests are served by \ref g_nav_update. Not thread safe.
+/// \param dest			destination cluster
+/// \param x			X coordinate of the point
+/// \param z			Z coordinate of the point
+void g_nav_request(int dest, float x, float z);
+/// \brief Serves the queued requests, up to the per-tick budget, on the
+/// worker threads. Not thread safe.
+void g_nav_update(void);
+/// \brief Looks the flow direction towards a destination up. Safe to call from
+/// many threads at once, but not concurrently with the other functions.
+/// \param dest			destination cluster
+/// \param x			X coordinate of the point
+/// \param z			Z coordinate of the point
+/// \param dx			pointer to where to store the X component of the unit
+///						flow direction
+/// \param dz			pointer to where to store the Z component of the unit
+///						flow direction
+/// \return				query result; the direction is only stored if the result
+///						is \ref NF_FLOW
+g_nav_flow_t g_nav_flow(int dest, float x, float z, float *dx, float *dz);
+/// \brief Changes the walking cost of the cell under a point, e.g. when the
+/// terrain is damaged. Only the cached flow field tiles around the cell are
+/// invalidated, unless the change affects the coarse graph. Not thread safe.
+/// \param x			X coordinate of the point
+/// \param z			Z coordinate of the point
+/// \param cost			new cost; 0 blocks the cell
+void g_nav_set_cost(float x, float z, int cost);
+/// \brief Adds to the walking cost of the open cells within a radius of a
+/// point, e.g. to the ones churned up by an explosion. All of the cells are
+/// changed before the coarse graph is updated, so it's cheaper than changing
+/// them one by one. Not thread safe.
+/// \param x			X coordinate of the point
+/// \param z			Z coordinate of the point
+/// \param radius		radius in metres
+/// \param cost			cost to add; the cells are neither blocked nor opened
+void g_nav_add_cost(float x, float z, float radius, int cost);
+/// \return number of flow field tile requests waiting for \ref g_nav_update
+int g_nav_pending(void);
 
 /// @}
 
@@ -4,11 +4,29 @@
 // Main game logic module
 
 #include "g_local.h"
+#include "../ac_thread.h"
+#ifdef __AVX__
+	#include <immintrin.h>
+#endif
 
-#define MAX_PROJECTILES		512
-projectile_t	g_projs[MAX_PROJECTILES];
-#define MAX_PARTICLES		1024
-particle_t		g_particles[MAX_PARTICLES];
+/// Initial capacity of the projectile pool.
+#define MIN_PROJECTILES		512
+/// Hard limit on the capacity of the projectile pool.
+#define MAX_PROJECTILES		65536
+/// Projectile pool. The projectiles in flight are packed at the beginning; a
+/// spent one is replaced with the last one, and the pool doubles in size when
+/// it runs out of room, so the order of the projectiles (and thus everything
+/// that depends on it) only depends on the sequence of shots and hits.
+projectile_t	*g_projs = NULL;
+int				g_num_projs = 0;
+static int		g_max_projs = 0;
+/// Ways covered by the projectiles in the current tick, and what they hit;
+/// they go along with the projectiles in the pool.
+static g_ray_t		*g_proj_rays = NULL;
+static g_trace_t	*g_proj_traces = NULL;
+static int		g_peak_projs = 0;
+static int		g_dropped_projs = 0;
+g_particles_t	g_particles;
 
 int				g_num_trees;
 ac_tree_t		*g_trees;
@@ -18,8 +36,14 @@ ac_bldg_t		*g_bldgs;
 
 bool			g_paused = true;
 
+int				g_tick_rate = 120;
+int				g_troop_count = 200;
+uint			g_seed = 0;
+
 // some helper vectors for physics and other mechanics
 float			g_time;
+/// Length of the current simulation step; a fixed tick in the simulation, the
+/// frame time everywhere else.
 float			g_frameTime;
 ac_vec4_t		g_gravity;
 ac_vec4_t		g_frameTimeVec;
@@ -40,23 +64,173 @@ float			g_neg_time = 0.f;
 
 float			g_expl_time = -EXPLOSION_TIME;
 
+static int			g_game_ticks = 0;	///< game time in milliseconds
+static float		g_sim_time = 0.f;	///< game time of the last tick
+static float		g_sim_accum = 0.f;	///< time not simulated yet
+static uint			g_sim_count = 0;	///< number of ticks run so far
+
+/// Frame snapshots; one is drawn while the simulation captures the other.
+static g_snapshot_t	g_snapshots[2];
+static int			g_cur_snapshot = 0;	///< the one being drawn
+
+/// Purposes of the game's random number streams. Each gets a stream of its
+/// own, so that drawing numbers for one never shifts the others; the bullet
+/// spread is drawn at the frame rate and the rest by the simulation job, so
+/// they couldn't share a generator anyway.
+typedef enum {
+	GR_SPREAD,		///< bullet spread
+	GR_PARTICLES,	///< explosion particles
+	GR_SHAKE,		///< gun shake
+	GR_NUM_STREAMS
+} g_rand_stream_t;
+
+/// Counter-based random number streams; the numbers only depend on
+/// \ref g_seed, the purpose and the number of draws.
+static struct {
+	uint	key;		///< hash of the seed and the purpose
+	uint	ctr;		///< number of numbers drawn so far
+} g_rand_streams[GR_NUM_STREAMS];
+
+/// 32-bit integer hash finalizer (from MurmurHash3).
+static inline uint g_mix(uint h) {
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+/// \return the next number of the given stream, in the [0..2^31) range
+static inline int g_rand(g_rand_stream_t stream) {
+	return g_mix(g_rand_streams[stream].key
+		+ g_mix(g_rand_streams[stream].ctr++)) >> 1;
+}
+
+/// Per-weapon particle constants; resolved into the particle lanes when the
+/// particles are spawned, so that the update doesn't need to branch.
+static const struct {
+	float	drag;		///< air drag coefficient (q in \ref g_advance_particles4)
+	float	gravity;	///< fraction of the gravity affecting the particle
+	float	fade;		///< reciprocal of the time in which the particle fades
+} g_particle_params[] = {
+	{0.f, 0.f, 0.f},		// WP_NONE
+	{-0.35f, 0.5f, 1.f},	// WP_M61, fade away during the last second
+	{-0.925f, 0.025f, 0.5f},// WP_L60, during the last 2 seconds
+	{-0.7f, 0.02f, 0.25f},	// WP_M102, during the last 4 seconds
+	{-0.35f, 0.5f, 1.f}		// WP_M61_TRACER
+};
+
+static void g_clear_particles(void) {
+	int i;
+
+	memset(&g_particles, 0, sizeof(g_particles));
+	// a negative life marks a free slot; hand out the low ones first, so that
+	// the particles stay packed at the beginning of the arrays
+	for (i = 0; i < MAX_PARTICLES; i++) {
+		g_particles.life[i] = -1.f;
+		g_particles.free[i] = MAX_PARTICLES - 1 - i;
+	}
+	g_particles.numFree = MAX_PARTICLES;
+}
+
+/// World loading stages, in the order the loader thread completes them.
+typedef enum {
+	LS_PROPS,		///< prop resources
+	LS_FX,			///< special effects resources
+	LS_TERRAIN,		///< terrain heightmap
+	LS_PROPLISTS,	///< prop lists and the prop tree
+	LS_NUM_STAGES
+} g_load_stage_t;
+
+/// Resources generated by the loader thread for the renderer.
+static struct {
+	uchar		propTex[PROP_TEXTURE_SIZE * PROP_TEXTURE_SIZE];
+	ac_vertex_t	propVerts[PROP_NUM_VERTS];
+	uchar		propIndices[PROP_NUM_INDICES];
+	uchar		fxTex[2 * FX_TEXTURE_SIZE * FX_TEXTURE_SIZE];
+	ac_vertex_t	fxVerts[4];
+	uchar		fxIndices[4];
+} g_load_res;
+
+static ac_thread_t	*g_load_thread = NULL;
+static volatile int	g_load_ticks = 0;	///< generator progress ticks
+static volatile int	g_load_stages = 0;	///< stages completed by the loader
+static int			g_load_uploaded = 0;	///< stages handed to the renderer
+/// Ticks the generator reports in each stage.
+static int			g_load_stage_ticks[LS_NUM_STAGES];
+static int			g_load_total_ticks;
+
+/// Publishes a completed loading stage. Stages may report fewer ticks than
+/// expected (e.g. on a world cache hit), so the counter is topped up first.
+static void g_load_finish_stage(g_load_stage_t stage) {
+	int i, end = 0;
+
+	for (i = 0; i <= (int)stage; i++)
+		end += g_load_stage_ticks[i];
+	if ((i = ac_atomic_get(&g_load_ticks)) < end)
+		ac_atomic_add(&g_load_ticks, end - i);
+	ac_atomic_add(&g_load_stages, 1);
+}
+
+/// Loader thread; generates the entire world, keeping the same order of the
+/// generator calls as always, so that the results don't change.
+static int g_load_world(void *unused) {
+	gen_props(g_load_res.propTex, g_load_res.propVerts,
+		g_load_res.propIndices);
+	g_load_finish_stage(LS_PROPS);
+
+	gen_fx(g_load_res.fxTex, g_load_res.fxVerts, g_load_res.fxIndices);
+	g_load_finish_stage(LS_FX);
+
+	gen_terrain(GEN_WORLD_SEED);
+	g_load_finish_stage(LS_TERRAIN);
+
+	gen_proplists(&g_num_trees, g_trees, &g_num_bldgs, g_bldgs);
+	// all of the world content is in place now
+	gen_cache_flush();
+	g_collide_build();
+	g_horizon_build();
+	g_nav_build(g_trees, g_num_trees, g_bldgs, g_num_bldgs);
+	g_load_finish_stage(LS_PROPLISTS);
+	return 0;
+}
+
 bool g_init(void) {
-	// set new terrain heightmap
-	gen_terrain(0xDEADBEEF);
-	r_set_heightmap();
+	int i;
 
-	// generate proplists
 	g_trees = malloc(sizeof(*g_trees) * MAX_NUM_TREES);
 	g_bldgs = malloc(sizeof(*g_bldgs) * MAX_NUM_BLDGS);
-	gen_proplists(&g_num_trees, g_trees, &g_num_bldgs, g_bldgs);
 
-	// final tick before game is ready
-	g_loading_tick();
+	// 2 ticks for the props, 1 per FX texture row, 1 per heightmap row (unless
+	// the world is streamed) and 3 for the prop lists
+	g_load_stage_ticks[LS_PROPS] = 2;
+	g_load_stage_ticks[LS_FX] = FX_TEXTURE_SIZE;
+	g_load_stage_ticks[LS_TERRAIN] = gen_heightmap ? gen_heightmap_size : 0;
+	g_load_stage_ticks[LS_PROPLISTS] = 3;
+	for (i = 0, g_load_total_ticks = 0; i < LS_NUM_STAGES; i++)
+		g_load_total_ticks += g_load_stage_ticks[i];
 
 	g_gravity = ac_vec_set(0, -9.81, 0, 0);
+	for (i = 0; i < GR_NUM_STREAMS; i++) {
+		g_rand_streams[i].key = g_mix(g_seed ^ g_mix(i + 1));
+		g_rand_streams[i].ctr = 0;
+	}
 
-	memset(g_projs, 0, sizeof(g_projs));
-	memset(g_particles, 0, sizeof(g_particles));
+	g_max_projs = MIN_PROJECTILES;
+	g_projs = malloc(sizeof(*g_projs) * g_max_projs);
+	g_proj_rays = malloc(sizeof(*g_proj_rays) * g_max_projs);
+	g_proj_traces = malloc(sizeof(*g_proj_traces) * g_max_projs);
+	g_num_projs = g_peak_projs = g_dropped_projs = 0;
+	g_clear_particles();
+	// the troops are spawned before the loader builds the navigation grid
+	if (!g_fmb_init(g_troop_count, GEN_WORLD_SEED))
+		return false;
+
+	// generate the world in the background; g_frame() shows the loading screen
+	// in the meantime
+	if (!(g_load_thread = ac_thread_spawn(g_load_world, NULL)))
+		g_load_world(NULL);
 
 	g_viewpoint.angles[0] = M_PI * 0.5;
 	g_viewpoint.angles[1] = M_PI * -0.17;
@@ -64,6 +238,25 @@ bool g_init(void) {
 }
 
 void g_shutdown(void) {
+	// the generator can't be interrupted
+	if (g_load_thread)
+		ac_thread_join(g_load_thread);
+	g_load_thread = NULL;
+	free(g_projs);
+	g_projs = NULL;
+	free(g_proj_rays);
+	g_proj_rays = NULL;
+	free(g_proj_traces);
+	g_proj_traces = NULL;
+	g_fmb_shutdown();
+	g_nav_free();
+	g_horizon_free();
+	g_collide_free();
+	free(g_snapshots[0].tracers);
+	free(g_snapshots[1].tracers);
+	free(g_snapshots[0].troops);
+	free(g_snapshots[1].troops);
+	memset(g_snapshots, 0, sizeof(g_snapshots));
 	free(g_trees);
 	free(g_bldgs);
 }
@@ -72,258 +265,365 @@ float g_sample_height(float x, float y) {
 	// bilinear filtering
 	float xi, yi, xfrac, yfrac;
 	float fR1, fR2;
+	int i;
 
 	xfrac = modff(x, &xi);
 	yfrac = modff(y, &yi);
 
 	if (yi < 0.f || xi < 0.f
-		|| yi + 1 >= HEIGHTMAP_SIZE || xi + 1 >= HEIGHTMAP_SIZE)
+		|| yi + 1 >= gen_heightmap_size || xi + 1 >= gen_heightmap_size)
 		return 0.f;
 
+	// streamed world
+	if (!gen_heightmap)
+		return gen_tiles_sample(x, y) * HEIGHT_SCALE;
+
 	// bilinear filtering
-	fR1 = (1.f - xfrac) * gen_heightmap[(int)yi * HEIGHTMAP_SIZE + (int)xi]
-		+ xfrac * gen_heightmap[(int)yi * HEIGHTMAP_SIZE + (int)xi + 1];
-	fR2 = (1.f - xfrac) * gen_heightmap[((int)yi + 1) * HEIGHTMAP_SIZE +(int)xi]
-		+ xfrac * gen_heightmap[((int)yi + 1) * HEIGHTMAP_SIZE + (int)xi + 1];
+	i = (int)yi * gen_heightmap_size + (int)xi;
+	fR1 = (1.f - xfrac) * gen_heightmap[i]
+		+ xfrac * gen_heightmap[i + 1];
+	fR2 = (1.f - xfrac) * gen_heightmap[i + gen_heightmap_size]
+		+ xfrac * gen_heightmap[i + gen_heightmap_size + 1];
 	return ((1.f - yfrac) * fR1 + yfrac * fR2) * HEIGHT_SCALE;
 }
 
-int g_particle_cmp(const void *p1, const void *p2) {
-	float diff;
-	// push inactive particles towards the end of the array
-	if (((particle_t *)p1)->weap == WP_NONE)
-		return 1;
-	if (((particle_t *)p2)->weap == WP_NONE)
-		return -1;
-	// sort the particles back-to-front
-	// cast the particle positions onto the view axis
-	diff = ac_vec_dot(((particle_t *)p1)->pos, g_forward)
-		- ac_vec_dot(((particle_t *)p2)->pos, g_forward);
-	// also find the nearest and farthest particles
-	if (diff < 0.f)	// p1 is closer than p2, draw p2 first
-		return 1;
-	if (diff > 0.f)	// p2 is closer than p1, draw p1 first
-		return -1;
-	return 0;	// p1 and p2 are equally distant from the viewpoint
-}
-
-#define USE_QSORT
-void g_advance_particles(void) {
-	size_t i;
-	ac_vec4_t grav = ac_vec_mul(g_gravity, g_frameTimeVec);
-	ac_vec4_t tmp;
-	float v, q, C, g = 1.f;
-	particle_t *p;
+/// Puts a particle in a free slot and appends it to the live list; it gets
+/// sorted into place by \ref g_advance_particles.
+static void g_spawn_particle(weap_t w, ac_vec4_t pos, ac_vec4_t vel,
+	float scale, float life, float angle) {
+	int i = g_particles.free[--g_particles.numFree];
+
+	if (g_particles.used <= i)
+		g_particles.used = i + 1;
+	g_particles.live[g_particles.numLive++] = i;
+
+	g_particles.x[i] = pos.f[0];
+	g_particles.y[i] = pos.f[1];
+	g_particles.z[i] = pos.f[2];
+	g_particles.px[i] = pos.f[0];
+	g_particles.py[i] = pos.f[1];
+	g_particles.pz[i] = pos.f[2];
+	g_particles.vx[i] = vel.f[0];
+	g_particles.vy[i] = vel.f[1];
+	g_particles.vz[i] = vel.f[2];
+	g_particles.scale[i] = scale;
+	g_particles.life[i] = life;
+	g_particles.alpha[i] = 1.f;
+	g_particles.angle[i] = angle;
+	g_particles.drag[i] = g_particle_params[w].drag;
+	g_particles.gravity[i] = g_particle_params[w].gravity;
+	g_particles.fade[i] = g_particle_params[w].fade;
+}
 
-	// we need the proper Z-order, so sort the particle array first
-#ifdef USE_QSORT
-	qsort(g_particles, sizeof(g_particles) / sizeof(g_particles[0]),
-		sizeof(g_particles[0]), g_particle_cmp);
-#endif
+/// Drops the dead particles from the live list and picks up the depths of the
+/// rest. The relative order of the survivors is preserved.
+static void g_gather_particles(void) {
+	int i, j, k;
 
-	for (i = 0, p = g_particles;
-		i < sizeof(g_particles) / sizeof(g_particles[0]); i++, p++) {
-		// the array is sorted, so break upon the first occurence of an unused
-		// particle
-		if (p->weap == WP_NONE)
-#ifdef USE_QSORT
-			break;
-#else
-			continue;
-#endif
-		p->life -= g_frameTime;
-		if (p->life < 0.f) {
-			p->weap = WP_NONE;
+	for (i = 0, j = 0; i < g_particles.numLive; i++) {
+		k = g_particles.live[i];
+		if (g_particles.life[k] < 0.f) {
+			g_particles.free[g_particles.numFree++] = k;
 			continue;
 		}
-		// find the new position
-		p->pos = ac_vec_add(p->pos, ac_vec_mul(p->vel, g_frameTimeVec));
-		v = ac_vec_decompose(p->vel, &tmp);
-
-		/*
-		OK, now, in order to make the air drag work properly under any
-		circumstances, we need to calculate an... integral. An analytic one, at
-		that. Let me explain.
-
-		The air drag force equation is a pretty complex one, but if you make a
-		few assumptions and approximations, its acceleration can be simplified
-		to this:
-
-		a = q * v^2
-
-		where q is a constant and q < 0, in order for the acceleration to have a
-		stopping effect. The most natural way to implement this in a real-time
-		simulation would be to just calculate the effect of this acceleration on
-		the velocity, like this:
-
-		v -= q * v^2 * t
-
-		where t is the time step (i. e. frame time). This is basically a form of
-		a discrete integral, and an approximation that is reasonably accurate,
-		as long as the time step stays small enough. However, as the time step
-		grows larger, the approximation becomes increasingly inaccurate due to
-		the quadratic growth, up until a point where the velocity delta induced
-		by the acceleration outweighs the original velocity, and the object
-		starts behaving in a totally erratic way.
-
-		There are two ways to fix this. One is to subdivide the time step if
-		it's too large; the other is to solve the problem analytically, which
-		involves solving a simple differential equation, thus finding the
-		velocity equation. I chose the latter because 1) it's way more accurate
-		and 2) it produces a solution with a constant time of execution.
-
-		So basically, we start with the original acceleration equation:
-
-		a = qv^2
-
-		We substitute dv/dt for a and make some transformations:
+		g_particles.live[j] = k;
+		g_particles.keys[j++] = g_particles.depth[k];
+	}
+	g_particles.numLive = j;
+	// trim the range of slots to advance
+	if (!j)
+		g_particles.used = 0;
+}
 
-		dv/dt = qv^2
-		1/v^2 * dv = qdt
+/// Sorts the live particles back-to-front. The camera moves slowly, so the
+/// list is nearly sorted from the previous frame and an insertion sort only
+/// has to move the few particles that swapped places, and the new ones that
+/// were appended at the end; the cost is linear in the number of live
+/// particles in the common case.
+static void g_sort_particles(void) {
+	int i, j, k;
+	float key;
+
+	for (i = 1; i < g_particles.numLive; i++) {
+		key = g_particles.keys[i];
+		if (key <= g_particles.keys[i - 1])
+			continue;
+		k = g_particles.live[i];
+		for (j = i; j > 0 && g_particles.keys[j - 1] < key; j--) {
+			g_particles.keys[j] = g_particles.keys[j - 1];
+			g_particles.live[j] = g_particles.live[j - 1];
+		}
+		g_particles.keys[j] = key;
+		g_particles.live[j] = k;
+	}
+}
 
-		By integrating both parts of the equation we get:
+/// Advances 4 particles, starting at the given index.
+static inline void g_advance_particles4(int i, float dt, float gdt,
+	const ac_vec4_t *fwd) {
+	__m128 t = _mm_set1_ps(dt);
+	__m128 life, x, y, z, vx, vy, vz, v, k;
+
+	life = _mm_sub_ps(_mm_load_ps(g_particles.life + i), t);
+	_mm_store_ps(g_particles.life + i, life);
+	// find the new position
+	vx = _mm_load_ps(g_particles.vx + i);
+	vy = _mm_load_ps(g_particles.vy + i);
+	vz = _mm_load_ps(g_particles.vz + i);
+	x = _mm_load_ps(g_particles.x + i);
+	y = _mm_load_ps(g_particles.y + i);
+	z = _mm_load_ps(g_particles.z + i);
+	_mm_store_ps(g_particles.px + i, x);
+	_mm_store_ps(g_particles.py + i, y);
+	_mm_store_ps(g_particles.pz + i, z);
+	x = _mm_add_ps(x, _mm_mul_ps(vx, t));
+	y = _mm_add_ps(y, _mm_mul_ps(vy, t));
+	z = _mm_add_ps(z, _mm_mul_ps(vz, t));
+	_mm_store_ps(g_particles.x + i, x);
+	_mm_store_ps(g_particles.y + i, y);
+	_mm_store_ps(g_particles.z + i, z);
+
+	/*
+	OK, now, in order to make the air drag work properly under any
+	circumstances, we need to calculate an... integral. An analytic one, at
+	that. Let me explain.
+
+	The air drag force equation is a pretty complex one, but if you make a
+	few assumptions and approximations, its acceleration can be simplified
+	to this:
+
+	a = q * v^2
+
+	where q is a constant and q < 0, in order for the acceleration to have a
+	stopping effect. The most natural way to implement this in a real-time
+	simulation would be to just calculate the effect of this acceleration on
+	the velocity, like this:
+
+	v -= q * v^2 * t
+
+	where t is the time step (i. e. frame time). This is basically a form of
+	a discrete integral, and an approximation that is reasonably accurate,
+	as long as the time step stays small enough. However, as the time step
+	grows larger, the approximation becomes increasingly inaccurate due to
+	the quadratic growth, up until a point where the velocity delta induced
+	by the acceleration outweighs the original velocity, and the object
+	starts behaving in a totally erratic way.
+
+	There are two ways to fix this. One is to subdivide the time step if
+	it's too large; the other is to solve the problem analytically, which
+	involves solving a simple differential equation, thus finding the
+	velocity equation. I chose the latter because 1) it's way more accurate
+	and 2) it produces a solution with a constant time of execution.
+
+	So basically, we start with the original acceleration equation:
+
+	a = qv^2
+
+	We substitute dv/dt for a and make some transformations:
+
+	dv/dt = qv^2
+	1/v^2 * dv = qdt
+
+	By integrating both parts of the equation we get:
+
+	-1/v = qt + C
+	v = -1/(qt + C)
+
+	As for the constant C, we can calculate it from boundary value of v(0):
+
+	C = -1/v(0) - q0 = -1/v(0)
+
+	And now we have all we need to solve the problem. Dividing the new speed
+	by the old one gets rid of the normalization, too:
+
+	v'/v = -1/(v(qt + C)) = 1/(1 - qtv)
+
+	and since q < 0, the denominator never drops below 1, even for particles
+	at rest.
+	*/
+	// slow the smoke down
+	v = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx),
+		_mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+	k = _mm_div_ps(_mm_set1_ps(1.f), _mm_sub_ps(_mm_set1_ps(1.f),
+		_mm_mul_ps(_mm_mul_ps(_mm_load_ps(g_particles.drag + i), t), v)));
+	_mm_store_ps(g_particles.vx + i, _mm_mul_ps(vx, k));
+	_mm_store_ps(g_particles.vz + i, _mm_mul_ps(vz, k));
+	// add reduced gravity
+	_mm_store_ps(g_particles.vy + i, _mm_add_ps(_mm_mul_ps(vy, k),
+		_mm_mul_ps(_mm_load_ps(g_particles.gravity + i), _mm_set1_ps(gdt))));
+	// fade the alpha away
+	_mm_store_ps(g_particles.alpha + i, _mm_min_ps(
+		_mm_load_ps(g_particles.alpha + i),
+		_mm_mul_ps(life, _mm_load_ps(g_particles.fade + i))));
+	// cast the particle positions onto the view axis for sorting
+	_mm_store_ps(g_particles.depth + i, _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(x, _mm_set1_ps(fwd->f[0])),
+		_mm_mul_ps(y, _mm_set1_ps(fwd->f[1]))),
+		_mm_mul_ps(z, _mm_set1_ps(fwd->f[2]))));
+}
 
-		-1/v = qt + C
-		v = -1/(qt + C)
+#ifdef __AVX__
+/// Advances 8 particles, starting at the given index.
+static inline void g_advance_particles8(int i, float dt, float gdt,
+	const ac_vec4_t *fwd) {
+	__m256 t = _mm256_set1_ps(dt);
+	__m256 life, x, y, z, vx, vy, vz, v, k;
+
+	life = _mm256_sub_ps(_mm256_loadu_ps(g_particles.life + i), t);
+	_mm256_storeu_ps(g_particles.life + i, life);
+	vx = _mm256_loadu_ps(g_particles.vx + i);
+	vy = _mm256_loadu_ps(g_particles.vy + i);
+	vz = _mm256_loadu_ps(g_particles.vz + i);
+	x = _mm256_loadu_ps(g_particles.x + i);
+	y = _mm256_loadu_ps(g_particles.y + i);
+	z = _mm256_loadu_ps(g_particles.z + i);
+	_mm256_storeu_ps(g_particles.px + i, x);
+	_mm256_storeu_ps(g_particles.py + i, y);
+	_mm256_storeu_ps(g_particles.pz + i, z);
+	x = _mm256_add_ps(x, _mm256_mul_ps(vx, t));
+	y = _mm256_add_ps(y, _mm256_mul_ps(vy, t));
+	z = _mm256_add_ps(z, _mm256_mul_ps(vz, t));
+	_mm256_storeu_ps(g_particles.x + i, x);
+	_mm256_storeu_ps(g_particles.y + i, y);
+	_mm256_storeu_ps(g_particles.z + i, z);
+	v = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx),
+		_mm256_mul_ps(vy, vy)), _mm256_mul_ps(vz, vz)));
+	k = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_sub_ps(_mm256_set1_ps(1.f),
+		_mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(g_particles.drag + i), t),
+			v)));
+	_mm256_storeu_ps(g_particles.vx + i, _mm256_mul_ps(vx, k));
+	_mm256_storeu_ps(g_particles.vz + i, _mm256_mul_ps(vz, k));
+	_mm256_storeu_ps(g_particles.vy + i, _mm256_add_ps(_mm256_mul_ps(vy, k),
+		_mm256_mul_ps(_mm256_loadu_ps(g_particles.gravity + i),
+			_mm256_set1_ps(gdt))));
+	_mm256_storeu_ps(g_particles.alpha + i, _mm256_min_ps(
+		_mm256_loadu_ps(g_particles.alpha + i),
+		_mm256_mul_ps(life, _mm256_loadu_ps(g_particles.fade + i))));
+	_mm256_storeu_ps(g_particles.depth + i, _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(x, _mm256_set1_ps(fwd->f[0])),
+		_mm256_mul_ps(y, _mm256_set1_ps(fwd->f[1]))),
+		_mm256_mul_ps(z, _mm256_set1_ps(fwd->f[2]))));
+}
+#endif
 
-		As for the constant C, we can calculate it from boundary value of v(0):
+void g_advance_particles(void) {
+	const float gdt = g_gravity.f[1] * g_frameTime;
+	int i;
+
+	// only the slots below the high-water mark need advancing; the free slots
+	// among them run through the same math, which is cheaper than masking
+	// them out, and their life just keeps going down
+#ifdef __AVX__
+	for (i = 0; i < g_particles.used; i += 8)
+		g_advance_particles8(i, g_frameTime, gdt, &g_forward);
+#else
+	for (i = 0; i < g_particles.used; i += 4)
+		g_advance_particles4(i, g_frameTime, gdt, &g_forward);
+#endif
 
-		C = -1/v(0) - q0 = -1/v(0)
+	// we need the proper Z-order
+	g_gather_particles();
+	g_sort_particles();
+}
 
-		And now we have all we need to solve the problem.
-		*/
-		C = -1.f / v;
-		switch (p->weap) {
-			case WP_M61:
-			case WP_M61_TRACER:
-				q = -0.35;
-				g = 0.5;
-				// fade the alpha away during the last second
-				if (p->life < 1.f)
-					p->alpha = p->life;
-				break;
-			case WP_L60:
-				q = -0.925;
-				g = 0.025;
-				// fade the alpha away during the last 2 seconds
-				if (p->life < 2.f)
-					p->alpha = p->life * 0.5;
-				break;
-			case WP_M102:
-				q = -0.7;
-				g = 0.02;
-				// fade the alpha away during the last 4 seconds
-				if (p->life < 4.f)
-					p->alpha = p->life * 0.25;
-				break;
-			default:
-				break;
-		}
-		// slow the smoke down
-		v = -1.f / (q * g_frameTime + C);
-		p->vel = ac_vec_mulf(tmp, v);
-		// add reduced gravity
-		tmp = ac_vec_mulf(grav, g);
-		p->vel = ac_vec_add(p->vel, tmp);
-		// draw the particle
-		r_draw_fx(p->pos, p->scale, p->alpha, p->angle);
+/// Captures the particles in between the last two simulation ticks.
+/// \param s			snapshot to capture the particles to
+/// \param lerp			fraction of the last tick to interpolate to
+static void g_capture_particles(g_snapshot_t *s, float lerp) {
+	int i, k;
+	g_sprite_t *sp;
+
+	for (i = 0; i < g_particles.numLive; i++) {
+		k = g_particles.live[i];
+		sp = &s->sprites[i];
+		sp->pos = ac_vec_set(
+			g_particles.px[k] + (g_particles.x[k] - g_particles.px[k]) * lerp,
+			g_particles.py[k] + (g_particles.y[k] - g_particles.py[k]) * lerp,
+			g_particles.pz[k] + (g_particles.z[k] - g_particles.pz[k]) * lerp,
+			0.f);
+		sp->scale = g_particles.scale[k];
+		sp->alpha = g_particles.alpha[k];
+		sp->angle = g_particles.angle[k];
 	}
+	s->numSprites = g_particles.numLive;
 }
 
 void g_explode(ac_vec4_t pos, weap_t w) {
-	size_t i, j;
-	particle_t *p;
-	ac_vec4_t dir;
+	size_t j;
+	ac_vec4_t dir, vel;
+	float scale, life, angle;
 
 	switch (w) {
 		case WP_M61:
 		case WP_M61_TRACER:
-			for (i = 0, j = 0, p = g_particles;
-				i < sizeof(g_particles) / sizeof(g_particles[0]) && j < 4;
-				i++, p++) {
-				if (p->weap != WP_NONE)
-					continue;
-				p->weap = w;
-				p->pos = pos;
-				p->alpha = 1.f;
-				p->scale = 0.2 + 0.0001 * (rand() % 4001);
-				p->life = 1.4 + 0.0001 * (rand() % 3001);
-				p->angle = 0.01 * (rand() % 628);
+			for (j = 0; j < 4 && g_particles.numFree > 0; j++) {
+				scale = 0.2 + 0.0001 * (g_rand(GR_PARTICLES) % 4001);
+				life = 1.4 + 0.0001 * (g_rand(GR_PARTICLES) % 3001);
+				angle = 0.01 * (g_rand(GR_PARTICLES) % 628);
 				dir = ac_vec_set(
-					-2000 + (rand() % 4001),
+					-2000 + (g_rand(GR_PARTICLES) % 4001),
 					10000,
-					-2000 + (rand() % 4001),
+					-2000 + (g_rand(GR_PARTICLES) % 4001),
 					0);
 				dir = ac_vec_normalize(dir);
-				p->vel = ac_vec_mulf(dir, 10.f);
-				j++;
+				vel = ac_vec_mulf(dir, 10.f);
+				g_spawn_particle(w, pos, vel, scale, life, angle);
 			}
 			break;
 		case WP_L60:
 			pos = ac_vec_add(pos, ac_vec_set(0, 2, 0, 0));
-			for (i = 0, j = 0, p = g_particles;
-				i < sizeof(g_particles) / sizeof(g_particles[0]) && j < 24;
-				i++, p++) {
-				if (p->weap != WP_NONE)
-					continue;
-				p->weap = w;
-				p->pos = pos;
-				p->alpha = 1.f;
-				p->scale = 3.5 + 0.001 * (rand() % 1001);
-				p->life = 5.75 + 0.005 * (rand() % 101);
-				p->angle = 0.01 * (rand() % 628);
+			for (j = 0; j < 24 && g_particles.numFree > 0; j++) {
+				scale = 3.5 + 0.001 * (g_rand(GR_PARTICLES) % 1001);
+				life = 5.75 + 0.005 * (g_rand(GR_PARTICLES) % 101);
+				angle = 0.01 * (g_rand(GR_PARTICLES) % 628);
 				if (j < 12)
 					dir = ac_vec_set(
-						-30000 + (rand() % 60001),
+						-30000 + (g_rand(GR_PARTICLES) % 60001),
 						90000,
-						-30000 + (rand() % 60001),
+						-30000 + (g_rand(GR_PARTICLES) % 60001),
 						0);
 				else
 					dir = ac_vec_set(
-						-50000 + (rand() % 100001),
-						rand() % 4000,
-						-50000 + (rand() % 100001),
+						-50000 + (g_rand(GR_PARTICLES) % 100001),
+						g_rand(GR_PARTICLES) % 4000,
+						-50000 + (g_rand(GR_PARTICLES) % 100001),
 						0);
 				dir = ac_vec_normalize(dir);
-				p->vel = ac_vec_mulf(dir, (float)(55 + (rand() % 75)) / 10.f);
+				vel = ac_vec_mulf(dir,
+					(float)(55 + (g_rand(GR_PARTICLES) % 75)) / 10.f);
 				if (j % 6 == 0)
-					p->vel = ac_vec_mulf(p->vel, 0.2);
+					vel = ac_vec_mulf(vel, 0.2);
 				else if (j % 6 == 1)
-					p->vel = ac_vec_mulf(p->vel, 0.4);
-				j++;
+					vel = ac_vec_mulf(vel, 0.4);
+				g_spawn_particle(w, pos, vel, scale, life, angle);
 			}
 			break;
 		case WP_M102:
 			g_expl_time = g_time;
 			pos = ac_vec_add(pos, ac_vec_set(0, 6, 0, 0));
-			for (i = 0, j = 0, p = g_particles;
-				i < sizeof(g_particles) / sizeof(g_particles[0]) && j < 36;
-				i++, p++) {
-				if (p->weap != WP_NONE)
-					continue;
-				p->weap = w;
-				p->pos = pos;
-				p->alpha = 1.f;
-				p->scale = (j % 2 == 0 ? 9.5 : 6.5) + 0.001 * (rand() % 1001);
-				p->life = 8.75 + 0.005 * (rand() % 101);
-				p->angle = 0.01 * (rand() % 628);
+			for (j = 0; j < 36 && g_particles.numFree > 0; j++) {
+				scale = (j % 2 == 0 ? 9.5 : 6.5)
+					+ 0.001 * (g_rand(GR_PARTICLES) % 1001);
+				life = 8.75 + 0.005 * (g_rand(GR_PARTICLES) % 101);
+				angle = 0.01 * (g_rand(GR_PARTICLES) % 628);
 				if (j < 18)
 					dir = ac_vec_set(
-						-30000 + (rand() % 60001),
+						-30000 + (g_rand(GR_PARTICLES) % 60001),
 						120000,
-						-30000 + (rand() % 60001),
+						-30000 + (g_rand(GR_PARTICLES) % 60001),
 						0);
 				else
 					dir = ac_vec_set(
-						-50000 + (rand() % 100001),
-						rand() % 40000,
-						-50000 + (rand() % 100001),
+						-50000 + (g_rand(GR_PARTICLES) % 100001),
+						g_rand(GR_PARTICLES) % 40000,
+						-50000 + (g_rand(GR_PARTICLES) % 100001),
 						0);
 				dir = ac_vec_normalize(dir);
-				p->vel = ac_vec_mulf(dir, (j < 18 ? 100 : 80) + (rand() % 19));
+				vel = ac_vec_mulf(dir,
+					(j < 18 ? 100 : 80) + (g_rand(GR_PARTICLES) % 19));
 				if (j % 3 == 0)
-					p->vel = ac_vec_mulf(p->vel, 0.35);
-				j++;
+					vel = ac_vec_mulf(vel, 0.35);
+				g_spawn_particle(w, pos, vel, scale, life, angle);
 			}
 			break;
 		default:
@@ -331,97 +631,263 @@ void g_explode(ac_vec4_t pos, weap_t w) {
 	}
 }
 
+/// Doubles the capacity of the projectile pool.
+/// \return false if the pool is at its limit
+static bool g_grow_projectiles(void) {
+	const int n = g_max_projs * 2;
+	projectile_t *p;
+	g_ray_t *r;
+	g_trace_t *t;
+
+	if (g_max_projs >= MAX_PROJECTILES)
+		return false;
+	// the capacity only goes up once all of the arrays have grown
+	if (!(p = realloc(g_projs, sizeof(*p) * n)))
+		return false;
+	g_projs = p;
+	if (!(r = realloc(g_proj_rays, sizeof(*r) * n)))
+		return false;
+	g_proj_rays = r;
+	if (!(t = realloc(g_proj_traces, sizeof(*t) * n)))
+		return false;
+	g_proj_traces = t;
+	g_max_projs = n;
+	return true;
+}
+
+/// Takes a projectile out of the pool, growing it if needed.
+/// \return the new projectile, or NULL if the pool is at its limit
+static projectile_t *g_alloc_projectile(void) {
+	projectile_t *p;
+
+	if (g_num_projs >= g_max_projs && !g_grow_projectiles()) {
+		g_dropped_projs++;
+		return NULL;
+	}
+	p = &g_projs[g_num_projs++];
+	if (g_num_projs > g_peak_projs)
+		g_peak_projs = g_num_projs;
+	return p;
+}
+
+/// Returns a projectile to the pool by moving the last one in its place.
+static void g_free_projectile(int i) {
+	g_projs[i] = g_projs[--g_num_projs];
+	g_proj_rays[i] = g_proj_rays[g_num_projs];
+	g_proj_traces[i] = g_proj_traces[g_num_projs];
+}
+
+/// Sets a round off: spawns the smoke and deals the splash damage.
+static void g_detonate(ac_vec4_t pos, weap_t w) {
+	g_explode(pos, w);
+	switch (w) {
+		case WP_M61:
+		case WP_M61_TRACER:
+			g_fmb_splash(pos, WEAP_SPLASH_M61, WEAP_DAMAGE_M61);
+			break;
+		case WP_L60:
+			g_fmb_splash(pos, WEAP_SPLASH_L60, WEAP_DAMAGE_L60);
+			// the craters slow the troops down
+			g_nav_add_cost(pos.f[0], pos.f[2], WEAP_CRATER_L60,
+				WEAP_CRATER_COST);
+			break;
+		case WP_M102:
+			g_fmb_splash(pos, WEAP_SPLASH_M102, WEAP_DAMAGE_M102);
+			g_nav_add_cost(pos.f[0], pos.f[2], WEAP_CRATER_M102,
+				WEAP_CRATER_COST);
+			break;
+		default:	// shut up compiler
+			break;
+	}
+}
+
 void g_advance_projectiles(void) {
-	size_t i;
+	int i;
 	ac_vec4_t grav = ac_vec_mul(g_gravity, g_frameTimeVec);
-	ac_vec4_t npos, ip;
-	ac_vec4_t ofs = ac_vec_set(HEIGHTMAP_SIZE / 2, 0, HEIGHTMAP_SIZE / 2, 0);
-	float h;
-
-	for (i = 0; i < sizeof(g_projs) / sizeof(g_projs[0]); i++) {
-		if (g_projs[i].weap == WP_NONE)
-			continue;
+	ac_vec4_t npos;
+	ac_vec4_t ofs = ac_vec_set(gen_heightmap_size / 2, 0,
+		gen_heightmap_size / 2, 0);
+	float frac;
+	bool troop;
+	g_trace_t *trace;
+	projectile_t *p;
+
+	// spent projectiles are replaced with the last one, which still needs to
+	// be advanced, so only move on if the current one is still in flight
+	for (i = 0; i < g_num_projs;) {
+		p = &g_projs[i];
 		// find the new position
-		npos = ac_vec_mul(g_projs[i].vel, g_frameTimeVec);
-		npos = ac_vec_add(g_projs[i].pos, npos);
+		npos = ac_vec_mul(p->vel, g_frameTimeVec);
+		npos = ac_vec_add(p->pos, npos);
 		npos = ac_vec_add(ofs, npos);
 		// see if we haven't gone off the map
 		if (npos.f[0] < 0 || npos.f[2] < 0
-			|| npos.f[0] > HEIGHTMAP_SIZE - 1
-			|| npos.f[2] > HEIGHTMAP_SIZE - 1) {
-			//printf("OUT! %d\n", (int)g_projs[i].weap);
-			g_projs[i].weap = WP_NONE;
+			|| npos.f[0] > gen_heightmap_size - 1
+			|| npos.f[2] > gen_heightmap_size - 1) {
+			//printf("OUT! %d\n", (int)p->weap);
+			g_free_projectile(i);
 			continue;
 		}
-		// terrain collision detection
-		h = g_sample_height(npos.f[0], npos.f[2]);
-		if (npos.f[1] < h) {
-			// find the impact point
-			ip = g_collide(ac_vec_add(ofs, g_projs[i].pos), npos);
-			//printf("HIT! %f %f %f\n", ip.f[0], ip.f[1], ip.f[2]);
-			g_explode(ac_vec_sub(ip, ofs), g_projs[i].weap);
-			g_projs[i].weap = WP_NONE;
+		g_proj_rays[i].p1 = ac_vec_add(ofs, p->pos);
+		g_proj_rays[i].p2 = npos;
+		i++;
+	}
+
+	// trace the whole way covered in this tick, so that the fast rounds
+	// don't fly through the ridges; the rounds of a burst fly side by side,
+	// so they are traced all together
+	if (!g_collide_batch(g_proj_rays, g_num_projs, g_proj_traces)) {
+		for (i = 0; i < g_num_projs; i++)
+			g_collide(g_proj_rays[i].p1, g_proj_rays[i].p2,
+				&g_proj_traces[i]);
+	}
+
+	for (i = 0; i < g_num_projs;) {
+		p = &g_projs[i];
+		p->prev = p->pos;
+		npos = ac_vec_sub(g_proj_rays[i].p2, ofs);
+		trace = &g_proj_traces[i];
+		// hit whatever comes first - the terrain, the props or the troops
+		troop = g_fmb_hit(p->pos, npos, &frac) >= 0 && frac <= trace->frac;
+		if (troop || trace->type != HIT_NOTHING) {
+			if (!troop)
+				frac = trace->frac;
+			g_detonate(ac_vec_ma(ac_vec_sub(npos, p->pos),
+				ac_vec_setall(frac), p->pos), p->weap);
+			g_free_projectile(i);
+			continue;
 		}
-		g_projs[i].pos = ac_vec_sub(npos, ofs);
-		// draw tracers
-		switch (g_projs[i].weap) {
+		p->pos = npos;
+		switch (p->weap) {
 			case WP_M61_TRACER:
-				r_draw_tracer(g_projs[i].pos,
-					ac_vec_normalize(g_projs[i].vel), 3.f);
-			case WP_M61:	// intentional fall-through!
+			case WP_M61:
 				// add full gravity
-				g_projs[i].vel = ac_vec_add(g_projs[i].vel, grav);
+				p->vel = ac_vec_add(p->vel, grav);
 				break;
 			case WP_L60:
-				r_draw_tracer(g_projs[i].pos,
-					ac_vec_normalize(g_projs[i].vel), 5.f);
 				// add reduced gravity
-				g_projs[i].vel = ac_vec_add(g_projs[i].vel,
-					ac_vec_mulf(grav, 0.5));
+				p->vel = ac_vec_add(p->vel, ac_vec_mulf(grav, 0.5));
 				break;
 			case WP_M102:
 				// add reduced gravity
-				g_projs[i].vel = ac_vec_add(g_projs[i].vel,
-					ac_vec_mulf(grav, 0.3));
+				p->vel = ac_vec_add(p->vel, ac_vec_mulf(grav, 0.3));
 				break;
 			default:	// shut up compiler
 				break;
 		}
+		i++;
+	}
+}
+
+/// Captures the tracers in between the last two simulation ticks.
+/// \param s			snapshot to capture the tracers to
+/// \param lerp			fraction of the last tick to interpolate to
+static void g_capture_projectiles(g_snapshot_t *s, float lerp) {
+	int i;
+	float len;
+	g_tracer_t *t;
+	projectile_t *p;
+
+	// the tracer array follows the size of the projectile pool
+	if (s->maxTracers < g_max_projs) {
+		if (!(t = realloc(s->tracers, sizeof(*t) * g_max_projs))) {
+			s->numTracers = 0;
+			return;
+		}
+		s->tracers = t;
+		s->maxTracers = g_max_projs;
+	}
+
+	for (i = 0, s->numTracers = 0; i < g_num_projs; i++) {
+		p = &g_projs[i];
+		switch (p->weap) {
+			case WP_M61_TRACER:
+				len = 3.f;
+				break;
+			case WP_L60:
+				len = 5.f;
+				break;
+			default:	// no tracer
+				continue;
+		}
+		t = &s->tracers[s->numTracers++];
+		t->pos = ac_vec_ma(ac_vec_sub(p->pos, p->prev), ac_vec_setall(lerp),
+			p->prev);
+		t->dir = ac_vec_normalize(p->vel);
+		t->scale = len;
 	}
 }
 
 void g_fire_weapon(weap_t w) {
-	size_t i;
 	static int m61 = 0;
+	projectile_t *p;
 	//printf("FIRE! %d\n", (int)w);
-	// find a free projectile slot
-	for (i = 0; i < sizeof(g_projs) / sizeof(g_projs[0]); i++) {
-		if (g_projs[i].weap == WP_NONE) {
-			g_projs[i].weap = w;
-			g_projs[i].pos = g_viewpoint.origin;
-			//g_projs[i].pos.f[1] += 0.5;
-			switch (w) {
-				case WP_M61:
-					// tracer round every 5 rounds
-					if (++m61 % 5 == 0)
-						g_projs[i].weap = WP_M61_TRACER;
-					g_projs[i].vel = ac_vec_mulf(g_forward, WEAP_MUZZVEL_M61);
-					break;
-				case WP_L60:
-					g_projs[i].vel = ac_vec_mulf(g_forward, WEAP_MUZZVEL_L60);
-					break;
-				case WP_M102:
-					g_projs[i].vel = ac_vec_mulf(g_forward, WEAP_MUZZVEL_M102);
-					g_shake_time = g_time;
-					break;
-				// shut up compiler
-				case WP_NONE:
-				case WP_M61_TRACER:
-					break;
-			}
-			return;
-		}
+	if (!(p = g_alloc_projectile()))
+		return;
+	p->weap = w;
+	p->pos = g_viewpoint.origin;
+	//p->pos.f[1] += 0.5;
+	p->prev = p->pos;
+	switch (w) {
+		case WP_M61:
+			// tracer round every 5 rounds
+			if (++m61 % 5 == 0)
+				p->weap = WP_M61_TRACER;
+			p->vel = ac_vec_mulf(g_forward, WEAP_MUZZVEL_M61);
+			break;
+		case WP_L60:
+			p->vel = ac_vec_mulf(g_forward, WEAP_MUZZVEL_L60);
+			break;
+		case WP_M102:
+			p->vel = ac_vec_mulf(g_forward, WEAP_MUZZVEL_M102);
+			g_shake_time = g_time;
+			break;
+		// shut up compiler
+		case WP_NONE:
+		case WP_M61_TRACER:
+			break;
+	}
+}
+
+void g_projectile_stats(ac_pool_stats_t *stats) {
+	stats->live = g_num_projs;
+	stats->capacity = g_max_projs;
+	stats->peak = g_peak_projs;
+	stats->drops = g_dropped_projs;
+}
+
+/// Folds a block of memory into an FNV-1a hash.
+static uint g_hash_bytes(uint h, const void *p, size_t size) {
+	const uchar *b = p;
+
+	while (size--)
+		h = (h ^ *b++) * 16777619u;
+	return h;
+}
+
+uint g_state_hash(void) {
+	uint h = 2166136261u;
+	int i;
+
+	h = g_hash_bytes(h, &g_sim_time, sizeof(g_sim_time));
+	h = g_hash_bytes(h, &g_viewpoint.origin, sizeof(g_viewpoint.origin));
+	h = g_hash_bytes(h, g_viewpoint.angles, sizeof(g_viewpoint.angles));
+	h = g_hash_bytes(h, &g_weapon, sizeof(g_weapon));
+	h = g_hash_bytes(h, &g_paused, sizeof(g_paused));
+	for (i = 0; i < g_num_projs; i++) {
+		h = g_hash_bytes(h, &g_projs[i].pos, sizeof(g_projs[i].pos));
+		h = g_hash_bytes(h, &g_projs[i].weap, sizeof(g_projs[i].weap));
 	}
+	h = g_hash_bytes(h, &g_particles.numLive, sizeof(g_particles.numLive));
+	h = g_hash_bytes(h, g_troops.x, sizeof(*g_troops.x) * g_troops.num);
+	h = g_hash_bytes(h, g_troops.z, sizeof(*g_troops.z) * g_troops.num);
+	h = g_hash_bytes(h, g_troops.health,
+		sizeof(*g_troops.health) * g_troops.num);
+	return h;
+}
+
+uint g_sim_ticks(void) {
+	return g_sim_count;
 }
 
 void g_player_think(ac_input_t *in) {
@@ -438,6 +904,9 @@ void g_player_think(ac_input_t *in) {
 		} else if (!(in->flags & INPUT_PAUSE))
 			pausepressed = false;
 	} else {
+		// don't let the M61 rounds pile up while the trigger is released
+		if (m61 > WEAP_FIREDELAY_M61)
+			m61 = WEAP_FIREDELAY_M61;
 		m61 += g_frameTime;
 		l60 += g_frameTime;
 		m102 += g_frameTime;
@@ -447,19 +916,11 @@ void g_player_think(ac_input_t *in) {
 			// fire if the gun's cooled down already
 			switch (g_weapon) {
 				case WP_M61:
-					// this gun needs special handling - it fires at 6000 rpm, so
-					// make sure we get all the rounds out even if the FPS stutters
-					{
-						float ft = g_frameTime;
-						while (ft >= WEAP_FIREDELAY_M61) {
-							g_fire_weapon(g_weapon);
-							ft -= WEAP_FIREDELAY_M61;
-						}
-						m61 += ft;
-						if (m61 >= WEAP_FIREDELAY_M61) {
-							m61 = 0;
-							g_fire_weapon(g_weapon);
-						}
+					// this gun needs special handling - it fires at 6000 rpm,
+					// which may well be more than one round per tick
+					while (m61 >= WEAP_FIREDELAY_M61) {
+						m61 -= WEAP_FIREDELAY_M61;
+						g_fire_weapon(g_weapon);
 					}
 					break;
 				case WP_L60:
@@ -598,13 +1059,12 @@ static const float g_reticle_M61[][2] = {
 	{0.67, 0.67},	{0.63, 0.67}
 };
 
-void g_drawHUD(float neg) {
+void g_drawHUD(g_snapshot_t *s) {
 	char buf[64];
-	ac_vec4_t p1, p2;
 
 	// static elements of the HUD
 	// different weapons have different reticles
-	switch (g_weapon) {
+	switch (s->weapon) {
 		case WP_M61:
 			r_draw_lines((float (*)[2])g_reticle_M61,
 				sizeof(g_reticle_M61) / sizeof(g_reticle_M61[0]), 3.f);
@@ -632,12 +1092,6 @@ void g_drawHUD(float neg) {
 		"BORE", 0, 0, 0.6);
 
 	// dynamic elements
-	// find the distance to the point we're looking at
-	p1 = ac_vec_add(g_viewpoint.origin,
-		ac_vec_set(HEIGHTMAP_SIZE / 2, 0, HEIGHTMAP_SIZE / 2, 0));
-	p2 = ac_vec_ma(g_forward, ac_vec_setall(800), p1);
-	p2 = g_collide(p1, p2);
-	p1 = ac_vec_sub(p2, p1);
 	sprintf(buf, "T\n"
 		"G\n"
 		"T\n"
@@ -650,7 +1104,7 @@ void g_drawHUD(float neg) {
 		"T\n"
 		"%s N\n"
 		"SCORE %08d TARG DIST %-4.0f",
-		neg > 0.5 ? "BHOT" : "WHOT", 0, ac_vec_length(p1));
+		s->neg > 0.5 ? "BHOT" : "WHOT", 0, s->targDist);
 	r_draw_string(buf, -1, 0, 0.6);
 }
 
@@ -673,17 +1127,52 @@ void g_draw_instructions(void) {
 		"marked by a flashing IR strobe!", 0.02, 0.56, 0.55);
 }
 
-#define TOTAL_TICKS	6410.f
-void g_loading_tick() {
+void g_loading_tick(void) {
+	ac_atomic_add(&g_load_ticks, 1);
+}
+
+/// Hands the generated resources over to the renderer as they become ready,
+/// a piece per frame, and draws the loading screen.
+static void g_load_frame(void) {
+	static bool hmapSet = false;
 	static char buf[32];
 	static float pts[][2] = {
 		{0.25, 0.97}, {0.25, 0.97}
 	};
-	static int counter = 0;
-	counter++;
-	// don't need update the screen every damn tick
-	if (counter % 100 != 1)
-		return;
+	float progress;
+
+	if (g_load_uploaded < ac_atomic_get(&g_load_stages)) {
+		switch (g_load_uploaded) {
+			case LS_PROPS:
+				r_set_props(g_load_res.propTex, g_load_res.propVerts,
+					g_load_res.propIndices);
+				g_load_uploaded++;
+				break;
+			case LS_FX:
+				r_set_fx(g_load_res.fxTex, g_load_res.fxVerts,
+					g_load_res.fxIndices);
+				g_load_uploaded++;
+				break;
+			case LS_TERRAIN:
+				// large heightmaps take several frames
+				if (!hmapSet) {
+					r_set_heightmap();
+					hmapSet = true;
+				}
+				if (r_upload_heightmap())
+					g_load_uploaded++;
+				break;
+			default:
+				g_load_uploaded++;
+				break;
+		}
+	}
+
+	progress = g_load_total_ticks > 0
+		? (float)ac_atomic_get(&g_load_ticks) / g_load_total_ticks : 1.f;
+	if (progress > 1.f)
+		progress = 1.f;
+
 	r_start_scene(0, NULL);
 	r_finish_fx();
 	r_finish_3D();
@@ -691,22 +1180,27 @@ void g_loading_tick() {
 	// draw the instructions
 	g_draw_instructions();
 	// draw the progress bar
-	pts[1][0] = 0.25 + 0.5 * (float)counter / TOTAL_TICKS;
+	pts[1][0] = 0.25 + 0.5 * progress;
 	r_draw_lines(pts, 2, 12.f);
 	// draw percentage
-	sprintf(buf, "LOADING - %.0f%%", (float)counter / TOTAL_TICKS * 100.f);
+	sprintf(buf, "LOADING - %.0f%%", progress * 100.f);
 	r_draw_string(buf, 0.25, 0.87, 1.0);
 	r_draw_string("(C) 2010, Leszek Godlewski - www.inequation.org",
 		-0.995, 0.005, 0.3);
 
 	r_finish_2D();
 	r_composite(0.f, 0.f);
+
+	if (g_load_uploaded == LS_NUM_STAGES && g_load_thread) {
+		ac_thread_join(g_load_thread);
+		g_load_thread = NULL;
+	}
 }
 
 #define FLOATING_RADIUS		200.f
 #define TIME_SCALE			-0.04
 #define MOUSE_SCALE			0.001
-void g_viewpoint_think(ac_input_t *input) {
+void g_viewpoint_think(ac_input_t *input, float frameTime) {
 	float plane_angle = g_time * TIME_SCALE;
 	float fy, fp;
 	ac_vec4_t tmp;
@@ -732,7 +1226,7 @@ void g_viewpoint_think(ac_input_t *input) {
 	// handle viewpoint movement
 	if (!g_paused) {
 		g_viewpoint.angles[0] -= ((float)input->deltaX) * MOUSE_SCALE * fy
-			+ g_frameTime * TIME_SCALE;	// keep the cam in sync with the plane
+			+ frameTime * TIME_SCALE;	// keep the cam in sync with the plane
 		g_viewpoint.angles[1] -= ((float)input->deltaY) * MOUSE_SCALE * fy;
 	}
 #if 1
@@ -760,28 +1254,45 @@ void g_viewpoint_think(ac_input_t *input) {
 
 	// calculate firing axis
 	// apply bullet spread (~0,45 of a degree)
-	fy = g_viewpoint.angles[0] - 0.004 + 0.001 * (rand() % 9);
-	fp = g_viewpoint.angles[1] - 0.004 + 0.001 * (rand() % 9);
+	fy = g_viewpoint.angles[0] - 0.004 + 0.001 * (g_rand(GR_SPREAD) % 9);
+	fp = g_viewpoint.angles[1] - 0.004 + 0.001 * (g_rand(GR_SPREAD) % 9);
 	g_forward = ac_vec_set(
 		-cosf(fp) * sinf(fy), sinf(fp), -cosf(fp) * cosf(fy), 0);
 }
 
-void g_frame(int ticks, float frameTime, ac_input_t *input) {
-	static int gameTicks = 0;
-	static int lastTicks = 0;
+bool g_loading(void) {
+	return g_load_uploaded < LS_NUM_STAGES;
+}
+
+/// Maximum amount of time simulated in a single frame, in seconds. If the
+/// frames take longer than that, the game slows down instead of taking ever
+/// more ticks to catch up.
+#define MAX_FRAME_LAG		0.25
+
+/// Advances the simulation by a single tick of \ref g_frameTime seconds.
+static void g_tick(ac_input_t *input) {
+	// operate the weapons
+	g_player_think(input);
+	// advance the non-player elements of the world
+	g_advance_projectiles();
+	g_advance_particles();
+	g_fmb_advance(g_viewpoint.origin, g_frameTime);
+}
+
+/// Captures the state of the world at the interpolated frame time.
+/// \param s			snapshot to capture the world to
+/// \param lerp			fraction of the last tick to interpolate to
+static void g_capture(g_snapshot_t *s, float lerp) {
 	static float neg = 0.f;
-	float expld;
-	ac_viewpoint_t vp;
+	float shake;
+	ac_vec4_t p1, p2;
+	ac_footmobile_t *fmb;
 
-	// don't advance the clocks if paused
-	if (!g_paused) {
-		gameTicks += ticks - lastTicks;
-		g_frameTime = frameTime;
-	} else
-		g_frameTime = 0.f;
-	lastTicks = ticks;
-	g_frameTimeVec = ac_vec_setall(g_frameTime);
-	g_time = (float)gameTicks * 0.001;
+	s->valid = true;
+	s->ticks = g_game_ticks;
+	s->paused = g_paused;
+	s->started = g_game_ticks != 0;
+	s->weapon = g_weapon;
 
 	// handle effects - inversion and contrast enhancement
 	// negative time means positive->negative transition
@@ -794,59 +1305,157 @@ void g_frame(int ticks, float frameTime, ac_input_t *input) {
 		if (neg < 0.f)
 			neg = 0.f;
 	}
+	s->neg = neg;
 	if (g_time - g_expl_time <= EXPLOSION_TIME) {
-		expld = EXPLOSION_TIME
+		s->expld = EXPLOSION_TIME
 			* (1.f - (g_time - g_expl_time) / EXPLOSION_TIME);
-		if (expld > 1.f)
-			expld = 1.f;
+		if (s->expld > 1.f)
+			s->expld = 1.f;
 	} else
-		expld = 0.f;
-
-	// advance the viewpoint
-	g_viewpoint_think(input);
-
-	// operate the weapons
-	g_player_think(input);
+		s->expld = 0.f;
 
 	// generate another viewpoint for gun shakes
+	memcpy(&s->vp, &g_viewpoint, sizeof(s->vp));
 	if (g_time - g_shake_time <= SHAKE_TIME) {
-		float lerp = expf(-4 * (g_time - g_shake_time) / SHAKE_TIME);
-		memcpy(&vp, &g_viewpoint, sizeof(vp));
-		vp.angles[0] += (-0.018 + 0.000036 * (rand() % 1001)) * lerp;
-		vp.angles[1] += (-0.018 + 0.000036 * (rand() % 1001)) * lerp;
-		r_start_scene(gameTicks, &vp);
-	} else
-		r_start_scene(gameTicks, &g_viewpoint);
+		shake = expf(-4 * (g_time - g_shake_time) / SHAKE_TIME);
+		s->vp.angles[0] += (-0.018 + 0.000036 * (g_rand(GR_SHAKE) % 1001))
+			* shake;
+		s->vp.angles[1] += (-0.018 + 0.000036 * (g_rand(GR_SHAKE) % 1001))
+			* shake;
+	}
+
+	// find the distance to the point we're looking at
+	p1 = ac_vec_add(g_viewpoint.origin,
+		ac_vec_set(gen_heightmap_size / 2, 0,
+			gen_heightmap_size / 2, 0));
+	p2 = ac_vec_ma(g_forward, ac_vec_setall(800), p1);
+	p2 = g_collide(p1, p2, NULL);
+	s->targDist = ac_vec_length(ac_vec_sub(p2, p1));
+
+	// the troop array follows the number of troops
+	if (s->maxTroops < g_troops.num) {
+		if ((fmb = realloc(s->troops, sizeof(*fmb) * g_troops.num))) {
+			s->troops = fmb;
+			s->maxTroops = g_troops.num;
+		}
+	}
+	s->numTroops = s->maxTroops >= g_troops.num ? g_fmb_capture(s->troops) : 0;
+
+	g_capture_projectiles(s, lerp);
+	g_capture_particles(s, lerp);
+}
+
+/// Simulation job; runs the ticks due in the current frame and captures the
+/// result into the back snapshot.
+static void g_simulate(void *arg, int first, int last) {
+	ac_input_t *input = arg;
+	const float tick = 1.f / g_tick_rate;
+	const int maxTicks = MAX_FRAME_LAG * g_tick_rate;
+	int n;
+
+	g_frameTime = tick;
+	g_frameTimeVec = ac_vec_setall(g_frameTime);
+	if (g_paused) {
+		// only looks for the unpause key
+		g_player_think(input);
+		if (!g_game_ticks && input->flags & INPUT_MOUSE_LEFT)
+			g_paused = false;
+	}
+	for (n = 0; g_sim_accum >= tick && !g_paused; n++) {
+		if (n == maxTicks) {
+			// too far behind, give up on the rest
+			g_sim_accum = 0.f;
+			break;
+		}
+		// stamp the events with the start of the tick, so that they never
+		// happen after the interpolated frame time
+		g_time = g_sim_time;
+		g_sim_time += tick;
+		g_sim_accum -= tick;
+		g_sim_count++;
+		g_tick(input);
+	}
+	g_time = g_sim_time + g_sim_accum - tick;
+
+	g_capture(&g_snapshots[!g_cur_snapshot], g_sim_accum / tick);
+}
+
+/// Draws a snapshot of the world. Only touches the snapshot, so that it can
+/// run while the simulation is already working on the next one.
+static void g_draw_snapshot(g_snapshot_t *s) {
+	int i;
+
+	r_start_scene(s->ticks, &s->vp);
 
-	// advance the non-player elements of the world
-	// draw a test footmobile
-	static ac_footmobile_t fmb;
-	float xpos = 20.f * sinf(g_time * 0.13);
-	fmb.pos = ac_vec_set(xpos, g_sample_height(512 + xpos, 512), 0, 0);
-	fmb.ang = g_time * 0.5;
-	fmb.stance = STANCE_STAND;
 	r_start_footmobiles();
-	r_draw_squad(&fmb, 1);
+	r_draw_squad(s->troops, s->numTroops);
 	r_finish_footmobiles();
-	g_advance_projectiles();
+	for (i = 0; i < s->numTracers; i++)
+		r_draw_tracer(s->tracers[i].pos, s->tracers[i].dir,
+			s->tracers[i].scale);
 	r_start_fx();
-	g_advance_particles();
+	for (i = 0; i < s->numSprites; i++)
+		r_draw_fx(s->sprites[i].pos, s->sprites[i].scale,
+			s->sprites[i].alpha, s->sprites[i].angle);
 	r_finish_fx();
 
 	r_finish_3D();
-	if (!g_paused)
-		g_drawHUD(neg);
+	if (!s->paused)
+		g_drawHUD(s);
 	else {
 		g_draw_instructions();
-		if (gameTicks == 0) {
+		if (!s->started)
 			r_draw_string("PRESS FIRE TO START", 0.125, 0.87,
 				1.0);
-			if (input->flags & INPUT_MOUSE_LEFT)
-				g_paused = false;
-		} else
+		else
 			r_draw_string("GAME PAUSED", 0.27, 0.87, 1.0);
 	}
 	r_finish_2D();
 
-	r_composite(neg, expld);
+	r_composite(s->neg, s->expld);
+}
+
+void g_frame(int ticks, float frameTime, ac_input_t *input) {
+	static int lastTicks = 0;
+	static ac_input_t simInput;
+	const float tick = 1.f / g_tick_rate;
+	ac_task_t *task;
+
+	// keep showing the loading screen until the world is in place
+	if (g_loading()) {
+		g_load_frame();
+		return;
+	}
+
+	// don't advance the clocks if paused
+	if (!g_paused) {
+		g_game_ticks += ticks - lastTicks;
+		g_sim_accum += frameTime;
+	} else
+		frameTime = 0.f;
+	lastTicks = ticks;
+	// the frame shows the world in between the last two ticks, so it lags a
+	// tick behind; this doesn't depend on the number of ticks run
+	g_time = g_sim_time + g_sim_accum - tick;
+
+	// advance the viewpoint at the frame rate, so that it follows the mouse
+	// smoothly
+	g_viewpoint_think(input, frameTime);
+	// have the terrain around it streamed in
+	gen_tiles_update(g_viewpoint.origin);
+
+	// simulate this frame on a worker thread while drawing the previous one;
+	// the very first frame has nothing to draw yet, so it waits; it's needed
+	// by the end of the frame, so it goes ahead of the terrain tiles
+	simInput = *input;
+	task = ac_thread_async_urgent(g_simulate, &simInput, 1, 1);
+	if (!g_snapshots[g_cur_snapshot].valid) {
+		ac_thread_wait(task);
+		g_cur_snapshot = !g_cur_snapshot;
+		g_draw_snapshot(&g_snapshots[g_cur_snapshot]);
+		return;
+	}
+	g_draw_snapshot(&g_snapshots[g_cur_snapshot]);
+	ac_thread_wait(task);
+	g_cur_snapshot = !g_cur_snapshot;
 }
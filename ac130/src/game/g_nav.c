@@ -0,0 +1,852 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Navigation module; ground troop pathfinding over the terrain
+
+#include "g_local.h"
+#include "../ac_thread.h"
+
+/// log2 of the navigation cell size in metres (heightmap texels).
+#define NAV_CELL_SHIFT		2
+/// Navigation cell size in metres.
+#define NAV_CELL			(1 << NAV_CELL_SHIFT)
+/// log2 of the cluster size in cells.
+#define NAV_CLUSTER_SHIFT	4
+/// Cluster size in cells; a cluster is also a flow field tile.
+#define NAV_CLUSTER			(1 << NAV_CLUSTER_SHIFT)
+/// Flow field tile size with the ring of cells around it.
+#define NAV_TILE_SPAN		(NAV_CLUSTER + 2)
+/// Steepest walkable slope (rise over run).
+#define NAV_MAX_SLOPE		1.f
+/// Cost of walking a cell on the steepest walkable slope; flat ground is 1.
+#define NAV_SLOPE_COST		8
+/// Cost added to the cells with trees in them.
+#define NAV_TREE_COST		2
+/// Highest cell cost.
+#define NAV_MAX_COST		15
+/// Maximum number of flow fields kept at once.
+#define NAV_MAX_FIELDS		256
+/// Coarse graph nodes integrated per tick, i.e. the flow field budget.
+#define NAV_COARSE_BUDGET	65536
+/// Flow field tiles computed per tick.
+#define NAV_TILE_BUDGET		64
+/// Integration value of the nodes with no path to the destination.
+#define NAV_UNREACHABLE		0xFFFFFFFFu
+/// Direction of the nodes with nowhere to go.
+#define NAV_DIR_NONE		8
+
+/// Flow field and tile states.
+typedef enum {
+	NS_EMPTY,		///< not requested
+	NS_PENDING,		///< queued for computation
+	NS_BATCHED,		///< being computed in this tick's batch
+	NS_READY		///< computed
+} g_nav_state_t;
+
+/// Flow directions of a single cluster, for a single destination.
+typedef struct {
+	uchar	state;		///< \ref g_nav_state_t value
+	uint	version;	///< cluster version the directions were computed for
+	uchar	dir[NAV_CLUSTER * NAV_CLUSTER];	///< flow direction of each cell
+} g_nav_tile_t;
+
+/// Flow field towards a single cluster. The coarse integration over the
+/// clusters is computed as a whole, the cell directions are computed lazily,
+/// one cluster tile at a time, only where there are troops to follow them.
+typedef struct {
+	int				dest;		///< destination cluster; -1 if the slot is free
+	uchar			state;		///< \ref g_nav_state_t value
+	uint			version;	///< coarse graph version of the integration
+	uint			lastUsed;	///< tick of the last request
+	uint			*dist;		///< coarse integration value of each cluster
+	uchar			*next;		///< direction to the next cluster on the way
+	g_nav_tile_t	**tiles;	///< flow field tile of each cluster
+} g_nav_field_t;
+
+/// Queued flow field tile computation.
+typedef struct {
+	int		field;
+	int		cluster;
+} g_nav_req_t;
+
+/// Binary heap node used by the integrations.
+typedef struct {
+	uint	dist;
+	int		node;
+} g_nav_heap_t;
+
+static const int	g_nav_dx[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+static const int	g_nav_dz[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+
+static int			g_nav_size = 0;			///< cells per side
+static int			g_nav_csize = 0;		///< clusters per side
+static uchar		*g_nav_cost = NULL;		///< cost of each cell; 0 if blocked
+static uint			*g_nav_ccost = NULL;	///< mean cell cost of each cluster,
+											///  in 1/16ths
+static uchar		*g_nav_edges = NULL;	///< bit mask of the directions in
+											///  which each cluster is linked
+static int			*g_nav_waypoint = NULL;	///< destination cell of each
+											///  cluster; -1 if blocked
+static uint			*g_nav_version = NULL;	///< version of each cluster
+static short		*g_nav_field_of = NULL;	///< field slot of each cluster
+static uint			g_nav_coarse_version = 0;
+static uint			g_nav_tick = 0;
+
+static g_nav_field_t	g_nav_fields[NAV_MAX_FIELDS];
+static g_nav_req_t		*g_nav_queue = NULL;
+static int				g_nav_queued = 0;
+static int				g_nav_max_queued = 0;
+
+/// \return true if the cell exists and can be walked on
+static inline bool g_nav_open(int x, int z) {
+	return x >= 0 && z >= 0 && x < g_nav_size && z < g_nav_size
+		&& g_nav_cost[z * g_nav_size + x];
+}
+
+/// \return cost of a single step in the given direction onto a cell of the
+/// given cost
+static inline uint g_nav_step(int dir, int cost) {
+	return (dir & 1 ? 14 : 10) * cost;
+}
+
+static void g_nav_heap_push(g_nav_heap_t *heap, int *n, uint dist, int node) {
+	int i = (*n)++, p;
+
+	for (; i > 0 && heap[p = (i - 1) / 2].dist > dist; i = p)
+		heap[i] = heap[p];
+	heap[i].dist = dist;
+	heap[i].node = node;
+}
+
+static g_nav_heap_t g_nav_heap_pop(g_nav_heap_t *heap, int *n) {
+	g_nav_heap_t top = heap[0], last = heap[--(*n)];
+	int i = 0, c;
+
+	for (; (c = i * 2 + 1) < *n; i = c) {
+		if (c + 1 < *n && heap[c + 1].dist < heap[c].dist)
+			c++;
+		if (heap[c].dist >= last.dist)
+			break;
+		heap[i] = heap[c];
+	}
+	heap[i] = last;
+	return top;
+}
+
+/// Set by \ref g_nav_slope_job if it runs out of memory.
+static volatile int	g_nav_slope_oom;
+
+/// Computes the slope costs of a row of cells. Streamed worlds have no
+/// heightmap, so the texel rows spanned by each row of cells are evaluated
+/// right here, one row of cells at a time.
+static void g_nav_slope_job(void *unused, int first, int last) {
+	const int hs = gen_heightmap_size;
+	const uchar *rows;
+	uchar *buf = NULL;
+	int x, z, tx, tz, lo, hi, h;
+	float slope;
+	uchar *c;
+
+	if (!gen_heightmap && !(buf = malloc((size_t)hs * (NAV_CELL + 1)))) {
+		ac_atomic_add(&g_nav_slope_oom, 1);
+		return;
+	}
+	for (z = first; z < last; z++) {
+		if (buf) {
+			// the last row of the previous row of cells is the first of this
+			if (z > first)
+				memcpy(buf, buf + (size_t)NAV_CELL * hs, hs);
+			for (tz = z > first ? 1 : 0; tz <= NAV_CELL
+				&& (z << NAV_CELL_SHIFT) + tz < hs; tz++)
+				gen_terrain_texels(buf + (size_t)tz * hs, 0,
+					(z << NAV_CELL_SHIFT) + tz, hs);
+			rows = buf;
+		} else
+			rows = gen_heightmap + ((size_t)z << NAV_CELL_SHIFT) * hs;
+		c = g_nav_cost + z * g_nav_size;
+		for (x = 0; x < g_nav_size; x++, c++) {
+			// the troops are kept off the edge of the map
+			if (!x || !z || x == g_nav_size - 1 || z == g_nav_size - 1) {
+				*c = 0;
+				continue;
+			}
+			lo = 255;
+			hi = 0;
+			for (tz = 0; tz <= ac_min(NAV_CELL,
+				hs - 1 - (z << NAV_CELL_SHIFT)); tz++) {
+				for (tx = x << NAV_CELL_SHIFT;
+					tx <= ac_min(hs - 1, (x + 1) << NAV_CELL_SHIFT); tx++) {
+					h = rows[tz * hs + tx];
+					lo = ac_min(lo, h);
+					hi = ac_max(hi, h);
+				}
+			}
+			slope = (hi - lo) * HEIGHT_SCALE / NAV_CELL;
+			*c = slope > NAV_MAX_SLOPE ? 0
+				: 1 + (int)(slope * (NAV_SLOPE_COST - 1) / NAV_MAX_SLOPE);
+		}
+	}
+	free(buf);
+}
+
+/// Marks the cells covered by the footprint of a building as blocked.
+static void g_nav_block_bldg(const ac_bldg_t *b) {
+	const float ofs = gen_heightmap_size / 2;
+	// the footprint is grown by half a cell, so that any cell the building
+	// cuts into is blocked
+	const float hx = 0.5f * (b->Xscale + NAV_CELL);
+	const float hz = 0.5f * (b->Zscale + NAV_CELL);
+	const float c = cosf(b->ang), s = sinf(b->ang);
+	float r = sqrtf(hx * hx + hz * hz), px, pz, lx, lz;
+	int x, z, x0, x1, z0, z1;
+
+	x0 = ac_max(0, (int)((b->pos.f[0] + ofs - r) / NAV_CELL));
+	x1 = ac_min(g_nav_size - 1, (int)((b->pos.f[0] + ofs + r) / NAV_CELL));
+	z0 = ac_max(0, (int)((b->pos.f[2] + ofs - r) / NAV_CELL));
+	z1 = ac_min(g_nav_size - 1, (int)((b->pos.f[2] + ofs + r) / NAV_CELL));
+	for (z = z0; z <= z1; z++) {
+		for (x = x0; x <= x1; x++) {
+			// cell centre in the building's object space, the same way the
+			// collision detection module does it
+			px = (x + 0.5f) * NAV_CELL - ofs - b->pos.f[0];
+			pz = (z + 0.5f) * NAV_CELL - ofs - b->pos.f[2];
+			lx = c * px - s * pz;
+			lz = s * px + c * pz;
+			if (fabsf(lx) <= hx && fabsf(lz) <= hz)
+				g_nav_cost[z * g_nav_size + x] = 0;
+		}
+	}
+}
+
+/// Computes the coarse graph node of a cluster: its mean cost, its waypoint
+/// and its links to the neighbouring clusters.
+/// \return true if anything has changed
+static bool g_nav_build_cluster(int n) {
+	const int cx = (n % g_nav_csize) << NAV_CLUSTER_SHIFT;
+	const int cz = (n / g_nav_csize) << NAV_CLUSTER_SHIFT;
+	uint sum = 0, count = 0, ccost, d, best = NAV_UNREACHABLE;
+	int i, j, k, x, z, waypoint = -1;
+	uchar edges = 0;
+
+	for (j = 0; j < NAV_CLUSTER; j++) {
+		for (i = 0; i < NAV_CLUSTER; i++) {
+			if (!g_nav_open(cx + i, cz + j))
+				continue;
+			sum += g_nav_cost[(cz + j) * g_nav_size + cx + i];
+			count++;
+			// the waypoint is the open cell closest to the middle
+			d = (2 * i + 1 - NAV_CLUSTER) * (2 * i + 1 - NAV_CLUSTER)
+				+ (2 * j + 1 - NAV_CLUSTER) * (2 * j + 1 - NAV_CLUSTER);
+			if (d < best) {
+				best = d;
+				waypoint = (cz + j) * g_nav_size + cx + i;
+			}
+		}
+	}
+	ccost = count ? (sum * 16 + count / 2) / count : 0;
+
+	for (k = 0; count && k < 8; k++) {
+		if (k & 1) {
+			// diagonal link through the corner; the same as a diagonal step
+			// between the cells, it needs both of the cells beside it open
+			x = g_nav_dx[k] > 0 ? cx + NAV_CLUSTER - 1 : cx;
+			z = g_nav_dz[k] > 0 ? cz + NAV_CLUSTER - 1 : cz;
+			if (g_nav_open(x, z)
+				&& g_nav_open(x + g_nav_dx[k], z + g_nav_dz[k])
+				&& g_nav_open(x + g_nav_dx[k], z)
+				&& g_nav_open(x, z + g_nav_dz[k]))
+				edges |= 1 << k;
+			continue;
+		}
+		// straight link; any pair of open cells across the border will do
+		for (i = 0; i < NAV_CLUSTER; i++) {
+			if (g_nav_dx[k]) {
+				x = g_nav_dx[k] > 0 ? cx + NAV_CLUSTER - 1 : cx;
+				z = cz + i;
+			} else {
+				x = cx + i;
+				z = g_nav_dz[k] > 0 ? cz + NAV_CLUSTER - 1 : cz;
+			}
+			if (g_nav_open(x, z)
+				&& g_nav_open(x + g_nav_dx[k], z + g_nav_dz[k])) {
+				edges |= 1 << k;
+				break;
+			}
+		}
+	}
+
+	if (g_nav_ccost[n] == ccost && g_nav_edges[n] == edges
+		&& g_nav_waypoint[n] == waypoint)
+		return false;
+	g_nav_ccost[n] = ccost;
+	g_nav_edges[n] = edges;
+	g_nav_waypoint[n] = waypoint;
+	return true;
+}
+
+static void g_nav_clusters_job(void *unused, int first, int last) {
+	int i;
+
+	for (i = first; i < last; i++)
+		g_nav_build_cluster(i);
+}
+
+/// Integrates a flow field over the coarse graph, from the destination
+/// cluster outwards.
+static void g_nav_integrate_field(g_nav_field_t *f) {
+	const int num = g_nav_csize * g_nav_csize;
+	g_nav_heap_t *heap, top;
+	int i, k, m, x, z, n = 0;
+	uint d;
+
+	for (i = 0; i < num; i++) {
+		f->dist[i] = NAV_UNREACHABLE;
+		f->next[i] = NAV_DIR_NONE;
+	}
+	// a node is pushed at most once per link
+	if (!(heap = malloc(sizeof(*heap) * (num * 8 + 1))))
+		return;
+	f->dist[f->dest] = 0;
+	g_nav_heap_push(heap, &n, 0, f->dest);
+	while (n) {
+		top = g_nav_heap_pop(heap, &n);
+		if (top.dist > f->dist[top.node])
+			continue;	// stale
+		x = top.node % g_nav_csize;
+		z = top.node / g_nav_csize;
+		for (k = 0; k < 8; k++) {
+			if (!(g_nav_edges[top.node] & (1 << k)))
+				continue;
+			m = (z + g_nav_dz[k]) * g_nav_csize + x + g_nav_dx[k];
+			// crossing half of each cluster
+			d = top.dist + (g_nav_ccost[top.node] + g_nav_ccost[m])
+				* (k & 1 ? 14 : 10) * NAV_CLUSTER / 32;
+			if (d < f->dist[m]) {
+				f->dist[m] = d;
+				// the way back is the opposite direction
+				f->next[m] = (k + 4) & 7;
+				g_nav_heap_push(heap, &n, d, m);
+			}
+		}
+	}
+	free(heap);
+}
+
+static void g_nav_fields_job(void *arg, int first, int last) {
+	const int *slots = arg;
+	int i;
+
+	for (i = first; i < last; i++)
+		g_nav_integrate_field(&g_nav_fields[slots[i]]);
+}
+
+/// Computes the flow directions of a single cluster tile. The integration runs
+/// over the tile and the ring of cells around it. The goals are the ring cells
+/// in the neighbouring clusters closer to the destination, weighted by their
+/// coarse integration values, or the destination cell itself.
+static void g_nav_compute_tile(g_nav_field_t *f, int n, g_nav_tile_t *t) {
+	// direction of each of the 3x3 neighbouring clusters
+	static const int nav_dir_of[9] = {5, 6, 7, 4, NAV_DIR_NONE, 0, 3, 2, 1};
+	uint dist[NAV_TILE_SPAN * NAV_TILE_SPAN], d, best, base = NAV_UNREACHABLE;
+	uint exits[8];
+	uchar open[NAV_TILE_SPAN * NAV_TILE_SPAN];
+	g_nav_heap_t heap[NAV_TILE_SPAN * NAV_TILE_SPAN * 8 + 1], top;
+	const int cx = (n % g_nav_csize) << NAV_CLUSTER_SHIFT;
+	const int cz = (n / g_nav_csize) << NAV_CLUSTER_SHIFT;
+	int i, j, k, x, z, m, h = 0, dir;
+
+	for (k = 0; k < 8; k++) {
+		exits[k] = NAV_UNREACHABLE;
+		x = n % g_nav_csize + g_nav_dx[k];
+		z = n / g_nav_csize + g_nav_dz[k];
+		if (n == f->dest || x < 0 || z < 0
+			|| x >= g_nav_csize || z >= g_nav_csize)
+			continue;
+		// only the clusters closer to the destination, so that the troops
+		// never go round in circles
+		if ((d = f->dist[z * g_nav_csize + x]) < f->dist[n]) {
+			exits[k] = d;
+			base = ac_min(base, d);
+		}
+	}
+
+	// cell (i, j) of the span is cell (cx + i - 1, cz + j - 1) of the grid
+	for (j = 0; j < NAV_TILE_SPAN; j++) {
+		for (i = 0; i < NAV_TILE_SPAN; i++) {
+			m = j * NAV_TILE_SPAN + i;
+			dist[m] = NAV_UNREACHABLE;
+			open[m] = g_nav_open(cx + i - 1, cz + j - 1);
+			k = nav_dir_of[(i == 0 ? 0 : i == NAV_TILE_SPAN - 1 ? 2 : 1)
+				+ (j == 0 ? 0 : j == NAV_TILE_SPAN - 1 ? 6 : 3)];
+			// the ring cells are never integrated, only seeded
+			if (k != NAV_DIR_NONE && open[m] && exits[k] != NAV_UNREACHABLE) {
+				dist[m] = exits[k] - base;
+				g_nav_heap_push(heap, &h, dist[m], m);
+			}
+		}
+	}
+	if (n == f->dest) {
+		m = g_nav_waypoint[n];
+		m = ((m / g_nav_size) - cz + 1) * NAV_TILE_SPAN
+			+ (m % g_nav_size) - cx + 1;
+		dist[m] = 0;
+		g_nav_heap_push(heap, &h, 0, m);
+	}
+
+	while (h) {
+		top = g_nav_heap_pop(heap, &h);
+		if (top.dist > dist[top.node])
+			continue;	// stale
+		x = top.node % NAV_TILE_SPAN;
+		z = top.node / NAV_TILE_SPAN;
+		for (k = 0; k < 8; k++) {
+			i = x + g_nav_dx[k];
+			j = z + g_nav_dz[k];
+			if (i < 1 || j < 1 || i > NAV_CLUSTER || j > NAV_CLUSTER)
+				continue;	// nothing to integrate outside of the tile
+			m = j * NAV_TILE_SPAN + i;
+			// no cutting corners
+			if (!open[m] || ((k & 1) && (!open[z * NAV_TILE_SPAN + i]
+				|| !open[j * NAV_TILE_SPAN + x])))
+				continue;
+			d = top.dist + g_nav_step(k,
+				g_nav_cost[(cz + z - 1) * g_nav_size + cx + x - 1]);
+			if (d < dist[m]) {
+				dist[m] = d;
+				g_nav_heap_push(heap, &h, d, m);
+			}
+		}
+	}
+
+	// every cell points at its cheapest neighbour
+	for (j = 1; j <= NAV_CLUSTER; j++) {
+		for (i = 1; i <= NAV_CLUSTER; i++) {
+			m = j * NAV_TILE_SPAN + i;
+			dir = NAV_DIR_NONE;
+			best = dist[m];
+			for (k = 0; best && k < 8; k++) {
+				x = i + g_nav_dx[k];
+				z = j + g_nav_dz[k];
+				if (!open[z * NAV_TILE_SPAN + x] || ((k & 1)
+					&& (!open[j * NAV_TILE_SPAN + x]
+					|| !open[z * NAV_TILE_SPAN + i])))
+					continue;
+				if (dist[z * NAV_TILE_SPAN + x] < best) {
+					best = dist[z * NAV_TILE_SPAN + x];
+					dir = k;
+				}
+			}
+			t->dir[(j - 1) * NAV_CLUSTER + i - 1] = dir;
+		}
+	}
+}
+
+static void g_nav_tiles_job(void *arg, int first, int last) {
+	const g_nav_req_t *reqs = arg;
+	g_nav_field_t *f;
+	int i;
+
+	for (i = first; i < last; i++) {
+		f = &g_nav_fields[reqs[i].field];
+		g_nav_compute_tile(f, reqs[i].cluster, f->tiles[reqs[i].cluster]);
+	}
+}
+
+/// Drops all the tiles of a flow field.
+static void g_nav_clear_tiles(g_nav_field_t *f) {
+	int i;
+
+	for (i = 0; i < g_nav_csize * g_nav_csize; i++) {
+		free(f->tiles[i]);
+		f->tiles[i] = NULL;
+	}
+}
+
+/// Finds a slot for a flow field, evicting the least recently used one if
+/// need be. Fields requested in the current tick are never evicted.
+/// \return slot index, or -1 if none is available
+static int g_nav_alloc_field(int dest) {
+	const int num = g_nav_csize * g_nav_csize;
+	g_nav_field_t *f;
+	int i, slot = -1;
+
+	for (i = 0; i < NAV_MAX_FIELDS; i++) {
+		f = &g_nav_fields[i];
+		if (f->dest < 0) {
+			slot = i;
+			break;
+		}
+		if (f->lastUsed != g_nav_tick && (slot < 0
+			|| f->lastUsed < g_nav_fields[slot].lastUsed))
+			slot = i;
+	}
+	if (slot < 0)
+		return -1;
+	f = &g_nav_fields[slot];
+	if (f->dest >= 0) {
+		g_nav_field_of[f->dest] = -1;
+		g_nav_clear_tiles(f);
+	} else if (!f->dist) {
+		f->dist = malloc(sizeof(*f->dist) * num);
+		f->next = malloc(num);
+		f->tiles = calloc(num, sizeof(*f->tiles));
+		if (!f->dist || !f->next || !f->tiles) {
+			free(f->dist);
+			free(f->next);
+			free(f->tiles);
+			f->dist = NULL;
+			f->next = NULL;
+			f->tiles = NULL;
+			return -1;
+		}
+	}
+	f->dest = dest;
+	f->state = NS_PENDING;
+	g_nav_field_of[dest] = slot;
+	return slot;
+}
+
+bool g_nav_build(const ac_tree_t *trees, int numTrees,
+	const ac_bldg_t *bldgs, int numBldgs) {
+	const float ofs = gen_heightmap_size / 2;
+	int i, x, z, num;
+	uchar *c;
+
+	g_nav_free();
+	g_nav_size = gen_heightmap_size >> NAV_CELL_SHIFT;
+	g_nav_csize = g_nav_size >> NAV_CLUSTER_SHIFT;
+	num = g_nav_csize * g_nav_csize;
+	g_nav_cost = malloc(g_nav_size * g_nav_size);
+	g_nav_ccost = calloc(num, sizeof(*g_nav_ccost));
+	g_nav_edges = calloc(num, 1);
+	g_nav_waypoint = malloc(sizeof(*g_nav_waypoint) * num);
+	g_nav_version = calloc(num, sizeof(*g_nav_version));
+	g_nav_field_of = malloc(sizeof(*g_nav_field_of) * num);
+	if (!g_nav_cost || !g_nav_ccost || !g_nav_edges || !g_nav_waypoint
+		|| !g_nav_version || !g_nav_field_of) {
+		g_nav_free();
+		return false;
+	}
+	for (i = 0; i < num; i++) {
+		g_nav_waypoint[i] = -1;
+		g_nav_field_of[i] = -1;
+	}
+
+	// the walking cost comes from the terrain slope...
+	g_nav_slope_oom = 0;
+	ac_thread_parallel_for(g_nav_slope_job, NULL, g_nav_size, 16, NULL);
+	if (g_nav_slope_oom) {
+		g_nav_free();
+		return false;
+	}
+	// ...the forests slow the troops down...
+	for (i = 0; i < numTrees; i++) {
+		x = (int)((trees[i].pos.f[0] + ofs) / NAV_CELL);
+		z = (int)((trees[i].pos.f[2] + ofs) / NAV_CELL);
+		if (x < 0 || z < 0 || x >= g_nav_size || z >= g_nav_size)
+			continue;
+		c = &g_nav_cost[z * g_nav_size + x];
+		if (*c)
+			*c = ac_min(NAV_MAX_COST, *c + NAV_TREE_COST);
+	}
+	// ...and the buildings are in the way
+	for (i = 0; i < numBldgs; i++)
+		g_nav_block_bldg(&bldgs[i]);
+
+	ac_thread_parallel_for(g_nav_clusters_job, NULL, num, 64, NULL);
+	for (i = 0; i < NAV_MAX_FIELDS; i++)
+		g_nav_fields[i].dest = -1;
+	return true;
+}
+
+void g_nav_free(void) {
+	int i;
+
+	for (i = 0; i < NAV_MAX_FIELDS; i++) {
+		if (g_nav_fields[i].tiles)
+			g_nav_clear_tiles(&g_nav_fields[i]);
+		free(g_nav_fields[i].dist);
+		free(g_nav_fields[i].next);
+		free(g_nav_fields[i].tiles);
+	}
+	memset(g_nav_fields, 0, sizeof(g_nav_fields));
+	free(g_nav_cost);
+	free(g_nav_ccost);
+	free(g_nav_edges);
+	free(g_nav_waypoint);
+	free(g_nav_version);
+	free(g_nav_field_of);
+	free(g_nav_queue);
+	g_nav_cost = NULL;
+	g_nav_ccost = NULL;
+	g_nav_edges = NULL;
+	g_nav_waypoint = NULL;
+	g_nav_version = NULL;
+	g_nav_field_of = NULL;
+	g_nav_queue = NULL;
+	g_nav_queued = g_nav_max_queued = 0;
+	g_nav_size = g_nav_csize = 0;
+	g_nav_coarse_version = 0;
+	g_nav_tick = 0;
+}
+
+bool g_nav_ready(void) {
+	return g_nav_cost != NULL;
+}
+
+/// \return cluster under the given point, or -1 if off the map
+static int g_nav_cluster_at(float x, float z) {
+	const float ofs = gen_heightmap_size / 2;
+	int cx, cz;
+
+	if (x + ofs < 0.f || z + ofs < 0.f)
+		return -1;
+	cx = (int)(x + ofs) >> (NAV_CELL_SHIFT + NAV_CLUSTER_SHIFT);
+	cz = (int)(z + ofs) >> (NAV_CELL_SHIFT + NAV_CLUSTER_SHIFT);
+	if (cx >= g_nav_csize || cz >= g_nav_csize)
+		return -1;
+	return cz * g_nav_csize + cx;
+}
+
+int g_nav_waypoint_near(float x, float z, int dx, int dz,
+	float *wx, float *wz) {
+	const float ofs = gen_heightmap_size / 2;
+	int n, cx, cz;
+
+	if (!g_nav_cost || (n = g_nav_cluster_at(x, z)) < 0)
+		return -1;
+	cx = n % g_nav_csize + dx;
+	cz = n / g_nav_csize + dz;
+	if (cx < 0 || cz < 0 || cx >= g_nav_csize || cz >= g_nav_csize)
+		return -1;
+	n = cz * g_nav_csize + cx;
+	if (g_nav_waypoint[n] < 0)
+		return -1;
+	*wx = ((g_nav_waypoint[n] % g_nav_size) + 0.5f) * NAV_CELL - ofs;
+	*wz = ((g_nav_waypoint[n] / g_nav_size) + 0.5f) * NAV_CELL - ofs;
+	return n;
+}
+
+void g_nav_request(int dest, float x, float z) {
+	g_nav_field_t *f;
+	g_nav_tile_t *t;
+	int slot, n;
+
+	if (!g_nav_cost || dest < 0 || (n = g_nav_cluster_at(x, z)) < 0)
+		return;
+	if ((slot = g_nav_field_of[dest]) < 0
+		&& (slot = g_nav_alloc_field(dest)) < 0)
+		return;	// all of the fields are in use, try again next tick
+	f = &g_nav_fields[slot];
+	f->lastUsed = g_nav_tick;
+	if (f->state == NS_READY && f->version != g_nav_coarse_version) {
+		// the coarse graph has changed since
+		f->state = NS_PENDING;
+		g_nav_clear_tiles(f);
+	}
+
+	if (!(t = f->tiles[n])) {
+		if (!(t = f->tiles[n] = malloc(sizeof(*t))))
+			return;
+		t->state = NS_EMPTY;
+	} else if (t->state == NS_READY && t->version != g_nav_version[n])
+		t->state = NS_EMPTY;
+	if (t->state != NS_EMPTY)
+		return;
+	if (g_nav_queued == g_nav_max_queued) {
+		g_nav_req_t *q;
+		int max = g_nav_max_queued ? g_nav_max_queued * 2 : 256;
+		if (!(q = realloc(g_nav_queue, sizeof(*q) * max)))
+			return;
+		g_nav_queue = q;
+		g_nav_max_queued = max;
+	}
+	t->state = NS_PENDING;
+	g_nav_queue[g_nav_queued].field = slot;
+	g_nav_queue[g_nav_queued++].cluster = n;
+}
+
+void g_nav_update(void) {
+	int slots[NAV_MAX_FIELDS];
+	g_nav_req_t batch[NAV_TILE_BUDGET];
+	const int num = g_nav_csize * g_nav_csize;
+	int i, j, numSlots = 0, numBatch = 0, budget;
+	g_nav_field_t *f;
+	g_nav_tile_t *t;
+
+	if (!g_nav_cost)
+		return;
+
+	// integrate as many of the pending flow fields as the budget allows, at
+	// least one per tick
+	budget = ac_max(1, NAV_COARSE_BUDGET / num);
+	for (i = 0; i < NAV_MAX_FIELDS && numSlots < budget; i++) {
+		if (g_nav_fields[i].dest >= 0 && g_nav_fields[i].state == NS_PENDING)
+			slots[numSlots++] = i;
+	}
+	ac_thread_parallel_for(g_nav_fields_job, slots, numSlots, 1, NULL);
+	for (i = 0; i < numSlots; i++) {
+		g_nav_fields[slots[i]].state = NS_READY;
+		g_nav_fields[slots[i]].version = g_nav_coarse_version;
+	}
+
+	// then compute the oldest tile requests whose fields are ready; the rest
+	// stays queued
+	for (i = j = 0; i < g_nav_queued; i++) {
+		f = &g_nav_fields[g_nav_queue[i].field];
+		t = f->tiles ? f->tiles[g_nav_queue[i].cluster] : NULL;
+		// evicted or invalidated in the meantime, or queued twice, since a
+		// field slot that has been evicted and reused may have old requests
+		// for the same tile left behind; a tile is only batched once
+		if (!t || t->state != NS_PENDING)
+			continue;
+		if (f->state != NS_READY || numBatch == NAV_TILE_BUDGET) {
+			g_nav_queue[j++] = g_nav_queue[i];
+			continue;
+		}
+		t->version = g_nav_version[g_nav_queue[i].cluster];
+		t->state = NS_BATCHED;
+		batch[numBatch++] = g_nav_queue[i];
+	}
+	g_nav_queued = j;
+	ac_thread_parallel_for(g_nav_tiles_job, batch, numBatch, 4, NULL);
+	for (i = 0; i < numBatch; i++)
+		g_nav_fields[batch[i].field].tiles[batch[i].cluster]->state = NS_READY;
+
+	g_nav_tick++;
+}
+
+g_nav_flow_t g_nav_flow(int dest, float x, float z, float *dx, float *dz) {
+	const float ofs = gen_heightmap_size / 2;
+	const float diag = 0.70710678f;
+	g_nav_field_t *f;
+	g_nav_tile_t *t;
+	int cx, cz, n, dir, slot;
+
+	if (!g_nav_cost || dest < 0 || (n = g_nav_cluster_at(x, z)) < 0
+		|| (slot = g_nav_field_of[dest]) < 0)
+		return NF_STRAIGHT;
+	cx = (int)(x + ofs) >> NAV_CELL_SHIFT;
+	cz = (int)(z + ofs) >> NAV_CELL_SHIFT;
+	// blocked cells are left the shortest way there is
+	if (!g_nav_cost[cz * g_nav_size + cx])
+		return NF_STRAIGHT;
+	f = &g_nav_fields[slot];
+	if (f->state != NS_READY || f->version != g_nav_coarse_version)
+		return NF_STRAIGHT;
+	if (n != dest && f->next[n] == NAV_DIR_NONE)
+		return NF_NO_PATH;
+	if (!(t = f->tiles[n]) || t->state != NS_READY
+		|| t->version != g_nav_version[n])
+		return NF_STRAIGHT;
+	dir = t->dir[((cz & (NAV_CLUSTER - 1)) << NAV_CLUSTER_SHIFT)
+		+ (cx & (NAV_CLUSTER - 1))];
+	if (dir == NAV_DIR_NONE)
+		return cz * g_nav_size + cx == g_nav_waypoint[dest] ? NF_STRAIGHT
+			: NF_NO_PATH;
+	*dx = g_nav_dx[dir] * (dir & 1 ? diag : 1.f);
+	*dz = g_nav_dz[dir] * (dir & 1 ? diag : 1.f);
+	return NF_FLOW;
+}
+
+/// Changes the cost of a cell and invalidates the cached tiles of its cluster,
+/// and the ones of the neighbours which might use the cell as a goal; the rest
+/// of the cached tiles stays valid, unless the coarse graph changes too.
+/// \return true if the cost has changed
+static bool g_nav_change_cell(int cx, int cz, int cost) {
+	const int n = (cz >> NAV_CLUSTER_SHIFT) * g_nav_csize
+		+ (cx >> NAV_CLUSTER_SHIFT);
+	const int lx = cx & (NAV_CLUSTER - 1), lz = cz & (NAV_CLUSTER - 1);
+	int i, j;
+
+	cost = ac_max(0, ac_min(NAV_MAX_COST, cost));
+	if (g_nav_cost[cz * g_nav_size + cx] == cost)
+		return false;
+	g_nav_cost[cz * g_nav_size + cx] = cost;
+	for (j = -1; j <= 1; j++) {
+		for (i = -1; i <= 1; i++) {
+			if ((cx >> NAV_CLUSTER_SHIFT) + i < 0
+				|| (cx >> NAV_CLUSTER_SHIFT) + i >= g_nav_csize
+				|| (cz >> NAV_CLUSTER_SHIFT) + j < 0
+				|| (cz >> NAV_CLUSTER_SHIFT) + j >= g_nav_csize)
+				continue;
+			if ((!i || lx == (i < 0 ? 0 : NAV_CLUSTER - 1))
+				&& (!j || lz == (j < 0 ? 0 : NAV_CLUSTER - 1)))
+				g_nav_version[n + j * g_nav_csize + i]++;
+		}
+	}
+	return true;
+}
+
+/// Rebuilds the coarse graph nodes of the clusters around the given range of
+/// changed cells; the links are stored on both sides, so the neighbours go
+/// too.
+static void g_nav_rebuild_clusters(int x0, int z0, int x1, int z1) {
+	bool changed = false;
+	int x, z;
+
+	x0 = ac_max(0, (x0 >> NAV_CLUSTER_SHIFT) - 1);
+	z0 = ac_max(0, (z0 >> NAV_CLUSTER_SHIFT) - 1);
+	x1 = ac_min(g_nav_csize - 1, (x1 >> NAV_CLUSTER_SHIFT) + 1);
+	z1 = ac_min(g_nav_csize - 1, (z1 >> NAV_CLUSTER_SHIFT) + 1);
+	for (z = z0; z <= z1; z++) {
+		for (x = x0; x <= x1; x++) {
+			if (g_nav_build_cluster(z * g_nav_csize + x))
+				changed = true;
+		}
+	}
+	if (changed)
+		g_nav_coarse_version++;
+}
+
+void g_nav_set_cost(float x, float z, int cost) {
+	const float ofs = gen_heightmap_size / 2;
+	int cx, cz;
+
+	if (!g_nav_cost || x + ofs < 0.f || z + ofs < 0.f)
+		return;
+	cx = (int)(x + ofs) >> NAV_CELL_SHIFT;
+	cz = (int)(z + ofs) >> NAV_CELL_SHIFT;
+	if (cx >= g_nav_size || cz >= g_nav_size)
+		return;
+	if (g_nav_change_cell(cx, cz, cost))
+		g_nav_rebuild_clusters(cx, cz, cx, cz);
+}
+
+void g_nav_add_cost(float x, float z, float radius, int cost) {
+	const float ofs = gen_heightmap_size / 2;
+	int cx, cz, x0, z0, x1, z1, mx0, mz0, mx1 = -1, mz1 = -1;
+	float dx, dz;
+	uchar c;
+
+	if (!g_nav_cost)
+		return;
+	x0 = ac_max(0, (int)floorf((x + ofs - radius) / NAV_CELL));
+	z0 = ac_max(0, (int)floorf((z + ofs - radius) / NAV_CELL));
+	x1 = ac_min(g_nav_size - 1, (int)floorf((x + ofs + radius) / NAV_CELL));
+	z1 = ac_min(g_nav_size - 1, (int)floorf((z + ofs + radius) / NAV_CELL));
+	mx0 = x1;
+	mz0 = z1;
+	for (cz = z0; cz <= z1; cz++) {
+		for (cx = x0; cx <= x1; cx++) {
+			// the cells whose centres are in reach; the blocked ones stay so
+			dx = (cx + 0.5f) * NAV_CELL - ofs - x;
+			dz = (cz + 0.5f) * NAV_CELL - ofs - z;
+			if (dx * dx + dz * dz > radius * radius
+				|| !(c = g_nav_cost[cz * g_nav_size + cx])
+				|| !g_nav_change_cell(cx, cz, ac_max(1, c + cost)))
+				continue;
+			mx0 = ac_min(mx0, cx);
+			mz0 = ac_min(mz0, cz);
+			mx1 = ac_max(mx1, cx);
+			mz1 = ac_max(mz1, cz);
+		}
+	}
+	// all of the changes at once, so that a cluster is only rebuilt once
+	if (mx1 >= 0)
+		g_nav_rebuild_clusters(mx0, mz0, mx1, mz1);
+}
+
+int g_nav_pending(void) {
+	return g_nav_queued;
+}
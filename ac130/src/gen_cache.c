@@ -0,0 +1,242 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// World cache; stores the generated content on disk so that subsequent runs
+// with the same seed can just map it into memory instead of regenerating it
+
+#include <stdio.h>
+#include "gen_local.h"
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+/// Cache file identifier.
+#define CACHE_MAGIC		"AC130WC"
+/// Lumps are padded to this many bytes so that vectors stay aligned.
+#define CACHE_ALIGN		16
+
+/// Cache file header.
+typedef struct {
+	char	magic[8];		///< \ref CACHE_MAGIC
+	uint	version;		///< \ref GEN_VERSION the cache was generated with
+	uint	seed;			///< random seed of the world
+	uint	hmapSize;		///< heightmap dimension
+	uint	octaves;		///< number of cloud noise octaves
+	uint	abi;			///< sizes of the stored structures, see
+							///  \ref gen_cache_abi
+	struct {
+		uint	ofs;		///< offset from the beginning of the file
+		uint	len;		///< length in bytes
+	}		lumps[CL_NUM_LUMPS];
+} gen_cache_header_t;
+
+static uint					gen_cache_seed;
+static bool					gen_cache_recording = false;
+static const uchar			*gen_cache_map = NULL;	///< mapped cache file
+static size_t				gen_cache_map_len = 0;
+#ifdef WIN32
+static HANDLE				gen_cache_file = INVALID_HANDLE_VALUE;
+static HANDLE				gen_cache_mapping = NULL;
+#endif
+/// Freshly generated lumps waiting to be written.
+static void					*gen_cache_lumps[CL_NUM_LUMPS];
+static size_t				gen_cache_lens[CL_NUM_LUMPS];
+
+/// Catches caches written by a build with different structure layouts (e.g.
+/// 32 vs 64-bit).
+static uint gen_cache_abi(void) {
+	return sizeof(ac_tree_t) | sizeof(ac_bldg_t) << 8
+		| sizeof(ac_prop_t) << 16 | sizeof(ac_vertex_t) << 24;
+}
+
+/// Worlds of different sizes get separate files so that they don't keep
+/// invalidating each other.
+static void gen_cache_path(char *buf, size_t len, uint seed) {
+	snprintf(buf, len, "ac130-%08x-%d.cache", seed, gen_heightmap_size);
+}
+
+static void gen_cache_unmap(void) {
+	if (!gen_cache_map)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(gen_cache_map);
+	CloseHandle(gen_cache_mapping);
+	CloseHandle(gen_cache_file);
+	gen_cache_file = INVALID_HANDLE_VALUE;
+#else
+	munmap((void *)gen_cache_map, gen_cache_map_len);
+#endif
+	gen_cache_map = NULL;
+	gen_cache_map_len = 0;
+}
+
+static bool gen_cache_map_file(const char *path) {
+#ifdef WIN32
+	LARGE_INTEGER size;
+	gen_cache_file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (gen_cache_file == INVALID_HANDLE_VALUE)
+		return false;
+	if (!GetFileSizeEx(gen_cache_file, &size)
+		|| !(gen_cache_mapping = CreateFileMapping(gen_cache_file, NULL,
+			PAGE_READONLY, 0, 0, NULL))) {
+		CloseHandle(gen_cache_file);
+		gen_cache_file = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	gen_cache_map = MapViewOfFile(gen_cache_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!gen_cache_map) {
+		CloseHandle(gen_cache_mapping);
+		CloseHandle(gen_cache_file);
+		gen_cache_file = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	gen_cache_map_len = size.QuadPart;
+#else
+	struct stat st;
+	void *p;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping stays valid after the descriptor is closed
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	gen_cache_map = p;
+	gen_cache_map_len = st.st_size;
+#endif
+	return true;
+}
+
+/// Makes sure the mapped file is a complete cache of the world we want.
+static bool gen_cache_validate(void) {
+	const gen_cache_header_t *h = (const gen_cache_header_t *)gen_cache_map;
+	int i;
+
+	if (gen_cache_map_len < sizeof(*h)
+		|| memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic))
+		|| h->version != GEN_VERSION
+		|| h->seed != gen_cache_seed
+		|| h->hmapSize != (uint)gen_heightmap_size
+		|| h->octaves != (uint)gen_num_cloud_octaves()
+		|| h->abi != gen_cache_abi())
+		return false;
+	for (i = 0; i < CL_NUM_LUMPS; i++) {
+		if (h->lumps[i].ofs % CACHE_ALIGN
+			|| h->lumps[i].ofs > gen_cache_map_len
+			|| h->lumps[i].len > gen_cache_map_len - h->lumps[i].ofs)
+			return false;
+	}
+	return true;
+}
+
+bool gen_cache_open(int seed) {
+	char path[64];
+
+	gen_cache_unmap();
+	gen_cache_seed = seed;
+	gen_cache_path(path, sizeof(path), gen_cache_seed);
+	if (gen_cache_map_file(path)) {
+		if (gen_cache_validate()) {
+			gen_cache_recording = false;
+			return true;
+		}
+		// stale or broken cache, regenerate and overwrite it
+		gen_cache_unmap();
+	}
+	gen_cache_recording = true;
+	return false;
+}
+
+const void *gen_cache_get(gen_lump_t lump, size_t *len) {
+	const gen_cache_header_t *h = (const gen_cache_header_t *)gen_cache_map;
+
+	if (!gen_cache_map)
+		return NULL;
+	*len = h->lumps[lump].len;
+	return gen_cache_map + h->lumps[lump].ofs;
+}
+
+void gen_cache_put(gen_lump_t lump, const void *data, size_t len) {
+	if (!gen_cache_recording)
+		return;
+	free(gen_cache_lumps[lump]);
+	gen_cache_lumps[lump] = malloc(len);
+	memcpy(gen_cache_lumps[lump], data, len);
+	gen_cache_lens[lump] = len;
+}
+
+static bool gen_cache_write(void) {
+	static const uchar pad[CACHE_ALIGN] = {0};
+	gen_cache_header_t h;
+	char path[64], tmppath[68];
+	size_t ofs;
+	FILE *f;
+	int i;
+
+	// only ever write complete caches
+	for (i = 0; i < CL_NUM_LUMPS; i++) {
+		if (!gen_cache_lumps[i])
+			return false;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+	h.version = GEN_VERSION;
+	h.seed = gen_cache_seed;
+	h.hmapSize = gen_heightmap_size;
+	h.octaves = gen_num_cloud_octaves();
+	h.abi = gen_cache_abi();
+	ofs = (sizeof(h) + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1);
+	for (i = 0; i < CL_NUM_LUMPS; i++) {
+		h.lumps[i].ofs = ofs;
+		h.lumps[i].len = gen_cache_lens[i];
+		ofs += (gen_cache_lens[i] + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1);
+	}
+
+	// write to a temporary file first so that an interrupted write never
+	// leaves a broken cache behind
+	gen_cache_path(path, sizeof(path), gen_cache_seed);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if (!(f = fopen(tmppath, "wb")))
+		return false;
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(pad, (CACHE_ALIGN - sizeof(h) % CACHE_ALIGN) % CACHE_ALIGN, 1, f);
+	for (i = 0; i < CL_NUM_LUMPS; i++) {
+		fwrite(gen_cache_lumps[i], gen_cache_lens[i], 1, f);
+		fwrite(pad, (CACHE_ALIGN - gen_cache_lens[i] % CACHE_ALIGN)
+			% CACHE_ALIGN, 1, f);
+	}
+	if (ferror(f)) {
+		fclose(f);
+		remove(tmppath);
+		return false;
+	}
+	fclose(f);
+	// rename() won't overwrite on win32
+	remove(path);
+	return rename(tmppath, path) == 0;
+}
+
+void gen_cache_flush(void) {
+	int i;
+
+	if (gen_cache_recording && !gen_cache_write())
+		fprintf(stderr, "Unable to write the world cache\n");
+	gen_cache_recording = false;
+	for (i = 0; i < CL_NUM_LUMPS; i++) {
+		free(gen_cache_lumps[i]);
+		gen_cache_lumps[i] = NULL;
+	}
+	gen_cache_unmap();
+}
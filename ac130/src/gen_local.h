@@ -0,0 +1,89 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Local content generator header file
+
+#ifndef GEN_LOCAL_H
+#define GEN_LOCAL_H
+
+#include "ac130.h"
+
+/// \file gen_local.h
+/// \brief Private interfaces to all content generator modules.
+
+/// \addtogroup priv_gen Private content generator interface
+/// @{
+
+/// World cache lumps, i.e. the separately stored pieces of generated content.
+typedef enum {
+	CL_HEIGHTMAP,		///< terrain heightmap
+	CL_TREES,			///< tree prop list
+	CL_BLDGS,			///< building prop list
+	CL_PROPTREE,		///< prop tree nodes
+	CL_PROPBOUNDS,		///< prop tree node bounds
+	CL_PROP_TEXTURE,	///< prop texture
+	CL_PROP_VERTS,		///< prop vertices
+	CL_PROP_INDICES,	///< prop indices
+	CL_FX_TEXTURE,		///< special effects texture
+	CL_FX_VERTS,		///< special effects vertices
+	CL_FX_INDICES,		///< special effects indices
+	CL_NUM_LUMPS
+} gen_lump_t;
+
+/// Noise parameters of a single octave.
+typedef struct {
+	int			xoff;		///< noise X offset
+	int			yoff;		///< noise Y offset
+	float		freq;		///< noise frequency
+} gen_octave_t;
+
+/// Terrain noise parameters. They are drawn from the seed up front, so that
+/// the height of any texel can be evaluated on its own, in any order.
+typedef struct {
+	gen_octave_t	base;							///< rough topography
+	gen_octave_t	cloud[GEN_MAX_CLOUD_OCTAVES];	///< cloud detail octaves
+	int				numOctaves;						///< cloud octaves in use
+} gen_terrain_params_t;
+
+/// Terrain noise parameters of the current world, set by \ref gen_terrain.
+extern gen_terrain_params_t	gen_terrain_params;
+
+// generator module
+/// \return \ref gen_cloud_octaves clamped to [1, \ref GEN_MAX_CLOUD_OCTAVES],
+/// i.e. the number of octaves that \ref gen_terrain actually generates
+int gen_num_cloud_octaves(void);
+/// \brief Evaluates the terrain height of a horizontal run of texels.
+/// Produces the exact same values as the ones \ref gen_terrain writes to the
+/// heightmap, but only depends on \ref gen_terrain_params, so it is safe to
+/// call from any thread.
+/// \param out			array of \e n bytes to write the heights to
+/// \param x			X coordinate of the first texel
+/// \param y			Y coordinate of the texels
+/// \param n			number of texels to evaluate
+/// \param stride		distance between consecutive texels
+void gen_terrain_span(uchar *out, int x, int y, int n, int stride);
+
+// terrain tile streaming module
+/// Memory budget for the terrain tiles in megabytes; 0 if the world is not
+/// streamed.
+extern int					gen_tile_budget;
+/// \brief Sets up the tile cache and generates the coarse overview map.
+/// Called by \ref gen_terrain for streamed worlds.
+void gen_tiles_start(void);
+/// \brief Waits for the tiles still being generated and frees the tile cache.
+void gen_tiles_stop(void);
+
+// world cache module
+/// \brief Fetches a lump from the mapped cache file.
+/// \param lump			lump to fetch
+/// \param len			pointer to where to store the lump length in bytes
+/// \return				pointer to the lump data, or NULL if there is no valid
+///						cache for the current seed
+const void *gen_cache_get(gen_lump_t lump, size_t *len);
+/// \brief Hands a freshly generated lump over to the cache writer.
+/// The data is copied, so the caller is free to reuse the buffer.
+void gen_cache_put(gen_lump_t lump, const void *data, size_t len);
+
+/// @}
+
+#endif // GEN_LOCAL_H
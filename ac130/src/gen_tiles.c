@@ -0,0 +1,294 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Terrain tile streaming; generates fixed-size heightmap tiles around the
+// viewpoint on the worker threads, so that large worlds never have to be kept
+// in memory in their entirety
+
+#include "gen_local.h"
+#include "ac_thread.h"
+
+/// Tile dimension in heightmap texels.
+#define TILE_SIZE			GEN_TILE_SIZE
+/// Tile data dimension; each tile stores 1 extra row and column, shared with
+/// its neighbours, so that it can be filtered on its own.
+#define TILE_STRIDE			(TILE_SIZE + 1)
+/// Maximum dimension of the coarse overview map.
+#define OVERVIEW_SIZE		256
+/// Radius around the viewpoint in which tiles are requested (in texels);
+/// matches the far clipping plane of the renderer.
+#define TILE_RADIUS			800
+/// Maximum number of tiles being generated at the same time.
+#define MAX_PENDING_TILES	8
+
+/// Tile slot state.
+typedef enum {
+	TS_FREE,			///< unused slot
+	TS_PENDING,			///< tile is being generated
+	TS_READY			///< tile is resident
+} gen_tile_state_t;
+
+/// Tile slot.
+typedef struct {
+	uchar				data[TILE_STRIDE * TILE_STRIDE];	///< heights
+	gen_tile_state_t	state;		///< slot state
+	int					cell;		///< index of the tile in the tile grid
+	uint				used;		///< frame in which the tile was last in
+									///  range of the viewpoint; only written by
+									///  \ref gen_tiles_update, so that the
+									///  samplers on other threads only read
+	ac_task_t			*task;		///< generation job, if pending
+} gen_tile_t;
+
+int					gen_tile_budget = 0;
+
+static gen_tile_t	*gen_tiles = NULL;
+static int			gen_num_tiles;
+static int			gen_num_pending;
+static int			*gen_tile_map = NULL;	///< tile grid -> slot, -1 if none
+static int			gen_tile_grid;			///< tiles per grid side
+static uint			gen_tile_frame;
+static uchar		*gen_overview = NULL;
+static int			gen_overview_size;
+static int			gen_overview_stride;	///< texels per overview sample
+
+static void gen_tile_rows(void *arg, int first, int last) {
+	gen_tile_t *t = arg;
+	const int size = gen_heightmap_size;
+	int x0 = (t->cell % gen_tile_grid) * TILE_SIZE;
+	int y0 = (t->cell / gen_tile_grid) * TILE_SIZE;
+	int n = size - x0 < TILE_STRIDE ? size - x0 : TILE_STRIDE;
+	int i, y;
+	uchar *row;
+
+	for (y = first; y < last; y++) {
+		row = t->data + y * TILE_STRIDE;
+		// the border of the last tile repeats the edge of the map
+		gen_terrain_span(row, x0, y0 + y < size ? y0 + y : size - 1, n, 1);
+		for (i = n; i < TILE_STRIDE; i++)
+			row[i] = row[n - 1];
+	}
+}
+
+static void gen_overview_rows(void *arg, int first, int last) {
+	int y;
+
+	for (y = first; y < last; y++) {
+		gen_terrain_span(gen_overview + y * gen_overview_size, 0,
+			y * gen_overview_stride, gen_overview_size, gen_overview_stride);
+	}
+}
+
+void gen_tiles_start(void) {
+	int i;
+
+	gen_tiles_stop();
+
+	gen_tile_grid = gen_heightmap_size / TILE_SIZE;
+	gen_tile_map = malloc(sizeof(*gen_tile_map)
+		* gen_tile_grid * gen_tile_grid);
+	for (i = 0; i < gen_tile_grid * gen_tile_grid; i++)
+		gen_tile_map[i] = -1;
+
+	gen_num_tiles = ((size_t)gen_tile_budget << 20) / sizeof(*gen_tiles);
+	if (gen_num_tiles < 1)
+		gen_num_tiles = 1;
+	if (gen_num_tiles > gen_tile_grid * gen_tile_grid)
+		gen_num_tiles = gen_tile_grid * gen_tile_grid;
+	gen_tiles = malloc(sizeof(*gen_tiles) * gen_num_tiles);
+	for (i = 0; i < gen_num_tiles; i++) {
+		gen_tiles[i].state = TS_FREE;
+		gen_tiles[i].cell = -1;
+	}
+	gen_num_pending = 0;
+	gen_tile_frame = 0;
+
+	// the overview is always resident, so there's always something to show
+	gen_overview_size = gen_heightmap_size < OVERVIEW_SIZE
+		? gen_heightmap_size : OVERVIEW_SIZE;
+	gen_overview_stride = gen_heightmap_size / gen_overview_size;
+	gen_overview = malloc(gen_overview_size * gen_overview_size);
+	ac_thread_parallel_for(gen_overview_rows, NULL, gen_overview_size, 16,
+		NULL);
+}
+
+void gen_tiles_stop(void) {
+	int i;
+
+	if (gen_tiles) {
+		for (i = 0; i < gen_num_tiles; i++) {
+			if (gen_tiles[i].state == TS_PENDING)
+				ac_thread_wait(gen_tiles[i].task);
+		}
+	}
+	free(gen_tiles);
+	free(gen_tile_map);
+	free(gen_overview);
+	gen_tiles = NULL;
+	gen_tile_map = NULL;
+	gen_overview = NULL;
+}
+
+/// Finds a slot for a new tile: a free one, or the least recently used
+/// resident tile that is not needed in this frame.
+/// \return slot index, or -1 if the budget is exhausted
+static int gen_tile_alloc(void) {
+	int i, best = -1;
+
+	for (i = 0; i < gen_num_tiles; i++) {
+		if (gen_tiles[i].state == TS_FREE)
+			return i;
+		if (gen_tiles[i].state == TS_READY
+			&& gen_tiles[i].used != gen_tile_frame
+			&& (best < 0 || gen_tiles[i].used < gen_tiles[best].used))
+			best = i;
+	}
+	if (best >= 0) {
+		gen_tile_map[gen_tiles[best].cell] = -1;
+		gen_tiles[best].state = TS_FREE;
+	}
+	return best;
+}
+
+/// Tile request, sorted by distance from the viewpoint.
+typedef struct {
+	int		dist;
+	int		cell;
+} gen_tile_req_t;
+
+static int gen_tile_req_cmp(const void *a, const void *b) {
+	return ((const gen_tile_req_t *)a)->dist
+		- ((const gen_tile_req_t *)b)->dist;
+}
+
+void gen_tiles_update(ac_vec4_t viewpoint) {
+	static gen_tile_req_t reqs[(2 * (TILE_RADIUS / TILE_SIZE + 2))
+		* (2 * (TILE_RADIUS / TILE_SIZE + 2))];
+	int i, x, y, cx, cy, dx, dy, numReqs = 0, slot, maxPending;
+	gen_tile_t *t;
+
+	if (!gen_tiles)
+		return;
+	gen_tile_frame++;
+
+	// pick up the finished tiles
+	for (i = 0; i < gen_num_tiles; i++) {
+		t = &gen_tiles[i];
+		if (t->state == TS_PENDING && ac_thread_poll(t->task)) {
+			t->state = TS_READY;
+			gen_num_pending--;
+		}
+	}
+
+	// gather the tiles in range and keep the resident ones from being evicted
+	cx = viewpoint.f[0] + gen_heightmap_size / 2;
+	cy = viewpoint.f[2] + gen_heightmap_size / 2;
+	for (y = (cy - TILE_RADIUS) / TILE_SIZE;
+		y <= (cy + TILE_RADIUS) / TILE_SIZE; y++) {
+		if (y < 0 || y >= gen_tile_grid)
+			continue;
+		for (x = (cx - TILE_RADIUS) / TILE_SIZE;
+			x <= (cx + TILE_RADIUS) / TILE_SIZE; x++) {
+			if (x < 0 || x >= gen_tile_grid)
+				continue;
+			dx = x * TILE_SIZE + TILE_SIZE / 2 - cx;
+			dy = y * TILE_SIZE + TILE_SIZE / 2 - cy;
+			reqs[numReqs].dist = dx * dx + dy * dy;
+			reqs[numReqs].cell = y * gen_tile_grid + x;
+			if ((slot = gen_tile_map[reqs[numReqs].cell]) >= 0)
+				gen_tiles[slot].used = gen_tile_frame;
+			else
+				numReqs++;
+		}
+	}
+	qsort(reqs, numReqs, sizeof(reqs[0]), gen_tile_req_cmp);
+
+	// queue the missing ones, nearest first; without worker threads the tiles
+	// are generated right here, so keep it to 1 tile per frame then
+	maxPending = ac_thread_count() > 0 ? MAX_PENDING_TILES : 1;
+	for (i = 0; i < numReqs && gen_num_pending < maxPending; i++) {
+		if ((slot = gen_tile_alloc()) < 0)
+			break;
+		t = &gen_tiles[slot];
+		t->cell = reqs[i].cell;
+		t->state = TS_PENDING;
+		t->used = gen_tile_frame;
+		gen_tile_map[t->cell] = slot;
+		gen_num_pending++;
+		t->task = ac_thread_async(gen_tile_rows, t, TILE_STRIDE, TILE_STRIDE);
+	}
+}
+
+/// \return the resident tile covering the given texel, or NULL if none
+static gen_tile_t *gen_tile_at(int x, int y) {
+	int slot;
+
+	if (!gen_tiles)
+		return NULL;
+	slot = gen_tile_map[(y / TILE_SIZE) * gen_tile_grid + x / TILE_SIZE];
+	if (slot < 0 || gen_tiles[slot].state != TS_READY)
+		return NULL;
+	return &gen_tiles[slot];
+}
+
+/// Bilinear filtering of a square map; samples past the last row and column
+/// are clamped.
+static float gen_bilerp(const uchar *map, int dim, float x, float y) {
+	float xi, yi, xfrac, yfrac;
+	const uchar *p;
+	int dx, dy;
+
+	xfrac = modff(x, &xi);
+	yfrac = modff(y, &yi);
+	p = map + (int)yi * dim + (int)xi;
+	dx = xi < dim - 1 ? 1 : 0;
+	dy = yi < dim - 1 ? dim : 0;
+	return (1.f - yfrac) * ((1.f - xfrac) * p[0] + xfrac * p[dx])
+		+ yfrac * ((1.f - xfrac) * p[dy] + xfrac * p[dy + dx]);
+}
+
+float gen_tiles_sample(float x, float y) {
+	const float max = gen_heightmap_size - 1;
+	gen_tile_t *t;
+	float u, v;
+
+	if (!gen_overview)
+		return 0.f;
+	x = x < 0.f ? 0.f : (x > max ? max : x);
+	y = y < 0.f ? 0.f : (y > max ? max : y);
+
+	if ((t = gen_tile_at(x, y))) {
+		return gen_bilerp(t->data, TILE_STRIDE,
+			x - (t->cell % gen_tile_grid) * TILE_SIZE,
+			y - (t->cell / gen_tile_grid) * TILE_SIZE);
+	}
+
+	// fall back to the overview
+	u = x / gen_overview_stride;
+	v = y / gen_overview_stride;
+	return gen_bilerp(gen_overview, gen_overview_size, u, v);
+}
+
+bool gen_tiles_resident(float x, float y) {
+	const float max = gen_heightmap_size - 1;
+
+	if (!gen_tiles)
+		return true;
+	x = x < 0.f ? 0.f : (x > max ? max : x);
+	y = y < 0.f ? 0.f : (y > max ? max : y);
+	return gen_tile_at(x, y) != NULL;
+}
+
+const uchar *gen_tiles_data(int x, int y) {
+	gen_tile_t *t;
+
+	if (x < 0 || y < 0 || x >= gen_tile_grid || y >= gen_tile_grid
+		|| !(t = gen_tile_at(x * TILE_SIZE, y * TILE_SIZE)))
+		return NULL;
+	return t->data;
+}
+
+const uchar *gen_tiles_overview(int *size) {
+	*size = gen_overview_size;
+	return gen_overview;
+}
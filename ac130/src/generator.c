@@ -3,14 +3,25 @@
 
 // Procedural content generation module
 
-#include "ac130.h"
+#include "gen_local.h"
+#include "ac_thread.h"
 #include <assert.h>
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+	#include <smmintrin.h>
+#endif
+#ifdef __AVX2__
+	#include <immintrin.h>
+#endif
 
 // make sure we don't use the libc rand() in this file!
 #define rand()	assert(!"Are you kidding me?!")
 
-uchar			gen_heightmap[HEIGHTMAP_SIZE * HEIGHTMAP_SIZE];
-ac_prop_t		*gen_proptree = NULL;
+uchar			*gen_heightmap = NULL;
+int				gen_heightmap_size = 0;
+int				gen_cloud_octaves = GEN_CLOUD_OCTAVES;
+gen_terrain_params_t	gen_terrain_params;
+ac_proptree_t	*gen_proptree = NULL;
 
 /// Seed for the internal pseudorandom number generator.
 static uint		gen_seed = 0;
@@ -21,6 +32,46 @@ int gen_rand(void) {
 	return gen_seed - 1;
 }
 
+/// Seed of the current world, for the counter-based generator.
+static uint		gen_world_seed = 0;
+
+/// Purposes of the counter-based random number streams.
+typedef enum {
+	GR_PROPMAP,		///< prop map random walk
+	GR_TREES,		///< trees of a prop map square
+	GR_BLDGS		///< buildings of a prop map square
+} gen_crand_purpose_t;
+
+/// Counter-based pseudorandom number stream. The numbers only depend on the
+/// world seed, the stream index, its purpose and the number of draws, so
+/// independent parts of the world may draw them in any order and on any thread.
+typedef struct {
+	uint	key;		///< hash of the seed, stream index and purpose
+	uint	ctr;		///< number of numbers drawn so far
+} gen_crand_t;
+
+/// 32-bit integer hash finalizer (from MurmurHash3).
+static inline uint gen_mix(uint h) {
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+/// Sets up the stream of the given index and purpose for the current world.
+static void gen_crand_init(gen_crand_t *r, uint index,
+							gen_crand_purpose_t purpose) {
+	r->key = gen_mix(gen_world_seed ^ gen_mix(index * 4 + purpose));
+	r->ctr = 0;
+}
+
+/// \return the next number of the stream; same range as \ref gen_rand
+static inline int gen_crand(gen_crand_t *r) {
+	return gen_mix(r->key + gen_mix(r->ctr++)) >> 1;
+}
+
 /// Perlin noise permutation table.
 static int p[] = { 151,160,137,91,90,15,
    131,13,201,95,96,53,194,233,7,225,140,36,103,30,69,142,8,99,37,240,21,10,23,
@@ -83,111 +134,422 @@ static float gen_perlin(float x, float y, float z) {
 #undef fade
 #undef lerp
 
-static void gen_cloudmap(char *dst, size_t size) {
-	size_t i, x, y, xoff, yoff;
-	int pix;
-	char *submaps[3];
-	char *c;
-	float freq;
+/// \brief Maximum absolute difference between the vectorized and the scalar
+/// Perlin noise.
+/// Both paths perform the very same IEEE single precision operations in the
+/// same order, so with SSE math they agree bit for bit; the slack is there for
+/// compilers that contract the scalar fade and lerp into fused multiply-adds
+/// or keep intermediates in x87 registers. A sample that is off by this much
+/// can only flip the rounding of a 127-scaled heightmap byte when it lies
+/// within 127 * 1e-5 of an integer.
+#define GEN_PERLIN_EPSILON	1e-5f
 
-	freq = 0.015 + 0.000001 * (float)((gen_rand() % 10000) - 5000);
+/// Returns \e t where \e mask is set, \e f elsewhere.
+static inline __m128 gen_select4(__m128 mask, __m128 t, __m128 f) {
+	return _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, f));
+}
 
-	for (x = 0; x < sizeof(submaps) / sizeof(submaps[0]); x++)
-		submaps[x] = malloc(size * size);
-
-	// fill the maps with noise
-	for (i = 0, c = dst;
-		i < 1 + sizeof(submaps) / sizeof(submaps[0]);
-		i++, freq *= 2.0) {
-		if (i > 0)
-			c = submaps[i - 1];
-		xoff = gen_rand() % (size * 2);
-		yoff = gen_rand() % (size * 2);
-		for (y = 0; y < size; y++) {
-			for (x = 0; x < size; x++)
-				c[y * size + x] = (char)(127.f
-					* gen_perlin(
-						(float)(x + xoff) * freq,
-						(float)(y + yoff) * freq,
-						sqrtf((x + xoff) * (y + yoff)) * freq));
-			g_loading_tick();
-		}
+/// Rounds towards negative infinity; SSE2 doesn't have a floor instruction.
+static inline __m128 gen_floor4(__m128 x, __m128i *i) {
+#ifdef __SSE4_1__
+	x = _mm_floor_ps(x);
+	*i = _mm_cvttps_epi32(x);
+	return x;
+#else
+	__m128 f, gt;
+	*i = _mm_cvttps_epi32(x);
+	f = _mm_cvtepi32_ps(*i);
+	// truncation rounds negative numbers up, correct that
+	gt = _mm_cmpgt_ps(f, x);
+	*i = _mm_add_epi32(*i, _mm_castps_si128(gt));	// mask is -1 where set
+	return _mm_sub_ps(f, _mm_and_ps(gt, _mm_set1_ps(1.f)));
+#endif
+}
+
+/// Vector counterpart of \ref fade; same operations in the same order.
+static inline __m128 gen_fade4(__m128 t) {
+	__m128 t3 = _mm_mul_ps(_mm_mul_ps(t, t), t);
+	__m128 p = _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.f)), _mm_set1_ps(15.f));
+	p = _mm_add_ps(_mm_mul_ps(t, p), _mm_set1_ps(10.f));
+	return _mm_mul_ps(t3, p);
+}
+
+static inline __m128 gen_lerp4(__m128 t, __m128 a, __m128 b) {
+	return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+}
+
+/// Branchless vector counterpart of \ref grad.
+static inline __m128 gen_grad4(__m128i hash, __m128 x, __m128 y, __m128 z) {
+	__m128i h = _mm_and_si128(hash, _mm_set1_epi32(15));
+	__m128 lt8 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+	__m128 lt4 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+	__m128 xz = _mm_castsi128_ps(_mm_or_si128(
+		_mm_cmpeq_epi32(h, _mm_set1_epi32(12)),
+		_mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+	__m128 u = gen_select4(lt8, x, y);
+	__m128 v = gen_select4(lt4, y, gen_select4(xz, x, z));
+	// move bits 0 and 1 of the hash into the sign bits to negate u and v
+	__m128 us = _mm_castsi128_ps(_mm_slli_epi32(h, 31));
+	__m128 vs = _mm_castsi128_ps(_mm_slli_epi32(
+		_mm_and_si128(h, _mm_set1_epi32(2)), 30));
+	return _mm_add_ps(_mm_xor_ps(u, us), _mm_xor_ps(v, vs));
+}
+
+/// 4-wide improved Perlin noise. SSE2 can't gather, so the permutation table
+/// lookups are done per lane; everything else is vectorized.
+static __m128 gen_perlin4(__m128 x, __m128 y, __m128 z) {
+	ALIGNED_16 int X[4], Y[4], Z[4], h[8][4];
+	__m128i xi, yi, zi;
+	__m128 u, v, w, x1, y1, z1, one = _mm_set1_ps(1.f);
+	int i, A, AA, AB, B, BA, BB;
+
+	// find unit cube that contains point and relative x, y, z of point in it
+	x = _mm_sub_ps(x, gen_floor4(x, &xi));
+	y = _mm_sub_ps(y, gen_floor4(y, &yi));
+	z = _mm_sub_ps(z, gen_floor4(z, &zi));
+	_mm_store_si128((__m128i *)X, _mm_and_si128(xi, _mm_set1_epi32(255)));
+	_mm_store_si128((__m128i *)Y, _mm_and_si128(yi, _mm_set1_epi32(255)));
+	_mm_store_si128((__m128i *)Z, _mm_and_si128(zi, _mm_set1_epi32(255)));
+	// compute fade curves for each of x, y, z
+	u = gen_fade4(x);
+	v = gen_fade4(y);
+	w = gen_fade4(z);
+	// hash coordinates of the 8 cube corners
+	for (i = 0; i < 4; i++) {
+		A  = p[X[i]] + Y[i];
+		AA = p[A & 255] + Z[i];
+		AB = p[(A + 1) & 255] + Z[i];
+		B  = p[(X[i] + 1) & 255] + Y[i];
+		BA = p[B & 255] + Z[i];
+		BB = p[(B + 1) & 255] + Z[i];
+		h[0][i] = p[AA & 255];
+		h[1][i] = p[BA & 255];
+		h[2][i] = p[AB & 255];
+		h[3][i] = p[BB & 255];
+		h[4][i] = p[(AA + 1) & 255];
+		h[5][i] = p[(BA + 1) & 255];
+		h[6][i] = p[(AB + 1) & 255];
+		h[7][i] = p[(BB + 1) & 255];
 	}
+	x1 = _mm_sub_ps(x, one);
+	y1 = _mm_sub_ps(y, one);
+	z1 = _mm_sub_ps(z, one);
+#define H(n)	_mm_load_si128((__m128i *)h[n])
+	// ...and add blended results from 8 corners of cube
+	return gen_lerp4(w,
+		gen_lerp4(v,
+			gen_lerp4(u, gen_grad4(H(0), x, y, z), gen_grad4(H(1), x1, y, z)),
+			gen_lerp4(u, gen_grad4(H(2), x, y1, z), gen_grad4(H(3), x1, y1, z))),
+		gen_lerp4(v,
+			gen_lerp4(u, gen_grad4(H(4), x, y, z1), gen_grad4(H(5), x1, y, z1)),
+			gen_lerp4(u, gen_grad4(H(6), x, y1, z1),
+				gen_grad4(H(7), x1, y1, z1))));
+#undef H
+}
 
-	// combine maps
-	for (y = 0; y < size; y++) {
-		for (x = 0; x < size; x++) {
-			for (i = 0, c = submaps[i];
-			i < sizeof(submaps) / sizeof(submaps[0]);
-			i++, c = submaps[i]) {
-				pix = (int)(dst[y * size + x])
-					+ (int)(c[y * size + x]) / (2 << i);
-				if (pix < -128)
-					pix = -128;
-				else if (pix > 127)
-					pix = 127;
-				dst[y * size + x] = (char)pix;
-			}
+#ifdef __AVX2__
+static inline __m256 gen_select8(__m256 mask, __m256 t, __m256 f) {
+	return _mm256_blendv_ps(f, t, mask);
+}
+
+static inline __m256 gen_fade8(__m256 t) {
+	__m256 t3 = _mm256_mul_ps(_mm256_mul_ps(t, t), t);
+	__m256 p = _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6.f)),
+		_mm256_set1_ps(15.f));
+	p = _mm256_add_ps(_mm256_mul_ps(t, p), _mm256_set1_ps(10.f));
+	return _mm256_mul_ps(t3, p);
+}
+
+static inline __m256 gen_lerp8(__m256 t, __m256 a, __m256 b) {
+	return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+static inline __m256 gen_grad8(__m256i hash, __m256 x, __m256 y, __m256 z) {
+	__m256i h = _mm256_and_si256(hash, _mm256_set1_epi32(15));
+	__m256 lt8 = _mm256_castsi256_ps(
+		_mm256_cmpgt_epi32(_mm256_set1_epi32(8), h));
+	__m256 lt4 = _mm256_castsi256_ps(
+		_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h));
+	__m256 xz = _mm256_castsi256_ps(_mm256_or_si256(
+		_mm256_cmpeq_epi32(h, _mm256_set1_epi32(12)),
+		_mm256_cmpeq_epi32(h, _mm256_set1_epi32(14))));
+	__m256 u = gen_select8(lt8, x, y);
+	__m256 v = gen_select8(lt4, y, gen_select8(xz, x, z));
+	__m256 us = _mm256_castsi256_ps(_mm256_slli_epi32(h, 31));
+	__m256 vs = _mm256_castsi256_ps(_mm256_slli_epi32(
+		_mm256_and_si256(h, _mm256_set1_epi32(2)), 30));
+	return _mm256_add_ps(_mm256_xor_ps(u, us), _mm256_xor_ps(v, vs));
+}
+
+/// 8-wide improved Perlin noise; AVX2 gathers do the table lookups.
+static __m256 gen_perlin8(__m256 x, __m256 y, __m256 z) {
+	const __m256i mask = _mm256_set1_epi32(255), one = _mm256_set1_epi32(1);
+	__m256i X, Y, Z, A, AA, AB, B, BA, BB;
+	__m256 fx, fy, fz, u, v, w, x1, y1, z1, onef = _mm256_set1_ps(1.f);
+
+	fx = _mm256_floor_ps(x);
+	fy = _mm256_floor_ps(y);
+	fz = _mm256_floor_ps(z);
+	X = _mm256_and_si256(_mm256_cvttps_epi32(fx), mask);
+	Y = _mm256_and_si256(_mm256_cvttps_epi32(fy), mask);
+	Z = _mm256_and_si256(_mm256_cvttps_epi32(fz), mask);
+	x = _mm256_sub_ps(x, fx);
+	y = _mm256_sub_ps(y, fy);
+	z = _mm256_sub_ps(z, fz);
+	u = gen_fade8(x);
+	v = gen_fade8(y);
+	w = gen_fade8(z);
+#define P(i)	_mm256_i32gather_epi32(p, _mm256_and_si256((i), mask), 4)
+#define P1(i)	P(_mm256_add_epi32((i), one))
+	A  = _mm256_add_epi32(P(X), Y);
+	AA = _mm256_add_epi32(P(A), Z);
+	AB = _mm256_add_epi32(P1(A), Z);
+	B  = _mm256_add_epi32(P1(X), Y);
+	BA = _mm256_add_epi32(P(B), Z);
+	BB = _mm256_add_epi32(P1(B), Z);
+	x1 = _mm256_sub_ps(x, onef);
+	y1 = _mm256_sub_ps(y, onef);
+	z1 = _mm256_sub_ps(z, onef);
+	return gen_lerp8(w,
+		gen_lerp8(v,
+			gen_lerp8(u, gen_grad8(P(AA), x, y, z), gen_grad8(P(BA), x1, y, z)),
+			gen_lerp8(u, gen_grad8(P(AB), x, y1, z),
+				gen_grad8(P(BB), x1, y1, z))),
+		gen_lerp8(v,
+			gen_lerp8(u, gen_grad8(P1(AA), x, y, z1),
+				gen_grad8(P1(BA), x1, y, z1)),
+			gen_lerp8(u, gen_grad8(P1(AB), x, y1, z1),
+				gen_grad8(P1(BB), x1, y1, z1))));
+#undef P1
+#undef P
+}
+#endif // __AVX2__
+
+/// \brief Evaluates Perlin noise for a run of points sharing the Y coordinate.
+/// Uses the widest vector unit available and falls back to \ref gen_perlin for
+/// the leftovers. The results are within \ref GEN_PERLIN_EPSILON of what
+/// \ref gen_perlin returns for the same points, which \ref gen_perlin_check
+/// verifies.
+/// \param out			output noise values
+/// \param x			X coordinates
+/// \param y			Y coordinate, common for all points
+/// \param z			Z coordinates
+/// \param n			number of points
+static void gen_perlin_run(float *out, const float *x, float y, const float *z,
+							int n) {
+	int i = 0;
+
+#ifdef __AVX2__
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(out + i, gen_perlin8(_mm256_loadu_ps(x + i),
+			_mm256_set1_ps(y), _mm256_loadu_ps(z + i)));
+#endif
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(out + i, gen_perlin4(_mm_loadu_ps(x + i),
+			_mm_set1_ps(y), _mm_loadu_ps(z + i)));
+	for (; i < n; i++)
+		out[i] = gen_perlin(x[i], y, z[i]);
+}
+
+/// Number of X and Z samples per row of the \ref gen_perlin_check sweep.
+#define GEN_PERLIN_CHECK_X	8192
+/// Number of Y rows of the \ref gen_perlin_check sweep.
+#define GEN_PERLIN_CHECK_Y	512
+
+bool gen_perlin_check(float *maxError) {
+	static float x[GEN_PERLIN_CHECK_X], z[GEN_PERLIN_CHECK_X],
+		out[GEN_PERLIN_CHECK_X];
+	float y, err;
+	int i, j;
+
+	// the X sweep hits every lattice plane in [-256, 256), i.e. every table
+	// entry from either side, exactly and in between; Z goes through the very
+	// same values, but shuffled by an odd stride, so that the corners are
+	// mixed up
+	for (i = 0; i < GEN_PERLIN_CHECK_X; i++)
+		x[i] = -256.f + i * (512.f / GEN_PERLIN_CHECK_X);
+	for (i = 0; i < GEN_PERLIN_CHECK_X; i++)
+		z[i] = x[(i * 3187) & (GEN_PERLIN_CHECK_X - 1)];
+	*maxError = 0.f;
+	for (j = 0; j < GEN_PERLIN_CHECK_Y; j++) {
+		y = -256.f + j * 1.0009765625f;
+		gen_perlin_run(out, x, y, z, GEN_PERLIN_CHECK_X);
+		for (i = 0; i < GEN_PERLIN_CHECK_X; i++) {
+			err = fabsf(out[i] - gen_perlin(x[i], y, z[i]));
+			if (err > *maxError)
+				*maxError = err;
 		}
-		g_loading_tick();
 	}
+	return *maxError <= GEN_PERLIN_EPSILON;
+}
 
-	for (x = 0; x < sizeof(submaps) / sizeof(submaps[0]); x++)
-		free(submaps[x]);
+/// Number of points fed to \ref gen_perlin_run at a time.
+#define GEN_PERLIN_RUN		256
+
+/// Number of heightmap rows handed out to a worker thread at a time.
+#define GEN_ROWS_PER_BATCH	16
+
+/// Terrain heightmap job; each row is evaluated on its own by
+/// \ref gen_terrain_span, so the rows may be processed in any order and by any
+/// thread.
+static void gen_terrain_rows(void *arg, int first, int last) {
+	int y;
+
+	for (y = first; y < last; y++)
+		gen_terrain_span(gen_heightmap + (size_t)y * gen_heightmap_size, 0, y,
+			gen_heightmap_size, 1);
 }
 
-void gen_terrain(int seed) {
-	int x, y, xoff, yoff, pix;
-	char *cloudmap = malloc(sizeof(gen_heightmap));
+bool gen_init(int size, int tileBudget) {
+	// the prop and terrain quadtrees both need a power of 2
+	if (size < HEIGHTMAP_SIZE_MIN || size > HEIGHTMAP_SIZE_MAX
+		|| (size & (size - 1)) || tileBudget < 0)
+		return false;
+	gen_shutdown();
+	gen_tile_budget = tileBudget;
+	// streamed worlds never hold the entire heightmap
+	if (!tileBudget && !(gen_heightmap = malloc((size_t)size * size)))
+		return false;
+	gen_heightmap_size = size;
+	return true;
+}
+
+void gen_shutdown(void) {
+	gen_tiles_stop();
+	gen_tile_budget = 0;
+	free(gen_heightmap);
+	gen_heightmap = NULL;
+	gen_heightmap_size = 0;
+}
+
+int gen_num_cloud_octaves(void) {
+	return gen_cloud_octaves < 1 ? 1
+		: (gen_cloud_octaves > GEN_MAX_CLOUD_OCTAVES
+		? GEN_MAX_CLOUD_OCTAVES : gen_cloud_octaves);
+}
+
+/// Draws all the terrain noise parameters, in the same order as always.
+static void gen_draw_terrain_params(int seed) {
+	gen_terrain_params_t *p = &gen_terrain_params;
 	float freq;
+	int i;
+
+	gen_world_seed = seed;
 
 	// HACK: this xor is a litle manipulation to keep a pre-bugfix landscape for
 	// a particular random seed (the seed used to be initialized after the
 	// frequency) while maintaining the randomness of the algorithm
 	gen_seed = seed ^ 0xDEADBEEF;
-	freq = 0.005 + 0.000001 * (float)((gen_rand() % 6000) - 3000);
+	p->base.freq = 0.005 + 0.000001 * (float)((gen_rand() % 6000) - 3000);
 	gen_seed = seed;
-	xoff = gen_rand() % (HEIGHTMAP_SIZE);
-	yoff = gen_rand() % (HEIGHTMAP_SIZE);
+	p->base.xoff = gen_rand() % (gen_heightmap_size);
+	p->base.yoff = gen_rand() % (gen_heightmap_size);
+
+	freq = 0.015 + 0.000001 * (float)((gen_rand() % 10000) - 5000);
+	p->numOctaves = gen_num_cloud_octaves();
+	for (i = 0; i < p->numOctaves; i++, freq *= 2.0) {
+		p->cloud[i].freq = freq;
+		p->cloud[i].xoff = gen_rand() % (gen_heightmap_size * 2);
+		p->cloud[i].yoff = gen_rand() % (gen_heightmap_size * 2);
+	}
+}
 
-	memset(gen_heightmap, 127, sizeof(gen_heightmap));
+/// Evaluates a single noise octave for a horizontal run of texels.
+static void gen_octave_run(const gen_octave_t *o, float *out, int x, int y,
+							int n, int stride) {
+	float px[GEN_PERLIN_RUN], pz[GEN_PERLIN_RUN];
+	int i, xo;
 
-	gen_cloudmap(cloudmap, HEIGHTMAP_SIZE);
+	assert(n <= GEN_PERLIN_RUN);
+	for (i = 0; i < n; i++) {
+		xo = x + i * stride + o->xoff;
+		px[i] = (float)xo * o->freq;
+		pz[i] = sqrtf(xo * (y + o->yoff)) * o->freq;
+	}
+	gen_perlin_run(out, px, (float)(y + o->yoff) * o->freq, pz, n);
+}
+
+/// Fractal cloud noise of a horizontal run of texels. All the octaves are
+/// accumulated per texel in registers, each one weighted half as much as the
+/// previous one, and the sum is kept in the signed byte range after each step.
+static void gen_cloud_span(int *out, int x, int y, int n, int stride) {
+	const gen_terrain_params_t *p = &gen_terrain_params;
+	float noise[GEN_PERLIN_RUN];
+	int i, o, pix;
 
-	for (y = 0; y < HEIGHTMAP_SIZE; y++) {
-		for (x = 0; x < HEIGHTMAP_SIZE; x++) {
+	assert(n <= GEN_PERLIN_RUN);
+	gen_octave_run(&p->cloud[0], noise, x, y, n, stride);
+	for (i = 0; i < n; i++)
+		out[i] = (char)(127.f * noise[i]);
+	for (o = 1; o < p->numOctaves; o++) {
+		gen_octave_run(&p->cloud[o], noise, x, y, n, stride);
+		for (i = 0; i < n; i++) {
+			pix = out[i] + (char)(127.f * noise[i]) / (1 << o);
+			if (pix < -128)
+				pix = -128;
+			else if (pix > 127)
+				pix = 127;
+			out[i] = pix;
+		}
+	}
+}
+
+void gen_terrain_span(uchar *out, int x, int y, int n, int stride) {
+	const gen_terrain_params_t *p = &gen_terrain_params;
+	float noise[GEN_PERLIN_RUN];
+	int cloud[GEN_PERLIN_RUN];
+	int i, m, pix;
+
+	for (; n > 0; n -= m, out += m, x += m * stride) {
+		m = n < GEN_PERLIN_RUN ? n : GEN_PERLIN_RUN;
+		gen_cloud_span(cloud, x, y, m, stride);
 #if 1
-			// pass 1 - rough topography
-			((char *)gen_heightmap)[y * HEIGHTMAP_SIZE + x] += (char)(127.f
-				* gen_perlin(
-					(float)(x + xoff) * freq,
-					(float)(y + yoff) * freq,
-					sqrtf((x + xoff) * (y + yoff)) * freq));
-#endif
-#if 0
-			// pass 2 - detail
-			freq *= 1.00002;
-			((char *)gen_heightmap)[y * HEIGHTMAP_SIZE + x] += (char)(127.f
-				* gen_perlin(
-					(float)(x + xoff) * freq,
-					(float)(y + yoff) * freq,
-					sqrtf((x + xoff) * (y + yoff)) * freq));
+		// pass 1 - rough topography
+		gen_octave_run(&p->base, noise, x, y, m, stride);
+		for (i = 0; i < m; i++)
+			out[i] = 127 + (char)(127.f * noise[i]);
 #endif
 #if 1
-			// pass 3 - cloud detail
-			pix = (int)(gen_heightmap[y * HEIGHTMAP_SIZE + x]) +
-				(int)(cloudmap[y * HEIGHTMAP_SIZE + x] / 2);
+		// pass 3 - cloud detail
+		for (i = 0; i < m; i++) {
+			pix = (int)out[i] + cloud[i] / 2;
 			if (pix < 0)
 				pix = 0;
 			else if (pix > 255)
 				pix = 255;
-			((char *)gen_heightmap)[y * HEIGHTMAP_SIZE + x] = pix;
-#endif
+			out[i] = pix;
 		}
-		g_loading_tick();
+#endif
 	}
+}
 
-	free(cloudmap);
+void gen_terrain_texels(uchar *out, int x, int y, int n) {
+	gen_terrain_span(out, x, y, n, 1);
+}
+
+void gen_terrain(int seed) {
+	const size_t hmapLen = (size_t)gen_heightmap_size * gen_heightmap_size;
+	const void *cached;
+	size_t len;
+
+	gen_draw_terrain_params(seed);
+
+	// streamed worlds generate their terrain tile by tile later on
+	if (!gen_heightmap) {
+		gen_tiles_start();
+		return;
+	}
+
+	if ((cached = gen_cache_get(CL_HEIGHTMAP, &len)) && len == hmapLen) {
+		memcpy(gen_heightmap, cached, len);
+		return;
+	}
+
+	// rows are independent of each other, spread them across the workers
+	ac_thread_parallel_for(gen_terrain_rows, NULL, gen_heightmap_size,
+		GEN_ROWS_PER_BATCH, g_loading_tick);
+
+	gen_cache_put(CL_HEIGHTMAP, gen_heightmap, hmapLen);
 }
 
 static float gen_sample_height(float x, float y) {
@@ -195,28 +557,75 @@ static float gen_sample_height(float x, float y) {
 	// bilinear filtering
 	float xi, yi, xfrac, yfrac;
 	float fR1, fR2;
+	const int size = gen_heightmap_size;
+	int i;
+	uchar h[4];
 
 	xfrac = modff(x, &xi);
 	yfrac = modff(y, &yi);
+	// props on the last row or column would sample past the end of the map
+	if (xi > size - 2) {
+		xi = size - 2;
+		xfrac = 1.f;
+	}
+	if (yi > size - 2) {
+		yi = size - 2;
+		yfrac = 1.f;
+	}
+
+	if (gen_heightmap) {
+		i = (int)yi * size + (int)xi;
+		h[0] = gen_heightmap[i];
+		h[1] = gen_heightmap[i + 1];
+		h[2] = gen_heightmap[i + size];
+		h[3] = gen_heightmap[i + size + 1];
+	} else {
+		// streamed world - evaluate the texels directly
+		gen_terrain_span(h, xi, yi, 2, 1);
+		gen_terrain_span(h + 2, xi, yi + 1, 2, 1);
+	}
 
 	// bilinear filtering
-	fR1 = (1.f - xfrac) * gen_heightmap[(int)yi * HEIGHTMAP_SIZE + (int)xi]
-		+ xfrac * gen_heightmap[(int)yi * HEIGHTMAP_SIZE + (int)xi + 1];
-	fR2 = (1.f - xfrac) * gen_heightmap[((int)yi + 1) * HEIGHTMAP_SIZE + (int)xi]
-		+ xfrac * gen_heightmap[((int)yi + 1) * HEIGHTMAP_SIZE + (int)xi + 1];
+	fR1 = (1.f - xfrac) * h[0] + xfrac * h[1];
+	fR2 = (1.f - xfrac) * h[2] + xfrac * h[3];
 	return ((1.f - yfrac) * fR1 + yfrac * fR2) * HEIGHT_SCALE;
 #else
 	// nearest filtering
-	return gen_heightmap[(int)roundf(y) * HEIGHTMAP_SIZE + (int)roundf(x)]
+	return gen_heightmap[(int)roundf(y) * gen_heightmap_size + (int)roundf(x)]
 		* HEIGHT_SCALE;
 #endif
 }
 
+/// Loads a set of generated resources from the world cache.
+/// \return false if there is no valid cache to load them from
+static bool gen_cache_load_resources(gen_lump_t texLump, uchar *texture,
+	size_t texLen, gen_lump_t vertLump, ac_vertex_t *verts, size_t numVerts,
+	gen_lump_t idxLump, uchar *indices, size_t numIndices) {
+	const void *tex, *v, *idx;
+	size_t len, vlen, ilen;
+
+	if (!(tex = gen_cache_get(texLump, &len)) || len != texLen
+		|| !(v = gen_cache_get(vertLump, &vlen))
+		|| vlen != numVerts * sizeof(*verts)
+		|| !(idx = gen_cache_get(idxLump, &ilen))
+		|| ilen != numIndices * sizeof(*indices))
+		return false;
+	memcpy(texture, tex, len);
+	memcpy(verts, v, vlen);
+	memcpy(indices, idx, ilen);
+	return true;
+}
+
 void gen_props(uchar *texture, ac_vertex_t *verts, uchar *indices) {
 	int i, l, base, vofs, iofs;
 	const float invScale = 1.f / (PROP_TEXTURE_SIZE - 1);
 	float rpi;
 
+	if (gen_cache_load_resources(CL_PROP_TEXTURE, texture,
+		PROP_TEXTURE_SIZE * PROP_TEXTURE_SIZE, CL_PROP_VERTS, verts,
+		PROP_NUM_VERTS, CL_PROP_INDICES, indices, PROP_NUM_INDICES))
+		return;
+
 	// generate vertices and indices
 
 	// trees
@@ -352,6 +761,11 @@ void gen_props(uchar *texture, ac_vertex_t *verts, uchar *indices) {
 	}
 
 	g_loading_tick();
+
+	gen_cache_put(CL_PROP_TEXTURE, texture,
+		PROP_TEXTURE_SIZE * PROP_TEXTURE_SIZE);
+	gen_cache_put(CL_PROP_VERTS, verts, vofs * sizeof(*verts));
+	gen_cache_put(CL_PROP_INDICES, indices, iofs * sizeof(*indices));
 }
 
 static inline float gen_smoothstep(float t) {
@@ -360,11 +774,17 @@ static inline float gen_smoothstep(float t) {
 
 void gen_fx(uchar *texture, ac_vertex_t *verts, uchar *indices) {
 	int i, j;
-	float d, x, y, z, f, perlin;
+	float d, x, y, f, perlin;
+	float px[FX_TEXTURE_SIZE], pz[FX_TEXTURE_SIZE], noise[FX_TEXTURE_SIZE];
 	const float r = (FX_TEXTURE_SIZE - 1) * 0.5;
 	const float invr = 1.f / r;
 	const float invr2 = invr * invr;
 
+	if (gen_cache_load_resources(CL_FX_TEXTURE, texture,
+		2 * FX_TEXTURE_SIZE * FX_TEXTURE_SIZE, CL_FX_VERTS, verts, 4,
+		CL_FX_INDICES, indices, 4))
+		return;
+
 	// geometry
 	for (i = 0; i < 4; i++) {
 		verts[i].pos = ac_vec_set(
@@ -380,12 +800,18 @@ void gen_fx(uchar *texture, ac_vertex_t *verts, uchar *indices) {
 	// texture
 	for (i = 0; i < FX_TEXTURE_SIZE; i++) {
 		y = (float)i - r;
+		// evaluate the noise for the entire row in one go
 		for (j = 0; j < FX_TEXTURE_SIZE; j++) {
 			x = (float)j - r;
 			// this won't give us an exact sphere, but it's close enough
-			z = -sinf(acosf(x * y * invr2));
+			px[j] = x * invr * 4;
+			pz[j] = -sinf(acosf(x * y * invr2)) * invr * 4;
+		}
+		gen_perlin_run(noise, px, y * invr * 4, pz, FX_TEXTURE_SIZE);
+		for (j = 0; j < FX_TEXTURE_SIZE; j++) {
+			x = (float)j - r;
 			d = sqrtf(x * x + y * y);
-			perlin = gen_perlin(x * invr * 4, y * invr * 4, z * invr * 4);
+			perlin = noise[j];
 			texture[(i * FX_TEXTURE_SIZE + j) * 2 + 0] = 225 + perlin * 30;
 			if (d <= r - 80.f)
 				texture[(i * FX_TEXTURE_SIZE + j) * 2 + 1] = 255;
@@ -399,12 +825,27 @@ void gen_fx(uchar *texture, ac_vertex_t *verts, uchar *indices) {
 		}
 		g_loading_tick();
 	}
+
+	gen_cache_put(CL_FX_TEXTURE, texture,
+		2 * FX_TEXTURE_SIZE * FX_TEXTURE_SIZE);
+	gen_cache_put(CL_FX_VERTS, verts, 4 * sizeof(*verts));
+	gen_cache_put(CL_FX_INDICES, indices, 4 * sizeof(*indices));
 }
 
 static uchar	*gen_propmap;
 
-static void gen_propmap_populate(int x, int y, int *counter, int *trace,
-									uchar value) {
+/// Maximum number of prop tree levels.
+#define GEN_MAX_PROP_LEVELS	16
+
+/// Number of prop tree levels; the root covers the entire prop map, the leaves
+/// are single prop map squares.
+static int		gen_prop_levels;
+/// Prop tree node index of every square of every level, in row-major order; -1
+/// for the squares without any props. Level \e l is (1 << l) squares wide.
+static int		*gen_propnode_index[GEN_MAX_PROP_LEVELS];
+
+static void gen_propmap_populate(gen_crand_t *r, int x, int y, int *counter,
+									int *trace, uchar value) {
 	int k;
 
 	if (x < 0 || x >= PROPMAP_SIZE || y < 0 || y >= PROPMAP_SIZE)
@@ -420,171 +861,407 @@ static void gen_propmap_populate(int x, int y, int *counter, int *trace,
 	if (!(*trace) || !(*counter))
 		return;
 	// try to recurse in one of the directions with a 33% chance
-	if (gen_rand() % 100 > 33)
-		gen_propmap_populate(x + 1, y, counter, trace, value);
-	if (*counter && gen_rand() % 100 > 33)
-		gen_propmap_populate(x + 1, y + 1, counter, trace, value);
-	if (*counter && gen_rand() % 100 > 33)
-		gen_propmap_populate(x, y + 1, counter, trace, value);
-	if (*counter && gen_rand() % 100 > 33)
-		gen_propmap_populate(x - 1, y + 1, counter, trace, value);
-	if (*counter && gen_rand() % 100 > 33)
-		gen_propmap_populate(x - 1, y, counter, trace, value);
-	if (*counter && gen_rand() % 100 > 33)
-		gen_propmap_populate(x - 1, y - 1, counter, trace, value);
-	if (*counter && gen_rand() % 100 > 33)
-		gen_propmap_populate(x, y - 1, counter, trace, value);
-	if (*counter && gen_rand() % 100 > 33)
-		gen_propmap_populate(x + 1, y - 1, counter, trace, value);
+	if (gen_crand(r) % 100 > 33)
+		gen_propmap_populate(r, x + 1, y, counter, trace, value);
+	if (*counter && gen_crand(r) % 100 > 33)
+		gen_propmap_populate(r, x + 1, y + 1, counter, trace, value);
+	if (*counter && gen_crand(r) % 100 > 33)
+		gen_propmap_populate(r, x, y + 1, counter, trace, value);
+	if (*counter && gen_crand(r) % 100 > 33)
+		gen_propmap_populate(r, x - 1, y + 1, counter, trace, value);
+	if (*counter && gen_crand(r) % 100 > 33)
+		gen_propmap_populate(r, x - 1, y, counter, trace, value);
+	if (*counter && gen_crand(r) % 100 > 33)
+		gen_propmap_populate(r, x - 1, y - 1, counter, trace, value);
+	if (*counter && gen_crand(r) % 100 > 33)
+		gen_propmap_populate(r, x, y - 1, counter, trace, value);
+	if (*counter && gen_crand(r) % 100 > 33)
+		gen_propmap_populate(r, x + 1, y - 1, counter, trace, value);
 }
 
 static void gen_create_propmap(void) {
 	const int numFields = PROPMAP_SIZE * PROPMAP_SIZE;
 	int treeFields = TREE_COVERAGE * numFields;
 	int bldgFields = BLDG_COVERAGE * numFields;
+	gen_crand_t r;
 
 	int trace;
 
+	// the random walks depend on each other through the occupied squares, so
+	// they stay serial; the prop map is tiny compared to its contents, though
+	gen_crand_init(&r, 0, GR_PROPMAP);
+
 	while (treeFields) {
-		trace = 1 + gen_rand() % 10;
-		gen_propmap_populate(gen_rand() % PROPMAP_SIZE,
-								gen_rand() % PROPMAP_SIZE,
+		trace = 1 + gen_crand(&r) % 10;
+		gen_propmap_populate(&r, gen_crand(&r) % PROPMAP_SIZE,
+								gen_crand(&r) % PROPMAP_SIZE,
 								&treeFields, &trace, 1);
 	}
 
 	g_loading_tick();
 
 	while (bldgFields) {
-		trace = 1 + gen_rand() % 4;
-		gen_propmap_populate(gen_rand() % PROPMAP_SIZE,
-								gen_rand() % PROPMAP_SIZE,
+		trace = 1 + gen_crand(&r) % 4;
+		gen_propmap_populate(&r, gen_crand(&r) % PROPMAP_SIZE,
+								gen_crand(&r) % PROPMAP_SIZE,
 								&bldgFields, &trace, 2);
 	}
 
 	g_loading_tick();
 }
 
-static ac_prop_t *gen_recurse_propmap(int *numTrees, ac_tree_t *trees,
-					int *numBldgs, ac_bldg_t *bldgs, int x, int y, int step) {
+/// Gathers every other bit of a Morton (Z-order) code; the X coordinate is in
+/// the even bits, so that the children of a square come out in the quad tree
+/// order.
+static inline uint gen_morton_compact(uint m) {
+	m &= 0x55555555;
+	m = (m | (m >> 1)) & 0x33333333;
+	m = (m | (m >> 2)) & 0x0F0F0F0F;
+	m = (m | (m >> 4)) & 0x00FF00FF;
+	m = (m | (m >> 8)) & 0x0000FFFF;
+	return m;
+}
+
+/// Allocates a prop tree with room for the given number of nodes. The header,
+/// the bounds and the nodes share a single block, so a single free() releases
+/// the entire tree.
+static ac_proptree_t *gen_alloc_proptree(int numNodes) {
+	// keep the bounds aligned for SSE
+	const size_t head = (sizeof(ac_proptree_t) + 15) & ~15;
+	ac_proptree_t *pt;
+
+	pt = malloc(head + numNodes * (2 * sizeof(ac_vec4_t) + sizeof(ac_prop_t)));
+	pt->numNodes = numNodes;
+	pt->bounds = (ac_vec4_t *)((uchar *)pt + head);
+	pt->nodes = (ac_prop_t *)(pt->bounds + 2 * numNodes);
+	return pt;
+}
+
+/// Sets the AABB of a prop tree node.
+/// \param bounds		pointer to the 2 points of the AABB
+/// \param x			X coordinate of the first prop map square of the node
+/// \param y			Y coordinate of the first prop map square of the node
+/// \param s			number of prop map squares per side of the node
+/// \param min			bottom of the AABB
+/// \param max			top of the AABB
+static void gen_set_propbounds(ac_vec4_t *bounds, int x, int y, int s,
+								float min, float max) {
+	bounds[0] = ac_vec_set(
+		(x << PROPMAP_SHIFT) - gen_heightmap_size / 2,
+		min,
+		(y << PROPMAP_SHIFT) - gen_heightmap_size / 2,
+		0);
+	bounds[1] = ac_vec_set(
+		((x + s) << PROPMAP_SHIFT) - gen_heightmap_size / 2,
+		max,
+		((y + s) << PROPMAP_SHIFT) - gen_heightmap_size / 2,
+		0);
+}
+
+/// Grows the AABB of a prop tree node to enclose a prop.
+/// \param bounds		pointer to the 2 points of the AABB
+/// \param pos			position of the prop
+/// \param rx			extent of the prop along the X axis
+/// \param rz			extent of the prop along the Z axis
+/// \param bottom		bottom of the prop
+/// \param top			top of the prop
+static void gen_grow_propbounds(ac_vec4_t *bounds, ac_vec4_t pos,
+								float rx, float rz, float bottom, float top) {
+	bounds[0].f[0] = ac_min(bounds[0].f[0], pos.f[0] - rx);
+	bounds[0].f[1] = ac_min(bounds[0].f[1], bottom);
+	bounds[0].f[2] = ac_min(bounds[0].f[2], pos.f[2] - rz);
+	bounds[1].f[0] = ac_max(bounds[1].f[0], pos.f[0] + rx);
+	bounds[1].f[1] = ac_max(bounds[1].f[1], top);
+	bounds[1].f[2] = ac_max(bounds[1].f[2], pos.f[2] + rz);
+}
+
+/// Fills a prop tree leaf with props and sets its bounds.
+static void gen_fill_propleaf(ac_proptree_t *pt, int n, int x, int y) {
+	const int k = y * PROPMAP_SIZE + x;
+	ac_prop_t *node = &pt->nodes[n];
+	ac_vec4_t *bounds = &pt->bounds[n * 2];
 	int i;
-	float tx, tz, min, max;
+	float tx, tz, h, c, s;
+	ac_tree_t *t;
+	ac_bldg_t *b;
+	gen_crand_t r;
+
+	// start with the square and an empty height range, and grow it until it
+	// encloses all of the props, which may stick out of the square
+	gen_set_propbounds(bounds, x, y, 1, FLT_MAX, -FLT_MAX);
+
+	if (node->trees >= 0) {
+		gen_crand_init(&r, k, GR_TREES);
+		t = &pt->trees[node->trees];
+		for (i = 0; i < TREES_PER_FIELD; i++) {
+			tx = (x << PROPMAP_SHIFT) + 0.01 * (gen_crand(&r)
+				% ((1 << PROPMAP_SHIFT) * 100));
+			tz = (y << PROPMAP_SHIFT) + 0.01 * (gen_crand(&r)
+				% ((1 << PROPMAP_SHIFT) * 100));
+			h = gen_sample_height(tx, tz);
+			t[i].pos = ac_vec_set(
+				tx - gen_heightmap_size * 0.5,
+				h,
+				tz - gen_heightmap_size * 0.5,
+				1.f);
+			t[i].ang = (gen_crand(&r) % 360) / 180.f * M_PI;
+			t[i].XZscale = 1.0 + 0.001 * (gen_crand(&r) % 1201);
+			t[i].Yscale = 2.4 + 0.001 * (gen_crand(&r) % 3201);
+			// the cone spans from 0.1 of its height below the origin to its
+			// height above it
+			gen_grow_propbounds(bounds, t[i].pos, t[i].XZscale, t[i].XZscale,
+				h - 0.1 * t[i].Yscale, h + t[i].Yscale);
+		}
+	} else {
+		gen_crand_init(&r, k, GR_BLDGS);
+		b = &pt->bldgs[node->bldgs];
+		for (i = 0; i < BLDGS_PER_FIELD; i++) {
+			tx = (x << PROPMAP_SHIFT) + 0.01 * (gen_crand(&r)
+				% ((1 << PROPMAP_SHIFT) * 100));
+			tz = (y << PROPMAP_SHIFT) + 0.01 * (gen_crand(&r)
+				% ((1 << PROPMAP_SHIFT) * 100));
+			h = gen_sample_height(tx, tz);
+			b[i].pos = ac_vec_set(
+				tx - gen_heightmap_size * 0.5,
+				h,
+				tz - gen_heightmap_size * 0.5,
+				1.f);
+			b[i].ang = ((gen_crand(&r) % 4) * 90 - 10
+				+ gen_crand(&r) % 21) / 180.f * M_PI;
+			b[i].Xscale = 5 + 0.001 * (gen_crand(&r) % 2001);
+			b[i].Zscale = 7 + 0.001 * (gen_crand(&r) % 3001);
+			b[i].Yscale = 2.8 + 0.001 * (gen_crand(&r) % 3001);
+			b[i].slantedRoof = gen_crand(&r) % 100 >= 33;
+			// the box spans from -1 to 1 (1.4 at the ridge of a slanted
+			// roof) along the Y axis, and the rotated unit square of its base
+			// is stretched along the world X and Z axes
+			c = fabsf(cosf(b[i].ang));
+			s = fabsf(sinf(b[i].ang));
+			gen_grow_propbounds(bounds, b[i].pos,
+				0.5f * b[i].Xscale * (c + s), 0.5f * b[i].Zscale * (c + s),
+				h - b[i].Yscale,
+				h + b[i].Yscale * (b[i].slantedRoof ? 1.4f : 1.f));
+		}
+	}
+}
+
+static void gen_propleaf_rows(void *arg, int first, int last) {
+	const int *index = gen_propnode_index[gen_prop_levels - 1];
+	int m, x, y;
+
+	// the range is in Morton order, so that each batch is a compact block
+	for (m = first; m < last; m++) {
+		x = gen_morton_compact(m);
+		y = gen_morton_compact(m >> 1);
+		if (index[y * PROPMAP_SIZE + x] >= 0)
+			gen_fill_propleaf(arg, index[y * PROPMAP_SIZE + x], x, y);
+	}
+}
+
+/// Builds the prop tree out of the prop map. The nodes are numbered level by
+/// level, in Morton order within each level, which makes for a breadth-first
+/// layout in which the children of every node are adjacent. Every square draws
+/// its random numbers from its own stream and gets its prop list range up
+/// front, so the leaves are filled in parallel and the result does not depend
+/// on the number of threads.
+static ac_proptree_t *gen_build_proptree(int *numTrees, ac_tree_t *trees,
+					int *numBldgs, ac_bldg_t *bldgs) {
+	const int leaves = gen_prop_levels - 1;
+	ac_proptree_t *pt;
 	ac_prop_t *node;
+	int l, dim, x, y, m, k, i, c, numNodes = 0;
+	int *index, *below;
+	ac_vec4_t *bounds;
 
-	min = FLT_MAX;
-	max = -FLT_MAX;
-
-	if (step < 1) {
-		float h;
-		switch (gen_propmap[y * PROPMAP_SIZE + x]) {
-			case 0:
-				return NULL;
-			case 1:	// tree node
-				node = calloc(1, sizeof(ac_prop_t));
-				node->trees = &trees[*numTrees];
-				for (i = 0; i < TREES_PER_FIELD; i++) {
-					tx = (x << PROPMAP_SHIFT) + 0.01 * (gen_rand()
-						% ((1 << PROPMAP_SHIFT) * 100));
-					tz = (y << PROPMAP_SHIFT) + 0.01 * (gen_rand()
-						% ((1 << PROPMAP_SHIFT) * 100));
-					h = gen_sample_height(tx, tz);
-					trees[i + *numTrees].pos = ac_vec_set(
-						tx - HEIGHTMAP_SIZE * 0.5,
-						h,
-						tz - HEIGHTMAP_SIZE * 0.5,
-						1.f);
-					trees[i + *numTrees].ang =
-						(gen_rand() % 360) / 180.f * M_PI;
-					trees[i + *numTrees].XZscale =
-						1.0 + 0.001 * (gen_rand() % 1201);
-					trees[i + *numTrees].Yscale =
-						2.4 + 0.001 * (gen_rand() % 3201);
-					if (h - 0.1 < min)
-						min = h - 0.1;
-					else if (h + trees[i + *numTrees].Yscale > max)
-						max = h + trees[i + *numTrees].Yscale;
+	// mark the occupied squares, bottom-up
+	for (l = leaves; l >= 0; l--) {
+		dim = 1 << l;
+		index = gen_propnode_index[l];
+		below = gen_propnode_index[l + 1];
+		for (y = 0, k = 0; y < dim; y++) {
+			for (x = 0; x < dim; x++, k++) {
+				if (l == leaves)
+					index[k] = gen_propmap[k] ? 0 : -1;
+				else {
+					i = 2 * y * 2 * dim + 2 * x;
+					index[k] = below[i] < 0 && below[i + 1] < 0
+						&& below[i + 2 * dim] < 0 && below[i + 2 * dim + 1] < 0
+						? -1 : 0;
 				}
-				(*numTrees) += TREES_PER_FIELD;
-				break;
-			case 2:	// building node
-				node = calloc(1, sizeof(ac_prop_t));
-				node->bldgs = &bldgs[*numBldgs];
-				for (i = 0; i < BLDGS_PER_FIELD; i++) {
-					tx = (x << PROPMAP_SHIFT) + 0.01 * (gen_rand()
-						% ((1 << PROPMAP_SHIFT) * 100));
-					tz = (y << PROPMAP_SHIFT) + 0.01 * (gen_rand()
-						% ((1 << PROPMAP_SHIFT) * 100));
-					h = gen_sample_height(tx, tz);
-					bldgs[i + *numBldgs].pos = ac_vec_set(
-						tx - HEIGHTMAP_SIZE * 0.5,
-						h,
-						tz - HEIGHTMAP_SIZE * 0.5,
-						1.f);
-					bldgs[i + *numBldgs].ang =
-						((gen_rand() % 4) * 90 - 10 + gen_rand() % 21)
-							/ 180.f * M_PI;
-					bldgs[i + *numBldgs].Xscale =
-						5 + 0.001 * (gen_rand() % 2001);
-					bldgs[i + *numBldgs].Zscale =
-						7 + 0.001 * (gen_rand() % 3001);
-					bldgs[i + *numBldgs].Yscale =
-						2.8 + 0.001 * (gen_rand() % 3001);
-					bldgs[i + *numBldgs].slantedRoof =
-						gen_rand() % 100 >= 33;
-					if (h - 1 < min)
-						min = h - 1;
-					/*else if (h + bldgs[i + *numBldgs].Yscale > max)
-						max = h + bldgs[i + *numBldgs].Yscale;*/
+			}
+		}
+	}
+
+	// number the nodes, top-down
+	for (l = 0; l <= leaves; l++) {
+		index = gen_propnode_index[l];
+		for (m = 0; m < 1 << (2 * l); m++) {
+			k = (gen_morton_compact(m >> 1) << l) + gen_morton_compact(m);
+			if (index[k] >= 0)
+				index[k] = numNodes++;
+		}
+	}
+	if (!numNodes)
+		return NULL;
+
+	pt = gen_alloc_proptree(numNodes);
+	pt->trees = trees;
+	pt->bldgs = bldgs;
+
+	// link the branches and hand out the prop list ranges; the leaves are
+	// visited in the same order as before, so the lists stay the same
+	for (l = 0; l <= leaves; l++) {
+		dim = 1 << l;
+		index = gen_propnode_index[l];
+		below = gen_propnode_index[l + 1];
+		for (y = 0, k = 0; y < dim; y++) {
+			for (x = 0; x < dim; x++, k++) {
+				if (index[k] < 0)
+					continue;
+				node = &pt->nodes[index[k]];
+				node->child = 0;
+				node->numChildren = 0;
+				node->trees = -1;
+				node->bldgs = -1;
+				if (l < leaves) {
+					i = 2 * y * 2 * dim + 2 * x;
+					for (m = 0; m < 4; m++) {
+						c = below[i + (m & 1) + (m >> 1) * 2 * dim];
+						if (c < 0)
+							continue;
+						if (!node->numChildren++)
+							node->child = c;
+					}
 				}
-				// HACK: for some reason the calculated heights are insufficient
-				max = HEIGHT + 5.8;
-				(*numBldgs) += BLDGS_PER_FIELD;
-				break;
+			}
 		}
-	} else {
-		ac_prop_t *c1, *c2, *c3, *c4;
-		c1 = gen_recurse_propmap(numTrees, trees, numBldgs, bldgs,
-								x, y, step / 2);
-		c2 = gen_recurse_propmap(numTrees, trees, numBldgs, bldgs,
-								x + step, y, step / 2);
-		c3 = gen_recurse_propmap(numTrees, trees, numBldgs, bldgs,
-								x, y + step, step / 2);
-		c4 = gen_recurse_propmap(numTrees, trees, numBldgs, bldgs,
-								x + step, y + step, step / 2);
-		if (!c1 && !c2 && !c3 && !c4)
-			// no children, no point in creating a node
-			return NULL;
-		node = calloc(1, sizeof(ac_prop_t));
-		// don't try to check the bounds of NULL children
-		min = ac_min(c1 ? c1->bounds[0].f[1] : FLT_MAX,
-			ac_min(c2 ? c2->bounds[0].f[1] : FLT_MAX,
-				ac_min(c3 ? c3->bounds[0].f[1] : FLT_MAX,
-					c4 ? c4->bounds[0].f[1] : FLT_MAX)));
-		max = ac_max(c1 ? c1->bounds[1].f[1] : -FLT_MAX,
-			ac_max(c2 ? c2->bounds[1].f[1] : -FLT_MAX,
-				ac_max(c3 ? c3->bounds[1].f[1] : -FLT_MAX,
-					c4 ? c4->bounds[1].f[1] : -FLT_MAX)));
-		node->child[0] = c1;
-		node->child[1] = c2;
-		node->child[2] = c3;
-		node->child[3] = c4;
 	}
-	node->bounds[0] = ac_vec_set(
-		(x << PROPMAP_SHIFT) - HEIGHTMAP_SIZE / 2,
-		min,
-		(y << PROPMAP_SHIFT) - HEIGHTMAP_SIZE / 2,
-		0);
-	node->bounds[1] = ac_vec_set(
-		((x + step * 2) << PROPMAP_SHIFT) - HEIGHTMAP_SIZE / 2,
-		max,
-		((y + step * 2) << PROPMAP_SHIFT) - HEIGHTMAP_SIZE / 2,
-		0);
-	return node;
+	index = gen_propnode_index[leaves];
+	for (m = 0; m < 1 << (2 * leaves); m++) {
+		k = (gen_morton_compact(m >> 1) << leaves) + gen_morton_compact(m);
+		if (index[k] < 0)
+			continue;
+		node = &pt->nodes[index[k]];
+		if (gen_propmap[k] == 1) {
+			node->trees = *numTrees;
+			*numTrees += TREES_PER_FIELD;
+		} else {
+			node->bldgs = *numBldgs;
+			*numBldgs += BLDGS_PER_FIELD;
+		}
+	}
+
+	ac_thread_parallel_for(gen_propleaf_rows, pt,
+		PROPMAP_SIZE * PROPMAP_SIZE, PROPMAP_SIZE, NULL);
+
+	// the branches enclose their children; the children always come after
+	// their parents, so a single backwards pass does it
+	for (l = leaves - 1; l >= 0; l--) {
+		dim = 1 << l;
+		index = gen_propnode_index[l];
+		for (y = 0, k = 0; y < dim; y++) {
+			for (x = 0; x < dim; x++, k++) {
+				if (index[k] < 0)
+					continue;
+				node = &pt->nodes[index[k]];
+				bounds = &pt->bounds[index[k] * 2];
+				gen_set_propbounds(bounds, x << (leaves - l),
+					y << (leaves - l), 1 << (leaves - l), FLT_MAX, -FLT_MAX);
+				// the props of the children may stick out of the square
+				for (i = node->child; i < node->child + node->numChildren;
+					i++) {
+					for (c = 0; c < 3; c++) {
+						bounds[0].f[c] = ac_min(bounds[0].f[c],
+							pt->bounds[i * 2].f[c]);
+						bounds[1].f[c] = ac_max(bounds[1].f[c],
+							pt->bounds[i * 2 + 1].f[c]);
+					}
+				}
+			}
+		}
+	}
+
+	return pt;
+}
+
+/// Loads the prop lists and the prop tree from the world cache.
+/// \return false if there is no valid cache to load them from
+static bool gen_cache_load_proplists(int *numTrees, ac_tree_t *trees,
+					int *numBldgs, ac_bldg_t *bldgs) {
+	const ac_prop_t *nodes;
+	const ac_vec4_t *bounds;
+	const void *t, *b;
+	size_t tlen, blen, nlen, bbLen;
+	int i, numNodes;
+
+	if (!(t = gen_cache_get(CL_TREES, &tlen))
+		|| !(b = gen_cache_get(CL_BLDGS, &blen))
+		|| !(nodes = gen_cache_get(CL_PROPTREE, &nlen))
+		|| !(bounds = gen_cache_get(CL_PROPBOUNDS, &bbLen))
+		|| tlen > MAX_NUM_TREES * sizeof(*trees)
+		|| blen > MAX_NUM_BLDGS * sizeof(*bldgs)
+		|| nlen < sizeof(*nodes)
+		|| bbLen != nlen / sizeof(*nodes) * 2 * sizeof(*bounds))
+		return false;
+	numNodes = nlen / sizeof(*nodes);
+	*numTrees = tlen / sizeof(*trees);
+	*numBldgs = blen / sizeof(*bldgs);
+	// the children always follow their parent, only the leaves have props,
+	// either trees or buildings, and a whole square's worth of them, so a
+	// damaged file can't send a traversal out of the arrays or round in
+	// circles
+	for (i = 0; i < numNodes; i++) {
+		if (nodes[i].numChildren < 0 || (nodes[i].numChildren > 0
+			&& (nodes[i].child <= i
+			|| nodes[i].child > numNodes - nodes[i].numChildren)))
+			return false;
+		if (nodes[i].numChildren > 0
+			? nodes[i].trees != -1 || nodes[i].bldgs != -1
+			: (nodes[i].trees == -1) == (nodes[i].bldgs == -1))
+			return false;
+		if (nodes[i].trees != -1 && (nodes[i].trees < 0
+			|| nodes[i].trees % TREES_PER_FIELD
+			|| nodes[i].trees > *numTrees - TREES_PER_FIELD))
+			return false;
+		if (nodes[i].bldgs != -1 && (nodes[i].bldgs < 0
+			|| nodes[i].bldgs % BLDGS_PER_FIELD
+			|| nodes[i].bldgs > *numBldgs - BLDGS_PER_FIELD))
+			return false;
+	}
+	memcpy(trees, t, tlen);
+	memcpy(bldgs, b, blen);
+
+	// the tree has no pointers in it, so it's copied verbatim
+	gen_proptree = gen_alloc_proptree(numNodes);
+	gen_proptree->trees = trees;
+	gen_proptree->bldgs = bldgs;
+	memcpy(gen_proptree->nodes, nodes, numNodes * sizeof(*nodes));
+	memcpy(gen_proptree->bounds, bounds, bbLen);
+	return true;
 }
 
 void gen_proplists(int *numTrees, ac_tree_t *trees,
 					int *numBldgs, ac_bldg_t *bldgs) {
+	int l, numSquares = 0;
+	int *index;
+
+	if (gen_cache_load_proplists(numTrees, trees, numBldgs, bldgs))
+		return;
+
 	gen_propmap = malloc(sizeof(*gen_propmap) * PROPMAP_SIZE * PROPMAP_SIZE);
 	memset(gen_propmap, 0, sizeof(*gen_propmap) * PROPMAP_SIZE * PROPMAP_SIZE);
+	for (gen_prop_levels = 1; 1 << (gen_prop_levels - 1) < PROPMAP_SIZE;
+		gen_prop_levels++);
+	assert(gen_prop_levels < GEN_MAX_PROP_LEVELS);
+	for (l = 0; l < gen_prop_levels; l++)
+		numSquares += 1 << (2 * l);
+	// the levels share a single allocation
+	index = malloc(sizeof(*index) * numSquares);
+	for (l = 0; l < gen_prop_levels; l++) {
+		gen_propnode_index[l] = index;
+		index += 1 << (2 * l);
+	}
+	gen_propnode_index[gen_prop_levels] = NULL;
 
 	*numTrees = 0;
 	*numBldgs = 0;
@@ -593,25 +1270,25 @@ void gen_proplists(int *numTrees, ac_tree_t *trees,
 	gen_create_propmap();
 
 	// use the propmap to place the actual objects
-	gen_proptree = gen_recurse_propmap(numTrees, trees, numBldgs, bldgs,
-							0, 0, PROPMAP_SIZE / 2);
+	gen_proptree = gen_build_proptree(numTrees, trees, numBldgs, bldgs);
 
 	g_loading_tick();
 
 	free(gen_propmap);
-}
+	free(gen_propnode_index[0]);
 
-void gen_free_proptree(ac_prop_t *n) {
-	int i;
-	if (n == NULL)
-		n = gen_proptree;
-	// it's enough to just check the existence of the 1st child because a node
-	// will always either have 4 children or none
-	if (n->trees == NULL && n->bldgs == NULL) {
-		for (i = 0; i < 4; i++) {
-			if (n->child[i])
-				gen_free_proptree(n->child[i]);
-		}
+	gen_cache_put(CL_TREES, trees, *numTrees * sizeof(*trees));
+	gen_cache_put(CL_BLDGS, bldgs, *numBldgs * sizeof(*bldgs));
+	if (gen_proptree) {
+		gen_cache_put(CL_PROPTREE, gen_proptree->nodes,
+			gen_proptree->numNodes * sizeof(*gen_proptree->nodes));
+		gen_cache_put(CL_PROPBOUNDS, gen_proptree->bounds,
+			gen_proptree->numNodes * 2 * sizeof(*gen_proptree->bounds));
 	}
-	free(n);
+}
+
+void gen_free_proptree(void) {
+	// the entire tree is a single block
+	free(gen_proptree);
+	gen_proptree = NULL;
 }
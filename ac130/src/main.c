@@ -6,10 +6,27 @@
 #include <string.h>
 #include <time.h>
 #include "ac130.h"
+#include "ac_thread.h"
+#include "ac_replay.h"
 
 int m_screen_width = 1024;
 int m_screen_height = 768;
 bool m_full_screen = true;
+bool m_serial = false;
+bool m_instanced_troops = true;
+int m_world_size = HEIGHTMAP_SIZE_DEFAULT;
+/// Terrain tile memory budget in megabytes, 0 if the terrain is not streamed.
+static int m_tile_budget = 0;
+/// Set to disable the world cache.
+static bool m_nocache = false;
+/// Path of the input log to record to, NULL if not recording.
+static const char *m_record = NULL;
+/// Path of the input log to replay, NULL if not replaying.
+static const char *m_replay = NULL;
+/// Number of frames of the game world to run before quitting, 0 if unlimited.
+static uint m_max_frames = 0;
+/// Number of frames an unattended run fires each of the guns for.
+#define SOAK_GUN_FRAMES		1000
 
 static void parse_args(int argc, char *argv[]) {
 	int i;
@@ -22,6 +39,52 @@ static void parse_args(int argc, char *argv[]) {
 			m_full_screen = false;
 			continue;
 		}
+		if (!strcmp(argv[i], "-serial")) {
+			m_serial = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "-noinstanced")) {
+			m_instanced_troops = false;
+			continue;
+		}
+		if (!strcmp(argv[i], "-nocache")) {
+			m_nocache = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "-size") && i + 1 < argc) {
+			m_world_size = atoi(argv[++i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "-octaves") && i + 1 < argc) {
+			gen_cloud_octaves = atoi(argv[++i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "-stream") && i + 1 < argc) {
+			m_tile_budget = atoi(argv[++i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "-tickrate") && i + 1 < argc) {
+			g_tick_rate = atoi(argv[++i]);
+			if (g_tick_rate < 10)
+				g_tick_rate = 10;
+			continue;
+		}
+		if (!strcmp(argv[i], "-troops") && i + 1 < argc) {
+			g_troop_count = atoi(argv[++i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "-record") && i + 1 < argc) {
+			m_record = argv[++i];
+			continue;
+		}
+		if (!strcmp(argv[i], "-replay") && i + 1 < argc) {
+			m_replay = argv[++i];
+			continue;
+		}
+		if (!strcmp(argv[i], "-frames") && i + 1 < argc) {
+			m_max_frames = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
 		if (!strcmp(argv[i], "-r") && i + 1 < argc) {
 			char buf[32];
 			float aspect;
@@ -55,34 +118,96 @@ static void parse_args(int argc, char *argv[]) {
 int main (int argc, char *argv[]) {
 	Uint32		prevTime;	/// Time of the previous frame time in milliseconds.
 	Uint32		curTime;	/// Time of the current frame time in milliseconds.
+	uint		frameMs;	/// \ref curTime - \ref prevTime
 	float		frameTime;	/// \ref curTime - \ref prevTime / 1000 (in seconds)
+	uint		gameTicks;	/// Time of the frame as seen by the game.
 	SDL_Event	event;
 	ac_input_t	prevInput;
 	ac_input_t	curInput;
 	bool		done;
+	bool		loading = true;
 	uint		frameCount = 0;
 	uint		vertCount = 0;
 	uint		triCount = 0;
 	uint		dpCount = 0;
 	uint		cpCount = 0;
 	uint		frameCountTime;
+	uint		worldFrames = 0;
+	int			status = 0;
+	bool		soak;
+	ac_replay_info_t	replay;
 
 	parse_args(argc, argv);
+	// a frame limit without a log to record or replay makes for an unattended
+	// run, which needs neither a player nor a clock
+	soak = m_max_frames && !m_replay && !m_record;
 
-	// initialize SDL
-	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0) {
+	// a replay must play out in the very same world as the recording
+	if (m_replay) {
+		if (!ac_replay_play(m_replay, &replay)) {
+			fprintf(stderr, "Unable to read input log %s\n", m_replay);
+			return 1;
+		}
+		m_record = NULL;
+		g_seed = replay.seed;
+		m_world_size = replay.worldSize;
+		m_tile_budget = replay.tileBudget;
+		g_tick_rate = replay.tickRate;
+		g_troop_count = replay.troops;
+		gen_cloud_octaves = replay.octaves;
+	} else if (soak) {
+		// unattended runs always play the same game, so that two runs of the
+		// same length end up in the same state
+		g_seed = 0;
+	} else
+		g_seed = (uint)time(NULL);
+
+	// initialize SDL; the renderer brings up the video subsystem, if it needs
+	// one at all
+	if (SDL_Init(SDL_INIT_TIMER) < 0) {
 		fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
 		return 1;
 	}
 
+	// start the worker threads before anything gets generated
+	if (!ac_thread_init(m_serial ? 0 : -1)) {
+		fprintf(stderr, "Unable to start worker threads\n");
+		return 1;
+	}
+
+	// allocate the world storage
+	if (!gen_init(m_world_size, m_tile_budget)) {
+		fprintf(stderr, "Invalid world size %d; must be a power of 2 between "
+			"%d and %d\n", m_world_size, HEIGHTMAP_SIZE_MIN, HEIGHTMAP_SIZE_MAX);
+		return 1;
+	}
+
+	// map the world cache so that the generator can skip the heavy lifting;
+	// streamed worlds have no heightmap to cache
+	if (!m_nocache && !m_tile_budget)
+		gen_cache_open(GEN_WORLD_SEED);
+
 	// initialize renderer
 	if (!r_init(&vertCount, &triCount, &dpCount, &cpCount)) {
 		fprintf(stderr, "Unable to init renderer\n");
 		return 1;
 	}
 
-	// initialize the system random number generator
-	srand((uint)time(NULL));
+	// start recording the input; the log begins with everything a replay
+	// needs to set up the same game
+	if (m_record) {
+		memset(&replay, 0, sizeof(replay));
+		replay.seed = g_seed;
+		replay.worldSize = m_world_size;
+		replay.tileBudget = m_tile_budget;
+		replay.tickRate = g_tick_rate;
+		replay.troops = g_troop_count;
+		replay.octaves = gen_cloud_octaves;
+		if (!ac_replay_record(m_record, &replay)) {
+			fprintf(stderr, "Unable to create input log %s\n", m_record);
+			return 1;
+		}
+	}
 
 	// set window caption to say that we're working
 	SDL_WM_SetCaption("AC-130 - Generating resources, please wait...",
@@ -104,12 +229,10 @@ int main (int argc, char *argv[]) {
 	memset(&prevInput, 0, sizeof(prevInput));
 	memset(&curInput, 0, sizeof(curInput));
 
-	// initialize game logic
+	// initialize game logic; the world is generated in the background while
+	// the main loop shows the loading screen
 	g_init();
 
-	// update window caption to say that we're done generating stuff
-	SDL_WM_SetCaption("AC-130", "AC-130");
-
 	memset(&prevInput, 0, sizeof(prevInput));
 
 	// initialize tick counter
@@ -130,7 +253,8 @@ int main (int argc, char *argv[]) {
 	done = false;
 	while (!done) {
 		curTime = SDL_GetTicks();
-		frameTime = (float)(curTime - prevTime) * 0.001;
+		frameMs = curTime - prevTime;
+		frameTime = (float)frameMs * 0.001;
 		prevTime = curTime;
 
 		memset(&curInput, 0, sizeof(curInput));
@@ -199,6 +323,7 @@ int main (int argc, char *argv[]) {
 		// show fps
 		if (curTime - frameCountTime >= 2000) {
 			float perFrameScale = 1.f / (float)frameCount;
+			ac_pool_stats_t projs;
 			printf("%.0f FPS, %.0f tris/%.0f verts, "
 					"%.0f/%.0f terrain patches culled (per frame)\n",
 					(float)frameCount
@@ -207,11 +332,43 @@ int main (int argc, char *argv[]) {
 					(float)vertCount * perFrameScale,
 					(float)cpCount * perFrameScale,
 					(float)(dpCount + cpCount) * perFrameScale);
+			g_projectile_stats(&projs);
+			printf("%d/%d projectiles in flight (peak %d, %d dropped)\n",
+					projs.live, projs.capacity, projs.peak, projs.drops);
 			frameCountTime = curTime;
 			frameCount = triCount = vertCount = dpCount = cpCount = 0;
 		}
 
-		g_frame(curTime, frameTime, &curInput);
+		// the loading screen isn't recorded, as it takes a different number
+		// of frames every time
+		if (m_replay && !loading) {
+			// the log stands in for both the clock and the player
+			if (!ac_replay_read(&curInput, &gameTicks, &frameMs))
+				break;
+			frameTime = (float)frameMs * 0.001;
+		} else if (soak && !loading) {
+			// nobody is there to start the game, so keep the trigger held
+			// down, which starts it and then fires each of the guns in turn;
+			// the world steps by exactly one tick per frame, so that a run
+			// covers the same stretch of the game however fast it goes
+			curInput.flags |= INPUT_MOUSE_LEFT
+				| (INPUT_1 << (worldFrames / SOAK_GUN_FRAMES % 3));
+			gameTicks = (uint)((worldFrames + 1) * 1000.0
+				/ g_tick_rate);
+			frameTime = 1.f / (float)g_tick_rate;
+		} else {
+			gameTicks = curTime;
+			if (m_record && !loading)
+				ac_replay_write(&curInput, curTime, frameMs);
+		}
+		g_frame(gameTicks, frameTime, &curInput);
+		// the loading screen doesn't count towards the limit, as it takes a
+		// different number of frames every time
+		if (m_max_frames && !loading && ++worldFrames >= m_max_frames)
+			done = true;
+		// update window caption to say that we're done generating stuff
+		if (loading && !(loading = g_loading()))
+			SDL_WM_SetCaption("AC-130", "AC-130");
 		prevInput = curInput;
 		frameCount++;
 
@@ -225,9 +382,22 @@ int main (int argc, char *argv[]) {
 	SDL_ShowCursor(1);
 	SDL_WM_GrabInput(SDL_GRAB_OFF);
 
+	// the log is finished with the state the game has ended up in; a replay
+	// that doesn't match it fails
+	if ((m_record || m_replay)
+		&& !ac_replay_stop(g_state_hash(), g_sim_ticks()))
+		status = 1;
+	// an unattended run has no log to check against, but two runs of the
+	// same length must end up in the same state
+	if (soak)
+		printf("%u frames, %u ticks, state hash %08X\n", worldFrames,
+			g_sim_ticks(), g_state_hash());
+
 	// shut all subsystems down
 	r_shutdown();
 	g_shutdown();
+	gen_shutdown();
+	ac_thread_shutdown();
 
-	return 0;
+	return status;
 }
@@ -10,7 +10,11 @@
 #include "../footmobile.h"
 
 uint		r_fmb_tex;
-uint		r_fmb_VBOs[2];
+/// Quad vertices, quad indices, the per-soldier instance data and stances.
+uint		r_fmb_VBOs[4];
+/// Stances of the batch as floats, as generic attributes are read as such.
+static float	*r_fmb_stances = NULL;
+static size_t	r_fmb_max_stances = 0;
 
 void r_create_footmobile(void) {
 	// generate texture
@@ -45,7 +49,7 @@ void r_create_footmobile(void) {
 	}
 
 	// generate VBOs
-	glGenBuffersARB(2, r_fmb_VBOs);
+	glGenBuffersARB(4, r_fmb_VBOs);
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, r_fmb_VBOs[0]);
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, r_fmb_VBOs[1]);
 	glBufferDataARB(GL_ARRAY_BUFFER_ARB,
@@ -70,24 +74,77 @@ void r_start_footmobiles(void) {
 					(void *)offsetof(ac_vertex_t, pos.f[0]));
 	glTexCoordPointer(2, GL_FLOAT, sizeof(ac_vertex_t),
 					(void *)offsetof(ac_vertex_t, st[0]));
-	glUseProgramObjectARB(r_fmb_prog);
+	if (r_fmb_inst_prog) {
+		glUseProgramObjectARB(r_fmb_inst_prog);
+		// the per-soldier attributes advance once per quad
+		glEnableVertexAttribArrayARB(R_FMB_ATTR_POS);
+		glEnableVertexAttribArrayARB(R_FMB_ATTR_ANG);
+		glEnableVertexAttribArrayARB(R_FMB_ATTR_STANCE);
+		glVertexAttribDivisorARB(R_FMB_ATTR_POS, 1);
+		glVertexAttribDivisorARB(R_FMB_ATTR_ANG, 1);
+		glVertexAttribDivisorARB(R_FMB_ATTR_STANCE, 1);
+	} else
+		glUseProgramObjectARB(r_fmb_prog);
 }
 
 void r_draw_squad(ac_footmobile_t *squad, size_t troops) {
 	size_t i;
 
-	for (i = 0; i < troops; i++, squad++) {
-		glMultiTexCoord3fv(GL_TEXTURE1, squad->pos.f);
-		glMultiTexCoord3f(GL_TEXTURE2,
-			squad->stance == STANCE_STAND ? 0.f : 0.5, 0.f, squad->ang);
-		glDrawElements(GL_TRIANGLE_STRIP, 4, GL_UNSIGNED_BYTE, (void *)0);
-		*r_vert_counter += 4;
-		*r_tri_counter += 2;
+	if (!troops)
+		return;
+
+	if (r_fmb_inst_prog) {
+		// the stance is an enum, which would have to go through the integer
+		// attribute path of GL 3; the shaders predate it, so convert it
+		if (troops > r_fmb_max_stances) {
+			free(r_fmb_stances);
+			if (!(r_fmb_stances = malloc(sizeof(*r_fmb_stances) * troops))) {
+				r_fmb_max_stances = 0;
+				return;
+			}
+			r_fmb_max_stances = troops;
+		}
+		for (i = 0; i < troops; i++)
+			r_fmb_stances[i] = squad[i].stance == STANCE_STAND ? 0.f : 1.f;
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, r_fmb_VBOs[3]);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(*r_fmb_stances) * troops,
+			r_fmb_stances, GL_STREAM_DRAW_ARB);
+		glVertexAttribPointerARB(R_FMB_ATTR_STANCE, 1, GL_FLOAT, GL_FALSE,
+			0, (void *)0);
+		// stream the rest of the batch in and draw it in one go; the
+		// positions and yaws are read from the footmobile structures directly
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, r_fmb_VBOs[2]);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(*squad) * troops, squad,
+			GL_STREAM_DRAW_ARB);
+		glVertexAttribPointerARB(R_FMB_ATTR_POS, 3, GL_FLOAT, GL_FALSE,
+			sizeof(*squad), (void *)offsetof(ac_footmobile_t, pos.f[0]));
+		glVertexAttribPointerARB(R_FMB_ATTR_ANG, 1, GL_FLOAT, GL_FALSE,
+			sizeof(*squad), (void *)offsetof(ac_footmobile_t, ang));
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, r_fmb_VBOs[0]);
+		glDrawElementsInstancedARB(GL_TRIANGLE_STRIP, 4, GL_UNSIGNED_BYTE,
+			(void *)0, troops);
+	} else {
+		for (i = 0; i < troops; i++, squad++) {
+			glMultiTexCoord3fv(GL_TEXTURE1, squad->pos.f);
+			glMultiTexCoord3f(GL_TEXTURE2,
+				squad->stance == STANCE_STAND ? 0.f : 0.5, 0.f, squad->ang);
+			glDrawElements(GL_TRIANGLE_STRIP, 4, GL_UNSIGNED_BYTE, (void *)0);
+		}
 	}
+	*r_vert_counter += 4 * troops;
+	*r_tri_counter += 2 * troops;
 }
 
 void r_finish_footmobiles(void) {
 	// bring the previous state back
+	if (r_fmb_inst_prog) {
+		glVertexAttribDivisorARB(R_FMB_ATTR_POS, 0);
+		glVertexAttribDivisorARB(R_FMB_ATTR_ANG, 0);
+		glVertexAttribDivisorARB(R_FMB_ATTR_STANCE, 0);
+		glDisableVertexAttribArrayARB(R_FMB_ATTR_POS);
+		glDisableVertexAttribArrayARB(R_FMB_ATTR_ANG);
+		glDisableVertexAttribArrayARB(R_FMB_ATTR_STANCE);
+	}
 	glUseProgramObjectARB(0);
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
@@ -99,6 +156,9 @@ void r_finish_footmobiles(void) {
 }
 
 void r_destroy_footmobile(void) {
-	glDeleteBuffersARB(2, r_fmb_VBOs);
+	glDeleteBuffersARB(4, r_fmb_VBOs);
+	free(r_fmb_stances);
+	r_fmb_stances = NULL;
+	r_fmb_max_stances = 0;
 	glDeleteTextures(1, &r_fmb_tex);
 }
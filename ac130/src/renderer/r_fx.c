@@ -9,13 +9,8 @@
 uint		r_fx_tex;
 uint		r_fx_VBOs[2];
 
-void r_create_fx(void) {
-	ac_vertex_t	verts[4];
-	uchar		indices[4];
-	uchar		texture[2 * FX_TEXTURE_SIZE * FX_TEXTURE_SIZE];
-
-	gen_fx(texture, verts, indices);
-
+void r_set_fx(const uchar *texture, const ac_vertex_t *verts,
+				const uchar *indices) {
 	// generate texture
 	glGenTextures(1, &r_fx_tex);
 	glBindTexture(GL_TEXTURE_2D, r_fx_tex);
@@ -33,9 +28,9 @@ void r_create_fx(void) {
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, r_fx_VBOs[0]);
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, r_fx_VBOs[1]);
 	glBufferDataARB(GL_ARRAY_BUFFER_ARB,
-		sizeof(verts), verts, GL_STATIC_DRAW_ARB);
+		sizeof(*verts) * 4, verts, GL_STATIC_DRAW_ARB);
 	glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB,
-		sizeof(indices), indices, GL_STATIC_DRAW_ARB);
+		sizeof(*indices) * 4, indices, GL_STATIC_DRAW_ARB);
 	// unbind VBOs
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
@@ -61,16 +61,12 @@ void r_draw_terrain(void);
 void r_destroy_terrain(void);
 
 // prop drawing engine
-/// Creates all prop resources.
-void r_create_props(void);
 /// Draws all props.
 void r_draw_props(void);
 /// Frees prop resources.
 void r_destroy_props(void);
 
 // FX engine
-/// Creates all special effects resources.
-void r_create_fx(void);
 /// Frees all special effects resources.
 void r_destroy_fx(void);
 
@@ -81,6 +77,12 @@ void r_create_font(void);
 void r_destroy_font(void);
 
 // Footmobile module
+/// Generic vertex attribute indices of the per-soldier footmobile data of the
+/// instanced program; kept clear of the ones aliased to the fixed-function
+/// vertex arrays.
+#define R_FMB_ATTR_POS		1
+#define R_FMB_ATTR_ANG		6
+#define R_FMB_ATTR_STANCE	7
 /// Creates footmobile resources.
 void r_create_footmobile(void);
 /// Frees footmobile resources.
@@ -97,10 +99,12 @@ extern uint	r_ter_prog;			///< terrain rendering program
 extern uint	r_prop_prog;		///< prop rendering program
 extern uint	r_sprite_prog;		///< sprite program
 extern uint	r_fmb_prog;			///< footmobile program
+extern uint	r_fmb_inst_prog;	///< instanced footmobile program, 0 if unused
 extern uint	r_font_prog;		///< font rendering program
 extern uint	r_comp_prog;		///< compositing program
 // uniform variables
 extern int	r_ter_patch_params;	///< per-patch terrain parameters
+extern int	r_ter_tex_params;	///< per-patch terrain texture mapping
 extern int	r_ter_height_samples;	///< height samples table
 extern int	r_comp_frames;		///< frame texture indices
 extern int	r_comp_neg;			///< colour inversion coefficient
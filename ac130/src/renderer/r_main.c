@@ -205,6 +205,12 @@ bool r_init(uint *vcounter, uint *tcounter,
 					uint *dpcounter, uint *cpcounter) {
 	float fogcolour[] = {0, 0, 0, 1};
 
+	// the window and the input come with the video subsystem
+	if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) {
+		fprintf(stderr, "Unable to init SDL video: %s\n", SDL_GetError());
+		return false;
+	}
+
 	SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 8);
 	SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
 	SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8);
@@ -286,10 +292,9 @@ bool r_init(uint *vcounter, uint *tcounter,
 	if (!r_create_shaders())
 		return false;
 
-	// generate resources
+	// generate resources; the world-dependent ones are set by the game once
+	// they have been generated
 	r_create_terrain();
-	r_create_props();
-	r_create_fx();
 	r_create_font();
 	r_create_footmobile();
 
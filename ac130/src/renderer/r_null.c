@@ -0,0 +1,118 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Null renderer module; takes the place of the OpenGL renderer in the headless
+// build, counting what it is asked to draw instead of drawing it
+
+#include <stdio.h>
+#include <string.h>
+#include "../ac130.h"
+
+/// Draw requests received since \ref r_init. The per-item counts are kept in
+/// doubles, as they overflow 32 bits in a long soak test.
+static struct {
+	uint	frames;		///< \ref r_composite calls
+	uint	scenes;		///< scenes of the game world, i.e. not of the
+						///  loading screen
+	uint	uploads;	///< heightmap upload steps
+	double	squads;		///< footmobile batches
+	double	troops;		///< footmobiles in the batches
+	double	tracers;
+	double	sprites;	///< smoke particles
+	double	strings;
+	double	lines;		///< line segment endpoints
+} r_null_stats;
+/// Set while drawing a scene of the game world.
+static bool r_null_world = false;
+
+bool r_init(uint *vcounter, uint *tcounter,
+					uint *dpcounter, uint *cpcounter) {
+	if (!vcounter || !tcounter || !dpcounter || !cpcounter)
+		return false;
+	// there's no geometry, so the counters stay at 0
+	*vcounter = *tcounter = *dpcounter = *cpcounter = 0;
+	memset(&r_null_stats, 0, sizeof(r_null_stats));
+	return true;
+}
+
+void r_shutdown(void) {
+	const double n = r_null_stats.scenes ? r_null_stats.scenes : 1;
+
+	printf("Null renderer: %u frames, %u of the game world, %u heightmap "
+		"uploads\n", r_null_stats.frames, r_null_stats.scenes,
+		r_null_stats.uploads);
+	// the loading screen is left out of the averages
+	printf("Per game frame: %.1f troop batches (%.1f troops), %.1f tracers, "
+		"%.1f sprites, %.1f strings, %.1f line points\n",
+		r_null_stats.squads / n, r_null_stats.troops / n,
+		r_null_stats.tracers / n, r_null_stats.sprites / n,
+		r_null_stats.strings / n, r_null_stats.lines / n);
+}
+
+void r_set_heightmap(void) {
+	// nothing to allocate
+}
+
+bool r_upload_heightmap(void) {
+	r_null_stats.uploads++;
+	return true;
+}
+
+void r_set_props(const uchar *texture, const ac_vertex_t *verts,
+					const uchar *indices) {
+	// nothing to upload
+}
+
+void r_set_fx(const uchar *texture, const ac_vertex_t *verts,
+					const uchar *indices) {
+	// nothing to upload
+}
+
+void r_start_scene(int time, ac_viewpoint_t *vp) {
+	r_null_world = vp != NULL;
+	r_null_stats.scenes += r_null_world;
+}
+
+void r_start_fx(void) {
+}
+
+void r_finish_fx(void) {
+}
+
+void r_draw_fx(ac_vec4_t pos, float scale, float alpha, float angle) {
+	r_null_stats.sprites++;
+}
+
+void r_draw_tracer(ac_vec4_t pos, ac_vec4_t dir, float scale) {
+	r_null_stats.tracers++;
+}
+
+void r_start_footmobiles(void) {
+}
+
+void r_finish_footmobiles(void) {
+}
+
+void r_draw_squad(ac_footmobile_t *squad, size_t troops) {
+	r_null_stats.squads++;
+	r_null_stats.troops += troops;
+}
+
+void r_draw_string(char *str, float ox, float oy, float scale) {
+	r_null_stats.strings += r_null_world;
+}
+
+void r_draw_lines(float pts[][2], uint num_pts, float width) {
+	if (r_null_world)
+		r_null_stats.lines += num_pts;
+}
+
+void r_finish_3D(void) {
+}
+
+void r_finish_2D(void) {
+}
+
+void r_composite(float negative, float contrast) {
+	r_null_stats.frames++;
+}
@@ -10,21 +10,8 @@
 uint		r_prop_tex;
 uint		r_prop_VBOs[2];
 
-void r_create_props(void) {
-	ac_vertex_t	verts[TREE_BASE + 1		// LOD 0
-					+ TREE_BASE - 2		// LOD 1
-					+ TREE_BASE - 4		// LOD 2
-					+ BLDG_FLAT_VERTS
-					+ BLDG_SLNT_VERTS];
-	uchar		indices[TREE_BASE + 2		// LOD 0
-					+ TREE_BASE			// LOD 1
-					+ TREE_BASE - 2		// LOD 2
-					+ BLDG_FLAT_INDICES
-					+ BLDG_SLNT_INDICES];
-	uchar		texture[PROP_TEXTURE_SIZE * PROP_TEXTURE_SIZE];
-
-	gen_props(texture, verts, indices);
-
+void r_set_props(const uchar *texture, const ac_vertex_t *verts,
+					const uchar *indices) {
 	// generate texture
 	glGenTextures(1, &r_prop_tex);
 	glBindTexture(GL_TEXTURE_2D, r_prop_tex);
@@ -42,25 +29,24 @@ void r_create_props(void) {
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, r_prop_VBOs[0]);
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, r_prop_VBOs[1]);
 	glBufferDataARB(GL_ARRAY_BUFFER_ARB,
-		sizeof(verts), verts, GL_STATIC_DRAW_ARB);
+		sizeof(*verts) * PROP_NUM_VERTS, verts, GL_STATIC_DRAW_ARB);
 	glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB,
-		sizeof(indices), indices, GL_STATIC_DRAW_ARB);
+		sizeof(*indices) * PROP_NUM_INDICES, indices, GL_STATIC_DRAW_ARB);
 	// unbind VBOs
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
 }
 
-static void r_recurse_proptree_drawall(ac_prop_t *node) {
-	if (!node)
-		return;
-	if (node->trees != NULL) {
-		int i;
+static void r_recurse_proptree_drawall(int n) {
+	const ac_prop_t *node = &gen_proptree->nodes[n];
+	int i;
+	if (node->trees >= 0) {
 		float d2;
 		ac_tree_t *t;
 		int ofs, num;
 		// pick level of detail
-		ac_vec4_t l = ac_vec_mulf(
-			ac_vec_add(node->bounds[0], node->bounds[1]), 0.5);
+		ac_vec4_t l = ac_vec_mulf(ac_vec_add(gen_proptree->bounds[n * 2],
+			gen_proptree->bounds[n * 2 + 1]), 0.5);
 		l = ac_vec_sub(l, r_viewpoint);
 		d2 = ac_vec_dot(l, l);
 
@@ -75,7 +61,8 @@ static void r_recurse_proptree_drawall(ac_prop_t *node) {
 			num = TREE_BASE - 2;
 		}
 
-		for (t = node->trees, i = 0; i < TREES_PER_FIELD; i++, t++) {
+		for (t = gen_proptree->trees + node->trees, i = 0;
+			i < TREES_PER_FIELD; i++, t++) {
 			glMultiTexCoord3fv(GL_TEXTURE1, t->pos.f);
 			glMultiTexCoord4f(GL_TEXTURE2, t->XZscale, t->Yscale, t->XZscale,
 				t->ang);
@@ -85,10 +72,10 @@ static void r_recurse_proptree_drawall(ac_prop_t *node) {
 			*r_tri_counter += num - 2;
 		}
 		return;
-	} else if (node->bldgs != NULL) {
-		int i;
+	} else if (node->bldgs >= 0) {
 		ac_bldg_t *b;
-		for (b = node->bldgs, i = 0; i < BLDGS_PER_FIELD; i++, b++) {
+		for (b = gen_proptree->bldgs + node->bldgs, i = 0;
+			i < BLDGS_PER_FIELD; i++, b++) {
 			glMultiTexCoord3fv(GL_TEXTURE1, b->pos.f);
 			glMultiTexCoord4f(GL_TEXTURE2, b->Xscale, b->Yscale, b->Zscale,
 				b->ang);
@@ -108,30 +95,26 @@ static void r_recurse_proptree_drawall(ac_prop_t *node) {
 		}
 		return;
 	}
-	r_recurse_proptree_drawall(node->child[0]);
-	r_recurse_proptree_drawall(node->child[1]);
-	r_recurse_proptree_drawall(node->child[2]);
-	r_recurse_proptree_drawall(node->child[3]);
+	for (i = 0; i < node->numChildren; i++)
+		r_recurse_proptree_drawall(node->child + i);
 }
 
-static void r_recurse_proptree(ac_prop_t *node, int step) {
-	if (!node)
-		return;
-	switch (r_cull_bbox(node->bounds)) {
+static void r_recurse_proptree(int n, int step) {
+	const ac_prop_t *node = &gen_proptree->nodes[n];
+	int i;
+	switch (r_cull_bbox(&gen_proptree->bounds[n * 2])) {
 		case CR_OUTSIDE:
 			return;
 		case CR_INSIDE:
-			r_recurse_proptree_drawall(node);
+			r_recurse_proptree_drawall(n);
 			break;
 		case CR_INTERSECT:
 			if ((step >>= 1) < 2) {
-				r_recurse_proptree_drawall(node);
+				r_recurse_proptree_drawall(n);
 				return;
 			}
-			r_recurse_proptree(node->child[0], step);
-			r_recurse_proptree(node->child[1], step);
-			r_recurse_proptree(node->child[2], step);
-			r_recurse_proptree(node->child[3], step);
+			for (i = 0; i < node->numChildren; i++)
+				r_recurse_proptree(node->child + i, step);
 			break;
 	}
 }
@@ -147,7 +130,8 @@ void r_draw_props(void) {
 					(void *)offsetof(ac_vertex_t, st[0]));
 	glUseProgramObjectARB(r_prop_prog);
 
-	r_recurse_proptree(gen_proptree, PROPMAP_SIZE / 2);
+	if (gen_proptree)
+		r_recurse_proptree(0, PROPMAP_SIZE / 2);
 
 	// bring the previous state back
 	glUseProgramObjectARB(0);
@@ -157,7 +141,7 @@ void r_draw_props(void) {
 }
 
 void r_destroy_props(void) {
-	gen_free_proptree(NULL);
+	gen_free_proptree();
 	glDeleteTextures(1, &r_prop_tex);
 	glDeleteBuffersARB(2, r_prop_VBOs);
 }
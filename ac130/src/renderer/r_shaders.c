@@ -14,6 +14,7 @@
 #include "../shaders/sprite_vs.glsl"
 #include "../shaders/sprite_fs.glsl"
 #include "../shaders/footmobile_vs.glsl"
+#include "../shaders/footmobile_inst_vs.glsl"
 #include "../shaders/font_fs.glsl"
 #include "../shaders/compositor_vs.glsl"
 #include "../shaders/compositor_fs.glsl"
@@ -22,6 +23,7 @@ uint		r_ter_prog = 0;
 uint		r_ter_vs = 0;
 uint		r_ter_fs = 0;
 int			r_ter_patch_params = -1;
+int			r_ter_tex_params = -1;
 int			r_ter_height_samples = -1;
 
 uint		r_prop_prog = 0;
@@ -36,6 +38,10 @@ uint		r_fmb_prog = 0;
 uint		r_fmb_vs = 0;
 uint		r_fmb_fs = 0;
 
+uint		r_fmb_inst_prog = 0;
+uint		r_fmb_inst_vs = 0;
+uint		r_fmb_inst_fs = 0;
+
 uint		r_font_prog = 0;
 uint		r_font_vs = 0;
 uint		r_font_fs = 0;
@@ -102,6 +108,34 @@ static inline bool r_create_program(const char *id, const char *vss,
 	return true;
 }
 
+/// Creates the instanced footmobile program.
+/// \return false if it can't be built, in which case it is left at 0
+static bool r_create_footmobile_inst(void) {
+	if (!r_create_program("Instanced footmobile", FOOTMOBILE_INST_VS, FONT_FS,
+		&r_fmb_inst_vs, &r_fmb_inst_fs, &r_fmb_inst_prog))
+		goto fail;
+	// the per-soldier attributes need fixed locations, so that the instance
+	// arrays can be set up without looking them up; they only take effect
+	// after relinking
+	glBindAttribLocationARB(r_fmb_inst_prog, R_FMB_ATTR_POS, "fmbPos");
+	glBindAttribLocationARB(r_fmb_inst_prog, R_FMB_ATTR_ANG, "fmbAng");
+	glBindAttribLocationARB(r_fmb_inst_prog, R_FMB_ATTR_STANCE, "fmbStance");
+	glLinkProgramARB(r_fmb_inst_prog);
+	if (!r_shader_check(r_fmb_inst_prog, GL_OBJECT_LINK_STATUS_ARB,
+		"Instanced footmobile", "GPU program linking")
+		|| glGetUniformLocationARB(r_fmb_inst_prog, "fontTex") < 0)
+		goto fail;
+	return true;
+
+fail:
+	// deleting 0 is silently ignored, so it doesn't matter how far it got
+	glDeleteObjectARB(r_fmb_inst_vs);
+	glDeleteObjectARB(r_fmb_inst_fs);
+	glDeleteObjectARB(r_fmb_inst_prog);
+	r_fmb_inst_prog = 0;
+	return false;
+}
+
 bool r_create_shaders(void) {
 	int i, frames[1 + FRAME_TRACE];
 
@@ -129,6 +163,11 @@ bool r_create_shaders(void) {
 	if (!r_create_program("Footmobile", FOOTMOBILE_VS, FONT_FS,
 		&r_fmb_vs, &r_fmb_fs, &r_fmb_prog))
 		return false;
+	// create the instanced footmobile GPU program, if asked to; the troops
+	// are drawn one by one with the program above if it can't be had
+	if (m_instanced_troops && GLEW_ARB_instanced_arrays
+		&& GLEW_ARB_draw_instanced && !r_create_footmobile_inst())
+		fprintf(stderr, "Falling back to drawing the troops one by one\n");
 
 	// set the terrain shader up
 	glUseProgramObjectARB(r_ter_prog);
@@ -141,7 +180,7 @@ bool r_create_shaders(void) {
 		fprintf(stderr, "Failed to find constant params uniform variable\n");
 		return false;
 	}
-	glUniform2fARB(i, HEIGHTMAP_SIZE, HEIGHT_SCALE);
+	glUniform2fARB(i, gen_heightmap_size, HEIGHT_SCALE);
 	if ((r_ter_patch_params = glGetUniformLocationARB(r_ter_prog,
 		"patchParams")) < 0) {
 		fprintf(stderr, "Failed to find per-patch params uniform variable\n");
@@ -152,6 +191,12 @@ bool r_create_shaders(void) {
 		fprintf(stderr, "Failed to find height samples uniform variable\n");
 		return false;
 	}
+	if ((r_ter_tex_params = glGetUniformLocationARB(r_ter_prog,
+		"texParams")) < 0) {
+		fprintf(stderr, "Failed to find texture params uniform variable\n");
+		return false;
+	}
+	glUniform3fARB(r_ter_tex_params, 0.f, 0.f, 1.f);
 
 	// set the prop shader up
 	glUseProgramObjectARB(r_prop_prog);
@@ -176,6 +221,10 @@ bool r_create_shaders(void) {
 		return false;
 	}
 	glUniform1iARB(i, 0);
+	if (r_fmb_inst_prog) {
+		glUseProgramObjectARB(r_fmb_inst_prog);
+		glUniform1iARB(glGetUniformLocationARB(r_fmb_inst_prog, "fontTex"), 0);
+	}
 
 	// set the font shader up
 	glUseProgramObjectARB(r_font_prog);
@@ -226,6 +275,10 @@ void r_destroy_shaders(void) {
 	r_destroy_program(r_comp_prog, r_comp_vs, r_comp_fs);
 	r_destroy_program(r_font_prog, r_font_vs, r_font_fs);
 	r_destroy_program(r_sprite_prog, r_sprite_vs, r_sprite_fs);
+	if (r_fmb_inst_prog) {
+		r_destroy_program(r_fmb_inst_prog, r_fmb_inst_vs, r_fmb_inst_fs);
+		r_fmb_inst_prog = 0;
+	}
 	r_destroy_program(r_prop_prog, r_prop_vs, r_prop_fs);
 	r_destroy_program(r_ter_prog, r_ter_vs, r_ter_fs);
 }
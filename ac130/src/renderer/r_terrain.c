@@ -36,9 +36,37 @@
 // resources
 GLuint		r_hmap_tex;
 int			r_ter_max_levels;
+/// Squared texel spacing of the coarse overview map of a streamed world.
+float		r_ter_coarse_spacing2 = 0.f;
 ac_vertex_t	r_ter_verts[TERRAIN_NUM_VERTS];
 uint		r_ter_VBOs[2];
 
+/// Heightmap bytes uploaded per frame by \ref r_upload_heightmap.
+#define HMAP_UPLOAD_BYTES	(1 << 20)
+static const uchar	*r_hmap_src = NULL;		///< heightmap being uploaded
+static int			r_hmap_size;			///< its dimension
+static int			r_hmap_rows;			///< rows uploaded so far
+
+/// Dimension of the atlas texture that the resident tiles of a streamed world
+/// are uploaded to.
+#define ATLAS_SIZE			2048
+/// Spacing of the tiles in the atlas, in texels; a tile takes
+/// \ref GEN_TILE_SIZE + 1 of them.
+#define ATLAS_SPACING		136
+/// Number of tiles along each side of the atlas.
+#define ATLAS_TILES			(ATLAS_SIZE / ATLAS_SPACING)
+/// Number of tiles uploaded to the atlas per frame at most.
+#define ATLAS_UPLOADS		8
+static GLuint		r_atlas_tex = 0;		///< tile atlas, 0 if not streamed
+static int			*r_atlas_slot_of = NULL;	///< tile -> atlas slot, or -1
+static int			r_atlas_tile[ATLAS_TILES * ATLAS_TILES];	///< slot -> tile
+static uint			r_atlas_used[ATLAS_TILES * ATLAS_TILES];	///< last frame
+															///  drawn in
+static uint			r_atlas_frame;
+static int			r_atlas_uploads;		///< uploads left in this frame
+static int			r_tile_grid;			///< tiles along each side of the map
+static GLuint		r_bound_tex;			///< texture bound for the patches
+
 static void r_fill_terrain_indices(ushort *indices) {
 	short	i, j;	// must be signed
 	ushort	*p = indices;
@@ -135,7 +163,7 @@ static void r_fill_terrain_vertices(ac_vertex_t *verts) {
 
 static void r_calc_terrain_lodlevels(void) {
 	// calculate max LOD levels
-	int i, pow2 = (HEIGHTMAP_SIZE - 1) / (TERRAIN_PATCH_SIZE - 1);
+	int i, pow2 = (gen_heightmap_size - 1) / (TERRAIN_PATCH_SIZE - 1);
 	r_ter_max_levels = 0;
 	for (i = 1; i < pow2; i *= 2)
 		r_ter_max_levels++;
@@ -143,14 +171,9 @@ static void r_calc_terrain_lodlevels(void) {
 
 void r_create_terrain(void) {
 	ushort		indices[TERRAIN_NUM_INDICES];
-	// signal the game from time to time
-	g_loading_tick();
 	r_fill_terrain_indices(indices);
-	g_loading_tick();
 	r_fill_terrain_vertices(r_ter_verts);
-	g_loading_tick();
 	r_calc_terrain_lodlevels();
-	g_loading_tick();
 
 	// generate VBOs
 	glGenBuffersARB(2, r_ter_VBOs);
@@ -171,30 +194,195 @@ void r_create_terrain(void) {
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
 }
 
+/// Sets up the atlas that the resident tiles of a streamed world are uploaded
+/// to as they're drawn, or frees it if the world is not streamed.
+static void r_set_atlas(void) {
+	int i;
+
+	if (r_atlas_tex) {
+		glDeleteTextures(1, &r_atlas_tex);
+		r_atlas_tex = 0;
+	}
+	free(r_atlas_slot_of);
+	r_atlas_slot_of = NULL;
+	if (gen_heightmap)
+		return;
+
+	r_tile_grid = gen_heightmap_size / GEN_TILE_SIZE;
+	if (!(r_atlas_slot_of = malloc(sizeof(*r_atlas_slot_of)
+		* r_tile_grid * r_tile_grid)))
+		return;
+	for (i = 0; i < r_tile_grid * r_tile_grid; i++)
+		r_atlas_slot_of[i] = -1;
+	for (i = 0; i < ATLAS_TILES * ATLAS_TILES; i++) {
+		r_atlas_tile[i] = -1;
+		r_atlas_used[i] = 0;
+	}
+	r_atlas_frame = 0;
+
+	glGenTextures(1, &r_atlas_tex);
+	glBindTexture(GL_TEXTURE_2D, r_atlas_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE8,
+				ATLAS_SIZE, ATLAS_SIZE, 0,
+				GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+	// the patches only sample between the texel centres of their own tile,
+	// so the neighbouring ones never bleed in
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+}
+
 void r_set_heightmap(void) {
-	if (gen_heightmap != NULL)
+	const uchar *hmap = gen_heightmap;
+	int size = gen_heightmap_size;
+
+	// streamed worlds only have the overview map in its entirety; the tiles
+	// go to the atlas as they arrive
+	r_ter_coarse_spacing2 = 0.f;
+	r_set_atlas();
+	if (!hmap) {
+		hmap = gen_tiles_overview(&size);
+		r_ter_coarse_spacing2 = (float)gen_heightmap_size / size;
+		r_ter_coarse_spacing2 *= r_ter_coarse_spacing2;
+	}
+
+	if (r_hmap_tex)
 		glDeleteTextures(1, &r_hmap_tex);
 	glGenTextures(1, &r_hmap_tex);
 	glBindTexture(GL_TEXTURE_2D, r_hmap_tex);
 
+	// allocate the storage only, the rows follow in r_upload_heightmap()
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE8,
-				HEIGHTMAP_SIZE, HEIGHTMAP_SIZE, 0,
-				GL_LUMINANCE, GL_UNSIGNED_BYTE, gen_heightmap);
+				size, size, 0,
+				GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+	r_hmap_src = hmap;
+	r_hmap_size = size;
+	r_hmap_rows = 0;
+}
+
+bool r_upload_heightmap(void) {
+	int rows;
+
+	if (!r_hmap_src)
+		return true;
+	rows = HMAP_UPLOAD_BYTES / r_hmap_size;
+	if (rows > r_hmap_size - r_hmap_rows)
+		rows = r_hmap_size - r_hmap_rows;
+
+	glBindTexture(GL_TEXTURE_2D, r_hmap_tex);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, r_hmap_rows, r_hmap_size, rows,
+		GL_LUMINANCE, GL_UNSIGNED_BYTE,
+		r_hmap_src + (size_t)r_hmap_rows * r_hmap_size);
+	r_hmap_rows += rows;
+	if (r_hmap_rows < r_hmap_size)
+		return false;
+	r_hmap_src = NULL;
+	return true;
 }
 
 void r_destroy_terrain(void) {
 	glDeleteTextures(1, &r_hmap_tex);
+	if (r_atlas_tex) {
+		glDeleteTextures(1, &r_atlas_tex);
+		r_atlas_tex = 0;
+	}
+	free(r_atlas_slot_of);
+	r_atlas_slot_of = NULL;
 	glDeleteBuffersARB(2, r_ter_VBOs);
 }
 
+/// Finds the atlas slot of a tile, uploading the tile if it is resident but
+/// not in the atlas yet, in place of the one drawn the longest ago.
+/// \return the slot, or -1 if the tile can't be had in this frame
+static int r_atlas_fetch(int x, int y) {
+	const int tile = y * r_tile_grid + x;
+	const uchar *data;
+	int i, slot;
+
+	// the terrain never changes, so what's uploaded stays good even after
+	// the tile is evicted from the generator's cache
+	if ((slot = r_atlas_slot_of[tile]) >= 0) {
+		r_atlas_used[slot] = r_atlas_frame;
+		return slot;
+	}
+	if (r_atlas_uploads < 1 || !(data = gen_tiles_data(x, y)))
+		return -1;
+	for (slot = -1, i = 0; i < ATLAS_TILES * ATLAS_TILES; i++) {
+		if (r_atlas_tile[i] < 0) {
+			slot = i;
+			break;
+		}
+		if (r_atlas_used[i] != r_atlas_frame
+			&& (slot < 0 || r_atlas_used[i] < r_atlas_used[slot]))
+			slot = i;
+	}
+	if (slot < 0)
+		return -1;
+	if (r_atlas_tile[slot] >= 0)
+		r_atlas_slot_of[r_atlas_tile[slot]] = -1;
+	r_atlas_tile[slot] = tile;
+	r_atlas_slot_of[tile] = slot;
+	r_atlas_used[slot] = r_atlas_frame;
+	r_atlas_uploads--;
+
+	if (r_bound_tex != r_atlas_tex) {
+		glBindTexture(GL_TEXTURE_2D, r_atlas_tex);
+		r_bound_tex = r_atlas_tex;
+	}
+	// the tile rows are an odd number of bytes long
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % ATLAS_TILES) * ATLAS_SPACING,
+		(slot / ATLAS_TILES) * ATLAS_SPACING,
+		GEN_TILE_SIZE + 1, GEN_TILE_SIZE + 1,
+		GL_LUMINANCE, GL_UNSIGNED_BYTE, data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	return slot;
+}
+
+/// Binds the texture to draw a patch of a streamed world with: the tile the
+/// patch is in, if it can be had, so that the patch looks just like the
+/// terrain that the game collides with, or else the overview map.
+static void r_terrain_patch_tex(float bu, float bv, float scale) {
+	const float texels = gen_heightmap_size - 1;
+	const int x0 = (int)floorf(bu * texels), y0 = (int)floorf(bv * texels);
+	const int x = x0 / GEN_TILE_SIZE, y = y0 / GEN_TILE_SIZE;
+	GLuint tex = r_hmap_tex;
+	int slot = -1;
+
+	if (!r_atlas_tex)
+		return;
+	// the tile holds one texel past its end, shared with the next one
+	if ((int)ceilf((bu + scale) * texels) <= (x + 1) * GEN_TILE_SIZE
+		&& (int)ceilf((bv + scale) * texels) <= (y + 1) * GEN_TILE_SIZE
+		&& (slot = r_atlas_fetch(x, y)) >= 0) {
+		tex = r_atlas_tex;
+		// map the heightmap texels of the tile onto their atlas texel centres
+		glUniform3fARB(r_ter_tex_params,
+			((slot % ATLAS_TILES) * ATLAS_SPACING - x * GEN_TILE_SIZE + 0.5f)
+				/ ATLAS_SIZE,
+			((slot / ATLAS_TILES) * ATLAS_SPACING - y * GEN_TILE_SIZE + 0.5f)
+				/ ATLAS_SIZE,
+			texels / ATLAS_SIZE);
+	} else
+		glUniform3fARB(r_ter_tex_params, 0.f, 0.f, 1.f);
+	if (r_bound_tex != tex) {
+		glBindTexture(GL_TEXTURE_2D, tex);
+		r_bound_tex = tex;
+	}
+}
+
 static inline float r_sample_height(float s, float t) {
-	int x = roundf(s * (HEIGHTMAP_SIZE - 1));
-	int y = roundf(t * (HEIGHTMAP_SIZE - 1));
-	return (float)gen_heightmap[y * HEIGHTMAP_SIZE + x];
+	int x = roundf(s * (gen_heightmap_size - 1));
+	int y = roundf(t * (gen_heightmap_size - 1));
+	if (!gen_heightmap)
+		return gen_tiles_sample(x, y);
+	return (float)gen_heightmap[y * gen_heightmap_size + x];
 }
 
 #if !defined(UNIFORM_HEIGHTS) && defined(MAP_VBO)
@@ -271,6 +459,7 @@ static void r_terrain_patch(float bu, float bv, float scale) {
 		sizeof(r_ter_verts), r_ter_verts, GL_STREAM_DRAW_ARB);
 #endif
 	glUniform3fARB(r_ter_patch_params, bu, bv, scale);
+	r_terrain_patch_tex(bu, bv, scale);
 
 	glVertexPointer(3, GL_FLOAT, sizeof(ac_vertex_t), (void *)0);
 	glTexCoordPointer(2, GL_FLOAT, sizeof(ac_vertex_t),
@@ -292,33 +481,38 @@ static void r_recurse_terrain(float minU, float minV,
 	float halfV = (minV + maxV) * 0.5;
 
 	// apply frustum culling
-	bounds[0] = ac_vec_set((minU - 0.5) * HEIGHTMAP_SIZE,
+	bounds[0] = ac_vec_set((minU - 0.5) * gen_heightmap_size,
 					-10.f,
-					(minV - 0.5) * HEIGHTMAP_SIZE,
+					(minV - 0.5) * gen_heightmap_size,
 					0.f);
-	bounds[1] = ac_vec_set((maxU - 0.5) * HEIGHTMAP_SIZE,
+	bounds[1] = ac_vec_set((maxU - 0.5) * gen_heightmap_size,
 					HEIGHT,
-					(maxV - 0.5) * HEIGHTMAP_SIZE,
+					(maxV - 0.5) * gen_heightmap_size,
 					0.f);
 	if (r_cull_bbox(bounds) == CR_OUTSIDE) {
 		(*r_culled_patch_counter)++;
 		return;
 	}
 
-	float d2 = (maxU - minU) * (float)HEIGHTMAP_SIZE
+	float d2 = (maxU - minU) * (float)gen_heightmap_size
 				/ (TERRAIN_PATCH_SIZE_F - 1.f);
 	d2 *= d2;
 
-	v = ac_vec_set((halfU - 0.5) * (float)HEIGHTMAP_SIZE,
+	v = ac_vec_set((halfU - 0.5) * (float)gen_heightmap_size,
 				128.f,
-				(halfV - 0.5) * (float)HEIGHTMAP_SIZE,
+				(halfV - 0.5) * (float)gen_heightmap_size,
 				0.f);
 	v = ac_vec_sub(v, r_viewpoint);
 
 	// use distances squared
 	float f2 = ac_vec_dot(v, v) / d2;
 
-	if (f2 > TERRAIN_LOD * TERRAIN_LOD || level < 1)
+	if (f2 > TERRAIN_LOD * TERRAIN_LOD || level < 1
+		// don't refine a streamed patch past the resolution of the overview
+		// map until its full-resolution tile is resident
+		|| (d2 * 0.25 < r_ter_coarse_spacing2
+			&& !gen_tiles_resident(halfU * (gen_heightmap_size - 1),
+				halfV * (gen_heightmap_size - 1))))
 		r_terrain_patch(minU, minV, scale);
 	else {
 		scale *= 0.5;
@@ -338,6 +532,10 @@ void r_draw_terrain(void) {
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, r_ter_VBOs[0]);
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, r_ter_VBOs[1]);
 	glBindTexture(GL_TEXTURE_2D, r_hmap_tex);
+	glUniform3fARB(r_ter_tex_params, 0.f, 0.f, 1.f);
+	r_bound_tex = r_hmap_tex;
+	r_atlas_frame++;
+	r_atlas_uploads = ATLAS_UPLOADS;
 
 	// traverse the quadtree
 	r_recurse_terrain(0.f, 0.f, 1.f, 1.f,
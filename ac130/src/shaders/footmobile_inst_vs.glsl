@@ -0,0 +1,40 @@
+static const char FOOTMOBILE_INST_VS[] = STRINGIFY(
+
+// per-soldier attributes, advancing once per instance
+attribute vec3 fmbPos;		// sprite coordinates
+attribute float fmbAng;		// yaw
+attribute float fmbStance;	// 0 for standing, 1 for crouching
+
+void main() {
+	// the crouching soldier is in the right half of the texture
+	gl_TexCoord[0] = gl_MultiTexCoord0 + vec4(0.5 * fmbStance, 0.0, 0.0, 0.0);
+	// soldier's look direction
+	vec3 dir = vec3(cos(fmbAng), 0.0, -sin(fmbAng));
+	float d = dot(dir, vec3(
+		gl_ModelViewMatrix[0][0],
+		gl_ModelViewMatrix[1][0],
+		gl_ModelViewMatrix[2][0]));
+	// sneaky little hack to get rid of near-zero values
+	d += 1.0 - step(0.01, abs(d));
+	mat4 mat = mat4(
+		// column 1
+		2.0 * sign(d),	// orient the soldier accordingly
+		0.0,
+		0.0,
+		0.0,
+		// column 2
+		0.0,
+		2.0,
+		0.0,
+		0.0,
+		// column 3
+		0.0,
+		0.0,
+		2.0,
+		0.0,
+		gl_ModelViewMatrix * vec4(fmbPos, 1.0)
+	);
+	gl_Position = gl_ProjectionMatrix * mat * gl_Vertex;
+}
+);
+
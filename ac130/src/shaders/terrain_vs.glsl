@@ -4,6 +4,8 @@ static const char TERRAIN_VS[] = STRINGIFY(
 uniform vec2 constParams;
 // patch-specific properties: xy - uv bias, z - scale
 uniform vec3 patchParams;
+// patch-specific texture mapping: xy - texture coordinate bias, z - scale
+uniform vec3 texParams;
 
 // the size of the MUST match TERRAIN_PATCH_SIZE * TERRAIN_PATCH_SIZE in
 // r_terrain.c!!!
@@ -26,9 +28,10 @@ float get_height(vec2 st) {
 }
 
 void main() {
-	// calculate texture coordinates - offset and bias
-	gl_TexCoord[0] = vec4(patchParams.z * gl_MultiTexCoord0.xy + patchParams.xy,
-		gl_MultiTexCoord0.zw);
+	// calculate texture coordinates - offset and bias, then map them onto
+	// the texture the patch is drawn with
+	gl_TexCoord[0] = vec4(texParams.z * (patchParams.z * gl_MultiTexCoord0.xy
+		+ patchParams.xy) + texParams.xy, gl_MultiTexCoord0.zw);
 
 	// calculate vertex positions
 	mat4 mvmat = mat4(
@@ -0,0 +1,324 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Ground troops benchmark; measures how the footmobile simulation scales with
+// the number of troops, without opening a window
+
+#include <stdio.h>
+#include <string.h>
+#include "../game/g_local.h"
+#include "../ac_thread.h"
+#include "../ac_time.h"
+
+/// Maximum number of troop counts on the command line.
+#define MAX_ARGS		16
+/// Maximum number of simulated ticks.
+#define MAX_TICKS		100000
+/// Simulation ticks per rendered frame.
+#define TICKS_PER_FRAME	2
+/// Flow field destinations of the navigation check.
+#define NAV_DESTS		4
+/// Cost changes made by the navigation check.
+#define NAV_CHANGES		64
+/// Steps a cost change of a single cell is made in by the navigation check.
+#define NAV_RAMP		6
+/// Flow sample spacing of the navigation check in metres; the cell size.
+#define NAV_STEP		4
+/// Flow field request spacing of the navigation check in metres; the cluster
+/// size.
+#define NAV_REQ_STEP	64
+
+/// Flow field sample.
+typedef struct {
+	g_nav_flow_t	flow;
+	float			dx, dz;
+} nav_sample_t;
+
+static uint bench_seed;
+
+void g_loading_tick(void) {
+	// no loading screen to update
+}
+
+/// \return random float in the [0..1] range
+static float bench_randf(void) {
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return (float)((bench_seed >> 8) % 10001) * 0.0001f;
+}
+
+/// Computes the whole flow fields towards the destinations.
+static void nav_compute(const int *dests) {
+	const float ofs = gen_heightmap_size / 2;
+	const int n = gen_heightmap_size / NAV_REQ_STEP;
+	int i, k;
+
+	for (k = 0; k < NAV_DESTS; k++) {
+		for (i = 0; i < n * n; i++) {
+			g_nav_request(dests[k], (i % n + 0.5f) * NAV_REQ_STEP - ofs,
+				(i / n + 0.5f) * NAV_REQ_STEP - ofs);
+		}
+	}
+	while (g_nav_pending())
+		g_nav_update();
+}
+
+/// Computes the whole flow fields towards the destinations and samples them in
+/// the middle of every cell.
+static void nav_sample(const int *dests, nav_sample_t *out) {
+	const float ofs = gen_heightmap_size / 2;
+	const int n = gen_heightmap_size / NAV_STEP;
+	float x, z;
+	int i, k;
+
+	nav_compute(dests);
+	for (k = 0; k < NAV_DESTS; k++) {
+		for (i = 0; i < n * n; i++, out++) {
+			x = (i % n + 0.5f) * NAV_STEP - ofs;
+			z = (i / n + 0.5f) * NAV_STEP - ofs;
+			out->dx = out->dz = 0.f;
+			out->flow = g_nav_flow(dests[k], x, z, &out->dx, &out->dz);
+		}
+	}
+}
+
+/// \return middle of the cell under a coordinate, or of the first or the last
+/// cell of the cluster under it
+/// \param edge	0 for the cell under the coordinate, -1 for the first cell of
+///				the cluster, 1 for the last one
+static float nav_cell(float x, int edge) {
+	const float ofs = gen_heightmap_size / 2;
+	const float step = edge ? NAV_REQ_STEP : NAV_STEP;
+
+	x = floorf((x + ofs) / step) * step - ofs;
+	return x + (edge > 0 ? step - NAV_STEP * 0.5f : NAV_STEP * 0.5f);
+}
+
+/// Makes the same craters and changes the same cells every time.
+/// \param dests	flow field destinations to bring up to date after every
+///					change, so that each is made with the fields cached, or
+///					NULL to make the changes all at once
+static void nav_damage(const int *dests) {
+	const float size = gen_heightmap_size;
+	float x, z;
+	int i, j;
+
+	bench_seed = 4321;
+	for (i = 0; i < NAV_CHANGES; i++) {
+		x = (bench_randf() - 0.5f) * size;
+		z = (bench_randf() - 0.5f) * size;
+		if (i % 8 == 0)
+			g_nav_add_cost(x, z, 4.f + bench_randf() * 20.f, i % 7 - 3);
+		else if (i % 8 == 1)
+			g_nav_set_cost(x, z, 0);
+		else {
+			// a single cell in small steps, which rarely move the mean cost
+			// of the cluster, so that the tiles are invalidated on their
+			// own; every other one is on the edge of a cluster, where the
+			// tiles of the neighbours go too
+			x = nav_cell(x, i & 2 ? (i & 4 ? 1 : -1) : 0);
+			z = nav_cell(z, i & 2 ? (i & 8 ? 1 : -1) : 0);
+			for (j = 0; j < NAV_RAMP; j++) {
+				g_nav_add_cost(x, z, 1.f, 1);
+				if (dests)
+					nav_compute(dests);
+			}
+			continue;
+		}
+		if (dests)
+			nav_compute(dests);
+	}
+}
+
+/// Checks that changing the cell costs of a navigation grid with flow fields
+/// cached on it gives the same flow fields as building it over with the same
+/// changes.
+static bool nav_check(const ac_tree_t *trees, int numTrees,
+	const ac_bldg_t *bldgs, int numBldgs) {
+	const int n = gen_heightmap_size / NAV_STEP;
+	nav_sample_t *a, *b;
+	float wx, wz;
+	int i, dests[NAV_DESTS], diff = 0;
+
+	a = malloc(sizeof(*a) * NAV_DESTS * n * n);
+	b = malloc(sizeof(*b) * NAV_DESTS * n * n);
+	if (!a || !b || !g_nav_build(trees, numTrees, bldgs, numBldgs)) {
+		fprintf(stderr, "Out of memory for the navigation check\n");
+		free(a);
+		free(b);
+		return false;
+	}
+	bench_seed = 1234;
+	for (i = 0; i < NAV_DESTS;) {
+		if ((dests[i] = g_nav_waypoint_near(
+			(bench_randf() - 0.5f) * gen_heightmap_size,
+			(bench_randf() - 0.5f) * gen_heightmap_size, 0, 0, &wx, &wz)) >= 0)
+			i++;
+	}
+
+	// fill the cache and damage the grid bit by bit, bringing the fields up
+	// to date in between...
+	nav_compute(dests);
+	nav_damage(dests);
+	nav_sample(dests, a);
+	// ...then start over with the damage already done
+	g_nav_build(trees, numTrees, bldgs, numBldgs);
+	nav_damage(NULL);
+	nav_sample(dests, b);
+
+	for (i = 0; i < NAV_DESTS * n * n; i++) {
+		if (a[i].flow != b[i].flow || a[i].dx != b[i].dx || a[i].dz != b[i].dz)
+			diff++;
+	}
+	printf("navigation check: %d of %d flow samples differ from a rebuild\n",
+		diff, NAV_DESTS * n * n);
+	free(a);
+	free(b);
+	return !diff;
+}
+
+/// Sorts the times and picks the median and the 99th percentile out of them.
+static void bench_stats(double *times, int n, double *median, double *p99) {
+	int i;
+
+	qsort(times, n, sizeof(times[0]), ac_time_cmp);
+	*median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) * 0.5;
+	// nearest rank
+	i = (99 * n + 99) / 100 - 1;
+	*p99 = times[i < n ? i : n - 1];
+}
+
+static bool bench_troops(int troops, int ticks, float dt) {
+	static double tickTimes[MAX_TICKS], frameTimes[MAX_TICKS];
+	ac_footmobile_t *out;
+	ac_vec4_t eye;
+	double t0, t1, tickMed, tickP99, frameMed, frameP99;
+	long updates = 0;
+	float ang;
+	int i, j, frames = 0;
+
+	if (!g_fmb_init(troops, GEN_WORLD_SEED)
+		|| !(out = malloc(sizeof(*out) * troops))) {
+		fprintf(stderr, "Out of memory for %d troops\n", troops);
+		g_fmb_shutdown();
+		return false;
+	}
+
+	for (i = 0; i < ticks; i++) {
+		// orbit the world the same way the gunship does
+		ang = i * dt * -0.04;
+		eye = ac_vec_set(cosf(ang) * 200.f, 250.f, sinf(ang) * 200.f, 0.f);
+		t0 = ac_time_now();
+		g_fmb_advance(eye, dt);
+		t1 = ac_time_now();
+		tickTimes[i] = t1 - t0;
+		for (j = 0; j < g_num_squads; j++)
+			updates += g_squads[j].dt == 0.f ? g_squads[j].count : 0;
+		// a frame is a few ticks and a capture for the renderer
+		if (i % TICKS_PER_FRAME == TICKS_PER_FRAME - 1) {
+			g_fmb_capture(out);
+			frameTimes[frames] = ac_time_now() - t1;
+			for (j = 1; j < TICKS_PER_FRAME; j++)
+				frameTimes[frames] += tickTimes[i - j];
+			frameTimes[frames++] += tickTimes[i];
+		}
+	}
+
+	bench_stats(tickTimes, ticks, &tickMed, &tickP99);
+	bench_stats(frameTimes, frames, &frameMed, &frameP99);
+	printf("%7d %6d %9.3f %9.3f %9.3f %9.3f %9.1f\n", troops, g_num_squads,
+		tickMed, tickP99, frameMed, frameP99, (double)updates / ticks);
+
+	free(out);
+	g_fmb_shutdown();
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	static const int defaultCounts[] = {1000, 10000, 50000};
+	int counts[MAX_ARGS], numCounts = 0, size = 1024, ticks = 1200, rate = 120;
+	int i, numTrees, numBldgs;
+	bool serial = false, nav = true, check = true, ok = true;
+	ac_tree_t *trees = NULL;
+	ac_bldg_t *bldgs = NULL;
+	double t0, navTime = 0.0;
+
+	// -serial forces single-threaded updates, -nolod updates every squad on
+	// every tick, -nonav makes the squads walk straight to their destinations,
+	// -nocheck skips the navigation check, -size sets the world size, -ticks
+	// the number of ticks to simulate, -tickrate the number of ticks per
+	// second, any other arguments are the troop counts to test
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-serial"))
+			serial = true;
+		else if (!strcmp(argv[i], "-nonav"))
+			nav = false;
+		else if (!strcmp(argv[i], "-nocheck"))
+			check = false;
+		else if (!strcmp(argv[i], "-nolod"))
+			g_fmb_lod = false;
+		else if (!strcmp(argv[i], "-size") && i + 1 < argc)
+			size = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-ticks") && i + 1 < argc)
+			ticks = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-tickrate") && i + 1 < argc)
+			rate = atoi(argv[++i]);
+		else if (numCounts < MAX_ARGS)
+			counts[numCounts++] = atoi(argv[i]);
+	}
+	if (!numCounts) {
+		numCounts = sizeof(defaultCounts) / sizeof(defaultCounts[0]);
+		memcpy(counts, defaultCounts, sizeof(defaultCounts));
+	}
+	if (ticks < TICKS_PER_FRAME)
+		ticks = TICKS_PER_FRAME;
+	else if (ticks > MAX_TICKS)
+		ticks = MAX_TICKS;
+	if (rate < 1)
+		rate = 120;
+
+	if (SDL_Init(SDL_INIT_TIMER) < 0) {
+		fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
+		return 1;
+	}
+	ac_thread_init(serial ? 0 : -1);
+	if (!gen_init(size, 0)) {
+		fprintf(stderr, "Invalid world size %d\n", size);
+		return 1;
+	}
+	gen_terrain(GEN_WORLD_SEED);
+	if (nav) {
+		trees = malloc(sizeof(*trees) * MAX_NUM_TREES);
+		bldgs = malloc(sizeof(*bldgs) * MAX_NUM_BLDGS);
+		if (!trees || !bldgs) {
+			fprintf(stderr, "Out of memory for the prop lists\n");
+			return 1;
+		}
+		gen_proplists(&numTrees, trees, &numBldgs, bldgs);
+		if (check && !nav_check(trees, numTrees, bldgs, numBldgs))
+			return 1;
+		t0 = ac_time_now();
+		nav = g_nav_build(trees, numTrees, bldgs, numBldgs);
+		navTime = ac_time_now() - t0;
+	}
+
+	printf("%d worker threads, world size %d, %d ticks at %d Hz, %s\n",
+		ac_thread_count(), size, ticks, rate,
+		g_fmb_lod ? "distant squads updated less often"
+			: "all squads updated every tick");
+	if (nav)
+		printf("navigation grid built in %.3f ms\n", navTime);
+	else
+		printf("no navigation grid, squads walk straight\n");
+	printf(" troops squads  tick med  tick p99 frame med frame p99 "
+		"upd/tick\n");
+	for (i = 0; i < numCounts && ok; i++)
+		ok = bench_troops(counts[i], ticks, 1.f / rate);
+
+	g_nav_free();
+	free(trees);
+	free(bldgs);
+	gen_shutdown();
+	ac_thread_shutdown();
+	SDL_Quit();
+	return !ok;
+}
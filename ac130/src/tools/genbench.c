@@ -0,0 +1,263 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Content generator benchmark; measures how generation time, allocations and
+// memory scale with the world size, without opening a window
+
+#include <stdio.h>
+#include <string.h>
+#ifndef WIN32
+	#include <sys/resource.h>
+#endif
+#include "../ac130.h"
+#include "../ac_thread.h"
+#include "../ac_time.h"
+
+/// Maximum number of seeds or sizes on the command line.
+#define MAX_ARGS		16
+/// Maximum number of runs per world.
+#define MAX_RUNS		1000
+
+void g_loading_tick(void) {
+	// no loading screen to update
+}
+
+/// Benchmarked generator stages.
+typedef enum {
+	BS_TERRAIN,
+	BS_PROPLISTS,
+	BS_PROPS,
+	BS_FX,
+	BS_NUM_STAGES
+} bench_stage_t;
+
+static const char *bench_stage_names[BS_NUM_STAGES] = {
+	"gen_terrain",
+	"gen_proplists",
+	"gen_props",
+	"gen_fx"
+};
+
+/// Results of a single stage over all the runs.
+typedef struct {
+	double	times[MAX_RUNS];	///< run times in milliseconds
+	long	allocs;				///< allocations made by the last run
+	long	allocBytes;			///< bytes allocated by the last run
+} bench_result_t;
+
+static volatile long	bench_allocs = 0;
+static volatile long	bench_alloc_bytes = 0;
+
+#ifdef GENBENCH_ALLOC_HOOKS
+// the project links with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, which
+// routes all the calls made by the generator through these; the counters are
+// bumped atomically, since the worker threads allocate too
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	__sync_fetch_and_add(&bench_allocs, 1);
+	__sync_fetch_and_add(&bench_alloc_bytes, (long)size);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+	__sync_fetch_and_add(&bench_allocs, 1);
+	__sync_fetch_and_add(&bench_alloc_bytes, (long)(num * size));
+	return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	__sync_fetch_and_add(&bench_allocs, 1);
+	__sync_fetch_and_add(&bench_alloc_bytes, (long)size);
+	return __real_realloc(ptr, size);
+}
+#endif
+
+/// \return peak resident set size of the process in megabytes, or a negative
+/// value if unknown
+static float peak_rss(void) {
+#ifndef WIN32
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		return ru.ru_maxrss / 1024.f;	// kilobytes on Linux
+#endif
+	return -1.f;
+}
+
+/// Sorts the run times and picks the statistics out of them.
+static void bench_stats(bench_result_t *r, int runs, double *min,
+						double *median, double *p99) {
+	int i;
+
+	qsort(r->times, runs, sizeof(r->times[0]), ac_time_cmp);
+	*min = r->times[0];
+	*median = runs % 2 ? r->times[runs / 2]
+		: (r->times[runs / 2 - 1] + r->times[runs / 2]) * 0.5;
+	// nearest rank
+	i = (99 * runs + 99) / 100 - 1;
+	*p99 = r->times[i < runs ? i : runs - 1];
+}
+
+/// Times a single generator call and records its allocations.
+#define BENCH_STAGE(stage, call)										\
+	do {																\
+		long a0 = bench_allocs, b0 = bench_alloc_bytes;					\
+		double t0 = ac_time_now();										\
+		call;															\
+		res[stage].times[run] = ac_time_now() - t0;						\
+		res[stage].allocs = bench_allocs - a0;							\
+		res[stage].allocBytes = bench_alloc_bytes - b0;					\
+	} while (0)
+
+static bool bench_world(int size, uint seed, int runs, bool json,
+						bool first) {
+	static bench_result_t res[BS_NUM_STAGES];
+	ac_vertex_t propVerts[PROP_NUM_VERTS];
+	uchar propIndices[PROP_NUM_INDICES];
+	uchar propTex[PROP_TEXTURE_SIZE * PROP_TEXTURE_SIZE];
+	ac_vertex_t fxVerts[4];
+	uchar fxIndices[4], *fxTex;
+	ac_tree_t *trees;
+	ac_bldg_t *bldgs;
+	int numTrees, numBldgs, numNodes = 0, run, i;
+	double min, median, p99;
+	float hmapMB, propMB;
+
+	if (!gen_init(size, 0)) {
+		fprintf(stderr, "Invalid world size %d\n", size);
+		return false;
+	}
+	trees = malloc(sizeof(*trees) * MAX_NUM_TREES);
+	bldgs = malloc(sizeof(*bldgs) * MAX_NUM_BLDGS);
+	fxTex = malloc(2 * FX_TEXTURE_SIZE * FX_TEXTURE_SIZE);
+
+	for (run = 0; run < runs; run++) {
+		BENCH_STAGE(BS_TERRAIN, gen_terrain(seed));
+		BENCH_STAGE(BS_PROPLISTS,
+			gen_proplists(&numTrees, trees, &numBldgs, bldgs));
+		BENCH_STAGE(BS_PROPS, gen_props(propTex, propVerts, propIndices));
+		BENCH_STAGE(BS_FX, gen_fx(fxTex, fxVerts, fxIndices));
+		numNodes = gen_proptree ? gen_proptree->numNodes : 0;
+		gen_free_proptree();
+	}
+
+	hmapMB = (float)size * size / (1024.f * 1024.f);
+	propMB = (sizeof(*trees) * MAX_NUM_TREES + sizeof(*bldgs) * MAX_NUM_BLDGS
+		+ (sizeof(ac_prop_t) + 2 * sizeof(ac_vec4_t)) * numNodes) / (1024.f * 1024.f);
+
+	if (json) {
+		printf("%s\n\t\t{\"size\": %d, \"seed\": %u, \"trees\": %d, "
+			"\"bldgs\": %d, \"hmap_mb\": %.2f, \"props_mb\": %.2f, "
+			"\"peak_rss_mb\": %.1f, \"stages\": {", first ? "" : ",", size,
+			seed, numTrees, numBldgs, hmapMB, propMB, peak_rss());
+		for (i = 0; i < BS_NUM_STAGES; i++) {
+			bench_stats(&res[i], runs, &min, &median, &p99);
+			printf("%s\n\t\t\t\"%s\": {\"min_ms\": %.3f, \"median_ms\": %.3f, "
+				"\"p99_ms\": %.3f, ", i ? "," : "", bench_stage_names[i], min,
+				median, p99);
+#ifdef GENBENCH_ALLOC_HOOKS
+			printf("\"allocs\": %ld, \"alloc_bytes\": %ld}", res[i].allocs,
+				res[i].allocBytes);
+#else
+			printf("\"allocs\": null, \"alloc_bytes\": null}");
+#endif
+		}
+		printf("\n\t\t}}");
+	} else {
+		printf("%6d %08x", size, seed);
+		for (i = 0; i < BS_NUM_STAGES; i++) {
+			bench_stats(&res[i], runs, &min, &median, &p99);
+			printf(" %9.2f", median);
+		}
+		printf(" %8d %6d %8.1f %8.1f %8.1f\n", numTrees, numBldgs, hmapMB,
+			propMB, peak_rss());
+	}
+
+	free(trees);
+	free(bldgs);
+	free(fxTex);
+	gen_shutdown();
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	static const int defaultSizes[] = {1024, 2048, 4096, 8192};
+	int sizes[MAX_ARGS], numSizes = 0, numSeeds = 0, runs = 5, i, j;
+	uint seeds[MAX_ARGS];
+	bool serial = false, json = false, perlin = false, ok = true;
+	float maxError;
+
+	// -serial forces single-threaded generation, -runs sets the number of
+	// repetitions per world, -octaves the number of cloud noise octaves,
+	// -seed adds a world seed to test, -json switches to machine-readable
+	// output, -perlin only checks the vectorized noise against the scalar one
+	// (which is done before the benchmarks anyway), any other arguments are
+	// the sizes to test
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-serial"))
+			serial = true;
+		else if (!strcmp(argv[i], "-perlin"))
+			perlin = true;
+		else if (!strcmp(argv[i], "-json"))
+			json = true;
+		else if (!strcmp(argv[i], "-runs") && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-octaves") && i + 1 < argc)
+			gen_cloud_octaves = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-seed") && i + 1 < argc) {
+			if (numSeeds < MAX_ARGS)
+				seeds[numSeeds++] = strtoul(argv[++i], NULL, 0);
+		} else if (numSizes < MAX_ARGS)
+			sizes[numSizes++] = atoi(argv[i]);
+	}
+	if (!numSizes) {
+		numSizes = sizeof(defaultSizes) / sizeof(defaultSizes[0]);
+		memcpy(sizes, defaultSizes, sizeof(defaultSizes));
+	}
+	if (!numSeeds)
+		seeds[numSeeds++] = GEN_WORLD_SEED;
+	if (runs < 1)
+		runs = 1;
+	else if (runs > MAX_RUNS)
+		runs = MAX_RUNS;
+
+	// the timings are worthless if the vectorized noise is off, so it's
+	// checked on every run
+	ok = gen_perlin_check(&maxError);
+	if (perlin || !ok) {
+		fprintf(ok ? stdout : stderr, "Perlin noise: maximum vector/scalar "
+			"difference %g, %s\n", maxError,
+			ok ? "within tolerance" : "OUT OF TOLERANCE");
+		return !ok;
+	}
+
+	if (SDL_Init(SDL_INIT_TIMER) < 0) {
+		fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
+		return 1;
+	}
+	ac_thread_init(serial ? 0 : -1);
+
+	if (json) {
+		printf("{\n\t\"threads\": %d, \"octaves\": %d, \"runs\": %d, "
+			"\"version\": %d,\n\t\"results\": [", ac_thread_count(),
+			gen_cloud_octaves, runs, GEN_VERSION);
+	} else {
+		printf("%d worker threads, %d cloud octaves, median of %d runs (ms)\n",
+			ac_thread_count(), gen_cloud_octaves, runs);
+		// peak RSS only ever grows, so sizes are best given in ascending order
+		printf("  size     seed   terrain proplists     props        fx"
+			"    trees  bldgs  hmap MB props MB  peak MB\n");
+	}
+	for (i = 0; i < numSizes && ok; i++) {
+		for (j = 0; j < numSeeds && ok; j++)
+			ok = bench_world(sizes[i], seeds[j], runs, json, !i && !j);
+	}
+	if (json)
+		printf("\n\t]\n}\n");
+
+	ac_thread_shutdown();
+	SDL_Quit();
+	return !ok;
+}
@@ -0,0 +1,218 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Spatial hash benchmark; checks the troop proximity queries against brute
+// force and measures how both scale with the number of troops, without opening
+// a window
+
+#include <stdio.h>
+#include <string.h>
+#include "../game/g_local.h"
+#include "../ac_thread.h"
+#include "../ac_time.h"
+
+/// Maximum number of troop counts on the command line.
+#define MAX_ARGS		16
+/// Query types: the splash radii of the three guns, a single tick of a
+/// projectile's flight and a long trace.
+#define NUM_QUERIES		5
+
+void g_loading_tick(void) {
+	// no loading screen to update
+}
+
+static const char *bench_query_names[NUM_QUERIES] = {
+	"radius 1.5",
+	"radius 8",
+	"radius 25",
+	"seg 3m",
+	"seg 300m"
+};
+
+static const float bench_radii[NUM_QUERIES] = {
+	WEAP_SPLASH_M61, WEAP_SPLASH_L60, WEAP_SPLASH_M102, 0.5f, 0.5f
+};
+
+static uint bench_seed = 1;
+
+/// \return random float in the [-1..1] range
+static float bench_randf(void) {
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return (float)((bench_seed >> 8) % 20001) * 0.0001f - 1.f;
+}
+
+static int cmp_int(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+/// Reference radius query.
+static int brute_radius(ac_vec4_t pos, float r, int *out) {
+	float dx, dy, dz;
+	int i, n = 0;
+
+	for (i = 0; i < g_troops.num; i++) {
+		dx = g_troops.x[i] - pos.f[0];
+		dy = g_troops.y[i] - pos.f[1];
+		dz = g_troops.z[i] - pos.f[2];
+		if (dx * dx + dy * dy + dz * dz <= r * r)
+			out[n++] = i;
+	}
+	return n;
+}
+
+/// Reference segment query.
+static int brute_segment(ac_vec4_t p1, ac_vec4_t p2, float r, int *out) {
+	const ac_vec4_t v = ac_vec_sub(p2, p1);
+	const float len2 = v.f[0] * v.f[0] + v.f[1] * v.f[1] + v.f[2] * v.f[2];
+	float dx, dy, dz, t;
+	int i, n = 0;
+
+	for (i = 0; i < g_troops.num; i++) {
+		dx = g_troops.x[i] - p1.f[0];
+		dy = g_troops.y[i] - p1.f[1];
+		dz = g_troops.z[i] - p1.f[2];
+		t = len2 > 0.f ? (dx * v.f[0] + dy * v.f[1] + dz * v.f[2]) / len2
+			: 0.f;
+		t = ac_max(0.f, ac_min(1.f, t));
+		dx -= v.f[0] * t;
+		dy -= v.f[1] * t;
+		dz -= v.f[2] * t;
+		if (dx * dx + dy * dy + dz * dz <= r * r)
+			out[n++] = i;
+	}
+	return n;
+}
+
+/// Picks a query around a random soldier, the way the guns would see them.
+static void bench_pick(int type, ac_vec4_t *p1, ac_vec4_t *p2) {
+	int i = (int)((bench_randf() * 0.5f + 0.5f) * (g_troops.num - 1));
+	// the projectiles are aimed closer than the splashes reach
+	float spread = type < 3 ? 10.f : 1.f;
+	ac_vec4_t dir;
+
+	*p1 = ac_vec_set(g_troops.x[i] + bench_randf() * spread,
+		g_troops.y[i] + bench_randf(),
+		g_troops.z[i] + bench_randf() * spread, 0.f);
+	if (type < 3)
+		return;
+	// coming down from the gunship's altitude at a steep angle
+	dir = ac_vec_normalize(ac_vec_set(bench_randf(), -2.f, bench_randf(),
+		0.f));
+	*p2 = *p1;
+	*p1 = ac_vec_sub(*p1, ac_vec_mulf(dir, type == 3 ? 3.f : 300.f));
+}
+
+static bool bench_troops(int troops, int ticks, int queries) {
+	int *hashOut, *bruteOut;
+	double t0, hashTime, bruteTime, updTime = 0.0, buildTime;
+	int i, type, n, m, mismatches, found;
+	ac_vec4_t p1, p2;
+	g_hash_t h;
+
+	if (!g_fmb_init(troops, GEN_WORLD_SEED)
+		|| !(hashOut = malloc(sizeof(*hashOut) * troops))
+		|| !(bruteOut = malloc(sizeof(*bruteOut) * troops))) {
+		fprintf(stderr, "Out of memory for %d troops\n", troops);
+		g_fmb_shutdown();
+		return false;
+	}
+
+	// a separate hash over the same troops, to time the updates on their own
+	g_fmb_advance(ac_vec_set(200.f, 250.f, 0.f, 0.f), 1.f / 120.f);
+	t0 = ac_time_now();
+	g_hash_init(&h, troops, g_troops.x, g_troops.y, g_troops.z);
+	buildTime = ac_time_now() - t0;
+	for (i = 0; i < ticks; i++) {
+		g_fmb_advance(ac_vec_set(200.f, 250.f, 0.f, 0.f), 1.f / 120.f);
+		t0 = ac_time_now();
+		g_hash_update(&h, 0, troops);
+		updTime += ac_time_now() - t0;
+	}
+
+	for (type = 0; type < NUM_QUERIES; type++) {
+		hashTime = bruteTime = 0.0;
+		mismatches = found = 0;
+		for (i = 0; i < queries; i++) {
+			bench_pick(type, &p1, &p2);
+			t0 = ac_time_now();
+			n = type < 3 ? g_hash_radius(&h, p1, bench_radii[type], hashOut,
+				troops) : g_hash_segment(&h, p1, p2, bench_radii[type],
+				hashOut, NULL, troops);
+			hashTime += ac_time_now() - t0;
+			t0 = ac_time_now();
+			m = type < 3 ? brute_radius(p1, bench_radii[type], bruteOut)
+				: brute_segment(p1, p2, bench_radii[type], bruteOut);
+			bruteTime += ac_time_now() - t0;
+			// both must find the very same troops
+			qsort(hashOut, n, sizeof(*hashOut), cmp_int);
+			if (n != m || memcmp(hashOut, bruteOut, sizeof(*hashOut) * n))
+				mismatches++;
+			found += m;
+		}
+		printf("%7d %9.3f %9.3f %-10s %7.2f %9.3f %9.3f %8.1f %5d\n", troops,
+			buildTime, updTime / ticks, bench_query_names[type],
+			(double)found / queries, hashTime * 1000.0 / queries,
+			bruteTime * 1000.0 / queries, bruteTime / hashTime, mismatches);
+	}
+
+	g_hash_free(&h);
+	free(hashOut);
+	free(bruteOut);
+	g_fmb_shutdown();
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	static const int defaultCounts[] = {1000, 10000, 50000};
+	int counts[MAX_ARGS], numCounts = 0, size = 1024, ticks = 240;
+	int queries = 2000, i;
+	bool serial = false, ok = true;
+
+	// -serial forces single-threaded troop updates, -size sets the world size,
+	// -ticks the number of ticks to move the troops for, -queries the number
+	// of queries of each type, any other arguments are the troop counts to
+	// test
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-serial"))
+			serial = true;
+		else if (!strcmp(argv[i], "-size") && i + 1 < argc)
+			size = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-ticks") && i + 1 < argc)
+			ticks = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-queries") && i + 1 < argc)
+			queries = atoi(argv[++i]);
+		else if (numCounts < MAX_ARGS)
+			counts[numCounts++] = atoi(argv[i]);
+	}
+	if (!numCounts) {
+		numCounts = sizeof(defaultCounts) / sizeof(defaultCounts[0]);
+		memcpy(counts, defaultCounts, sizeof(defaultCounts));
+	}
+	if (ticks < 1)
+		ticks = 1;
+	if (queries < 1)
+		queries = 1;
+
+	if (SDL_Init(SDL_INIT_TIMER) < 0) {
+		fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
+		return 1;
+	}
+	ac_thread_init(serial ? 0 : -1);
+	if (!gen_init(size, 0)) {
+		fprintf(stderr, "Invalid world size %d\n", size);
+		return 1;
+	}
+	gen_terrain(GEN_WORLD_SEED);
+
+	printf("%d worker threads, world size %d, %d ticks, %d queries per type\n",
+		ac_thread_count(), size, ticks, queries);
+	printf(" troops  build ms update ms query      found/q   hash us  brute us"
+		"  speedup  diff\n");
+	for (i = 0; i < numCounts && ok; i++)
+		ok = bench_troops(counts[i], ticks, queries);
+
+	gen_shutdown();
+	ac_thread_shutdown();
+	SDL_Quit();
+	return !ok;
+}
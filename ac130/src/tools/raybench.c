@@ -0,0 +1,577 @@
+// AC-130 shooter
+// Written by Leszek Godlewski <leszgod081@student.polsl.pl>
+
+// Collision benchmark; checks the ray traces against a brute force march and
+// measures their speed through the prop tree and through the BVH, and the line
+// of sight queries against the exact ones, without opening a window
+
+#include <stdio.h>
+#include <string.h>
+#include "../game/g_local.h"
+#include "../ac_thread.h"
+#include "../ac_time.h"
+
+/// Maximum number of world sizes on the command line.
+#define MAX_ARGS		16
+/// Maximum number of runs of each measurement.
+#define MAX_RUNS		100
+/// Step of the reference march in metres.
+#define REF_STEP		0.02f
+/// Hits further apart than that from the reference ones are mismatches, in
+/// metres.
+#define REF_TOLERANCE	0.05f
+
+/// Step of the reference march through the props in metres.
+#define REF_PROP_STEP	0.01f
+
+/// Number of rounds in flight in a burst.
+#define BURST_ROUNDS	64
+
+/// Height of a soldier's eyes above the ground in metres.
+#define LOS_EYE_HEIGHT	1.7f
+
+/// Ray sets, after the traces the game makes.
+typedef enum {
+	RS_HUD,			///< the HUD's 800 metre target range ray
+	RS_ROUND,		///< a tick of flight of a round fired at the ground
+	RS_GRAZING,		///< a long ray skimming over the terrain
+	RS_LEVEL,		///< a level ray through the woods and the villages
+	RS_BURST,		///< ticks of flight of the rounds of a burst
+	RS_NUM_SETS
+} ray_set_t;
+
+static const char *bench_set_names[RS_NUM_SETS] = {
+	"hud 800m",
+	"round",
+	"grazing",
+	"level",
+	"burst"
+};
+
+/// Line of sight query sets, after the ones the troops will make.
+typedef enum {
+	LS_TROOPS,		///< between two soldiers up to 400 metres apart
+	LS_GUNSHIP,		///< from a soldier to the gunship in its orbit
+	LS_NUM_SETS
+} los_set_t;
+
+static const char *bench_los_names[LS_NUM_SETS] = {
+	"troops",
+	"gunship"
+};
+
+static uint bench_seed = 1;
+
+static ac_tree_t	*bench_trees;
+static ac_bldg_t	*bench_bldgs;
+static int			bench_num_trees;
+static int			bench_num_bldgs;
+
+/// \return random float in the [0..1] range
+static float bench_randf(void) {
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return (float)((bench_seed >> 8) % 10001) * 0.0001f;
+}
+
+/// Picks a ray of the given set, in heightmap space.
+/// \param i		index of the ray in the set
+static void bench_pick(ray_set_t set, int i, ac_vec4_t *p1, ac_vec4_t *p2) {
+	const float size = gen_heightmap_size;
+	static ac_vec4_t burstOrigin, burstTarget;
+	float yaw = bench_randf() * 2.f * M_PI, pitch, len, x, z;
+	ac_vec4_t dir;
+
+	switch (set) {
+		case RS_HUD:
+			// from the gunship's orbit, looking down the way the player can
+			*p1 = ac_vec_set(size * 0.5f + cosf(yaw) * 200.f, 250.f,
+				size * 0.5f + sinf(yaw) * 200.f, 0.f);
+			yaw += M_PI * (0.7f + 0.6f * bench_randf());
+			pitch = -M_PI * (0.17f + 0.28f * bench_randf());
+			len = 800.f;
+			break;
+		case RS_ROUND:
+			// the distance an M61 round covers in a 120 Hz tick, starting
+			// anywhere up to 3 metres above the ground
+			x = size * (0.05f + 0.9f * bench_randf());
+			z = size * (0.05f + 0.9f * bench_randf());
+			*p1 = ac_vec_set(x, g_sample_height(x, z) + 3.f * bench_randf(),
+				z, 0.f);
+			pitch = -M_PI * (0.17f + 0.28f * bench_randf());
+			len = WEAP_MUZZVEL_M61 / 120.f;
+			break;
+		case RS_GRAZING:
+			x = size * (0.1f + 0.8f * bench_randf());
+			z = size * (0.1f + 0.8f * bench_randf());
+			*p1 = ac_vec_set(x, g_sample_height(x, z) + 1.f + bench_randf(),
+				z, 0.f);
+			pitch = -0.02f * bench_randf();
+			len = 50.f + 150.f * bench_randf();
+			break;
+		case RS_BURST:
+			// rounds spread along the way from the gunship to the target
+			if (!(i % BURST_ROUNDS)) {
+				burstOrigin = ac_vec_set(size * 0.5f + cosf(yaw) * 1000.f,
+					1000.f, size * 0.5f + sinf(yaw) * 1000.f, 0.f);
+				x = size * (0.4f + 0.2f * bench_randf());
+				z = size * (0.4f + 0.2f * bench_randf());
+				burstTarget = ac_vec_set(x, g_sample_height(x, z), z, 0.f);
+			}
+			dir = ac_vec_sub(burstTarget, burstOrigin);
+			*p1 = ac_vec_ma(dir, ac_vec_setall(bench_randf()), burstOrigin);
+			yaw = atan2f(dir.f[2], dir.f[0]) + 0.004f * (bench_randf() - 0.5f);
+			pitch = atan2f(dir.f[1], sqrtf(dir.f[0] * dir.f[0]
+				+ dir.f[2] * dir.f[2])) + 0.004f * (bench_randf() - 0.5f);
+			len = WEAP_MUZZVEL_M61 / 120.f;
+			break;
+		default:
+			x = size * (0.1f + 0.8f * bench_randf());
+			z = size * (0.1f + 0.8f * bench_randf());
+			*p1 = ac_vec_set(x, g_sample_height(x, z) + 1.f + 3.f
+				* bench_randf(), z, 0.f);
+			pitch = 0.01f - 0.02f * bench_randf();
+			len = 100.f;
+			break;
+	}
+	dir = ac_vec_set(cosf(pitch) * cosf(yaw), sinf(pitch),
+		cosf(pitch) * sinf(yaw), 0.f);
+	*p2 = ac_vec_ma(dir, ac_vec_setall(len), *p1);
+}
+
+/// Picks a line of sight query of the given set, in heightmap space.
+static void bench_pick_los(los_set_t set, ac_vec4_t *p1, ac_vec4_t *p2) {
+	const float size = gen_heightmap_size;
+	const float yaw = bench_randf() * 2.f * M_PI;
+	float x, z, dist;
+
+	x = size * (0.1f + 0.8f * bench_randf());
+	z = size * (0.1f + 0.8f * bench_randf());
+	*p1 = ac_vec_set(x, g_sample_height(x, z) + LOS_EYE_HEIGHT, z, 0.f);
+	if (set == LS_GUNSHIP) {
+		*p2 = ac_vec_set(size * 0.5f + cosf(yaw) * 200.f, 250.f,
+			size * 0.5f + sinf(yaw) * 200.f, 0.f);
+		return;
+	}
+	dist = 10.f + 390.f * bench_randf();
+	x = ac_max(0.f, ac_min(x + cosf(yaw) * dist, size - 1.f));
+	z = ac_max(0.f, ac_min(z + sinf(yaw) * dist, size - 1.f));
+	*p2 = ac_vec_set(x, g_sample_height(x, z) + LOS_EYE_HEIGHT, z, 0.f);
+}
+
+/// Reference trace; marches in tiny steps and bisects the one that goes below
+/// the surface.
+static float ref_trace(ac_vec4_t p1, ac_vec4_t p2) {
+	const ac_vec4_t v = ac_vec_sub(p2, p1);
+	const int steps = (int)(ac_vec_length(v) / REF_STEP) + 1;
+	float t0 = 0.f, t1, t;
+	int i;
+
+	for (i = 1; i <= steps; i++, t0 = t1) {
+		t1 = (float)i / steps;
+		if (p1.f[1] + v.f[1] * t1
+			> g_sample_height(p1.f[0] + v.f[0] * t1, p1.f[2] + v.f[2] * t1))
+			continue;
+		for (i = 0; i < 24; i++) {
+			t = (t0 + t1) * 0.5f;
+			if (p1.f[1] + v.f[1] * t
+				> g_sample_height(p1.f[0] + v.f[0] * t, p1.f[2] + v.f[2] * t))
+				t0 = t;
+			else
+				t1 = t;
+		}
+		return t1;
+	}
+	return 1.f;
+}
+
+/// \return true if the point (in world space) is inside the tree
+static bool ref_in_tree(const ac_tree_t *t, ac_vec4_t p) {
+	const float depth = t->pos.f[1] + t->Yscale - p.f[1];
+	const float r = t->XZscale * depth / (1.1f * t->Yscale);
+	const float dx = p.f[0] - t->pos.f[0], dz = p.f[2] - t->pos.f[2];
+
+	return depth >= 0.f && depth <= 1.1f * t->Yscale
+		&& dx * dx + dz * dz <= r * r;
+}
+
+/// \return true if the point (in world space) is inside the building
+static bool ref_in_bldg(const ac_bldg_t *b, ac_vec4_t p) {
+	const float c = cosf(b->ang), s = sinf(b->ang);
+	const float wx = (p.f[0] - b->pos.f[0]) / b->Xscale;
+	const float wz = (p.f[2] - b->pos.f[2]) / b->Zscale;
+	// the renderer's prop shader takes the model to the world with
+	// x' = X * (c * x + s * z) and z' = Z * (-s * x + c * z)
+	const float x = c * wx - s * wz, z = s * wx + c * wz;
+	const float y = (p.f[1] - b->pos.f[1]) / b->Yscale;
+
+	return fabsf(x) <= 0.5f && fabsf(z) <= 0.5f && y >= -1.f
+		&& y <= (b->slantedRoof ? 1.4f - 0.8f * fabsf(x) : 1.f);
+}
+
+/// Reference trace through a single prop; marches through the part of the ray
+/// within the prop's reach and bisects the step in which it goes in.
+static float ref_trace_prop(ac_vec4_t p1, ac_vec4_t v, ac_vec4_t pos,
+	float reach, const ac_tree_t *t, const ac_bldg_t *b, float best) {
+	const float a = v.f[0] * v.f[0] + v.f[2] * v.f[2];
+	const float dx = p1.f[0] - pos.f[0], dz = p1.f[2] - pos.f[2];
+	const float hb = dx * v.f[0] + dz * v.f[2];
+	const float disc = hb * hb - a * (dx * dx + dz * dz - reach * reach);
+	float t0, t1, step, lo, hi, mid;
+	ac_vec4_t p;
+
+	if (a <= 0.f || disc < 0.f)
+		return best;
+	// the stretch of the ray within the reach of the prop's axis
+	t0 = ac_max((-hb - sqrtf(disc)) / a, 0.f);
+	t1 = ac_min((-hb + sqrtf(disc)) / a, best);
+	step = REF_PROP_STEP / sqrtf(a + v.f[1] * v.f[1]);
+	for (lo = hi = t0; lo < t1; lo = hi, hi = ac_min(hi + step, t1)) {
+		p = ac_vec_ma(v, ac_vec_setall(hi), p1);
+		if (t ? !ref_in_tree(t, p) : !ref_in_bldg(b, p))
+			continue;
+		if (hi == t0)
+			return t0;
+		while (hi - lo > 1e-6f) {
+			mid = (lo + hi) * 0.5f;
+			p = ac_vec_ma(v, ac_vec_setall(mid), p1);
+			if (t ? ref_in_tree(t, p) : ref_in_bldg(b, p))
+				hi = mid;
+			else
+				lo = mid;
+		}
+		return hi;
+	}
+	return best;
+}
+
+/// Reference trace through all of the props, one by one.
+static float ref_trace_props(ac_vec4_t p1, ac_vec4_t p2, float best) {
+	const ac_vec4_t v = ac_vec_sub(p2, p1);
+	const float size = gen_heightmap_size;
+	float reach;
+	int i;
+
+	// the props are in world space
+	p1 = ac_vec_sub(p1, ac_vec_set(size * 0.5f, 0.f, size * 0.5f, 0.f));
+	for (i = 0; i < bench_num_trees; i++) {
+		best = ref_trace_prop(p1, v, bench_trees[i].pos,
+			bench_trees[i].XZscale, &bench_trees[i], NULL, best);
+	}
+	for (i = 0; i < bench_num_bldgs; i++) {
+		reach = 0.75f * sqrtf(bench_bldgs[i].Xscale * bench_bldgs[i].Xscale
+			+ bench_bldgs[i].Zscale * bench_bldgs[i].Zscale);
+		best = ref_trace_prop(p1, v, bench_bldgs[i].pos, reach, NULL,
+			&bench_bldgs[i], best);
+	}
+	return best;
+}
+
+/// The way the projectiles used to be checked: only the end of the tick.
+static bool endpoint_hit(ac_vec4_t p2) {
+	return p2.f[1] < g_sample_height(p2.f[0], p2.f[2]);
+}
+
+/// Sorts the times of the runs of a measurement and picks their median.
+static double bench_median(double *times, int runs) {
+	qsort(times, runs, sizeof(times[0]), ac_time_cmp);
+	return runs % 2 ? times[runs / 2]
+		: (times[runs / 2 - 1] + times[runs / 2]) * 0.5;
+}
+
+/// Ray sets of a world, traced through both prop structures.
+typedef struct {
+	ac_vec4_t	*p1, *p2;
+	g_ray_t		*batch;
+	float		*fracs;			///< terrain hits
+	g_trace_t	*traces;		///< hits through the prop tree
+} ray_sets_t;
+
+static void bench_structure(int size, bool bvh, ray_sets_t *sets, int rays,
+	int refRays, int runs) {
+	g_trace_t *traces, *batchTraces;
+	ac_vec4_t *p1, *p2;
+	float ref, len;
+	double t0, times[MAX_RUNS], buildTime, terrainTime, collideTime, batchTime;
+	int set, i, run, hits[HIT_TREE + 1], mismatches, tunnels, batchDiffs;
+	int diffs;
+
+	// every run builds the structure from scratch
+	g_collide_bvh = bvh;
+	for (run = 0; run < runs; run++) {
+		t0 = ac_time_now();
+		if (!g_collide_build()) {
+			fprintf(stderr, "Out of memory for the collision data\n");
+			g_collide_free();
+			return;
+		}
+		times[run] = ac_time_now() - t0;
+	}
+	buildTime = bench_median(times, runs);
+
+	traces = malloc(sizeof(*traces) * rays);
+	batchTraces = malloc(sizeof(*batchTraces) * rays);
+	for (set = 0; set < RS_NUM_SETS && traces && batchTraces; set++) {
+		p1 = sets[set].p1;
+		p2 = sets[set].p2;
+
+		for (run = 0; run < runs; run++) {
+			t0 = ac_time_now();
+			for (i = 0; i < rays; i++)
+				sets[set].fracs[i] = g_trace_terrain(p1[i], p2[i]);
+			times[run] = ac_time_now() - t0;
+		}
+		terrainTime = bench_median(times, runs);
+
+		for (run = 0; run < runs; run++) {
+			t0 = ac_time_now();
+			for (i = 0; i < rays; i++)
+				g_collide(p1[i], p2[i], &traces[i]);
+			times[run] = ac_time_now() - t0;
+		}
+		collideTime = bench_median(times, runs);
+
+		for (run = 0; run < runs; run++) {
+			t0 = ac_time_now();
+			if (!g_collide_batch(sets[set].batch, rays, batchTraces))
+				break;
+			times[run] = ac_time_now() - t0;
+		}
+		if (run < runs) {
+			fprintf(stderr, "Out of memory for the batch\n");
+			break;
+		}
+		batchTime = bench_median(times, runs);
+
+		// the batch must come up with exactly the same hits, and the BVH with
+		// the same ones as the prop tree, if not to the last bit, as the cones
+		// are solved from where the ray enters their leaves
+		batchDiffs = diffs = 0;
+		for (i = 0; i < rays; i++) {
+			if (batchTraces[i].frac != traces[i].frac
+				|| batchTraces[i].type != traces[i].type
+				|| batchTraces[i].prop != traces[i].prop)
+				batchDiffs++;
+			if (!bvh)
+				sets[set].traces[i] = traces[i];
+			else if (fabsf(sets[set].traces[i].frac - traces[i].frac)
+				* ac_vec_length(ac_vec_sub(p2[i], p1[i])) > REF_TOLERANCE)
+				diffs++;
+		}
+
+		memset(hits, 0, sizeof(hits));
+		for (i = 0; i < rays; i++)
+			hits[traces[i].type]++;
+
+		// the references are slow, so only check the first few rays
+		mismatches = tunnels = 0;
+		for (i = 0; i < rays && i < refRays; i++) {
+			len = ac_vec_length(ac_vec_sub(p2[i], p1[i]));
+			ref = ref_trace(p1[i], p2[i]);
+			// hits that checking the end point alone would have missed
+			if (ref < 1.f && !endpoint_hit(p2[i]))
+				tunnels++;
+			if (fabsf(ref - sets[set].fracs[i]) * len > REF_TOLERANCE)
+				mismatches++;
+			else if (fabsf(ref_trace_props(p1[i], p2[i], ref)
+				- traces[i].frac) * len > REF_TOLERANCE)
+				mismatches++;
+		}
+
+		// the props alone take what the terrain doesn't
+		printf("%5d %-4s %8.3f %-9s %5.1f%% %5.1f%% %5.1f%% %10.0f %10.0f "
+			"%10.0f %10.0f %5d %5d %5d %7d\n", size, bvh ? "bvh" : "tree",
+			buildTime, bench_set_names[set], 100.0 * hits[HIT_TERRAIN] / rays,
+			100.0 * hits[HIT_BLDG] / rays, 100.0 * hits[HIT_TREE] / rays,
+			rays / terrainTime * 1000.0, rays / collideTime * 1000.0,
+			rays / ac_max(collideTime - terrainTime, 1e-3) * 1000.0,
+			rays / batchTime * 1000.0, batchDiffs, diffs, mismatches,
+			tunnels);
+	}
+
+	free(traces);
+	free(batchTraces);
+	g_collide_free();
+}
+
+/// Checks the horizon map line of sight queries against the exact terrain
+/// traces and compares their speed.
+static void bench_los(int size, int queries, int runs) {
+	ac_vec4_t *p1, *p2;
+	bool *exact, *los;
+	double t0, times[MAX_RUNS], buildTime, traceTime, losTime;
+	int set, i, run, visible, falsePos, falseNeg;
+
+	p1 = malloc(sizeof(*p1) * queries);
+	p2 = malloc(sizeof(*p2) * queries);
+	exact = malloc(sizeof(*exact) * queries);
+	los = malloc(sizeof(*los) * queries);
+	if (!p1 || !p2 || !exact || !los || !g_collide_build()) {
+		fprintf(stderr, "Out of memory for the line of sight queries\n");
+		goto out;
+	}
+	for (run = 0; run < runs; run++) {
+		t0 = ac_time_now();
+		if (!g_horizon_build()) {
+			fprintf(stderr, "Out of memory for the horizon maps\n");
+			goto out;
+		}
+		times[run] = ac_time_now() - t0;
+	}
+	buildTime = bench_median(times, runs);
+
+	printf(" size horizon ms los       visible    false+    false-    "
+		"trace/s  horizon/s\n");
+	for (set = 0; set < LS_NUM_SETS; set++) {
+		for (i = 0; i < queries; i++)
+			bench_pick_los(set, &p1[i], &p2[i]);
+
+		for (run = 0; run < runs; run++) {
+			t0 = ac_time_now();
+			for (i = 0; i < queries; i++)
+				exact[i] = g_trace_terrain(p1[i], p2[i]) >= 1.f;
+			times[run] = ac_time_now() - t0;
+		}
+		traceTime = bench_median(times, runs);
+
+		for (run = 0; run < runs; run++) {
+			t0 = ac_time_now();
+			for (i = 0; i < queries; i++)
+				los[i] = g_horizon_los(p1[i], p2[i]);
+			times[run] = ac_time_now() - t0;
+		}
+		losTime = bench_median(times, runs);
+
+		visible = falsePos = falseNeg = 0;
+		for (i = 0; i < queries; i++) {
+			visible += exact[i];
+			falsePos += los[i] && !exact[i];
+			falseNeg += !los[i] && exact[i];
+		}
+		// the errors are relative to the pairs they could have happened to
+		printf("%5d %8.3f %-8s %7.1f%% %7.2f%% %7.2f%% %10.0f %10.0f\n",
+			size, buildTime, bench_los_names[set], 100.0 * visible / queries,
+			100.0 * falsePos / ac_max(queries - visible, 1),
+			100.0 * falseNeg / ac_max(visible, 1),
+			queries / traceTime * 1000.0, queries / losTime * 1000.0);
+	}
+
+out:
+	g_horizon_free();
+	g_collide_free();
+	free(p1);
+	free(p2);
+	free(exact);
+	free(los);
+}
+
+static void bench_size(int size, int rays, int refRays, int runs) {
+	ray_sets_t sets[RS_NUM_SETS];
+	int set, i;
+	bool ok = true;
+
+	if (!gen_init(size, 0)) {
+		fprintf(stderr, "Invalid world size %d\n", size);
+		return;
+	}
+	bench_trees = malloc(sizeof(*bench_trees) * MAX_NUM_TREES);
+	bench_bldgs = malloc(sizeof(*bench_bldgs) * MAX_NUM_BLDGS);
+	if (!bench_trees || !bench_bldgs) {
+		fprintf(stderr, "Out of memory for the prop lists\n");
+		free(bench_trees);
+		free(bench_bldgs);
+		gen_shutdown();
+		return;
+	}
+	gen_terrain(GEN_WORLD_SEED);
+	gen_proplists(&bench_num_trees, bench_trees, &bench_num_bldgs,
+		bench_bldgs);
+
+	// both of the structures trace the very same rays
+	memset(sets, 0, sizeof(sets));
+	for (set = 0; set < RS_NUM_SETS; set++) {
+		sets[set].p1 = malloc(sizeof(*sets[set].p1) * rays);
+		sets[set].p2 = malloc(sizeof(*sets[set].p2) * rays);
+		sets[set].batch = malloc(sizeof(*sets[set].batch) * rays);
+		sets[set].fracs = malloc(sizeof(*sets[set].fracs) * rays);
+		sets[set].traces = malloc(sizeof(*sets[set].traces) * rays);
+		if (!sets[set].p1 || !sets[set].p2 || !sets[set].batch
+			|| !sets[set].fracs || !sets[set].traces) {
+			ok = false;
+			break;
+		}
+		for (i = 0; i < rays; i++) {
+			bench_pick(set, i, &sets[set].p1[i], &sets[set].p2[i]);
+			sets[set].batch[i].p1 = sets[set].p1[i];
+			sets[set].batch[i].p2 = sets[set].p2[i];
+		}
+	}
+	if (ok) {
+		bench_structure(size, false, sets, rays, refRays, runs);
+		bench_structure(size, true, sets, rays, refRays, runs);
+		bench_los(size, rays, runs);
+	} else
+		fprintf(stderr, "Out of memory for the rays\n");
+
+	for (set = 0; set < RS_NUM_SETS; set++) {
+		free(sets[set].p1);
+		free(sets[set].p2);
+		free(sets[set].batch);
+		free(sets[set].fracs);
+		free(sets[set].traces);
+	}
+	gen_free_proptree();
+	gen_shutdown();
+	free(bench_trees);
+	free(bench_bldgs);
+}
+
+int main(int argc, char *argv[]) {
+	static const int defaultSizes[] = {1024, 4096};
+	int sizes[MAX_ARGS], numSizes = 0, rays = 20000, refRays = 250, runs = 5;
+	int i;
+	bool serial = false;
+
+	// -serial forces single-threaded builds, -rays sets the number of rays in
+	// each set, -ref the number of them checked against the references, -runs
+	// the number of runs of each measurement, any other arguments are the
+	// world sizes to test
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-serial"))
+			serial = true;
+		else if (!strcmp(argv[i], "-rays") && i + 1 < argc)
+			rays = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-ref") && i + 1 < argc)
+			refRays = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-runs") && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else if (numSizes < MAX_ARGS)
+			sizes[numSizes++] = atoi(argv[i]);
+	}
+	if (!numSizes) {
+		numSizes = sizeof(defaultSizes) / sizeof(defaultSizes[0]);
+		memcpy(sizes, defaultSizes, sizeof(defaultSizes));
+	}
+	if (rays < 1)
+		rays = 1;
+	if (runs < 1)
+		runs = 1;
+	else if (runs > MAX_RUNS)
+		runs = MAX_RUNS;
+
+	if (SDL_Init(SDL_INIT_TIMER) < 0) {
+		fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
+		return 1;
+	}
+	ac_thread_init(serial ? 0 : -1);
+
+	printf("%d worker threads, %d rays per set, %d checked, "
+		"median of %d runs\n", ac_thread_count(), rays, refRays, runs);
+	printf(" size      build ms set       terr   bldg   tree  terrain/s  "
+		"collide/s    props/s    batch/s bdiff tdiff  diff tunnels\n");
+	for (i = 0; i < numSizes; i++)
+		bench_size(sizes[i], rays, refRays, runs);
+
+	ac_thread_shutdown();
+	SDL_Quit();
+	return 0;
+}
@@ -3,13 +3,40 @@
 
 // Terrain heightmap viewer app
 
+#include <string.h>
 #include "../ac130.h"
+#include "../ac_thread.h"
 
 void g_loading_tick(void) {
 	// placeholder for the program to link properly
 }
 
 int main(int argc, char **argv) {
+	bool serial = false;
+	char *dump = NULL;
+	int i, size = HEIGHTMAP_SIZE_DEFAULT, winSize;
+
+	// -serial forces single-threaded generation, -dump writes the raw
+	// heightmap to a file so that the outputs of both paths can be diffed,
+	// -size sets the heightmap size, -octaves the number of cloud noise octaves
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-serial"))
+			serial = true;
+		else if (!strcmp(argv[i], "-dump") && i + 1 < argc)
+			dump = argv[++i];
+		else if (!strcmp(argv[i], "-size") && i + 1 < argc)
+			size = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-octaves") && i + 1 < argc)
+			gen_cloud_octaves = atoi(argv[++i]);
+	}
+
+	if (!gen_init(size, 0)) {
+		printf("Invalid heightmap size %d\n", size);
+		return 1;
+	}
+	// larger maps are shown cropped
+	winSize = size < HEIGHTMAP_SIZE_DEFAULT ? size : HEIGHTMAP_SIZE_DEFAULT;
+
 	// initialize SDL video
 	if (SDL_Init(SDL_INIT_VIDEO) < 0) {
 		printf ("Unable to init SDL: %s\n", SDL_GetError());
@@ -20,7 +47,7 @@ int main(int argc, char **argv) {
 	atexit (SDL_Quit);
 
 	// create a new window
-	SDL_Surface *screen = SDL_SetVideoMode(HEIGHTMAP_SIZE, HEIGHTMAP_SIZE, 16,
+	SDL_Surface *screen = SDL_SetVideoMode(winSize, winSize, 16,
 	                                        SDL_HWSURFACE | SDL_DOUBLEBUF);
 	if (!screen) {
 		printf ("Unable to set 640x480 video: %s\n", SDL_GetError());
@@ -28,11 +55,21 @@ int main(int argc, char **argv) {
 	}
 
 	SDL_WM_SetCaption("Generating heightmap...", "Terrain viewer");
-	gen_terrain(0xDEADBEEF);
+	ac_thread_init(serial ? 0 : -1);
+	gen_terrain(GEN_WORLD_SEED);
+	ac_thread_shutdown();
+	if (dump) {
+		FILE *f = fopen(dump, "wb");
+		if (f) {
+			fwrite(gen_heightmap, 1, (size_t)size * size, f);
+			fclose(f);
+		} else
+			printf("Unable to write heightmap to %s\n", dump);
+	}
 	// load the heightmap into a surface
 	SDL_Surface *bmp = SDL_CreateRGBSurfaceFrom(
-		gen_heightmap, HEIGHTMAP_SIZE, HEIGHTMAP_SIZE, 8,
-		HEIGHTMAP_SIZE, 0xFF, 0xFF, 0xFF, 0);
+		gen_heightmap, size, size, 8,
+		size, 0xFF, 0xFF, 0xFF, 0);
 	SDL_WM_SetCaption("Terrain viewer", "Terrain viewer");
 
 	// centre the bitmap on screen
@@ -79,6 +116,7 @@ int main(int argc, char **argv) {
 
 	// free loaded bitmap
 	SDL_FreeSurface (bmp);
+	gen_shutdown();
 
 	// all is well ;)
 	printf ("Exited cleanly\n");